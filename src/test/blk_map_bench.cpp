@@ -0,0 +1,199 @@
+/**
+ * 	Microbenchmark for mapping file blk indexes to data blks.
+ * 	Compares the old walks (the per level divisor computed in a loop
+ * 	as in recursive_set_dblk, and the three hand-written branches of
+ * 	DataBlockIterator::next) against BlockMap::Tree::lookup (shifts and
+ * 	masks, unrolled at compile time). The indirect blks are in memory,
+ * 	so only the arithmetic of the walk is measured.
+ *
+ * 	Usage: ./bench-blk-map [blks]
+ */
+
+#include "../uwufs/uwufs.h"
+#include "../uwufs/cpp/BlockMap.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <vector>
+
+// the walk of 4K volumes (mkfs.uwu's default)
+using BlockMap = BasicBlockMap<4096>;
+static constexpr uwufs_blk_t PER_BLK = BlockMap::PER_BLK;
+
+// end of the direct blks and of the single, double and triple trees
+static constexpr uwufs_blk_t LEVEL_0 = UWUFS_DIRECT_BLOCKS;
+static constexpr uwufs_blk_t LEVEL_1 = BlockMap::Tree<1>::END;
+static constexpr uwufs_blk_t LEVEL_2 = BlockMap::Tree<2>::END;
+static constexpr uwufs_blk_t LEVEL_3 = BlockMap::Tree<3>::END;
+
+// indirect blks by blk no (0 is a hole)
+static std::vector<BlockMap::IndirectBlock> blks(1);
+
+static const BlockMap::IndirectBlock* read_indirect(uwufs_blk_t blk_no)
+{
+	return blk_no != 0 ? &blks[blk_no] : nullptr;
+}
+
+static uwufs_blk_t new_indirect()
+{
+	blks.emplace_back();
+	memset(&blks.back(), 0, sizeof(blks.back()));
+	return blks.size() - 1;
+}
+
+// Points data blk `index` of a tree `level` + 1 levels deep to `data`
+static uwufs_blk_t build(unsigned level, uwufs_blk_t cur_no,
+						 uwufs_blk_t index, uwufs_blk_t data)
+{
+	if (cur_no == 0)
+		cur_no = new_indirect();
+	auto i = BlockMap::slot(index, level);
+	if (level == 0) {
+		blks[cur_no].block_nos[i] = data;
+		return cur_no;
+	}
+	auto child_no = build(level - 1, blks[cur_no].block_nos[i],
+						  index & (BlockMap::span(level) - 1), data);
+	blks[cur_no].block_nos[i] = child_no;
+	return cur_no;
+}
+
+// Walk from before BlockMap: the divisor of each level is computed at
+// run time (recursive_set_dblk and recursive_remove_dblk), and the
+// recursion is a real call per level
+__attribute__((noinline))
+static uwufs_blk_t old_recursive(uint8_t level, uwufs_blk_t cur_no,
+								 uwufs_blk_t index)
+{
+	auto blk = read_indirect(cur_no);
+	if (!blk)
+		return 0;
+	if (level == 0)
+		return blk->block_nos[index];
+	uwufs_blk_t mod = 1;
+	for (uint8_t i{0}; i < level; ++i)
+		mod *= PER_BLK;
+	return old_recursive(level - 1, blk->block_nos[index / mod], index % mod);
+}
+
+static uwufs_blk_t old_map(const uwufs_inode *inode, uwufs_blk_t index)
+{
+	if (index < LEVEL_0)
+		return inode->direct_blks[index];
+	if (index < LEVEL_1)
+		return old_recursive(0, inode->single_indirect_blks, index - LEVEL_0);
+	if (index < LEVEL_2)
+		return old_recursive(1, inode->double_indirect_blks, index - LEVEL_1);
+	return old_recursive(2, inode->triple_indirect_blks, index - LEVEL_2);
+}
+
+// DataBlockIterator::next from before BlockMap: one branch per tree
+static uwufs_blk_t old_next(const uwufs_inode *inode, uwufs_blk_t index)
+{
+	if (index < LEVEL_0)
+		return inode->direct_blks[index];
+	if (index < LEVEL_1) {
+		auto single = read_indirect(inode->single_indirect_blks);
+		return single ? single->block_nos[index - LEVEL_0] : 0;
+	}
+	if (index < LEVEL_2) {
+		auto double_index = index - LEVEL_1;
+		auto i = double_index / PER_BLK;
+		auto j = double_index % PER_BLK;
+		auto dbl = read_indirect(inode->double_indirect_blks);
+		if (!dbl)
+			return 0;
+		auto single = read_indirect(dbl->block_nos[i]);
+		return single ? single->block_nos[j] : 0;
+	}
+	auto triple_index = index - LEVEL_2;
+	auto i = triple_index / (PER_BLK * PER_BLK);
+	auto rem = triple_index % (PER_BLK * PER_BLK);
+	auto j = rem / PER_BLK;
+	auto k = rem % PER_BLK;
+	auto triple = read_indirect(inode->triple_indirect_blks);
+	if (!triple)
+		return 0;
+	auto dbl = read_indirect(triple->block_nos[i]);
+	if (!dbl)
+		return 0;
+	auto single = read_indirect(dbl->block_nos[j]);
+	return single ? single->block_nos[k] : 0;
+}
+
+static uwufs_blk_t new_map(const uwufs_inode *inode, uwufs_blk_t index)
+{
+	if (index < LEVEL_0)
+		return inode->direct_blks[index];
+	return BlockMap::with_tree(index, [&](auto tree) {
+		using Tree = decltype(tree);
+		return Tree::lookup(Tree::root(inode), index - Tree::FIRST,
+			[](unsigned level, uwufs_blk_t blk_no) { return read_indirect(blk_no); });
+	});
+}
+
+static double now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+template <typename Map>
+static double bench(const char *name, Map map, const uwufs_inode *inode,
+					uwufs_blk_t first, uwufs_blk_t n, int rounds, double base)
+{
+	volatile uwufs_blk_t sink = 0;
+	double start = now_ns();
+	for (int r = 0; r < rounds; r++)
+		for (uwufs_blk_t i = first; i < first + n; i++)
+			sink += map(inode, i);
+	double ns = (now_ns() - start) / ((double)rounds * n);
+	if (base == 0)
+		printf("\t%-22s %.2f ns/block\n", name, ns);
+	else
+		printf("\t%-22s %.2f ns/block (%.1fx)\n", name, ns, base / ns);
+	return ns;
+}
+
+int main(int argc, char *argv[])
+{
+	uwufs_blk_t n = argc > 1 ? atol(argv[1]) : 1 << 18;
+	const int rounds = 20;
+	struct uwufs_inode inode;
+	uwufs_blk_t i;
+
+	// the end of the double indirect tree and the start of the triple one
+	memset(&inode, 0, sizeof(inode));
+	uwufs_blk_t first = LEVEL_2 > n / 2 ? LEVEL_2 - n / 2 : 0;
+	if (first + n > LEVEL_3)
+		n = LEVEL_3 - first;
+	for (i = first; i < first + n; i++) {
+		uwufs_blk_t data = 1000 + i;
+		if (i < LEVEL_0)
+			inode.direct_blks[i] = data;
+		else if (i < LEVEL_1)
+			inode.single_indirect_blks = build(0, inode.single_indirect_blks, i - LEVEL_0, data);
+		else if (i < LEVEL_2)
+			inode.double_indirect_blks = build(1, inode.double_indirect_blks, i - LEVEL_1, data);
+		else
+			inode.triple_indirect_blks = build(2, inode.triple_indirect_blks, i - LEVEL_2, data);
+	}
+	for (i = first; i < first + n; i++) {
+		uwufs_blk_t data = 1000 + i;
+		if (old_map(&inode, i) != data || old_next(&inode, i) != data ||
+			new_map(&inode, i) != data) {
+			printf("mapping mismatch at %lu\n", i);
+			return 1;
+		}
+	}
+
+	printf("Mapping %lu blocks from %lu (%zu indirect blocks of %lu entries), %d rounds\n",
+		   n, first, blks.size() - 1, PER_BLK, rounds);
+	double old_ns = bench("runtime divisor walk:", old_map, &inode, first, n, rounds, 0);
+	bench("iterator branches:", old_next, &inode, first, n, rounds, old_ns);
+	bench("BlockMap::Tree lookup:", new_map, &inode, first, n, rounds, old_ns);
+	return 0;
+}
@@ -54,9 +54,9 @@ void test_single_indirect_full(int device_fd) {
     inode.single_indirect_blks = 11;
     inode.double_indirect_blks = 0;
     inode.triple_indirect_blks = 0;
-    INode::IndirectBlock iblk;
+    uwufs_indirect_blk iblk;
     for (int i = 0; i < UWUFS_BLOCK_SIZE / sizeof(uwufs_blk_t); i++) {
-        iblk.block_nos[i] = 20 + i;
+        iblk.entries[i] = 20 + i;
     }
     write_blk(device_fd, &iblk, 11);
     INode wrapper(&inode, device_fd);
@@ -81,19 +81,19 @@ void test_double_indirect_full(int device_fd) {
     inode.single_indirect_blks = 11;
     inode.double_indirect_blks = 21;
     inode.triple_indirect_blks = 0;
-    INode::IndirectBlock iblk;
+    uwufs_indirect_blk iblk;
     for (int i = 0; i < UWUFS_BLOCK_SIZE / sizeof(uwufs_blk_t); i++) {
-        iblk.block_nos[i] = 30 + i;
+        iblk.entries[i] = 30 + i;
     }
     write_blk(device_fd, &iblk, 11);
     for (int i = 0; i < UWUFS_BLOCK_SIZE / sizeof(uwufs_blk_t); i++) {
-        iblk.block_nos[i] = 1000 + i;
+        iblk.entries[i] = 1000 + i;
     }
     write_blk(device_fd, &iblk, 21);
     int cur = 2000;
     for (int i = 0; i < UWUFS_BLOCK_SIZE / sizeof(uwufs_blk_t); i++) {
         for (int j = 0; j < UWUFS_BLOCK_SIZE / sizeof(uwufs_blk_t); j++) {
-            iblk.block_nos[j] = cur++;
+            iblk.entries[j] = cur++;
         }
         write_blk(device_fd, &iblk, 1000 + i);
     }
@@ -0,0 +1,100 @@
+/**
+ * 	Microbenchmark for scanning a directory data block for a name.
+ * 	Compares the old strcmp scan (entries copied by value) against
+ * 	find_directory_file_entry (hash compare + memcmp on hits).
+ *
+ * 	Usage: ./bench-dir-scan [iterations]
+ */
+
+#include "../uwufs/uwufs.h"
+#include "../uwufs/file_operations.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define ENTRIES_PER_BLK (UWUFS_BLOCK_SIZE/sizeof(struct uwufs_directory_file_entry))
+#define MAX_ENTRIES_PER_BLK \
+	(UWUFS_MAX_BLOCK_SIZE/sizeof(struct uwufs_directory_file_entry))
+
+// Scan loop from before the name hash was added to directory entries
+static int old_scan(const struct uwufs_directory_data_blk *dir_blk,
+					const char *name)
+{
+	struct uwufs_directory_file_entry file_entry;
+	int i;
+	for (i = 0; i < (int)ENTRIES_PER_BLK; i++) {
+		file_entry = dir_blk->file_entries[i];
+		if (file_entry.inode_num <= 0)
+			continue;
+		if (strlen(name) > 0 && strcmp(file_entry.file_name, name) == 0)
+			return i;
+	}
+	return -1;
+}
+
+static double now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(int argc, char *argv[])
+{
+	long iterations = argc > 1 ? atol(argv[1]) : 10000000;
+	struct uwufs_directory_data_blk dir_blk;
+	char names[MAX_ENTRIES_PER_BLK][UWUFS_FILE_NAME_SIZE];
+	char missing[] = "this-name-is-not-in-the-block.txt";
+	size_t i;
+	long it;
+	volatile long sink = 0;
+
+	// Typical source tree names that share long prefixes
+	memset(&dir_blk, 0, sizeof(dir_blk));
+	for (i = 0; i < ENTRIES_PER_BLK; i++) {
+		snprintf(names[i], sizeof(names[i]), "src_module_component_%02zu.c", i);
+		put_directory_file_entry(&dir_blk, names[i], i + 3);
+	}
+
+	size_t lens[MAX_ENTRIES_PER_BLK];
+	uint32_t hashes[MAX_ENTRIES_PER_BLK];
+	for (i = 0; i < ENTRIES_PER_BLK; i++) {
+		lens[i] = strlen(names[i]);
+		hashes[i] = uwufs_name_hash(names[i], lens[i]);
+		if (old_scan(&dir_blk, names[i]) != (int)i ||
+			find_directory_file_entry(&dir_blk, names[i], lens[i], hashes[i])
+				!= (ssize_t)i) {
+			printf("scan mismatch for %s\n", names[i]);
+			return 1;
+		}
+	}
+	size_t missing_len = strlen(missing);
+	uint32_t missing_hash = uwufs_name_hash(missing, missing_len);
+
+	printf("Scanning a %zu entry directory block, %ld iterations\n",
+		   ENTRIES_PER_BLK, iterations);
+
+	double start = now_ns();
+	for (it = 0; it < iterations; it++) {
+		sink += old_scan(&dir_blk, names[it % ENTRIES_PER_BLK]);
+		sink += old_scan(&dir_blk, missing);
+	}
+	double old_ns = (now_ns() - start) / (2.0 * iterations);
+
+	start = now_ns();
+	for (it = 0; it < iterations; it++) {
+		i = it % ENTRIES_PER_BLK;
+		// the hash is computed once per lookup, not once per block
+		sink += find_directory_file_entry(&dir_blk, names[i], lens[i],
+										  hashes[i]);
+		sink += find_directory_file_entry(&dir_blk, missing, missing_len,
+										  missing_hash);
+	}
+	double new_ns = (now_ns() - start) / (2.0 * iterations);
+
+	printf("\tstrcmp scan: %.1f ns/block\n", old_ns);
+	printf("\thash scan:   %.1f ns/block (%.1fx)\n", new_ns, old_ns / new_ns);
+	return 0;
+}
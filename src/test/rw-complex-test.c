@@ -54,7 +54,7 @@ int main(int argc, char* argv[]) {
     for (i = UWUFS_DIRECT_BLOCKS; i < UWUFS_DIRECT_BLOCKS + indirect_addresses; i++) {
         printf("Writing data block %d\n", i+1);
         offset = i * UWUFS_BLOCK_SIZE;
-        status = write_file(fd, test_data, data_size, offset, &test_inode, inode_num);
+        status = write_file(fd, test_data, data_size, offset, &test_inode, inode_num, NULL);
         if(status != data_size){
             printf("Unable to write full %ld bytes\n", data_size);
             return -1;
@@ -76,7 +76,7 @@ int main(int argc, char* argv[]) {
         }
         
         offset = i * UWUFS_BLOCK_SIZE;
-        status = write_file(fd, test_data, data_size, offset, &test_inode, inode_num);
+        status = write_file(fd, test_data, data_size, offset, &test_inode, inode_num, NULL);
         if(status != data_size){
             printf("Unable to write full %ld bytes\n", data_size);
             return -1;
@@ -85,7 +85,7 @@ int main(int argc, char* argv[]) {
 
 	struct uwufs_regular_file_data_blk data_blk;
     
-    status = read_file(fd, data_blk.data, data_size, 0, &test_inode);
+    status = read_file(fd, data_blk.data, data_size, 0, &test_inode, NULL);
     if (status <= 0) {
         printf("Read 0 bytes/unsucesful\n");
         return -EIO;
@@ -0,0 +1,849 @@
+/**
+ * 	Only for testing
+ *
+ * 	Checks the block map, truncate, preallocation, hole punching, SEEK_DATA/
+ * 	SEEK_HOLE, reflinks and directory entries on a device formatted with
+ * 	mkfs.uwu (the files it creates are left unlinked).
+ */
+
+#include "../uwufs/uwufs.h"
+#include "../uwufs/low_level_operations.h"
+#include "../uwufs/file_operations.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <linux/falloc.h>
+
+#include "../uwufs/cpp/c_api.h"
+
+#define PER_BLK		(UWUFS_BLOCK_SIZE / sizeof(uwufs_blk_t))
+#define DIR_ENTRIES	(UWUFS_BLOCK_SIZE / sizeof(struct uwufs_directory_file_entry))
+
+#define CHECK(cond) \
+	do { \
+		if (!(cond)) { \
+			printf("\t==> FAILED line %d: %s\n", __LINE__, #cond); \
+			return -1; \
+		} \
+	} while (0)
+
+static int fd;
+
+static uwufs_blk_t free_blks()
+{
+	uwufs_blk_t blks, inodes;
+	if (read_free_counts(fd, &blks, &inodes) < 0)
+		return 0;
+	return blks;
+}
+
+static int new_file(struct uwufs_inode *inode, uwufs_blk_t *inode_num)
+{
+	if (find_free_inode(fd, inode_num) < 0)
+		return -1;
+	memset(inode, 0, sizeof(*inode));
+	inode->file_mode = F_TYPE_REGULAR | 0644;
+	inode->file_links_count = 1;
+	return write_inode(fd, inode, sizeof(*inode), *inode_num) < 0 ? -1 : 0;
+}
+
+static int write_blk_at(struct uwufs_inode *inode, uwufs_blk_t inode_num,
+						uwufs_blk_t index)
+{
+	char data[UWUFS_MAX_BLOCK_SIZE];
+	memset(data, 'a' + index % 26, UWUFS_BLOCK_SIZE);
+	return write_file(fd, data, UWUFS_BLOCK_SIZE, index * UWUFS_BLOCK_SIZE,
+					  inode, inode_num, NULL) == UWUFS_BLOCK_SIZE ? 0 : -1;
+}
+
+// Punching all the data under an indirect blk frees it, also when the
+// range only covers part of the blk
+static int test_punch_frees_indirect()
+{
+	struct uwufs_inode inode;
+	uwufs_blk_t inode_num;
+	printf("TEST punch frees empty indirect blks\n");
+	CHECK(new_file(&inode, &inode_num) == 0);
+
+	// single indirect blk: one data blk
+	uwufs_blk_t single = UWUFS_DIRECT_BLOCKS;
+	CHECK(write_blk_at(&inode, inode_num, single) == 0);
+	CHECK(inode.single_indirect_blks != 0 && inode.file_blocks == 2);
+	uwufs_blk_t before = free_blks();
+	CHECK(fallocate_file(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+						 single * UWUFS_BLOCK_SIZE, 8 * UWUFS_BLOCK_SIZE,
+						 &inode, inode_num) == 0);
+	CHECK(inode.single_indirect_blks == 0 && inode.file_blocks == 0);
+	CHECK(free_blks() == before + 2);
+
+	// double indirect tree: two blks of the first leaf, one of the second
+	uwufs_blk_t dbl = UWUFS_DIRECT_BLOCKS + PER_BLK;
+	CHECK(write_blk_at(&inode, inode_num, dbl) == 0);
+	CHECK(write_blk_at(&inode, inode_num, dbl + 6) == 0);
+	CHECK(write_blk_at(&inode, inode_num, dbl + PER_BLK) == 0);
+	CHECK(inode.file_blocks == 3 + 3);
+	before = free_blks();
+	CHECK(fallocate_file(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+						 dbl * UWUFS_BLOCK_SIZE, 100 * UWUFS_BLOCK_SIZE,
+						 &inode, inode_num) == 0);
+	// the first leaf goes, the root and the second leaf stay
+	CHECK(inode.file_blocks == 3);
+	CHECK(free_blks() == before + 3);
+	CHECK(inode.double_indirect_blks != 0);
+	CHECK(get_dblk(&inode, fd, dbl + PER_BLK) != 0);
+
+	CHECK(remove_file(fd, &inode, inode_num) == 0);
+	CHECK(write_inode(fd, &inode, sizeof(inode), inode_num) >= 0);
+	printf("\t==> passed\n");
+	return 0;
+}
+
+// A file from before the blk counters (file_blocks 0) with a data blk
+// keeps it: a small write doesn't move the file into the inode
+static int test_inline_keeps_blk_map()
+{
+	struct uwufs_inode inode;
+	uwufs_blk_t inode_num;
+	char buf[UWUFS_MAX_BLOCK_SIZE];
+	printf("TEST small write to a file with blks and no blk counter\n");
+	CHECK(new_file(&inode, &inode_num) == 0);
+	CHECK(write_blk_at(&inode, inode_num, 0) == 0);
+	uwufs_blk_t blk = inode.direct_blks[0];
+	inode.file_size = 100;
+	inode.file_blocks = 0;
+
+	CHECK(write_file(fd, "xyz", 3, 0, &inode, inode_num, NULL) == 3);
+	CHECK(!(inode.file_flags & UWUFS_INODE_INLINE_DATA));
+	CHECK(inode.direct_blks[0] == blk);
+	CHECK(read_file(fd, buf, sizeof(buf), 0, &inode, NULL) == 100);
+	CHECK(memcmp(buf, "xyz", 3) == 0 && buf[3] == 'a' && buf[99] == 'a');
+
+	CHECK(remove_file(fd, &inode, inode_num) == 0);
+	CHECK(write_inode(fd, &inode, sizeof(inode), inode_num) >= 0);
+	printf("\t==> passed\n");
+	return 0;
+}
+
+static int is_zero(const char *buf, size_t size)
+{
+	size_t i;
+	for (i = 0; i < size; i++)
+		if (buf[i] != 0)
+			return 0;
+	return 1;
+}
+
+// Truncating to any size: blks past the end are freed, the rest of the
+// last blk reads as zeros when the file grows again
+static int test_truncate()
+{
+	struct uwufs_inode inode;
+	uwufs_blk_t inode_num;
+	static char buf[16 * UWUFS_MAX_BLOCK_SIZE];
+	uwufs_blk_t i;
+	printf("TEST truncate to a smaller and a larger size\n");
+	CHECK(new_file(&inode, &inode_num) == 0);
+	for (i = 0; i < 16; i++)
+		CHECK(write_blk_at(&inode, inode_num, i) == 0);
+	CHECK(inode.file_blocks == 16 + 1);
+	uwufs_blk_t before = free_blks();
+
+	uint64_t size = 5 * UWUFS_BLOCK_SIZE + 100;
+	CHECK(truncate_file(fd, inode_num, size) == 0);
+	CHECK(read_inode(fd, &inode, inode_num) >= 0);
+	CHECK(inode.file_size == size && inode.file_blocks == 6);
+	CHECK(inode.single_indirect_blks == 0);
+	CHECK(free_blks() == before + 11);
+	CHECK(read_file(fd, buf, sizeof(buf), 0, &inode, NULL) == (ssize_t)size);
+	CHECK(buf[0] == 'a' && buf[size - 1] == 'f');
+
+	// growing leaves a hole, the old bytes of the last blk are gone
+	CHECK(truncate_file(fd, inode_num, 10 * UWUFS_BLOCK_SIZE) == 0);
+	CHECK(read_inode(fd, &inode, inode_num) >= 0);
+	CHECK(inode.file_blocks == 6);
+	CHECK(read_file(fd, buf, sizeof(buf), 0, &inode, NULL) ==
+		  10 * UWUFS_BLOCK_SIZE);
+	CHECK(buf[size - 1] == 'f');
+	CHECK(is_zero(buf + size, 10 * UWUFS_BLOCK_SIZE - size));
+
+	// an inline file
+	CHECK(truncate_file(fd, inode_num, 0) == 0);
+	CHECK(read_inode(fd, &inode, inode_num) >= 0);
+	CHECK(write_file(fd, "0123456789012345678901234567890123456789", 40, 0,
+					 &inode, inode_num, NULL) == 40);
+	CHECK(inode.file_flags & UWUFS_INODE_INLINE_DATA);
+	CHECK(truncate_file(fd, inode_num, 10) == 0);
+	CHECK(truncate_file(fd, inode_num, 30) == 0);
+	CHECK(read_inode(fd, &inode, inode_num) >= 0);
+	CHECK(inode.file_flags & UWUFS_INODE_INLINE_DATA);
+	CHECK(read_file(fd, buf, sizeof(buf), 0, &inode, NULL) == 30);
+	CHECK(memcmp(buf, "0123456789", 10) == 0 && is_zero(buf + 10, 20));
+	CHECK(truncate_file(fd, inode_num, 2 * UWUFS_BLOCK_SIZE) == 0);
+	CHECK(read_inode(fd, &inode, inode_num) >= 0);
+	CHECK(!(inode.file_flags & UWUFS_INODE_INLINE_DATA));
+	CHECK(read_file(fd, buf, sizeof(buf), 0, &inode, NULL) ==
+		  2 * UWUFS_BLOCK_SIZE);
+	CHECK(memcmp(buf, "0123456789", 10) == 0);
+	CHECK(is_zero(buf + 10, 2 * UWUFS_BLOCK_SIZE - 10));
+
+	// a packed tail: the file ends in it, then before it
+	CHECK(truncate_file(fd, inode_num, 0) == 0);
+	CHECK(read_inode(fd, &inode, inode_num) >= 0);
+	CHECK(write_blk_at(&inode, inode_num, 0) == 0);
+	CHECK(write_blk_at(&inode, inode_num, 1) == 0);
+	CHECK(truncate_file(fd, inode_num, UWUFS_BLOCK_SIZE + 1000) == 0);
+	CHECK(read_inode(fd, &inode, inode_num) >= 0);
+	CHECK(pack_file_tail(fd, &inode, inode_num) == 1);
+	CHECK(truncate_file(fd, inode_num, UWUFS_BLOCK_SIZE + 500) == 0);
+	CHECK(read_inode(fd, &inode, inode_num) >= 0);
+	CHECK(!(inode.file_flags & UWUFS_INODE_TAIL_PACKED));
+	CHECK(read_file(fd, buf, sizeof(buf), 0, &inode, NULL) ==
+		  UWUFS_BLOCK_SIZE + 500);
+	CHECK(buf[UWUFS_BLOCK_SIZE - 1] == 'a' && buf[UWUFS_BLOCK_SIZE + 499] == 'b');
+	CHECK(pack_file_tail(fd, &inode, inode_num) == 1);
+	CHECK(truncate_file(fd, inode_num, 300) == 0);
+	CHECK(read_inode(fd, &inode, inode_num) >= 0);
+	CHECK(!(inode.file_flags & UWUFS_INODE_TAIL_PACKED));
+	CHECK(inode.file_blocks == 1);
+	CHECK(truncate_file(fd, inode_num, UWUFS_BLOCK_SIZE) == 0);
+	CHECK(read_inode(fd, &inode, inode_num) >= 0);
+	CHECK(read_file(fd, buf, sizeof(buf), 0, &inode, NULL) == UWUFS_BLOCK_SIZE);
+	CHECK(buf[299] == 'a' && is_zero(buf + 300, UWUFS_BLOCK_SIZE - 300));
+
+	CHECK(remove_file(fd, &inode, inode_num) == 0);
+	CHECK(write_inode(fd, &inode, sizeof(inode), inode_num) >= 0);
+	printf("\t==> passed\n");
+	return 0;
+}
+
+// Unwritten (preallocated, past EOF writes) and punched ranges read back
+// as zeros, the data around them is kept
+static int test_zero_ranges()
+{
+	struct uwufs_inode inode;
+	uwufs_blk_t inode_num;
+	static char buf[24 * UWUFS_MAX_BLOCK_SIZE];
+	uwufs_blk_t i;
+	printf("TEST unwritten and punched ranges read as zeros\n");
+	CHECK(new_file(&inode, &inode_num) == 0);
+
+	// never written: a write past the end leaves a hole before it
+	CHECK(write_blk_at(&inode, inode_num, 20) == 0);
+	CHECK(read_file(fd, buf, sizeof(buf), 0, &inode, NULL) ==
+		  21 * UWUFS_BLOCK_SIZE);
+	CHECK(is_zero(buf, 20 * UWUFS_BLOCK_SIZE));
+	CHECK(buf[20 * UWUFS_BLOCK_SIZE] == 'a' + 20);
+
+	// preallocated: inside the file and past its end
+	CHECK(fallocate_file(fd, 0, 2 * UWUFS_BLOCK_SIZE, 4 * UWUFS_BLOCK_SIZE,
+						 &inode, inode_num) == 0);
+	CHECK(fallocate_file(fd, FALLOC_FL_KEEP_SIZE, 21 * UWUFS_BLOCK_SIZE,
+						 3 * UWUFS_BLOCK_SIZE, &inode, inode_num) == 0);
+	CHECK(inode.file_size == 21 * UWUFS_BLOCK_SIZE);
+	CHECK(truncate_file(fd, inode_num, 24 * UWUFS_BLOCK_SIZE) == 0);
+	CHECK(read_inode(fd, &inode, inode_num) >= 0);
+	CHECK(read_file(fd, buf, sizeof(buf), 0, &inode, NULL) ==
+		  24 * UWUFS_BLOCK_SIZE);
+	CHECK(is_zero(buf, 20 * UWUFS_BLOCK_SIZE));
+	CHECK(is_zero(buf + 21 * UWUFS_BLOCK_SIZE, 3 * UWUFS_BLOCK_SIZE));
+
+	// punched: whole blks, part of a blk and a zeroed range
+	for (i = 0; i < 8; i++)
+		CHECK(write_blk_at(&inode, inode_num, i) == 0);
+	CHECK(fallocate_file(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+						 2 * UWUFS_BLOCK_SIZE + 100, 2 * UWUFS_BLOCK_SIZE,
+						 &inode, inode_num) == 0);
+	CHECK(fallocate_file(fd, FALLOC_FL_ZERO_RANGE, 6 * UWUFS_BLOCK_SIZE,
+						 UWUFS_BLOCK_SIZE + 10, &inode, inode_num) == 0);
+	CHECK(read_file(fd, buf, sizeof(buf), 0, &inode, NULL) ==
+		  24 * UWUFS_BLOCK_SIZE);
+	CHECK(buf[2 * UWUFS_BLOCK_SIZE + 99] == 'c');
+	CHECK(is_zero(buf + 2 * UWUFS_BLOCK_SIZE + 100, 2 * UWUFS_BLOCK_SIZE));
+	CHECK(buf[4 * UWUFS_BLOCK_SIZE + 100] == 'e');
+	CHECK(buf[6 * UWUFS_BLOCK_SIZE - 1] == 'f');
+	CHECK(is_zero(buf + 6 * UWUFS_BLOCK_SIZE, UWUFS_BLOCK_SIZE + 10));
+	CHECK(buf[7 * UWUFS_BLOCK_SIZE + 10] == 'h');
+
+	CHECK(remove_file(fd, &inode, inode_num) == 0);
+	CHECK(write_inode(fd, &inode, sizeof(inode), inode_num) >= 0);
+	printf("\t==> passed\n");
+	return 0;
+}
+
+// SEEK_DATA/SEEK_HOLE over a known layout: data, a hole, an unwritten blk,
+// data, a hole into the single indirect tree, a partial last blk
+static int test_seek_layout()
+{
+	struct uwufs_inode inode;
+	uwufs_blk_t inode_num;
+	const off_t bs = UWUFS_BLOCK_SIZE;
+	const off_t last = (UWUFS_DIRECT_BLOCKS + 20) * bs;
+	printf("TEST SEEK_DATA/SEEK_HOLE on a known layout\n");
+	CHECK(new_file(&inode, &inode_num) == 0);
+	CHECK(write_blk_at(&inode, inode_num, 0) == 0);
+	CHECK(write_blk_at(&inode, inode_num, 4) == 0);
+	CHECK(write_file(fd, "tail", 4, last, &inode, inode_num, NULL) == 4);
+	CHECK(fallocate_file(fd, FALLOC_FL_KEEP_SIZE, 3 * bs, bs,
+						 &inode, inode_num) == 0);
+	off_t size = last + 4;
+	CHECK((off_t)inode.file_size == size);
+
+	CHECK(seek_data_hole(fd, 0, SEEK_DATA, &inode) == 0);
+	CHECK(seek_data_hole(fd, 10, SEEK_HOLE, &inode) == bs);
+	CHECK(seek_data_hole(fd, bs, SEEK_DATA, &inode) == 4 * bs);
+	CHECK(seek_data_hole(fd, 3 * bs + 5, SEEK_DATA, &inode) == 4 * bs);
+	CHECK(seek_data_hole(fd, 3 * bs + 5, SEEK_HOLE, &inode) == 3 * bs + 5);
+	CHECK(seek_data_hole(fd, 4 * bs + 5, SEEK_DATA, &inode) == 4 * bs + 5);
+	CHECK(seek_data_hole(fd, 4 * bs, SEEK_HOLE, &inode) == 5 * bs);
+	CHECK(seek_data_hole(fd, 5 * bs, SEEK_DATA, &inode) == last);
+	CHECK(seek_data_hole(fd, last, SEEK_HOLE, &inode) == size);
+	CHECK(seek_data_hole(fd, size, SEEK_DATA, &inode) == -ENXIO);
+	CHECK(seek_data_hole(fd, size, SEEK_HOLE, &inode) == -ENXIO);
+
+	// a packed tail is data
+	CHECK(truncate_file(fd, inode_num, 0) == 0);
+	CHECK(read_inode(fd, &inode, inode_num) >= 0);
+	CHECK(write_file(fd, "tail", 4, bs, &inode, inode_num, NULL) == 4);
+	CHECK(pack_file_tail(fd, &inode, inode_num) == 1);
+	CHECK(seek_data_hole(fd, 0, SEEK_HOLE, &inode) == 0);
+	CHECK(seek_data_hole(fd, 0, SEEK_DATA, &inode) == bs);
+	CHECK(seek_data_hole(fd, bs + 1, SEEK_HOLE, &inode) == bs + 4);
+
+	// an inline file is all data
+	CHECK(truncate_file(fd, inode_num, 0) == 0);
+	CHECK(read_inode(fd, &inode, inode_num) >= 0);
+	CHECK(write_file(fd, "inline", 6, 0, &inode, inode_num, NULL) == 6);
+	CHECK(inode.file_flags & UWUFS_INODE_INLINE_DATA);
+	CHECK(seek_data_hole(fd, 2, SEEK_DATA, &inode) == 2);
+	CHECK(seek_data_hole(fd, 2, SEEK_HOLE, &inode) == 6);
+
+	CHECK(remove_file(fd, &inode, inode_num) == 0);
+	CHECK(write_inode(fd, &inode, sizeof(inode), inode_num) >= 0);
+	printf("\t==> passed\n");
+	return 0;
+}
+
+// Reflinks `src` into a new file, writes to the clone and checks the
+// source still reads `expect`
+static int check_clone_write(struct uwufs_inode *src, uwufs_blk_t src_num,
+							 const char *expect, size_t size)
+{
+	struct uwufs_inode dst;
+	uwufs_blk_t dst_num;
+	static char buf[8 * UWUFS_MAX_BLOCK_SIZE];
+	CHECK(new_file(&dst, &dst_num) == 0);
+	CHECK(copy_file_data(fd, src, src_num, 0, &dst, dst_num, 0, size, true) ==
+		  (ssize_t)size);
+	CHECK(read_file(fd, buf, sizeof(buf), 0, &dst, NULL) == (ssize_t)size);
+	CHECK(memcmp(buf, expect, size) == 0);
+	if (size >= UWUFS_BLOCK_SIZE)
+		CHECK(get_dblk(&dst, fd, 0) == get_dblk(src, fd, 0));
+
+	// the first and the last byte of the clone
+	CHECK(write_file(fd, "X", 1, 0, &dst, dst_num, NULL) == 1);
+	CHECK(write_file(fd, "Y", 1, size - 1, &dst, dst_num, NULL) == 1);
+	CHECK(read_inode(fd, src, src_num) >= 0);
+	CHECK(read_file(fd, buf, sizeof(buf), 0, src, NULL) == (ssize_t)size);
+	CHECK(memcmp(buf, expect, size) == 0);
+	CHECK(read_file(fd, buf, sizeof(buf), 0, &dst, NULL) == (ssize_t)size);
+	CHECK(buf[0] == 'X' && buf[size - 1] == 'Y');
+	CHECK(memcmp(buf + 1, expect + 1, size - 2) == 0);
+
+	CHECK(remove_file(fd, &dst, dst_num) == 0);
+	CHECK(write_inode(fd, &dst, sizeof(dst), dst_num) >= 0);
+	CHECK(read_file(fd, buf, sizeof(buf), 0, src, NULL) == (ssize_t)size);
+	CHECK(memcmp(buf, expect, size) == 0);
+	return 0;
+}
+
+// Writing to a reflinked copy leaves the source alone, also when the
+// source is inline or has a packed tail
+static int test_clone_write()
+{
+	struct uwufs_inode inode;
+	uwufs_blk_t inode_num;
+	static char expect[8 * UWUFS_MAX_BLOCK_SIZE];
+	uwufs_blk_t i;
+	printf("TEST writing to a reflinked copy keeps the source\n");
+	CHECK(new_file(&inode, &inode_num) == 0);
+
+	// whole blks (shared) and a partial last blk
+	size_t size = 4 * UWUFS_BLOCK_SIZE + 300;
+	for (i = 0; i < 5; i++) {
+		CHECK(write_blk_at(&inode, inode_num, i) == 0);
+		memset(expect + i * UWUFS_BLOCK_SIZE, 'a' + i, UWUFS_BLOCK_SIZE);
+	}
+	CHECK(truncate_file(fd, inode_num, size) == 0);
+	CHECK(read_inode(fd, &inode, inode_num) >= 0);
+	CHECK(check_clone_write(&inode, inode_num, expect, size) == 0);
+
+	// a packed tail
+	size = 2 * UWUFS_BLOCK_SIZE + 500;
+	CHECK(truncate_file(fd, inode_num, size) == 0);
+	CHECK(read_inode(fd, &inode, inode_num) >= 0);
+	CHECK(pack_file_tail(fd, &inode, inode_num) == 1);
+	CHECK(check_clone_write(&inode, inode_num, expect, size) == 0);
+
+	// inline
+	CHECK(truncate_file(fd, inode_num, 0) == 0);
+	CHECK(read_inode(fd, &inode, inode_num) >= 0);
+	size = 50;
+	memset(expect, 'i', size);
+	CHECK(write_file(fd, expect, size, 0, &inode, inode_num, NULL) ==
+		  (ssize_t)size);
+	CHECK(inode.file_flags & UWUFS_INODE_INLINE_DATA);
+	CHECK(check_clone_write(&inode, inode_num, expect, size) == 0);
+
+	CHECK(remove_file(fd, &inode, inode_num) == 0);
+	CHECK(write_inode(fd, &inode, sizeof(inode), inode_num) >= 0);
+	printf("\t==> passed\n");
+	return 0;
+}
+
+// Position of `name` in the directory (blk index * entries per blk + slot)
+// or -1
+static long entry_pos(struct uwufs_inode *dir, const char *name)
+{
+	struct uwufs_directory_data_blk dir_blk;
+	uwufs_blk_t n = dir->file_size / UWUFS_BLOCK_SIZE;
+	uwufs_blk_t i;
+	for (i = 0; i < n; i++) {
+		if (read_blk(fd, &dir_blk, get_dblk(dir, fd, i)) < 0)
+			return -1;
+		ssize_t slot = find_directory_file_entry(&dir_blk, name, strlen(name),
+												 uwufs_name_hash(name, strlen(name)));
+		if (slot >= 0)
+			return i * DIR_ENTRIES + slot;
+	}
+	return -1;
+}
+
+// Unlinking leaves the other entries where they are (the readdir offsets),
+// a new entry takes the freed slot
+static int test_unlink_keeps_entries()
+{
+	struct uwufs_inode dir, file;
+	uwufs_blk_t dir_num, file_num;
+	char name[16];
+	long pos[3 * UWUFS_MAX_BLOCK_SIZE /
+			 sizeof(struct uwufs_directory_file_entry)];
+	size_t i;
+	printf("TEST unlink keeps the positions of directory entries\n");
+	CHECK(new_file(&file, &file_num) == 0);
+	CHECK(new_file(&dir, &dir_num) == 0);
+	dir.file_mode = F_TYPE_DIRECTORY | 0755;
+	CHECK(write_inode(fd, &dir, sizeof(dir), dir_num) >= 0);
+	CHECK(add_directory_file_entry(fd, dir_num, ".", dir_num, 0) == 0);
+	CHECK(add_directory_file_entry(fd, dir_num, "..", dir_num, 0) == 0);
+	for (i = 2; i < 3 * DIR_ENTRIES; i++) {
+		sprintf(name, "f%zu", i);
+		CHECK(add_directory_file_entry(fd, dir_num, name, file_num, 0) == 0);
+	}
+	CHECK(read_inode(fd, &dir, dir_num) >= 0);
+	CHECK(dir.file_size == 3 * UWUFS_BLOCK_SIZE);
+	for (i = 2; i < 3 * DIR_ENTRIES; i++) {
+		sprintf(name, "f%zu", i);
+		pos[i] = entry_pos(&dir, name);
+		CHECK(pos[i] == (long)i);
+	}
+
+	// every other entry of the first two blks
+	for (i = 2; i < 2 * DIR_ENTRIES; i += 2) {
+		sprintf(name, "f%zu", i);
+		CHECK(unlink_file(fd, dir_num, name, &file, file_num, 0) == 0);
+	}
+	CHECK(read_inode(fd, &dir, dir_num) >= 0);
+	CHECK(dir.file_size == 3 * UWUFS_BLOCK_SIZE);
+	for (i = 2; i < 3 * DIR_ENTRIES; i++) {
+		sprintf(name, "f%zu", i);
+		CHECK(entry_pos(&dir, name) == (i < 2 * DIR_ENTRIES && i % 2 == 0 ? -1 : (long)i));
+	}
+	CHECK(!is_directory_empty(fd, &dir));
+
+	CHECK(add_directory_file_entry(fd, dir_num, "new", file_num, 0) == 0);
+	CHECK(read_inode(fd, &dir, dir_num) >= 0);
+	CHECK(entry_pos(&dir, "new") == 2);
+
+	// emptying the last blk frees it, the rest only leaves free slots
+	// until the blks at the end are empty
+	uwufs_blk_t before = free_blks();
+	for (i = 2 * DIR_ENTRIES; i < 3 * DIR_ENTRIES; i++) {
+		sprintf(name, "f%zu", i);
+		CHECK(unlink_file(fd, dir_num, name, &file, file_num, 0) == 0);
+	}
+	CHECK(read_inode(fd, &dir, dir_num) >= 0);
+	CHECK(dir.file_size == 2 * UWUFS_BLOCK_SIZE && free_blks() == before + 1);
+	CHECK(unlink_file(fd, dir_num, "new", &file, file_num, 0) == 0);
+	for (i = 3; i < 2 * DIR_ENTRIES; i += 2) {
+		sprintf(name, "f%zu", i);
+		CHECK(unlink_file(fd, dir_num, name, &file, file_num, 0) == 0);
+	}
+	CHECK(read_inode(fd, &dir, dir_num) >= 0);
+	CHECK(is_directory_empty(fd, &dir) && dir.file_size == UWUFS_BLOCK_SIZE);
+
+	dir.file_links_count = 0;
+	CHECK(remove_file(fd, &dir, dir_num) == 0);
+	CHECK(write_inode(fd, &dir, sizeof(dir), dir_num) >= 0);
+	file.file_links_count = 0;
+	CHECK(remove_file(fd, &file, file_num) == 0);
+	CHECK(write_inode(fd, &file, sizeof(file), file_num) >= 0);
+	printf("\t==> passed\n");
+	return 0;
+}
+
+// Fills the volume through `inode` until ENOSPC
+static int fill_volume(struct uwufs_inode *inode, uwufs_blk_t inode_num,
+					   const char *data, size_t size)
+{
+	uint64_t offset = inode->file_size;
+	ssize_t n;
+	while ((n = write_file(fd, data, size, offset, inode, inode_num,
+						   NULL)) > 0)
+		offset += n;
+	return n == -ENOSPC ? 0 : -1;
+}
+
+// Blks freed since the last checkpoint count as free space: an allocation
+// that needs them checkpoints instead of failing with ENOSPC
+static int test_enospc_reclaims_frees()
+{
+	struct uwufs_inode inode;
+	uwufs_blk_t inode_num;
+	static char data[1 << 20];
+	printf("TEST allocations get the blks the journal holds back\n");
+	memset(data, 'f', sizeof(data));
+	CHECK(new_file(&inode, &inode_num) == 0);
+
+	CHECK(fill_volume(&inode, inode_num, data, sizeof(data)) == 0);
+	CHECK(truncate_file(fd, inode_num, 0) == 0);
+	CHECK(read_inode(fd, &inode, inode_num) >= 0);
+	CHECK(journal_deferred_frees() > 0);
+	CHECK(check_free_blks(fd, 2 * sizeof(data) / UWUFS_BLOCK_SIZE) == 0);
+	CHECK(write_file(fd, data, sizeof(data), 0, &inode, inode_num, NULL) ==
+		  sizeof(data));
+
+	// inside an operation: the frees of the ones committed before it
+	CHECK(fill_volume(&inode, inode_num, data, sizeof(data)) == 0);
+	CHECK(truncate_file(fd, inode_num, 0) == 0);
+	CHECK(read_inode(fd, &inode, inode_num) >= 0);
+	journal_begin();
+	ssize_t n = write_file(fd, data, sizeof(data), 0, &inode, inode_num, NULL);
+	journal_end();
+	CHECK(n == sizeof(data));
+
+	CHECK(remove_file(fd, &inode, inode_num) == 0);
+	CHECK(write_inode(fd, &inode, sizeof(inode), inode_num) >= 0);
+	printf("\t==> passed\n");
+	return 0;
+}
+
+// A preallocation whose blks fit but whose indirect blks don't gives back
+// the blks it took
+static int test_prealloc_enospc_frees_blks()
+{
+	struct uwufs_inode filler, inode;
+	uwufs_blk_t filler_num, inode_num, free;
+	static char data[1 << 20];
+	printf("TEST a preallocation out of indirect blks frees its blks\n");
+	memset(data, 'p', sizeof(data));
+	CHECK(new_file(&filler, &filler_num) == 0);
+	CHECK(new_file(&inode, &inode_num) == 0);
+	CHECK(fill_volume(&filler, filler_num, data, sizeof(data)) == 0);
+	CHECK(truncate_file(fd, filler_num,
+						filler.file_size - 16 * UWUFS_BLOCK_SIZE) == 0);
+	CHECK(journal_checkpoint() == 0);
+	free = free_blks();
+	CHECK(free >= 3 && free <= PER_BLK);
+
+	// the first blk of the double indirect tree needs 2 indirect blks,
+	// only 1 is left once the data blks are taken
+	CHECK(fallocate_file(fd, FALLOC_FL_KEEP_SIZE,
+						 (UWUFS_DIRECT_BLOCKS + PER_BLK) * UWUFS_BLOCK_SIZE,
+						 (free - 1) * UWUFS_BLOCK_SIZE, &inode, inode_num) ==
+		  -ENOSPC);
+	CHECK(read_inode(fd, &inode, inode_num) >= 0);
+	CHECK(inode.file_blocks == 0 && inode.file_unwritten_blocks == 0);
+	CHECK(journal_checkpoint() == 0);
+	CHECK(free_blks() == free);
+
+	CHECK(remove_file(fd, &inode, inode_num) == 0);
+	CHECK(write_inode(fd, &inode, sizeof(inode), inode_num) >= 0);
+	CHECK(read_inode(fd, &filler, filler_num) >= 0);
+	CHECK(remove_file(fd, &filler, filler_num) == 0);
+	CHECK(write_inode(fd, &filler, sizeof(filler), filler_num) >= 0);
+	printf("\t==> passed\n");
+	return 0;
+}
+
+// The blk on the device, not the journaled copy read_blk returns
+static int raw_blk_is(uwufs_blk_t blk_num, char c)
+{
+	static char buf[UWUFS_MAX_BLOCK_SIZE];
+	if (pread(fd, buf, UWUFS_BLOCK_SIZE, (off_t)blk_num * UWUFS_BLOCK_SIZE) !=
+		UWUFS_BLOCK_SIZE)
+		return 0;
+	return buf[0] == c && memcmp(buf, buf + 1, UWUFS_BLOCK_SIZE - 1) == 0;
+}
+
+// Journals a metadata write of `c` everywhere
+static int write_meta(uwufs_blk_t blk_num, char c)
+{
+	char buf[UWUFS_MAX_BLOCK_SIZE];
+	memset(buf, c, UWUFS_BLOCK_SIZE);
+	return write_meta_blk(fd, buf, blk_num) < 0 ? -1 : 0;
+}
+
+// What mount does after a crash: replays the log onto the device
+static int replay_journal()
+{
+	struct uwufs_super_blk super_blk;
+	if (read_super_blk(fd, &super_blk) < 0)
+		return -1;
+	return journal_open(fd, &super_blk);
+}
+
+// A commit whose log write fails is written again (same place, same
+// sequence number) by the next one: replay still finds both, and flushes
+// fail until it is logged
+static int test_journal_failed_commit()
+{
+	struct uwufs_super_blk super_blk;
+	struct rlimit old_limit, limit;
+	struct stat st;
+	uwufs_blk_t a, b;
+	printf("TEST a failed log write is logged again by the next commit\n");
+	// the log writes fail past the file size limit (only on an image file)
+	CHECK(fstat(fd, &st) == 0 && read_super_blk(fd, &super_blk) >= 0);
+	if (!S_ISREG(st.st_mode) || super_blk.journal_total_size == 0) {
+		printf("\t==> skipped\n");
+		return 0;
+	}
+	CHECK(malloc_blk(fd, &a) == 0 && malloc_blk(fd, &b) == 0);
+	CHECK(write_meta(a, 'A') == 0 && write_meta(b, 'A') == 0);
+	CHECK(journal_checkpoint() == 0);
+
+	signal(SIGXFSZ, SIG_IGN);
+	CHECK(getrlimit(RLIMIT_FSIZE, &old_limit) == 0);
+	limit = old_limit;
+	limit.rlim_cur = super_blk.journal_start * UWUFS_BLOCK_SIZE;
+	CHECK(setrlimit(RLIMIT_FSIZE, &limit) == 0);
+	CHECK(write_meta(a, 'B') == 0);
+	int flushed = journal_flush();
+	CHECK(setrlimit(RLIMIT_FSIZE, &old_limit) == 0);
+	CHECK(flushed < 0);
+
+	CHECK(write_meta(b, 'C') == 0);
+	CHECK(journal_flush() == 0);
+	CHECK(raw_blk_is(a, 'A') && raw_blk_is(b, 'A'));
+	// crash
+	CHECK(replay_journal() == 0);
+	CHECK(raw_blk_is(a, 'B') && raw_blk_is(b, 'C'));
+
+	CHECK(free_blk(fd, a) == 0 && free_blk(fd, b) == 0);
+	CHECK(journal_checkpoint() == 0);
+	printf("\t==> passed\n");
+	return 0;
+}
+
+// The start of the log, where the next transaction is written after a
+// checkpoint
+static int journal_head(uwufs_blk_t *head)
+{
+	struct uwufs_journal_header header;
+	if (pread(fd, &header, sizeof(header),
+		(off_t)UWUFS_JOURNAL_HEADER_BLK * UWUFS_BLOCK_SIZE) != sizeof(header))
+		return -1;
+	*head = header.head;
+	return 0;
+}
+
+// Committed but not checkpointed blks are written by replay, and only them
+static int test_journal_replay()
+{
+	struct uwufs_super_blk super_blk;
+	uwufs_blk_t a, b, c;
+	printf("TEST replay writes the committed transactions\n");
+	CHECK(read_super_blk(fd, &super_blk) >= 0);
+	if (super_blk.journal_total_size == 0) {
+		printf("\t==> skipped\n");
+		return 0;
+	}
+	CHECK(malloc_blk(fd, &a) == 0 && malloc_blk(fd, &b) == 0 &&
+		malloc_blk(fd, &c) == 0);
+	CHECK(write_meta(a, 'A') == 0 && write_meta(b, 'A') == 0 &&
+		write_meta(c, 'A') == 0);
+	CHECK(journal_checkpoint() == 0);
+
+	journal_begin();
+	CHECK(write_meta(a, '1') == 0 && write_meta(b, '1') == 0);
+	journal_end();
+	CHECK(write_meta(b, '2') == 0);
+	CHECK(journal_flush() == 0);
+	CHECK(raw_blk_is(a, 'A') && raw_blk_is(b, 'A'));
+	// crash
+	CHECK(replay_journal() == 0);
+	CHECK(raw_blk_is(a, '1') && raw_blk_is(b, '2') && raw_blk_is(c, 'A'));
+	// nothing is left to replay a second time
+	char buf[UWUFS_MAX_BLOCK_SIZE];
+	memset(buf, 'X', UWUFS_BLOCK_SIZE);
+	CHECK(pwrite(fd, buf, UWUFS_BLOCK_SIZE, (off_t)b * UWUFS_BLOCK_SIZE) ==
+		UWUFS_BLOCK_SIZE);
+	CHECK(replay_journal() == 0);
+	CHECK(raw_blk_is(b, 'X'));
+
+	CHECK(free_blk(fd, a) == 0 && free_blk(fd, b) == 0 &&
+		free_blk(fd, c) == 0);
+	CHECK(journal_checkpoint() == 0);
+	printf("\t==> passed\n");
+	return 0;
+}
+
+// A transaction that does not fit before the end of the log goes on at its
+// start: replay follows it there
+static int test_journal_wrap()
+{
+	struct uwufs_super_blk super_blk;
+	uwufs_blk_t filler, blks[4], pos;
+	printf("TEST a transaction wrapping around the end of the log\n");
+	CHECK(read_super_blk(fd, &super_blk) >= 0);
+	const uwufs_blk_t size = super_blk.journal_total_size;
+	if (size == 0) {
+		printf("\t==> skipped\n");
+		return 0;
+	}
+	CHECK(malloc_blk(fd, &filler) == 0);
+	for (int i = 0; i < 4; i++)
+		CHECK(malloc_blk(fd, &blks[i]) == 0 && write_meta(blks[i], 'A') == 0);
+	CHECK(journal_checkpoint() == 0 && journal_head(&pos) == 0);
+
+	// transactions of 1 blk (descriptor, blk, commit) until at most 3 log
+	// blks are left before the end
+	while (size - pos > 3) {
+		CHECK(write_meta(filler, 'F') == 0);
+		pos += 3;
+	}
+	// 6 log blks: the first ones at the end, the rest at the start
+	journal_begin();
+	for (int i = 0; i < 4; i++)
+		CHECK(write_meta(blks[i], 'W') == 0);
+	journal_end();
+	CHECK(journal_flush() == 0);
+	CHECK(raw_blk_is(blks[0], 'A') && raw_blk_is(blks[3], 'A'));
+	// crash
+	CHECK(replay_journal() == 0);
+	CHECK(raw_blk_is(filler, 'F'));
+	for (int i = 0; i < 4; i++)
+		CHECK(raw_blk_is(blks[i], 'W'));
+	// the log goes on from where the wrapped transaction ended
+	CHECK(write_meta(filler, 'G') == 0 && journal_flush() == 0);
+	CHECK(replay_journal() == 0);
+	CHECK(raw_blk_is(filler, 'G'));
+
+	CHECK(free_blk(fd, filler) == 0);
+	for (int i = 0; i < 4; i++)
+		CHECK(free_blk(fd, blks[i]) == 0);
+	CHECK(journal_checkpoint() == 0);
+	printf("\t==> passed\n");
+	return 0;
+}
+
+// A transaction bigger than the whole log is written through, and the
+// transactions after it are logged as usual
+static int test_journal_oversized()
+{
+	struct uwufs_super_blk super_blk;
+	static uwufs_blk_t blks[16384];
+	uwufs_blk_t a;
+	printf("TEST a transaction bigger than the journal\n");
+	CHECK(read_super_blk(fd, &super_blk) >= 0);
+	const uwufs_blk_t n = super_blk.journal_total_size;
+	if (n == 0 || n > sizeof(blks) / sizeof(blks[0]) ||
+		check_free_blks(fd, n + 1) < 0) {
+		printf("\t==> skipped\n");
+		return 0;
+	}
+	CHECK(malloc_blk(fd, &a) == 0 && write_meta(a, 'A') == 0);
+	for (uwufs_blk_t i = 0; i < n; i++)
+		CHECK(malloc_blk(fd, &blks[i]) == 0);
+	CHECK(journal_checkpoint() == 0);
+
+	journal_begin();
+	for (uwufs_blk_t i = 0; i < n; i++)
+		CHECK(write_meta(blks[i], 'O') == 0);
+	journal_end();
+	for (uwufs_blk_t i = 0; i < n; i++)
+		CHECK(raw_blk_is(blks[i], 'O'));
+
+	CHECK(write_meta(a, 'B') == 0 && journal_flush() == 0);
+	CHECK(raw_blk_is(a, 'A'));
+	// crash
+	CHECK(replay_journal() == 0);
+	CHECK(raw_blk_is(a, 'B') && raw_blk_is(blks[n - 1], 'O'));
+
+	CHECK(free_blk(fd, a) == 0);
+	for (uwufs_blk_t i = 0; i < n; i++)
+		CHECK(free_blk(fd, blks[i]) == 0);
+	CHECK(journal_checkpoint() == 0);
+	printf("\t==> passed\n");
+	return 0;
+}
+
+int main(int argc, char* argv[]) {
+	if (argc < 2) {
+		printf("Usage: %s [block device formatted with mkfs.uwu]\n", argv[0]);
+		return 1;
+	}
+
+	fd = open(argv[1], O_RDWR);
+	if (fd < 0) {
+		perror("Failed to access block device");
+		return 1;
+	}
+
+	struct uwufs_super_blk super_blk;
+	if (read_super_blk(fd, &super_blk) < 0 ||
+		set_blk_size(UWUFS_SUPER_BLK_SIZE(&super_blk)) < 0 ||
+		journal_open(fd, &super_blk) < 0 || mount_super_blk(fd) < 0) {
+		printf("Failed to mount the super blk\n");
+		return 1;
+	}
+
+	int ret = 0;
+	if (test_punch_frees_indirect() < 0)
+		ret = 1;
+	if (test_inline_keeps_blk_map() < 0)
+		ret = 1;
+	if (test_truncate() < 0)
+		ret = 1;
+	if (test_unlink_keeps_entries() < 0)
+		ret = 1;
+	if (test_zero_ranges() < 0)
+		ret = 1;
+	if (test_seek_layout() < 0)
+		ret = 1;
+	if (test_clone_write() < 0)
+		ret = 1;
+	if (test_enospc_reclaims_frees() < 0)
+		ret = 1;
+	if (test_prealloc_enospc_frees_blks() < 0)
+		ret = 1;
+	if (test_journal_failed_commit() < 0)
+		ret = 1;
+	if (test_journal_replay() < 0)
+		ret = 1;
+	if (test_journal_wrap() < 0)
+		ret = 1;
+	if (test_journal_oversized() < 0)
+		ret = 1;
+
+	journal_close();
+	unmount_super_blk(fd);
+	close(fd);
+	return ret;
+}
@@ -42,7 +42,7 @@ int main(int argc, char* argv[]) {
     test_inode.direct_blks[0] = 0;
     
 
-	ssize_t write_status = write_file(fd, test_data, data_size, offset, &test_inode, inode_num);
+	ssize_t write_status = write_file(fd, test_data, data_size, offset, &test_inode, inode_num, NULL);
     if(write_status != data_size){
         printf("error 1");
         ret = -1;
@@ -0,0 +1,356 @@
+#ifndef BlockMap_h
+#define BlockMap_h
+
+#include "../uwufs.h"
+#include "../low_level_operations.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <iterator>
+#include <utility>  // std::pair
+
+
+// Geometry of the blk map of an inode and the one walker of its indirect
+// blk trees, for blks of BlockSize bytes (indirect blks of PER_BLK
+// entries). It is compiled for each supported block size, with_block_map
+// picks the one of the mounted volume.
+//
+// After the direct blks come three trees: Tree<1> (the single indirect
+// blk), Tree<2> (double) and Tree<3> (triple). Entry i of an indirect blk
+// `level` levels above the data blks (level 0: its entries are data blks)
+// covers the data blks [i << (SHIFT * level), (i + 1) << (SHIFT * level))
+// of its tree, so the walk down to a data blk is a shift and a mask per
+// level, and the recursion is unrolled at compile time.
+//
+// Like INode, the walker writes indirect blks (journaled) and frees blks
+// but never writes the inode: the callers update the root pointers and
+// the counters.
+template <size_t BlockSize>
+class BasicBlockMap {
+public:
+    static constexpr uwufs_blk_t PER_BLK = BlockSize / sizeof(uwufs_blk_t);
+    static_assert(UWUFS_BLOCK_SIZE_SUPPORTED(BlockSize), "not one of the supported block sizes");
+
+    static constexpr unsigned SHIFT = __builtin_ctzll(PER_BLK);
+    static constexpr uwufs_blk_t MASK = PER_BLK - 1;
+
+    struct IndirectBlock {
+        uwufs_blk_t block_nos[PER_BLK];
+    };
+
+    // data blks under an entry of an indirect blk `level` levels above them
+    static constexpr uwufs_blk_t span(unsigned level) { return uwufs_blk_t{1} << (SHIFT * level); }
+
+    // the entry of that indirect blk leading to data blk `index` of the tree
+    static constexpr uwufs_blk_t slot(uwufs_blk_t index, unsigned level) { return (index >> (SHIFT * level)) & MASK; }
+
+    // where the tree of `depth` levels starts in the file (after the
+    // direct blks and the smaller trees)
+    static constexpr uwufs_blk_t first(unsigned depth) {
+        return depth == 1 ? UWUFS_DIRECT_BLOCKS : first(depth - 1) + span(depth - 1);
+    }
+
+    // end of the blk map (of Tree<3>): the largest file in data blks
+    static constexpr uwufs_blk_t end() { return first(4); }
+
+    // what remove_range took out of the inode
+    struct Freed {
+        uint64_t blks = 0;
+        uint64_t unwritten = 0;
+        uint64_t shared = 0;
+    };
+
+    static bool is_written(uwufs_blk_t entry) { return entry != 0 && !(entry & UWUFS_BLK_UNWRITTEN); }
+
+    static void free_entry(int device_fd, uwufs_blk_t entry, Freed& freed) {
+        if (entry == 0) {
+            return;
+        }
+        // a shared block only leaves this file (see release_data_blk)
+        if (release_data_blk(device_fd, entry) < 0) {
+#ifdef DEBUG
+            printf("failed to free data block: %lu\n", UWUFS_BLK_NUM(entry));
+#endif
+            return;
+        }
+        ++freed.blks;
+        if (entry & UWUFS_BLK_UNWRITTEN) {
+            ++freed.unwritten;
+        }
+        if (entry & UWUFS_BLK_SHARED) {
+            ++freed.shared;
+        }
+    }
+
+    // The tree of `Depth` levels of indirect blks. Indexes are data blks
+    // of the tree ([0, SIZE)), FIRST is where the tree starts in the file.
+    template <unsigned Depth>
+    struct Tree {
+        static_assert(Depth >= 1 && Depth <= 3, "an inode has single, double and triple indirect trees");
+
+        static constexpr uwufs_blk_t SIZE = span(Depth);
+        static constexpr uwufs_blk_t FIRST = first(Depth);
+        static constexpr uwufs_blk_t END = FIRST + SIZE;
+
+        // data blks under each entry of the root
+        static constexpr unsigned CHILD_SHIFT = SHIFT * (Depth - 1);
+        static constexpr uwufs_blk_t CHILD = span(Depth - 1);
+
+        static uwufs_blk_t root(const uwufs_inode* inode) {
+            if constexpr (Depth == 1) {
+                return inode->single_indirect_blks;
+            }
+            else if constexpr (Depth == 2) {
+                return inode->double_indirect_blks;
+            }
+            else {
+                return inode->triple_indirect_blks;
+            }
+        }
+
+        static void set_root(uwufs_inode* inode, uwufs_blk_t root_no) {
+            if constexpr (Depth == 1) {
+                inode->single_indirect_blks = root_no;
+            }
+            else if constexpr (Depth == 2) {
+                inode->double_indirect_blks = root_no;
+            }
+            else {
+                inode->triple_indirect_blks = root_no;
+            }
+        }
+
+        // The entry of data blk `index`, 0 for a hole. `read(level, blk_no)`
+        // returns the indirect blk (nullptr if blk_no is 0 or unreadable),
+        // so the caller decides what is cached.
+        template <typename Read>
+        static uwufs_blk_t lookup(uwufs_blk_t root_no, uwufs_blk_t index, Read&& read) {
+            const IndirectBlock* blk = read(Depth - 1, root_no);
+            if (!blk) {
+                return 0;
+            }
+            auto entry = blk->block_nos[slot(index, Depth - 1)];
+            if constexpr (Depth == 1) {
+                return entry;
+            }
+            else {
+                return Tree<Depth - 1>::lookup(entry, index & (CHILD - 1), read);
+            }
+        }
+
+        // Points data blk `index` to `block_no`, the missing indirect blks
+        // (a hole until now, `cur_no` 0 included) are allocated and
+        // counted in `new_blks`. Returns the (possibly new) root or 0 if
+        // an indirect blk could not be allocated.
+        static uwufs_blk_t set(int device_fd, uwufs_blk_t cur_no, uwufs_blk_t index, uwufs_blk_t block_no, uint64_t& new_blks) {
+            IndirectBlock indirect_block;
+            bool allocated{cur_no == 0};
+            if (allocated) {
+                if (malloc_blk(device_fd, &cur_no) < 0) {
+                    return 0;
+                }
+                ++new_blks;
+                memset(&indirect_block, 0, sizeof(indirect_block));
+#ifdef DEBUG
+                printf("new indirect block: %lu\n", cur_no);
+#endif
+            }
+            else if (read_blk(device_fd, &indirect_block, cur_no) < 0) {
+                return 0;
+            }
+            auto i = index >> CHILD_SHIFT;
+            if constexpr (Depth == 1) {
+                indirect_block.block_nos[i] = block_no;
+            }
+            else {
+                auto child_no = Tree<Depth - 1>::set(device_fd, indirect_block.block_nos[i], index & (CHILD - 1), block_no, new_blks);
+                if (child_no == 0) {
+                    if (allocated && free_blk(device_fd, cur_no) == 0) {
+                        --new_blks;
+                    }
+                    return 0;
+                }
+                indirect_block.block_nos[i] = child_no;
+            }
+            if (write_meta_blk(device_fd, &indirect_block, cur_no) < 0) {
+                return 0;
+            }
+            return cur_no;
+        }
+
+        // Removes the last data blk `index` of the tree (the file shrinks
+        // from its end): an indirect blk whose first entry goes is freed.
+        // Returns the removed entry and whether `cur_no` was freed.
+        static std::pair<uwufs_blk_t, bool> remove(int device_fd, uwufs_blk_t cur_no, uwufs_blk_t index, uint64_t& freed_blks) {
+            IndirectBlock indirect_block;
+            if (read_blk(device_fd, &indirect_block, cur_no) < 0) {
+                return {0, false};
+            }
+            auto i = index >> CHILD_SHIFT;
+            uwufs_blk_t block_no;
+            if constexpr (Depth == 1) {
+                block_no = indirect_block.block_nos[i];
+            }
+            else {
+                auto [child_block_no, free] = Tree<Depth - 1>::remove(device_fd, indirect_block.block_nos[i], index & (CHILD - 1), freed_blks);
+                if (!free) {
+                    return {child_block_no, false};
+                }
+                block_no = child_block_no;
+            }
+            if (index == 0) {   // nothing left in the current indirect block
+                if (free_blk(device_fd, cur_no) < 0) {
+                    return {0, true};
+                }
+                ++freed_blks;
+#ifdef DEBUG
+                printf("free indirect block: %lu\n", cur_no);
+#endif
+                return {block_no, true};
+            }
+            indirect_block.block_nos[i] = 0;
+            if (write_meta_blk(device_fd, &indirect_block, cur_no) < 0) {
+                return {0, false};
+            }
+            return {block_no, false};
+        }
+
+        // Clears the entries of the data blks [start, end) (start < end <=
+        // SIZE), freeing the data blks too if `free_data`. The indirect
+        // blks left without entries are freed, also when the range only
+        // covers part of them. Returns true if `cur_no` was freed
+        // (the caller drops its pointer).
+        static bool remove_range(int device_fd, uwufs_blk_t cur_no, uwufs_blk_t start, uwufs_blk_t end, bool free_data, Freed& freed) {
+            if (cur_no == 0) {  // a hole: nothing allocated below
+                return false;
+            }
+            bool whole{start == 0 && end == SIZE};
+            if (Depth > 1 || free_data || !whole) {    // need the entries
+                IndirectBlock indirect_block;
+                if (read_blk(device_fd, &indirect_block, cur_no) < 0) {
+#ifdef DEBUG
+                    printf("failed to read indirect block: %lu\n", cur_no);
+#endif
+                    return false;
+                }
+                bool dirty{false};
+                for (uwufs_blk_t i{start >> CHILD_SHIFT}; i <= (end - 1) >> CHILD_SHIFT; ++i) {
+                    if (indirect_block.block_nos[i] == 0) {
+                        continue;
+                    }
+                    if constexpr (Depth == 1) {  // data blocks
+                        if (free_data) {
+                            free_entry(device_fd, indirect_block.block_nos[i], freed);
+                        }
+                        indirect_block.block_nos[i] = 0;
+                        dirty = true;
+                    }
+                    else {
+                        uwufs_blk_t left{i << CHILD_SHIFT};
+                        uwufs_blk_t child_start{start > left ? start - left : 0};
+                        uwufs_blk_t child_end{end < left + CHILD ? end - left : CHILD};
+                        if (Tree<Depth - 1>::remove_range(device_fd, indirect_block.block_nos[i], child_start, child_end, free_data, freed)) {
+                            indirect_block.block_nos[i] = 0;
+                            dirty = true;
+                        }
+                    }
+                }
+                if (!whole) {   // the blocks outside of the range stay
+                    if (!dirty) {
+                        return false;
+                    }
+                    // unless there are none: free the indirect block below
+                    bool empty{std::all_of(std::begin(indirect_block.block_nos), std::end(indirect_block.block_nos), [](uwufs_blk_t entry) { return entry == 0; })};
+                    if (!empty) {
+                        if (write_meta_blk(device_fd, &indirect_block, cur_no) < 0) {
+#ifdef DEBUG
+                            printf("failed to write indirect block: %lu\n", cur_no);
+#endif
+                        }
+                        return false;
+                    }
+                }
+            }
+#ifdef DEBUG
+            printf("free indirect block: %lu\n", cur_no);
+#endif
+            if (free_blk(device_fd, cur_no) < 0) {
+#ifdef DEBUG
+                printf("failed to free indirect block: %lu\n", cur_no);
+#endif
+                return false;
+            }
+            ++freed.blks;
+            return true;
+        }
+
+        // The first data blk in [start, end) (start < end <= SIZE) that is
+        // written (`data`) or a hole (!`data`), `end` if none. Unallocated
+        // subtrees are skipped without reading them.
+        static uwufs_blk_t seek(int device_fd, uwufs_blk_t cur_no, uwufs_blk_t start, uwufs_blk_t end, bool data) {
+            if (cur_no == 0) {  // the whole subtree is a hole
+                return data ? end : start;
+            }
+            IndirectBlock indirect_block;
+            if (read_blk(device_fd, &indirect_block, cur_no) < 0) {
+#ifdef DEBUG
+                printf("failed to read indirect block: %lu\n", cur_no);
+#endif
+                return end;
+            }
+            for (uwufs_blk_t i{start >> CHILD_SHIFT}; i <= (end - 1) >> CHILD_SHIFT; ++i) {
+                if constexpr (Depth == 1) {  // the entries are data blocks
+                    if (is_written(indirect_block.block_nos[i]) == data) {
+                        return i;
+                    }
+                }
+                else {
+                    uwufs_blk_t left{i << CHILD_SHIFT};
+                    uwufs_blk_t child_start{start > left ? start - left : 0};
+                    uwufs_blk_t child_end{end < left + CHILD ? end - left : CHILD};
+                    auto found = Tree<Depth - 1>::seek(device_fd, indirect_block.block_nos[i], child_start, child_end, data);
+                    if (found != child_end) {
+                        return left + found;
+                    }
+                }
+            }
+            return end;
+        }
+    };
+
+    // f(Tree<Depth>{}) for the tree holding data blk `index`
+    // (Tree<1>::FIRST <= index < Tree<3>::END)
+    template <typename F>
+    static decltype(auto) with_tree(uwufs_blk_t index, F&& f) {
+        if (index < Tree<1>::END) {
+            return f(Tree<1>{});
+        }
+        if (index < Tree<2>::END) {
+            return f(Tree<2>{});
+        }
+        return f(Tree<3>{});
+    }
+
+    // f(Tree<Depth>{}) for each tree in file order, until f returns true
+    template <typename F>
+    static void for_each_tree(F&& f) {
+        f(Tree<1>{}) || f(Tree<2>{}) || f(Tree<3>{});
+    }
+};
+
+// f(BasicBlockMap<BlockSize>{}) for the block size of the mounted volume
+// (UWUFS_BLOCK_SIZE, one of UWUFS_BLOCK_SIZE_SUPPORTED)
+template <typename F>
+decltype(auto) with_block_map(F&& f) {
+    switch (UWUFS_BLOCK_SIZE) {
+    case 16384:
+        return f(BasicBlockMap<16384>{});
+    case 65536:
+        return f(BasicBlockMap<65536>{});
+    default:
+        return f(BasicBlockMap<4096>{});
+    }
+}
+
+
+#endif
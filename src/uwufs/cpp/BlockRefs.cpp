@@ -0,0 +1,61 @@
+#include "BlockRefs.h"
+
+#include <new>
+
+
+bool BlockRefs::share(uwufs_blk_t blk_num) {
+    std::lock_guard<std::mutex> guard(lock);
+    try {
+        auto it = refs.emplace(blk_num, 1).first;
+        ++it->second;
+    }
+    catch (const std::bad_alloc&) {
+        return false;
+    }
+    return true;
+}
+
+bool BlockRefs::release(uwufs_blk_t blk_num) {
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = refs.find(blk_num);
+    if (it == refs.end()) {
+        return true;
+    }
+    if (--it->second < 2) {
+        refs.erase(it);
+    }
+    return false;
+}
+
+void BlockRefs::clear() {
+    std::lock_guard<std::mutex> guard(lock);
+    refs.clear();
+}
+
+bool BlockRefs::rebuild_add(uwufs_blk_t blk_num) {
+    std::lock_guard<std::mutex> guard(lock);
+    try {
+        ++refs[blk_num];
+    }
+    catch (const std::bad_alloc&) {
+        return false;
+    }
+    return true;
+}
+
+size_t BlockRefs::rebuild_done() {
+    std::lock_guard<std::mutex> guard(lock);
+    for (auto it = refs.begin(); it != refs.end();) {
+        if (it->second < 2) {
+            it = refs.erase(it);    // only one file has it left
+            continue;
+        }
+        ++it;
+    }
+    return refs.size();
+}
+
+BlockRefs& BlockRefs::instance() {
+    static BlockRefs block_refs;
+    return block_refs;
+}
@@ -0,0 +1,43 @@
+#ifndef BlockRefs_h
+#define BlockRefs_h
+
+#include "../uwufs.h"
+#include "c_api.h"
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+
+
+// Reference counts of the data blks that are in more than one file
+// (reflink copies, see clone_file_range in file_operations.h)
+//
+// The block maps flag these blks UWUFS_BLK_SHARED. Only counts of 2 and
+// more are kept: a flagged blk that isn't here belongs to one file only
+// (the others dropped it). Nothing is stored on the device, mount counts
+// the flagged blks of all the inodes again (see rebuild_add).
+//
+// Thread safe: every method takes the lock
+class BlockRefs {
+public:
+    // one more file has the blk, returns false if out of memory
+    bool share(uwufs_blk_t blk_num);
+
+    // a file dropped the blk, returns true if it was the last one (the
+    // caller frees it)
+    bool release(uwufs_blk_t blk_num);
+
+    void clear();
+
+    // counts one flagged blk map entry, call done() after the last one
+    bool rebuild_add(uwufs_blk_t blk_num);
+    size_t rebuild_done();
+
+    static BlockRefs& instance();
+
+private:
+    std::mutex lock;
+    std::unordered_map<uwufs_blk_t, uint32_t> refs;
+};
+
+
+#endif
@@ -143,48 +143,50 @@
 
 DataBlockIterator::DataBlockIterator(const uwufs_inode* inode, int device_fd, uwufs_blk_t start_index) : inode(inode), device_fd(device_fd), current_index(start_index) {}
 
+void DataBlockIterator::invalidate() {
+    for (int depth{0}; depth < 3; ++depth) {
+        cached_nos[depth] = 0;
+    }
+}
+
+const void* DataBlockIterator::indirect_blk(int depth, uwufs_blk_t blk_no) {
+    if (!cache) {
+        cache.reset(new char[3 * UWUFS_BLOCK_SIZE]);  // read before use
+    }
+    if (blk_no == 0) {  // a hole (cached_nos is 0 for an empty slot too)
+        return nullptr;
+    }
+    char* slot = &cache[depth * UWUFS_BLOCK_SIZE];
+    if (cached_nos[depth] != blk_no) {
+        if (read_blk(device_fd, slot, blk_no) < 0) {
+            cached_nos[depth] = 0;
+            return nullptr;
+        }
+        cached_nos[depth] = blk_no;
+    }
+    return slot;
+}
+
 DataBlockIterator::value_type DataBlockIterator::next() {
 #ifdef DEBUG
     printf("current_index: %lu\n", current_index);
 #endif
-    if (current_index < INode::LEVEL_0_BLOCKS) {
+    auto index = current_index;
+    if (index < INode::LEVEL_0_BLOCKS) {
         return inode->direct_blks[current_index++];
     }
-    if (current_index < INode::LEVEL_1_BLOCKS) {    // single indirect blocks
-        auto single_index = current_index - INode::LEVEL_0_BLOCKS;
-        INode::IndirectBlock single_indirect_blk;
-        read_blk(device_fd, &single_indirect_blk, inode->single_indirect_blks);
-        auto blk_no = single_indirect_blk.block_nos[single_index];
+    // the cache slot of an indirect block is its level above the data blocks
+    return with_block_map([&](auto map) -> value_type {
+        using Map = decltype(map);
+        if (index >= Map::end()) {
+            return 0;
+        }
         ++current_index;
-        return blk_no;
-    }
-    if (current_index < INode::LEVEL_2_BLOCKS) {    // double indirect blocks
-        auto double_index = current_index - INode::LEVEL_1_BLOCKS;
-        auto i = double_index / (UWUFS_BLOCK_SIZE / sizeof(uwufs_blk_t));
-        auto j = double_index % (UWUFS_BLOCK_SIZE / sizeof(uwufs_blk_t));
-        INode::IndirectBlock double_indirect_blk;
-        read_blk(device_fd, &double_indirect_blk, inode->double_indirect_blks);
-        INode::IndirectBlock single_indirect_blk;
-        read_blk(device_fd, &single_indirect_blk, double_indirect_blk.block_nos[i]);
-        auto blk_no = single_indirect_blk.block_nos[j];
-        ++current_index;
-        return blk_no;
-    }
-    if (current_index < INode::LEVEL_3_BLOCKS) {    // triple indirect blocks
-        auto triple_index = current_index - INode::LEVEL_2_BLOCKS;
-        auto i = triple_index / (UWUFS_BLOCK_SIZE / sizeof(uwufs_blk_t) * UWUFS_BLOCK_SIZE / sizeof(uwufs_blk_t));
-        auto rem = triple_index % (UWUFS_BLOCK_SIZE / sizeof(uwufs_blk_t) * UWUFS_BLOCK_SIZE / sizeof(uwufs_blk_t));
-        auto j = rem / (UWUFS_BLOCK_SIZE / sizeof(uwufs_blk_t));
-        auto k = rem % (UWUFS_BLOCK_SIZE / sizeof(uwufs_blk_t));
-        INode::IndirectBlock triple_indirect_blk;
-        read_blk(device_fd, &triple_indirect_blk, inode->triple_indirect_blks);
-        INode::IndirectBlock double_indirect_blk;
-        read_blk(device_fd, &double_indirect_blk, triple_indirect_blk.block_nos[i]);
-        INode::IndirectBlock single_indirect_blk;
-        read_blk(device_fd, &single_indirect_blk, double_indirect_blk.block_nos[j]);
-        auto blk_no = single_indirect_blk.block_nos[k];
-        ++current_index;
-        return blk_no;
-    }
-    return 0;
-}
\ No newline at end of file
+        return Map::with_tree(index, [&](auto tree) {
+            using Tree = decltype(tree);
+            return Tree::lookup(Tree::root(inode), index - Tree::FIRST, [this](unsigned level, uwufs_blk_t blk_no) {
+                return static_cast<const typename Map::IndirectBlock*>(indirect_blk(level, blk_no));
+            });
+        });
+    });
+}
@@ -97,6 +97,9 @@
 #include <iterator>
 #include <memory>
 
+// Keeps the indirect blocks it walked through, so iterating over
+// consecutive blocks reads each indirect block once instead of once per
+// data block. Call invalidate() when the block map of the inode changes.
 class DataBlockIterator {
 public:
     using iterator_category = std::forward_iterator_tag;
@@ -110,10 +113,24 @@ public:
     // no bounds checking
     value_type next();
 
+    // moves the iterator to start_index (keeps the cached indirect blocks)
+    void seek(uwufs_blk_t start_index) { current_index = start_index; }
+
+    // drops the cached indirect blocks
+    void invalidate();
+
 private:
+    // returns the indirect block blk_no, read through the cache slot
+    const void* indirect_blk(int depth, uwufs_blk_t blk_no);
+
     const uwufs_inode* inode; // not owned
     int device_fd;
     uwufs_blk_t current_index;
+    // cached indirect block for each depth of the tree (0: the indirect
+    // block holding data block nos, 1: its parent, ...): its number and
+    // its UWUFS_BLOCK_SIZE bytes in `cache`
+    uwufs_blk_t cached_nos[3] = {0, 0, 0};
+    std::unique_ptr<char[]> cache;  // allocated on first indirect access
 };
 
 
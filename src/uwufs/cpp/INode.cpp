@@ -2,18 +2,11 @@
 #include "DataBlockIterator.h"
 
 #include "../low_level_operations.h"
+#include <algorithm>
 #include <cstdio>
 #include <cstring>
 
 
-#ifndef assert_low_level_operation
-#define assert_low_level_operation(operation) \
-    if (operation < 0) { \
-        return 0; \
-    }
-#endif
-
-
 uwufs_blk_t INode::get_dblk(uwufs_blk_t index) const {
     // directly build a temporary iterator
     // so it is not recommended to do random access on data blocks
@@ -34,100 +27,38 @@ DataBlockIterator INode::static_dblk_itr(const uwufs_inode* inode, int device_fd
     return DataBlockIterator(inode, device_fd, start_index);
 }
 
-uwufs_blk_t INode::recursive_append_dblk(int device_fd, uint8_t level, uwufs_blk_t cur_no, uwufs_blk_t index, uwufs_blk_t block_no) {
-    INode::IndirectBlock indirect_block;
-    if (index == 0) {   // need to allocate a new indirect block
-        assert_low_level_operation(malloc_blk(device_fd, &cur_no));
-        memset(&indirect_block, 0, UWUFS_BLOCK_SIZE);
-#ifdef DEBUG
-        printf("new indirect block: %lu\n", cur_no);
-#endif
-    }
-    else {
-        assert_low_level_operation(read_blk(device_fd, &indirect_block, cur_no));
-    }
-    if (level == 0) {   // cur_no is the single indirect block
-        indirect_block.block_nos[index] = block_no;
-        assert_low_level_operation(write_blk(device_fd, &indirect_block, cur_no));
-        return cur_no;
-    }
-    // recursively append the data block
-    uwufs_blk_t mod = 1;
-    for (uint8_t i{0}; i < level; ++i) {
-        mod *= UWUFS_BLOCK_SIZE / sizeof(uwufs_blk_t);
-    }
-    indirect_block.block_nos[index / mod] = recursive_append_dblk(device_fd, level - 1, indirect_block.block_nos[index / mod], index % mod, block_no);
-    assert_low_level_operation(write_blk(device_fd, &indirect_block, cur_no));  // write back the indirect block
-    return cur_no;
-}
-
-uwufs_blk_t INode::append_dblk(uwufs_inode* inode, int device_fd, uwufs_blk_t index, uwufs_blk_t block_no) {
+uwufs_blk_t INode::set_dblk(uwufs_inode* inode, int device_fd, uwufs_blk_t index, uwufs_blk_t block_no) {
     // It will write all modification directly to the disk EXCEPT the inode itself.
     // Remember to write the inode to disk after calling this function.
-    // It assumes `index` is the position of the new data block no.
-    // index == current block count
-    if (index >= LEVEL_3_BLOCKS) {
-        return 0;
-    }
+    // `index` can be anywhere in the file: missing indirect blocks are allocated.
+    // Returns block_no or 0 if an indirect block could not be allocated.
     if (index < LEVEL_0_BLOCKS) {   // direct block
         inode->direct_blks[index] = block_no;
+        return block_no;
     }
-    else if (index < LEVEL_1_BLOCKS) {  // single indirect block
-        inode->single_indirect_blks = recursive_append_dblk(device_fd, 0, inode->single_indirect_blks, index - LEVEL_0_BLOCKS, block_no);
-    }
-    else if (index < LEVEL_2_BLOCKS) {  // double indirect block
-        inode->double_indirect_blks = recursive_append_dblk(device_fd, 1, inode->double_indirect_blks, index - LEVEL_1_BLOCKS, block_no);
-    }
-    else {  // triple indirect block
-        inode->triple_indirect_blks = recursive_append_dblk(device_fd, 2, inode->triple_indirect_blks, index - LEVEL_2_BLOCKS, block_no);
-    }
-    return block_no;
-}
-
-std::pair<uwufs_blk_t, bool> INode::recursive_remove_dblk(int device_fd, uint8_t level, uwufs_blk_t cur_no, uwufs_blk_t index) {
-    // Returns true if the current indirect block is empty after removing the data block.
-    INode::IndirectBlock indirect_block;
-    if (read_blk(device_fd, &indirect_block, cur_no) < 0) {
-        return {0, false};
-    }
-    if (level == 0) {   // cur_no is the single indirect block
-        uwufs_blk_t block_no = indirect_block.block_nos[index];
-        if (index == 0) {
-            if (free_blk(device_fd, cur_no) < 0) {
-                return {0, true};
-            }
-#ifdef DEBUG
-            printf("free indirect block: %lu\n", cur_no);
-#endif
-            return {block_no, true};
+    uint64_t new_blks{0};
+    auto root_no = with_block_map([&](auto map) -> uwufs_blk_t {
+        using Map = decltype(map);
+        if (index >= Map::end()) {
+            return 0;
         }
-        indirect_block.block_nos[index] = 0;
-        if (write_blk(device_fd, &indirect_block, cur_no) < 0) {
-            return {0, false};
-        }
-        return {block_no, false};
-    }
-    uwufs_blk_t mod = 1;
-    for (uint8_t i{0}; i < level; ++i) {
-        mod *= UWUFS_BLOCK_SIZE / sizeof(uwufs_blk_t);
-    }
-    auto [block_no, free] = recursive_remove_dblk(device_fd, level - 1, indirect_block.block_nos[index / mod], index % mod);
-    if (free) { // the child indirect block is empty
-        if (index == 0) {   // need to free the current indirect block
-            if (free_blk(device_fd, cur_no) < 0) {
-                return {0, true};
+        return Map::with_tree(index, [&](auto tree) {
+            using Tree = decltype(tree);
+            auto root_no = Tree::set(device_fd, Tree::root(inode), index - Tree::FIRST, block_no, new_blks);
+            if (root_no != 0) {
+                Tree::set_root(inode, root_no);
             }
-#ifdef DEBUG
-            printf("free indirect block: %lu\n", cur_no);
-#endif
-            return {block_no, true};
-        }
-        indirect_block.block_nos[index / mod] = 0;
-        if (write_blk(device_fd, &indirect_block, cur_no) < 0) {
-            return {0, false};
-        }
-    }
-    return {block_no, false};
+            return root_no;
+        });
+    });
+    inode->file_blocks += new_blks;
+    return root_no != 0 ? block_no : 0;
+}
+
+uwufs_blk_t INode::append_dblk(uwufs_inode* inode, int device_fd, uwufs_blk_t index, uwufs_blk_t block_no) {
+    // It assumes `index` is the position of the new data block no.
+    // index == current block count
+    return set_dblk(inode, device_fd, index, block_no);
 }
 
 uwufs_blk_t INode::remove_dblk(uwufs_inode *inode, int device_fd, uwufs_blk_t index) {
@@ -136,80 +67,110 @@ uwufs_blk_t INode::remove_dblk(uwufs_inode *inode, int device_fd, uwufs_blk_t in
     // It assumes `index` is the position of the data block to be removed.
     // Returns the block number of the removed data block.
     // It will not free the data block.
-    if (index >= LEVEL_3_BLOCKS) {
-        return 0;
-    }
     if (index < LEVEL_0_BLOCKS) {   // direct block
         auto block_no = inode->direct_blks[index];
         inode->direct_blks[index] = 0;
         return block_no;
     }
-    if (index < LEVEL_1_BLOCKS) {  // single indirect block
-        auto [block_no, free] = recursive_remove_dblk(device_fd, 0, inode->single_indirect_blks, index - LEVEL_0_BLOCKS);
-        if (free) {
-            inode->single_indirect_blks = 0;
-        }
-        return block_no;
-    }
-    if (index < LEVEL_2_BLOCKS) {  // double indirect block
-        auto [block_no, free] = recursive_remove_dblk(device_fd, 1, inode->double_indirect_blks, index - LEVEL_1_BLOCKS);
-        if (free) {
-            inode->double_indirect_blks = 0;
+    uint64_t freed_blks{0};
+    auto removed_no = with_block_map([&](auto map) -> uwufs_blk_t {
+        using Map = decltype(map);
+        if (index >= Map::end()) {
+            return 0;
         }
-        return block_no;
-    }
-    // triple indirect block
-    auto [block_no, free] = recursive_remove_dblk(device_fd, 2, inode->triple_indirect_blks, index - LEVEL_2_BLOCKS);
-    if (free) {
-        inode->triple_indirect_blks = 0;
-    }
-    return block_no;
+        return Map::with_tree(index, [&](auto tree) {
+            using Tree = decltype(tree);
+            auto [block_no, free] = Tree::remove(device_fd, Tree::root(inode), index - Tree::FIRST, freed_blks);
+            if (free) {
+                Tree::set_root(inode, 0);
+            }
+            return block_no;
+        });
+    });
+    inode->file_blocks -= freed_blks;
+    return removed_no;
 }
 
 void INode::remove_dblks(uwufs_inode *inode, int device_fd, uwufs_blk_t start_index, uwufs_blk_t end_index) {
     // It will write all modification directly to the disk EXCEPT the inode itself.
     // Remember to write the inode to disk after calling this function.
-    // Returns the block number of the removed data block.
     // It will not free the data block.
     // free the data block numbers: [start_index, end_index)
     // for (uwufs_blk_t i{start_index}; i < end_index; ++i) {
     //     remove_dblk(inode, device_fd, i);
     // }
-    if (start_index >= end_index) {
-        return;
-    }
-    recursive_remove_dblks(device_fd, inode->single_indirect_blks, LEVEL_0_BLOCKS, LEVEL_1_BLOCKS, start_index, end_index);
-    recursive_remove_dblks(device_fd, inode->double_indirect_blks, LEVEL_1_BLOCKS, LEVEL_2_BLOCKS, start_index, end_index);
-    recursive_remove_dblks(device_fd, inode->triple_indirect_blks, LEVEL_2_BLOCKS, LEVEL_3_BLOCKS, start_index, end_index);
+    remove_range(inode, device_fd, start_index, end_index, false);
 }
 
-void INode::recursive_remove_dblks(int device_fd, uwufs_blk_t cur_no, uwufs_blk_t cur_left, uwufs_blk_t cur_right, uwufs_blk_t start_index, uwufs_blk_t end_index) {
-    // free the data block numbers: [start_index, end_index)
-    // the current indirect block contains the data blocks: [cur_left, cur_right)
-    if (start_index >= cur_right || end_index <= cur_left) {    // no overlap
+void INode::punch_dblks(uwufs_inode *inode, int device_fd, uwufs_blk_t start_index, uwufs_blk_t end_index) {
+    // Same as remove_dblks but also frees the data blocks (and counts them in the inode).
+    remove_range(inode, device_fd, start_index, end_index, true);
+}
+
+void INode::remove_range(uwufs_inode *inode, int device_fd, uwufs_blk_t start_index, uwufs_blk_t end_index, bool free_data) {
+    if (start_index >= end_index) {
         return;
     }
-    auto stride{(cur_right - cur_left) / (UWUFS_BLOCK_SIZE / sizeof(uwufs_blk_t))};
-    if (stride > 1) {   // not single indirect block
-        INode::IndirectBlock indirect_block;
-        if (read_blk(device_fd, &indirect_block, cur_no) < 0) {
-#ifdef DEBUG
-            printf("failed to read indirect block: %lu\n", cur_no);
-#endif
-            return;
+    with_block_map([&](auto map) {
+        using Map = decltype(map);
+        typename Map::Freed freed;
+        for (uwufs_blk_t i{start_index}; i < end_index && i < LEVEL_0_BLOCKS; ++i) {
+            if (free_data) {
+                Map::free_entry(device_fd, inode->direct_blks[i], freed);
+            }
+            inode->direct_blks[i] = 0;
         }
-        for (uwufs_blk_t i{0}; i < UWUFS_BLOCK_SIZE / sizeof(uwufs_blk_t); ++i) {
-            recursive_remove_dblks(device_fd, indirect_block.block_nos[i], cur_left + i * stride, cur_left + (i + 1) * stride, start_index, end_index);
+        Map::for_each_tree([&](auto tree) {
+            using Tree = decltype(tree);
+            if (end_index <= Tree::FIRST) { // the range ends before this tree
+                return true;
+            }
+            // the part of the range in this tree
+            uwufs_blk_t start{start_index > Tree::FIRST ? start_index - Tree::FIRST : 0};
+            uwufs_blk_t end{std::min(end_index - Tree::FIRST, Tree::SIZE)};
+            if (start < end && Tree::remove_range(device_fd, Tree::root(inode), start, end, free_data, freed)) {
+                Tree::set_root(inode, 0);
+            }
+            return false;
+        });
+        // (files from before the counters existed have 0)
+        inode->file_blocks -= std::min(freed.blks, inode->file_blocks);
+        inode->file_unwritten_blocks -= std::min(freed.unwritten, inode->file_unwritten_blocks);
+        inode->file_shared_blocks -= std::min(freed.shared, inode->file_shared_blocks);
+    });
+}
+
+uwufs_blk_t INode::seek_dblk(const uwufs_inode* inode, int device_fd, uwufs_blk_t start_index, uwufs_blk_t end_index, bool data) {
+    // Returns the first index in [start_index, end_index) whose data block is allocated (`data`)
+    // or a hole (!`data`). Returns end_index if there is none.
+    return with_block_map([&](auto map) {
+        using Map = decltype(map);
+        if (end_index > Map::end()) {
+            end_index = Map::end();
         }
-    }
-    if (start_index <= cur_left) {  // need to free the current indirect block
-#ifdef DEBUG
-        printf("free indirect block: %lu\n", cur_no);
-#endif
-        if (free_blk(device_fd, cur_no) < 0) {
-#ifdef DEBUG
-            printf("failed to free indirect block: %lu\n", cur_no);
-#endif
+        for (uwufs_blk_t i{start_index}; i < end_index && i < LEVEL_0_BLOCKS; ++i) {
+            if (Map::is_written(inode->direct_blks[i]) == data) {
+                return i;
+            }
         }
-    }
-}
\ No newline at end of file
+        auto found = end_index;
+        Map::for_each_tree([&](auto tree) {
+            using Tree = decltype(tree);
+            if (end_index <= Tree::FIRST) {
+                return true;
+            }
+            uwufs_blk_t start{start_index > Tree::FIRST ? start_index - Tree::FIRST : 0};
+            uwufs_blk_t end{std::min(end_index - Tree::FIRST, Tree::SIZE)};
+            if (start >= end) { // the range starts after this tree
+                return false;
+            }
+            auto i = Tree::seek(device_fd, Tree::root(inode), start, end, data);
+            if (i == end) {
+                return false;
+            }
+            found = Tree::FIRST + i;
+            return true;
+        });
+        return found;
+    });
+}
@@ -2,7 +2,7 @@
 #define INode_h
 
 #include "../uwufs.h"
-#include <utility>  // std::pair
+#include "BlockMap.h"
 
 
 class DataBlockIterator;    // forward declaration
@@ -12,22 +12,16 @@ class DataBlockIterator;    // forward declaration
 // It never writes to disk, only modifies the in-memory inode
 class INode {
 public:
-    struct IndirectBlock {
-        uwufs_blk_t block_nos[UWUFS_BLOCK_SIZE / sizeof(uwufs_blk_t)];
-    };
-    static_assert(sizeof(IndirectBlock) == UWUFS_BLOCK_SIZE, "IndirectBlock size must be equal to block size");
-
+    // end of the direct blocks (where the indirect trees end depends on
+    // the block size, see BasicBlockMap::Tree)
     static constexpr uwufs_blk_t LEVEL_0_BLOCKS = UWUFS_DIRECT_BLOCKS;
-    static constexpr uwufs_blk_t LEVEL_1_BLOCKS = LEVEL_0_BLOCKS + UWUFS_BLOCK_SIZE / sizeof(uwufs_blk_t);
-    static constexpr uwufs_blk_t LEVEL_2_BLOCKS = LEVEL_1_BLOCKS + UWUFS_BLOCK_SIZE / sizeof(uwufs_blk_t) * UWUFS_BLOCK_SIZE / sizeof(uwufs_blk_t);
-    static constexpr uwufs_blk_t LEVEL_3_BLOCKS = LEVEL_2_BLOCKS + UWUFS_BLOCK_SIZE / sizeof(uwufs_blk_t) * UWUFS_BLOCK_SIZE / sizeof(uwufs_blk_t) * UWUFS_BLOCK_SIZE / sizeof(uwufs_blk_t);
 
     INode(uwufs_inode* inode, int device_fd) : inode(inode), device_fd(device_fd) {}
 
     // auxilliary functions
     bool is_used() const { return inode->file_mode ^ F_TYPE_FREE; }
-    bool is_reg() const { return inode->file_mode & F_TYPE_REGULAR; }
-    bool is_dir() const { return inode->file_mode & F_TYPE_DIRECTORY; }
+    bool is_reg() const { return (inode->file_mode & F_TYPE_BITS) == F_TYPE_REGULAR; }
+    bool is_dir() const { return (inode->file_mode & F_TYPE_BITS) == F_TYPE_DIRECTORY; }
 
     // returns the block number of index-th data block
     // no bounds checking: index
@@ -43,14 +37,19 @@ public:
     // static functions
     static uwufs_blk_t static_get_dblk(const uwufs_inode* inode, int device_fd, uwufs_blk_t index);
     static DataBlockIterator static_dblk_itr(const uwufs_inode* inode, int device_fd, uwufs_blk_t start_index);
+    // the indirect blocks they allocate or free are counted in inode->file_blocks
+    static uwufs_blk_t set_dblk(uwufs_inode* inode, int device_fd, uwufs_blk_t index, uwufs_blk_t block_no);
     static uwufs_blk_t append_dblk(uwufs_inode* inode, int device_fd, uwufs_blk_t index, uwufs_blk_t block_no);
     static uwufs_blk_t remove_dblk(uwufs_inode* inode, int device_fd, uwufs_blk_t index);
     static void remove_dblks(uwufs_inode* inode, int device_fd, uwufs_blk_t start_index, uwufs_blk_t end_index);
+    static void punch_dblks(uwufs_inode* inode, int device_fd, uwufs_blk_t start_index, uwufs_blk_t end_index);
+    // first index in [start_index, end_index) that is written data (`data`) or a hole (!`data`), end_index if none
+    // unallocated indirect subtrees are skipped without reading them, unwritten blocks count as holes
+    static uwufs_blk_t seek_dblk(const uwufs_inode* inode, int device_fd, uwufs_blk_t start_index, uwufs_blk_t end_index, bool data);
 
 private:
-    static uwufs_blk_t recursive_append_dblk(int device_fd, uint8_t level, uwufs_blk_t cur_no, uwufs_blk_t index, uwufs_blk_t block_no);
-    static std::pair<uwufs_blk_t, bool> recursive_remove_dblk(int device_fd, uint8_t level, uwufs_blk_t cur_no, uwufs_blk_t index);
-    static void recursive_remove_dblks(int device_fd, uwufs_blk_t cur_no, uwufs_blk_t cur_left, uwufs_blk_t cur_right, uwufs_blk_t start_index, uwufs_blk_t end_index);
+    // the indirect trees are walked by BasicBlockMap
+    static void remove_range(uwufs_inode* inode, int device_fd, uwufs_blk_t start_index, uwufs_blk_t end_index, bool free_data);
 };
 
 
@@ -0,0 +1,109 @@
+#include "InodeTable.h"
+
+#include <cstring>
+#include <new>
+
+
+void InodeTable::lookup(uwufs_blk_t inode_num, uint64_t n) {
+    std::lock_guard<std::mutex> guard(lock);
+    entries[inode_num].nlookup += n;
+}
+
+bool InodeTable::forget(uwufs_blk_t inode_num, uint64_t n) {
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = entries.find(inode_num);
+    if (it == entries.end()) {
+        return false;
+    }
+    auto& entry = it->second;
+    entry.nlookup = n < entry.nlookup ? entry.nlookup - n : 0;
+    if (entry.nlookup > 0) {
+        return false;
+    }
+    bool unlinked = entry.unlinked;
+    entries.erase(it);
+    return unlinked;
+}
+
+bool InodeTable::mark_unlinked(uwufs_blk_t inode_num) {
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = entries.find(inode_num);
+    if (it == entries.end() || it->second.nlookup == 0) {
+        return false;
+    }
+    it->second.unlinked = true;
+    return true;
+}
+
+uwufs_blk_t InodeTable::pop_unlinked() {
+    std::lock_guard<std::mutex> guard(lock);
+    for (auto it = entries.begin(); it != entries.end(); ++it) {
+        if (it->second.unlinked) {
+            auto inode_num = it->first;
+            entries.erase(it);
+            return inode_num;
+        }
+    }
+    return 0;
+}
+
+uwufs_open_inode* InodeTable::open(uwufs_blk_t inode_num, const uwufs_inode* inode) {
+    std::lock_guard<std::mutex> guard(lock);
+    try {
+        auto result = open_inodes.try_emplace(inode_num);
+        auto& open_inode = result.first->second;
+        if (result.second) {
+            open_inode.inode = *inode;
+            open_inode.map_gen = 0;
+            open_inode.synced_map_gen = UINT64_MAX;
+            open_inode.nopen = 0;
+        }
+        ++open_inode.nopen;
+        return &open_inode;
+    }
+    catch (const std::bad_alloc&) {
+        return nullptr;
+    }
+}
+
+void InodeTable::close(uwufs_blk_t inode_num) {
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = open_inodes.find(inode_num);
+    if (it != open_inodes.end() && --it->second.nopen == 0) {
+        open_inodes.erase(it);
+    }
+}
+
+void InodeTable::inode_written(uwufs_blk_t inode_num, const uwufs_inode* old_inode, const uwufs_inode* new_inode) {
+    std::lock_guard<std::mutex> guard(lock);
+    if (open_inodes.empty()) {
+        return;
+    }
+    auto it = open_inodes.find(inode_num);
+    if (it == open_inodes.end()) {
+        return;
+    }
+    auto& open_inode = it->second;
+    constexpr size_t blk_map_size = sizeof(new_inode->direct_blks) +
+                                    sizeof(new_inode->single_indirect_blks) +
+                                    sizeof(new_inode->double_indirect_blks) +
+                                    sizeof(new_inode->triple_indirect_blks);
+    // adding blocks also changes indirect blocks the inode points to,
+    // which shows up as a change of the allocated block count
+    if (old_inode->file_size != new_inode->file_size ||
+        old_inode->file_blocks != new_inode->file_blocks ||
+        old_inode->file_unwritten_blocks != new_inode->file_unwritten_blocks ||
+        old_inode->file_shared_blocks != new_inode->file_shared_blocks ||
+        old_inode->file_flags != new_inode->file_flags ||
+        memcmp(old_inode->direct_blks, new_inode->direct_blks, blk_map_size) != 0) {
+        ++open_inode.map_gen;
+    }
+    if (&open_inode.inode != new_inode) {
+        open_inode.inode = *new_inode;
+    }
+}
+
+InodeTable& InodeTable::instance() {
+    static InodeTable table;
+    return table;
+}
@@ -0,0 +1,59 @@
+#ifndef InodeTable_h
+#define InodeTable_h
+
+#include "../uwufs.h"
+#include "c_api.h"
+#include <mutex>
+#include <unordered_map>
+
+
+// In-memory state of the inodes the kernel currently knows about
+// (FUSE low-level API: every successful lookup/create/mkdir/link reply
+// increments the kernel's lookup count of an inode and forget decrements it)
+//
+// Inodes that are unlinked while the kernel still references them are
+// only marked here, the caller frees them once the last reference is
+// forgotten (see itable_* in c_api.h)
+//
+// It also owns the in-memory inodes of the open files (shared by all the
+// file handles of an inode)
+//
+// Thread safe: every method takes the table lock (callers must hold the
+// inode lock to read or modify an in-memory inode)
+class InodeTable {
+public:
+    struct Entry {
+        uint64_t nlookup = 0;
+        bool unlinked = false;  // link count reached 0, free on last forget
+    };
+
+    void lookup(uwufs_blk_t inode_num, uint64_t n = 1);
+
+    // returns true if the inode was unlinked and this was the last reference
+    bool forget(uwufs_blk_t inode_num, uint64_t n);
+
+    // returns true if the inode is still referenced (deletion is deferred)
+    bool mark_unlinked(uwufs_blk_t inode_num);
+
+    // removes and returns an unlinked inode (0 if there is none)
+    uwufs_blk_t pop_unlinked();
+
+    // returns the in-memory inode of an open file (nullptr if out of memory)
+    uwufs_open_inode* open(uwufs_blk_t inode_num, const uwufs_inode* inode);
+
+    void close(uwufs_blk_t inode_num);
+
+    // keeps the in-memory inode the same as the one on disk
+    void inode_written(uwufs_blk_t inode_num, const uwufs_inode* old_inode, const uwufs_inode* new_inode);
+
+    static InodeTable& instance();
+
+private:
+    std::mutex lock;
+    std::unordered_map<uwufs_blk_t, Entry> entries;
+    // pointers to the elements stay valid until they are erased
+    std::unordered_map<uwufs_blk_t, uwufs_open_inode> open_inodes;
+};
+
+
+#endif
@@ -0,0 +1,587 @@
+#include "Journal.h"
+
+#include "../low_level_operations.h"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <new>
+#include <thread>
+#include <unistd.h>
+
+
+namespace {
+
+constexpr uint64_t CHECKSUM_SEED = 0xcbf29ce484222325ULL;
+
+// handles held by this thread (only the outermost one counts)
+thread_local int depth = 0;
+// set while the checkpoint gives the deferred frees back
+thread_local bool releasing = false;
+
+// FNV-1a over 64-bit words
+uint64_t checksum(uint64_t sum, const void* blk) {
+    const uint64_t* words = static_cast<const uint64_t*>(blk);
+    for (size_t i{0}; i < UWUFS_BLOCK_SIZE / sizeof(uint64_t); ++i) {
+        sum = (sum ^ words[i]) * 0x100000001b3ULL;
+    }
+    return sum;
+}
+
+}
+
+
+uwufs_blk_t Journal::log_blks(size_t nblks) const {
+    // descriptors + blks + commit
+    return (nblks + UWUFS_JOURNAL_BLK_NUMS - 1) / UWUFS_JOURNAL_BLK_NUMS + nblks + 1;
+}
+
+int Journal::open(int device_fd, const uwufs_super_blk* super_blk) {
+    std::lock_guard<std::mutex> guard(commit_lock);
+    if (super_blk->journal_total_size < 2) {
+        return 0;   // formatted without a journal
+    }
+    fd = device_fd;
+    start = super_blk->journal_start;
+    size = super_blk->journal_total_size;
+    max_txn_blks = size / 4;
+    int status = replay();
+    if (status < 0) {
+        return status;
+    }
+    active = true;
+    return 0;
+}
+
+int Journal::replay() {
+    uwufs_journal_header header;
+    uwufs_journal_blk record;
+    std::unique_ptr<char[]> blk(new char[UWUFS_BLOCK_SIZE]);
+    if (::read_blk(fd, &header, UWUFS_JOURNAL_HEADER_BLK) < 0) {
+        return -EIO;
+    }
+    if (header.magic != UWUFS_JOURNAL_MAGIC) {
+        return -EINVAL;
+    }
+
+    uwufs_blk_t pos = header.head % size;
+    uint64_t seq = header.sequence;
+    uint64_t replayed = 0;
+    for (;;) {
+        // a transaction only counts if its commit blk made it to the log
+        uwufs_blk_t n = 0;
+        uint64_t sum = CHECKSUM_SEED;
+        bool complete = false;
+        while (n < size) {
+            if (::read_blk(fd, &record, log_blk_num(pos + n)) < 0) {
+                return -EIO;
+            }
+            if (record.magic != UWUFS_JOURNAL_MAGIC || record.sequence != seq) {
+                break;
+            }
+            if (record.type == UWUFS_JOURNAL_COMMIT) {
+                complete = n > 0 && record.count == n && record.checksum == sum;
+                break;
+            }
+            if (record.type != UWUFS_JOURNAL_DESCRIPTOR || record.count > UWUFS_JOURNAL_BLK_NUMS ||
+                n + 1 + record.count >= size) {
+                break;
+            }
+            sum = checksum(sum, &record);
+            for (uint32_t i{0}; i < record.count; ++i) {
+                if (::read_blk(fd, blk.get(), log_blk_num(pos + n + 1 + i)) < 0) {
+                    return -EIO;
+                }
+                sum = checksum(sum, blk.get());
+            }
+            n += 1 + record.count;
+        }
+        if (!complete) {
+            break;
+        }
+
+        for (uwufs_blk_t p{0}; p < n; p += 1 + record.count) {
+            if (::read_blk(fd, &record, log_blk_num(pos + p)) < 0) {
+                return -EIO;
+            }
+            for (uint32_t i{0}; i < record.count; ++i) {
+                if (::read_blk(fd, blk.get(), log_blk_num(pos + p + 1 + i)) < 0 ||
+                    ::write_blk(fd, blk.get(), record.blk_nums[i]) != UWUFS_BLOCK_SIZE) {
+                    return -EIO;
+                }
+            }
+        }
+        pos = (pos + n + 1) % size;
+        ++seq;
+        ++replayed;
+    }
+
+    head = tail = pos;
+    used = 0;
+    logged_seq = flushed_seq = seq - 1;
+    running = Transaction();
+    running.seq = seq;
+    pending_frees.clear();
+    if (replayed == 0) {
+        return 0;
+    }
+    printf("uwufs: replayed %lu transactions from the journal\n", replayed);
+    int status = sync();
+    if (status == 0) {
+        status = write_header();
+    }
+    if (status == 0) {
+        status = sync();
+    }
+    return status;
+}
+
+int Journal::write_header() {
+    uwufs_journal_header header;
+    memset(&header, 0, sizeof(header));
+    header.magic = UWUFS_JOURNAL_MAGIC;
+    header.head = head;
+    header.sequence = logged_seq + 1;
+    if (::write_blk(fd, &header, UWUFS_JOURNAL_HEADER_BLK) != UWUFS_BLOCK_SIZE) {
+        return -EIO;
+    }
+    return 0;
+}
+
+int Journal::sync() {
+    // shared with the fsyncs of file data (see flush_device)
+    return (int)::flush_device(fd, ::flush_ticket());
+}
+
+int Journal::close() {
+    if (!active) {
+        return 0;
+    }
+    int status = checkpoint();
+    std::lock_guard<std::mutex> guard(commit_lock);
+    active = false;
+    for (auto& s : shards) {
+        std::lock_guard<std::mutex> shard_guard(s.lock);
+        s.entries.clear();
+    }
+    std::lock_guard<std::mutex> state_guard(lock);
+    running = Transaction();
+    pending_frees.clear();
+    return status;
+}
+
+void Journal::begin(bool wait) {
+    if (!active.load(std::memory_order_acquire) || depth++ > 0) {
+        return;
+    }
+    std::unique_lock<std::mutex> guard(lock);
+    if (wait) {
+        // a transaction that grew too big is closed as soon as its
+        // handles end, don't start new ones in it
+        cond.wait(guard, [this] {
+            return !closing && (handles == 0 || running.blk_nums.size() < max_txn_blks);
+        });
+    }
+    ++handles;
+}
+
+void Journal::end() {
+    if (depth == 0 || --depth > 0) {
+        return;
+    }
+    bool commit;
+    bool too_big;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (--handles == 0) {
+            cond.notify_all();
+        }
+        commit = handles == 0 && !closing &&
+                 (!running.blk_nums.empty() || !running.frees.empty());
+        too_big = running.blk_nums.size() >= max_txn_blks;
+    }
+    if (!commit) {
+        return;
+    }
+    // whoever holds the lock is committing already, the next handle
+    // that ends (or the next flush) logs what it missed
+    if (too_big) {
+        commit_lock.lock();
+    }
+    else if (!commit_lock.try_lock()) {
+        return;
+    }
+    commit_locked();
+    commit_lock.unlock();
+}
+
+bool Journal::write_blk(const void* buf, uwufs_blk_t blk_num) {
+    if (!active.load(std::memory_order_acquire)) {
+        return false;
+    }
+    begin(false);
+    bool added = false;
+    bool journaled = true;
+    {
+        Shard& s = shard(blk_num);
+        std::lock_guard<std::mutex> guard(s.lock);
+        auto it = s.entries.find(blk_num);
+        if (it == s.entries.end()) {
+            try {
+                it = s.entries.emplace(blk_num, std::unique_ptr<Entry>(new Entry)).first;
+            }
+            catch (const std::bad_alloc&) {
+                // no copy of the blk exists: writing it through keeps reads right
+                journaled = false;
+            }
+        }
+        if (journaled) {
+            Entry& entry = *it->second;
+            memcpy(entry.data.get(), buf, UWUFS_BLOCK_SIZE);
+            if (!entry.dirty) {
+                entry.dirty = true;
+                added = true;
+            }
+        }
+    }
+    if (added) {
+        std::lock_guard<std::mutex> guard(lock);
+        running.blk_nums.push_back(blk_num);
+    }
+    end();
+    return journaled;
+}
+
+bool Journal::read_blk(void* buf, uwufs_blk_t blk_num) {
+    if (!active.load(std::memory_order_acquire)) {
+        return false;
+    }
+    Shard& s = shard(blk_num);
+    std::lock_guard<std::mutex> guard(s.lock);
+    auto it = s.entries.find(blk_num);
+    if (it == s.entries.end()) {
+        return false;
+    }
+    memcpy(buf, it->second->data.get(), UWUFS_BLOCK_SIZE);
+    return true;
+}
+
+bool Journal::defer_free(uwufs_blk_t blk_num) {
+    if (!active.load(std::memory_order_acquire) || releasing) {
+        return false;
+    }
+    std::lock_guard<std::mutex> guard(lock);
+    try {
+        running.frees.push_back(blk_num);
+    }
+    catch (const std::bad_alloc&) {
+        return false;
+    }
+    return true;
+}
+
+uwufs_blk_t Journal::deferred_frees() {
+    std::lock_guard<std::mutex> guard(lock);
+    return running.frees.size() + pending_frees.size();
+}
+
+bool Journal::reclaim_frees() {
+    if (!active.load(std::memory_order_acquire)) {
+        return false;
+    }
+    if (depth == 0) {
+        // closes the running transaction too
+        return deferred_frees() > 0 && checkpoint() == 0;
+    }
+
+    // Inside a handle the running transaction can't be closed (a commit
+    // waits for this handle to end), only the frees of the closed ones can
+    // come back: checkpoint what is logged without committing. Never wait
+    // for commit_lock while a commit waits for the handles
+    std::unique_lock<std::mutex> commit_guard(commit_lock, std::defer_lock);
+    for (;;) {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            if (pending_frees.empty() || closing) {
+                return false;
+            }
+        }
+        if (commit_guard.try_lock()) {
+            break;
+        }
+        // the log is being written or synced
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return checkpoint_locked() == 0;
+}
+
+int Journal::commit_locked() {
+    std::unique_lock<std::mutex> guard(lock);
+    int status = 0;
+    closing = true;
+    for (;;) {
+        cond.wait(guard, [this] { return handles == 0; });
+        // (a full log is checkpointed by the next transaction, not by a
+        // commit with nothing to log)
+        if (used == 0 || running.blk_nums.empty() ||
+            used + log_blks(running.blk_nums.size()) <= size) {
+            break;
+        }
+        // no room left in the log: make what is in there obsolete first
+        guard.unlock();
+        status = checkpoint_locked();
+        guard.lock();
+        if (status < 0) {
+            closing = false;
+            cond.notify_all();
+            return status;
+        }
+    }
+
+    Transaction txn = std::move(running);
+    running = Transaction();
+    running.seq = txn.blk_nums.empty() ? txn.seq : txn.seq + 1;
+    const size_t n = txn.blk_nums.size();
+    if (n == 0) {
+        pending_frees.insert(pending_frees.end(), txn.frees.begin(), txn.frees.end());
+        closing = false;
+        cond.notify_all();
+        return 0;
+    }
+
+    // descriptor, the blks it describes, next descriptor... then the commit
+    const uwufs_blk_t nlog = log_blks(n);
+    std::unique_ptr<char[]> log(new char[nlog * UWUFS_BLOCK_SIZE]);
+    uwufs_blk_t pos = 0;
+    for (size_t i{0}; i < n; ++i) {
+        if (i % UWUFS_JOURNAL_BLK_NUMS == 0) {
+            auto descriptor = reinterpret_cast<uwufs_journal_blk*>(&log[pos++ * UWUFS_BLOCK_SIZE]);
+            memset(descriptor, 0, UWUFS_BLOCK_SIZE);
+            descriptor->magic = UWUFS_JOURNAL_MAGIC;
+            descriptor->type = UWUFS_JOURNAL_DESCRIPTOR;
+            descriptor->count = std::min(n - i, UWUFS_JOURNAL_BLK_NUMS);
+            descriptor->sequence = txn.seq;
+            memcpy(descriptor->blk_nums, &txn.blk_nums[i], descriptor->count * sizeof(uwufs_blk_t));
+        }
+        Shard& s = shard(txn.blk_nums[i]);
+        std::lock_guard<std::mutex> shard_guard(s.lock);
+        Entry& entry = *s.entries[txn.blk_nums[i]];
+        entry.dirty = false;
+        memcpy(&log[pos++ * UWUFS_BLOCK_SIZE], entry.data.get(), UWUFS_BLOCK_SIZE);
+    }
+    closing = false;
+    cond.notify_all();
+    guard.unlock();
+
+    if (nlog > size) {
+        // can never fit: write it through (not atomic, but ordered
+        // after everything logged before it)
+        fprintf(stderr, "uwufs: transaction of %zu blks does not fit in the journal\n", n);
+        committed(txn, log.get());
+        logged_seq = flushed_seq = txn.seq;
+        return checkpoint_locked();
+    }
+
+    auto commit = reinterpret_cast<uwufs_journal_blk*>(&log[pos * UWUFS_BLOCK_SIZE]);
+    uint64_t sum = CHECKSUM_SEED;
+    for (uwufs_blk_t i{0}; i < pos; ++i) {
+        sum = checksum(sum, &log[i * UWUFS_BLOCK_SIZE]);
+    }
+    memset(commit, 0, UWUFS_BLOCK_SIZE);
+    commit->magic = UWUFS_JOURNAL_MAGIC;
+    commit->type = UWUFS_JOURNAL_COMMIT;
+    commit->count = pos;
+    commit->sequence = txn.seq;
+    commit->checksum = sum;
+
+    // one write unless it wraps around the end of the log
+    uwufs_blk_t first = std::min(nlog, size - tail);
+    bool written = pwrite(fd, log.get(), first * UWUFS_BLOCK_SIZE,
+                          (off_t)log_blk_num(tail) * UWUFS_BLOCK_SIZE) ==
+                   (ssize_t)(first * UWUFS_BLOCK_SIZE);
+    if (written && nlog > first) {
+        written = pwrite(fd, &log[first * UWUFS_BLOCK_SIZE], (nlog - first) * UWUFS_BLOCK_SIZE,
+                         (off_t)start * UWUFS_BLOCK_SIZE) ==
+                  (ssize_t)((nlog - first) * UWUFS_BLOCK_SIZE);
+    }
+    if (!written) {
+        // nothing happened: the next commit writes it again, at the
+        // same place and with the same sequence number
+        uncommit(std::move(txn));
+        return -EIO;
+    }
+    committed(txn, log.get());
+    tail = (tail + nlog) % size;
+    used += nlog;
+    logged_seq = txn.seq;
+    return 0;
+}
+
+void Journal::committed(const Transaction& txn, const char* log) {
+    // the blks are in the log after their descriptor
+    for (size_t i{0}; i < txn.blk_nums.size(); ++i) {
+        const char* data = &log[(i / UWUFS_JOURNAL_BLK_NUMS + 1 + i) * UWUFS_BLOCK_SIZE];
+        Shard& s = shard(txn.blk_nums[i]);
+        std::lock_guard<std::mutex> guard(s.lock);
+        Entry& entry = *s.entries[txn.blk_nums[i]];
+        if (!entry.committed) {
+            entry.committed.reset(new char[UWUFS_BLOCK_SIZE]);
+        }
+        memcpy(entry.committed.get(), data, UWUFS_BLOCK_SIZE);
+        entry.committed_seq = txn.seq;
+    }
+    std::lock_guard<std::mutex> guard(lock);
+    pending_frees.insert(pending_frees.end(), txn.frees.begin(), txn.frees.end());
+}
+
+void Journal::uncommit(Transaction txn) {
+    // back into the running transaction, the latest contents of the blks
+    // are logged with it
+    std::lock_guard<std::mutex> guard(lock);
+    for (auto blk_num : txn.blk_nums) {
+        Shard& s = shard(blk_num);
+        std::lock_guard<std::mutex> shard_guard(s.lock);
+        Entry& entry = *s.entries[blk_num];
+        if (!entry.dirty) {
+            entry.dirty = true;
+            running.blk_nums.push_back(blk_num);
+        }
+    }
+    running.frees.insert(running.frees.begin(), txn.frees.begin(), txn.frees.end());
+    running.seq = txn.seq;
+}
+
+int Journal::flush_locked() {
+    int status = commit_locked();
+    if (status < 0 || logged_seq == flushed_seq) {
+        return status;
+    }
+    status = sync();
+    if (status == 0) {
+        flushed_seq = logged_seq;
+    }
+    return status;
+}
+
+int Journal::checkpoint_locked() {
+    std::vector<std::pair<uwufs_blk_t, const char*>> blks;
+    std::vector<uwufs_blk_t> frees;
+    int status;
+
+    // everything closed is logged: once it is durable, the committed
+    // copies can go to their place
+    if (logged_seq != flushed_seq) {
+        status = sync();
+        if (status < 0) {
+            return status;
+        }
+        flushed_seq = logged_seq;
+    }
+
+    // only commit_locked changes the committed copies (the caller holds
+    // commit_lock) and only this erases entries
+    for (auto& s : shards) {
+        std::lock_guard<std::mutex> guard(s.lock);
+        for (auto& it : s.entries) {
+            if (it.second->committed) {
+                blks.emplace_back(it.first, it.second->committed.get());
+            }
+        }
+    }
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        frees.swap(pending_frees);
+    }
+    if (blks.empty() && frees.empty() && used == 0) {
+        return 0;
+    }
+
+    std::sort(blks.begin(), blks.end());
+    for (auto& blk : blks) {
+        if (::write_blk(fd, blk.second, blk.first) != UWUFS_BLOCK_SIZE) {
+            status = -EIO;
+            goto restore_frees_ret;
+        }
+    }
+    for (auto& s : shards) {
+        std::lock_guard<std::mutex> guard(s.lock);
+        for (auto it = s.entries.begin(); it != s.entries.end();) {
+            Entry& entry = *it->second;
+            if (entry.committed && !entry.dirty) {
+                it = s.entries.erase(it);   // same as on the device now
+                continue;
+            }
+            entry.committed.reset();
+            ++it;
+        }
+    }
+
+    // the log can be reused once the blks and then the new head are durable
+    status = sync();
+    if (status < 0) {
+        goto restore_frees_ret;
+    }
+    head = tail;
+    used = 0;
+    status = write_header();
+    if (status == 0) {
+        status = sync();
+    }
+    if (status < 0) {
+        goto restore_frees_ret;
+    }
+
+    releasing = true;
+    for (auto blk_num : frees) {
+        ::free_blk(fd, blk_num);
+    }
+    releasing = false;
+    return 0;
+
+restore_frees_ret:
+    std::lock_guard<std::mutex> guard(lock);
+    pending_frees.insert(pending_frees.end(), frees.begin(), frees.end());
+    return status;
+}
+
+int Journal::flush() {
+    if (!active.load(std::memory_order_acquire)) {
+        return 0;
+    }
+    if (depth > 0) {
+        return -EDEADLK;    // would wait for its own handle
+    }
+    uint64_t target;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        target = running.blk_nums.empty() ? running.seq - 1 : running.seq;
+    }
+    // the callers that queue up here while one flushes find their
+    // transactions flushed already
+    std::lock_guard<std::mutex> guard(commit_lock);
+    if (flushed_seq >= target) {
+        return 0;
+    }
+    return flush_locked();
+}
+
+int Journal::checkpoint() {
+    if (!active.load(std::memory_order_acquire)) {
+        return 0;
+    }
+    if (depth > 0) {
+        return -EDEADLK;
+    }
+    std::lock_guard<std::mutex> guard(commit_lock);
+    int status = commit_locked();
+    if (status < 0) {
+        return status;
+    }
+    return checkpoint_locked();
+}
+
+Journal& Journal::instance() {
+    static Journal journal;
+    return journal;
+}
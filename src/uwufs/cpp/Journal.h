@@ -0,0 +1,128 @@
+#ifndef Journal_h
+#define Journal_h
+
+#include "../uwufs.h"
+#include "c_api.h"
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+
+// Write-ahead journal of the metadata blks (ilist, directory and indirect
+// blks), in the log area mkfs.uwu reserves after the ilist
+//
+// Metadata writes only go to an in-memory copy of the blk (read_blk sees
+// it) and join the running transaction. Every FUSE callback that changes
+// something holds a handle (begin/end) so a transaction only ever contains
+// whole operations. When the last handle ends, the transaction is closed
+// and appended to the log without waiting for the device: the operation
+// survives a crash of the daemon. A flush makes everything logged so far
+// durable with one fdatasync, shared by every operation logged since the
+// last one (group commit). A checkpoint then writes the blks to where they
+// belong and lets the log be reused.
+//
+// A transaction whose log write fails goes back into the running one (with
+// its sequence number): the next commit writes it again at the same place,
+// and flushes fail until that works.
+//
+// Blks freed by a transaction are only given back to the allocator at the
+// next checkpoint: until then a crash could undo the free, or replay an
+// old copy of the blk over whatever it was reused for. An allocation that
+// runs out of blks checkpoints right away (reclaim_frees) instead of
+// failing while the deferred frees still count as free space.
+//
+// The freelist and the super blk are not journaled (see mount_super_blk):
+// they are rebuilt from the inodes after a crash.
+//
+// Lock order: commit_lock -> lock -> Shard::lock
+class Journal {
+public:
+    // replays the log and starts journaling (nothing if the volume has no journal)
+    int open(int device_fd, const uwufs_super_blk* super_blk);
+
+    // checkpoints everything and stops journaling
+    int close();
+
+    // handles: `wait` false never blocks (for writes outside of a callback)
+    void begin(bool wait = true);
+    void end();
+
+    int flush();
+    int checkpoint();
+
+    // return false if there is no journal (the caller does the real thing)
+    bool write_blk(const void* buf, uwufs_blk_t blk_num);
+    bool read_blk(void* buf, uwufs_blk_t blk_num);
+    bool defer_free(uwufs_blk_t blk_num);
+
+    uwufs_blk_t deferred_frees();
+    // checkpoints early so the deferred frees can be allocated again
+    bool reclaim_frees();
+
+    static Journal& instance();
+
+private:
+    struct Entry {
+        Entry() : data(new char[UWUFS_BLOCK_SIZE]) {}
+
+        std::unique_ptr<char[]> data;   // latest contents
+        bool dirty = false;             // changed by the running transaction
+        std::unique_ptr<char[]> committed;  // contents as of committed_seq
+        uint64_t committed_seq = 0;
+    };
+
+    static constexpr size_t SHARDS = 64;
+    struct Shard {
+        std::mutex lock;
+        std::unordered_map<uwufs_blk_t, std::unique_ptr<Entry>> entries;
+    };
+
+    struct Transaction {
+        uint64_t seq = 0;
+        std::vector<uwufs_blk_t> blk_nums;  // metadata blks it changed
+        std::vector<uwufs_blk_t> frees;     // blks it freed
+    };
+
+    Shard& shard(uwufs_blk_t blk_num) { return shards[blk_num % SHARDS]; }
+    uwufs_blk_t log_blks(size_t nblks) const;
+    uwufs_blk_t log_blk_num(uwufs_blk_t pos) const { return start + pos % size; }
+
+    int replay();
+    int write_header();
+    int sync();
+
+    // the caller holds commit_lock
+    int commit_locked();
+    void committed(const Transaction& txn, const char* log);
+    void uncommit(Transaction txn);
+    int flush_locked();
+    int checkpoint_locked();
+
+    int fd = -1;
+    uwufs_blk_t start = 0;
+    uwufs_blk_t size = 0;
+    size_t max_txn_blks = 0;    // closed early past this many blks
+    std::atomic<bool> active{false};
+
+    std::mutex commit_lock;
+    uwufs_blk_t head = 0;       // where replay would start (on disk)
+    uwufs_blk_t tail = 0;       // where the next transaction goes
+    uwufs_blk_t used = 0;       // log blks between head and tail
+    uint64_t logged_seq = 0;
+    uint64_t flushed_seq = 0;
+
+    std::mutex lock;
+    std::condition_variable cond;
+    Transaction running;
+    size_t handles = 0;
+    bool closing = false;
+    std::vector<uwufs_blk_t> pending_frees;    // of closed transactions
+
+    Shard shards[SHARDS];
+};
+
+
+#endif
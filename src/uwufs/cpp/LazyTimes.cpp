@@ -0,0 +1,66 @@
+#include "LazyTimes.h"
+
+#include <new>
+
+
+bool LazyTimes::update(uwufs_blk_t inode_num, const uwufs_inode* inode) {
+    if (!enabled.load(std::memory_order_relaxed)) {
+        return false;
+    }
+    std::lock_guard<std::mutex> guard(lock);
+    try {
+        times[inode_num] = Times{inode->file_atime, inode->file_mtime, inode->file_ctime};
+    }
+    catch (const std::bad_alloc&) {
+        return false;
+    }
+    count.store(times.size(), std::memory_order_release);
+    return true;
+}
+
+void LazyTimes::apply(uwufs_blk_t inode_num, uwufs_inode* inode) {
+    if (count.load(std::memory_order_acquire) == 0) {
+        return;
+    }
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = times.find(inode_num);
+    if (it == times.end()) {
+        return;
+    }
+    inode->file_atime = it->second.atime;
+    inode->file_mtime = it->second.mtime;
+    inode->file_ctime = it->second.ctime;
+}
+
+void LazyTimes::written(uwufs_blk_t inode_num) {
+    if (count.load(std::memory_order_acquire) == 0) {
+        return;
+    }
+    std::lock_guard<std::mutex> guard(lock);
+    if (times.erase(inode_num) > 0) {
+        count.store(times.size(), std::memory_order_release);
+    }
+}
+
+bool LazyTimes::has(uwufs_blk_t inode_num) {
+    if (count.load(std::memory_order_acquire) == 0) {
+        return false;
+    }
+    std::lock_guard<std::mutex> guard(lock);
+    return times.count(inode_num) > 0;
+}
+
+std::vector<uwufs_blk_t> LazyTimes::pending() {
+    std::vector<uwufs_blk_t> inode_nums;
+    std::lock_guard<std::mutex> guard(lock);
+    inode_nums.reserve(times.size());
+    for (auto& it : times) {
+        inode_nums.push_back(it.first);
+    }
+    return inode_nums;
+}
+
+LazyTimes& LazyTimes::instance() {
+    static LazyTimes lazy_times;
+    return lazy_times;
+}
@@ -0,0 +1,52 @@
+#ifndef LazyTimes_h
+#define LazyTimes_h
+
+#include "../uwufs.h"
+#include "c_api.h"
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+
+// Timestamps of the inodes that changed without anything else changing
+// (-o lazytime): they are only kept here until the inode is written for
+// another reason or the commit timer writes them back (see lazytime_* in
+// c_api.h)
+//
+// Thread safe: every method takes the lock (callers hold the inode lock
+// so an inode is never written and updated here at the same time)
+class LazyTimes {
+public:
+    struct Times {
+        uint64_t atime;
+        uint64_t mtime;
+        uint64_t ctime;
+    };
+
+    void enable(bool on) { enabled = on; }
+
+    // returns false if lazytime is off (the caller writes the inode)
+    bool update(uwufs_blk_t inode_num, const uwufs_inode* inode);
+
+    // puts the pending timestamps of the inode into `inode`
+    void apply(uwufs_blk_t inode_num, uwufs_inode* inode);
+
+    // the inode was written: nothing pending anymore
+    void written(uwufs_blk_t inode_num);
+
+    bool has(uwufs_blk_t inode_num);
+
+    std::vector<uwufs_blk_t> pending();
+
+    static LazyTimes& instance();
+
+private:
+    std::atomic<bool> enabled{false};
+    std::atomic<size_t> count{0};   // lets apply/written skip the lock
+    std::mutex lock;
+    std::unordered_map<uwufs_blk_t, Times> times;
+};
+
+
+#endif
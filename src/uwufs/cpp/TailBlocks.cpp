@@ -0,0 +1,89 @@
+#include "TailBlocks.h"
+
+#include <new>
+
+
+bool TailBlocks::find(size_t size, uwufs_blk_t& blk_num) {
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = by_free.lower_bound(size);
+    if (it == by_free.end()) {
+        return false;
+    }
+    blk_num = it->second;
+    return true;
+}
+
+void TailBlocks::update(uwufs_blk_t blk_num, size_t free) {
+    std::lock_guard<std::mutex> guard(lock);
+    erase_locked(blk_num);
+    if (free == 0) {
+        return;
+    }
+    try {
+        free_of.emplace(blk_num, free);
+        by_free.emplace(free, blk_num);
+    }
+    catch (const std::bad_alloc&) {
+        // forgotten: the next tails go to another blk
+        free_of.erase(blk_num);
+    }
+}
+
+void TailBlocks::erase_locked(uwufs_blk_t blk_num) {
+    auto it = free_of.find(blk_num);
+    if (it == free_of.end()) {
+        return;
+    }
+    auto range = by_free.equal_range(it->second);
+    for (auto i = range.first; i != range.second; ++i) {
+        if (i->second == blk_num) {
+            by_free.erase(i);
+            break;
+        }
+    }
+    free_of.erase(it);
+}
+
+void TailBlocks::clear() {
+    std::lock_guard<std::mutex> guard(lock);
+    free_of.clear();
+    by_free.clear();
+    rebuilt.clear();
+    unmeasured.clear();
+}
+
+bool TailBlocks::rebuild_add(uwufs_blk_t blk_num) {
+    std::lock_guard<std::mutex> guard(lock);
+    try {
+        if (rebuilt.insert(blk_num).second) {
+            unmeasured.push_back(blk_num);
+        }
+    }
+    catch (const std::bad_alloc&) {
+        return false;
+    }
+    return true;
+}
+
+uwufs_blk_t TailBlocks::rebuild_next() {
+    std::lock_guard<std::mutex> guard(lock);
+    if (unmeasured.empty()) {
+        return 0;
+    }
+    uwufs_blk_t blk_num = unmeasured.back();
+    unmeasured.pop_back();
+    return blk_num;
+}
+
+size_t TailBlocks::rebuild_done() {
+    std::lock_guard<std::mutex> guard(lock);
+    size_t n = rebuilt.size();
+    rebuilt.clear();
+    unmeasured.clear();
+    return n;
+}
+
+TailBlocks& TailBlocks::instance() {
+    static TailBlocks tail_blocks;
+    return tail_blocks;
+}
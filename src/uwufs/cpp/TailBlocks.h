@@ -0,0 +1,54 @@
+#ifndef TailBlocks_h
+#define TailBlocks_h
+
+#include "../uwufs.h"
+#include "c_api.h"
+#include <cstddef>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+
+// Free space of the tail blks (tail packing, see pack_file_tail in
+// file_operations.h): the size of the largest free run of each blk that
+// still has room, so a tail goes to the fullest blk it fits in.
+//
+// Nothing is stored on the device, mount lists the tail blks of the
+// inodes again (see rebuild_add) and measures them.
+//
+// Thread safe: every method takes the lock
+class TailBlocks {
+public:
+    // the blk with the smallest free run of at least `size` bytes,
+    // false if there is none
+    bool find(size_t size, uwufs_blk_t& blk_num);
+
+    // the largest free run of the blk is `free` bytes now (0: the blk
+    // is full or was freed)
+    void update(uwufs_blk_t blk_num, size_t free);
+
+    void clear();
+
+    // a tail blk an inode points to, then rebuild_next() gives each one
+    // once to be measured (0 after the last) and rebuild_done() returns
+    // how many there were
+    bool rebuild_add(uwufs_blk_t blk_num);
+    uwufs_blk_t rebuild_next();
+    size_t rebuild_done();
+
+    static TailBlocks& instance();
+
+private:
+    void erase_locked(uwufs_blk_t blk_num);
+
+    std::mutex lock;
+    std::unordered_map<uwufs_blk_t, size_t> free_of;
+    std::multimap<size_t, uwufs_blk_t> by_free;
+    std::unordered_set<uwufs_blk_t> rebuilt;
+    std::vector<uwufs_blk_t> unmeasured;    // of rebuilt
+};
+
+
+#endif
@@ -1,7 +1,16 @@
 #include "c_api.h"
 
+#include "BlockRefs.h"
 #include "INode.h"
 #include "DataBlockIterator.h"
+#include "InodeTable.h"
+#include "Journal.h"
+#include "LazyTimes.h"
+#include "TailBlocks.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <new>
 
 
 uwufs_blk_t get_dblk(const uwufs_inode* inode, int device_fd, uwufs_blk_t index) {
@@ -20,6 +29,18 @@ void destroy_dblk_itr(dblk_itr_t itr) {
     delete static_cast<DataBlockIterator*>(itr);
 }
 
+void dblk_itr_seek(dblk_itr_t itr, uwufs_blk_t index) {
+    static_cast<DataBlockIterator*>(itr)->seek(index);
+}
+
+void dblk_itr_invalidate(dblk_itr_t itr) {
+    static_cast<DataBlockIterator*>(itr)->invalidate();
+}
+
+uwufs_blk_t set_dblk(uwufs_inode* inode, int device_fd, uwufs_blk_t index, uwufs_blk_t block_no) {
+    return INode::set_dblk(inode, device_fd, index, block_no);
+}
+
 uwufs_blk_t append_dblk(uwufs_inode* inode, int device_fd, uwufs_blk_t index, uwufs_blk_t block_no) {
     return INode::append_dblk(inode, device_fd, index, block_no);
 }
@@ -30,4 +51,167 @@ uwufs_blk_t remove_dblk(uwufs_inode* inode, int device_fd, uwufs_blk_t index) {
 
 void remove_dblks(uwufs_inode* inode, int device_fd, uwufs_blk_t start_index, uwufs_blk_t end_index) {
     INode::remove_dblks(inode, device_fd, start_index, end_index);
-}
\ No newline at end of file
+}
+
+void punch_dblks(uwufs_inode* inode, int device_fd, uwufs_blk_t start_index, uwufs_blk_t end_index) {
+    INode::punch_dblks(inode, device_fd, start_index, end_index);
+}
+
+uwufs_blk_t seek_dblk(const uwufs_inode* inode, int device_fd, uwufs_blk_t start_index, uwufs_blk_t end_index, bool data) {
+    return INode::seek_dblk(inode, device_fd, start_index, end_index, data);
+}
+
+void itable_lookup(uwufs_blk_t inode_num) {
+    InodeTable::instance().lookup(inode_num);
+}
+
+int itable_forget(uwufs_blk_t inode_num, uint64_t nlookup) {
+    return InodeTable::instance().forget(inode_num, nlookup);
+}
+
+int itable_mark_unlinked(uwufs_blk_t inode_num) {
+    return InodeTable::instance().mark_unlinked(inode_num);
+}
+
+uwufs_blk_t itable_pop_unlinked(void) {
+    return InodeTable::instance().pop_unlinked();
+}
+
+uwufs_open_inode* itable_open(uwufs_blk_t inode_num, const uwufs_inode* inode) {
+    return InodeTable::instance().open(inode_num, inode);
+}
+
+void itable_close(uwufs_blk_t inode_num) {
+    InodeTable::instance().close(inode_num);
+}
+
+void itable_inode_written(uwufs_blk_t inode_num, const uwufs_inode* old_inode, const uwufs_inode* new_inode) {
+    InodeTable::instance().inode_written(inode_num, old_inode, new_inode);
+}
+
+int journal_open(int device_fd, const uwufs_super_blk* super_blk) {
+    return Journal::instance().open(device_fd, super_blk);
+}
+
+int journal_close(void) {
+    return Journal::instance().close();
+}
+
+void journal_begin(void) {
+    Journal::instance().begin();
+}
+
+void journal_end(void) {
+    Journal::instance().end();
+}
+
+int journal_flush(void) {
+    return Journal::instance().flush();
+}
+
+int journal_checkpoint(void) {
+    return Journal::instance().checkpoint();
+}
+
+int journal_write_blk(const void* buf, uwufs_blk_t blk_num) {
+    return Journal::instance().write_blk(buf, blk_num);
+}
+
+int journal_read_blk(void* buf, uwufs_blk_t blk_num) {
+    return Journal::instance().read_blk(buf, blk_num);
+}
+
+int journal_defer_free(uwufs_blk_t blk_num) {
+    return Journal::instance().defer_free(blk_num);
+}
+
+uwufs_blk_t journal_deferred_frees(void) {
+    return Journal::instance().deferred_frees();
+}
+
+int journal_reclaim_frees(void) {
+    return Journal::instance().reclaim_frees();
+}
+
+void lazytime_enable(int on) {
+    LazyTimes::instance().enable(on);
+}
+
+int lazytime_update(uwufs_blk_t inode_num, const uwufs_inode* inode) {
+    return LazyTimes::instance().update(inode_num, inode);
+}
+
+void lazytime_apply(uwufs_blk_t inode_num, uwufs_inode* inode) {
+    LazyTimes::instance().apply(inode_num, inode);
+}
+
+void lazytime_written(uwufs_blk_t inode_num) {
+    LazyTimes::instance().written(inode_num);
+}
+
+int lazytime_has(uwufs_blk_t inode_num) {
+    return LazyTimes::instance().has(inode_num);
+}
+
+uwufs_blk_t* lazytime_pending(size_t* n) {
+    *n = 0;
+    try {
+        auto inode_nums = LazyTimes::instance().pending();
+        if (inode_nums.empty()) {
+            return nullptr;
+        }
+        auto result = static_cast<uwufs_blk_t*>(malloc(inode_nums.size() * sizeof(uwufs_blk_t)));
+        if (result != nullptr) {
+            memcpy(result, inode_nums.data(), inode_nums.size() * sizeof(uwufs_blk_t));
+            *n = inode_nums.size();
+        }
+        return result;
+    }
+    catch (const std::bad_alloc&) {
+        return nullptr;
+    }
+}
+
+int blk_ref_share(uwufs_blk_t blk_num) {
+    return BlockRefs::instance().share(blk_num);
+}
+
+int blk_ref_release(uwufs_blk_t blk_num) {
+    return BlockRefs::instance().release(blk_num);
+}
+
+void blk_ref_clear(void) {
+    BlockRefs::instance().clear();
+}
+
+int blk_ref_rebuild_add(uwufs_blk_t blk_num) {
+    return BlockRefs::instance().rebuild_add(blk_num);
+}
+
+size_t blk_ref_rebuild_done(void) {
+    return BlockRefs::instance().rebuild_done();
+}
+
+int tail_blk_find(size_t size, uwufs_blk_t* blk_num) {
+    return TailBlocks::instance().find(size, *blk_num);
+}
+
+void tail_blk_update(uwufs_blk_t blk_num, size_t free) {
+    TailBlocks::instance().update(blk_num, free);
+}
+
+void tail_blk_clear(void) {
+    TailBlocks::instance().clear();
+}
+
+int tail_blk_rebuild_add(uwufs_blk_t blk_num) {
+    return TailBlocks::instance().rebuild_add(blk_num);
+}
+
+uwufs_blk_t tail_blk_rebuild_next(void) {
+    return TailBlocks::instance().rebuild_next();
+}
+
+size_t tail_blk_rebuild_done(void) {
+    return TailBlocks::instance().rebuild_done();
+}
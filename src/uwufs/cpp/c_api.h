@@ -8,6 +8,8 @@ extern "C" {
 #define dblk_itr_t void*
 
 #include "../uwufs.h"
+#include <stdbool.h>
+#include <stddef.h>
 
 /**
  * Returns the block number of index-th data block of the inode.
@@ -48,6 +50,31 @@ uwufs_blk_t dblk_itr_next(dblk_itr_t itr);
  */
 void destroy_dblk_itr(dblk_itr_t itr);
 
+/**
+ * Moves the iterator to the data block `index` (the next dblk_itr_next
+ * returns the block no of `index`). The indirect blocks the iterator
+ * already read stay cached, so seeking near the last position is cheap.
+ */
+void dblk_itr_seek(dblk_itr_t itr, uwufs_blk_t index);
+
+/**
+ * Drops the indirect blocks cached by the iterator.
+ * Call it when the block map of the inode changed (blocks were appended
+ * or removed) and the iterator is reused.
+ */
+void dblk_itr_invalidate(dblk_itr_t itr);
+
+/**
+ * Sets the data block at `index` of the inode, anywhere in the file: the
+ * indirect blocks missing on the way (holes) are allocated and counted in
+ * inode->file_blocks (the data block itself is not, that's the caller's).
+ * It will write all modification directly to the disk EXCEPT the inode itself (but will modify the struct inode in memory).
+ * Remember to write the inode to disk after calling this function.
+ * Returns `block_no`.
+ * Returns 0 if the operation fails.
+ */
+uwufs_blk_t set_dblk(struct uwufs_inode* inode, int device_fd, uwufs_blk_t index, uwufs_blk_t block_no);
+
 /**
  * Appends a new data block to the inode.
  * It will write all modification directly to the disk EXCEPT the inode itself (but will modify the struct inode in memory).
@@ -79,6 +106,250 @@ uwufs_blk_t remove_dblk(struct uwufs_inode* inode, int device_fd, uwufs_blk_t in
  */
 void remove_dblks(struct uwufs_inode* inode, int device_fd, uwufs_blk_t start_index, uwufs_blk_t end_index);
 
+/**
+ * Frees the data blocks in [start_index, end_index) and leaves holes: the
+ * indirect blocks entirely in the range are freed too, the others keep
+ * their entries outside of it (shared data blocks are only freed by the
+ * last file that has them). file_blocks, file_unwritten_blocks and
+ * file_shared_blocks of the inode are updated.
+ * It will write all modification directly to the disk EXCEPT the inode itself (but will modify the struct inode in memory).
+ */
+void punch_dblks(struct uwufs_inode* inode, int device_fd, uwufs_blk_t start_index, uwufs_blk_t end_index);
+
+/**
+ * Returns the first data block index in [start_index, end_index) that is
+ * written data (`data` true) or a hole (`data` false), end_index if none.
+ * Unwritten (preallocated) blocks count as holes.
+ * Unallocated indirect subtrees are skipped without reading them.
+ */
+uwufs_blk_t seek_dblk(const struct uwufs_inode* inode, int device_fd, uwufs_blk_t start_index, uwufs_blk_t end_index, bool data);
+
+/**
+ * Inode table: tracks which inodes the kernel still references (lookup counts).
+ * Only the FUSE callbacks should use these.
+ */
+
+/**
+ * Increments the lookup count of the inode (call for every reply that
+ * gives the kernel a new reference: lookup, create, mkdir, link, ...).
+ */
+void itable_lookup(uwufs_blk_t inode_num);
+
+/**
+ * Decrements the lookup count of the inode by `nlookup`.
+ * Returns 1 if the inode was unlinked (see itable_mark_unlinked) and this
+ * was the last reference, so the caller must free the inode now.
+ */
+int itable_forget(uwufs_blk_t inode_num, uint64_t nlookup);
+
+/**
+ * Call when the links count of an inode reaches 0.
+ * Returns 1 if the kernel still references the inode: freeing it is
+ * deferred until itable_forget returns 1.
+ * Returns 0 if the caller must free the inode now.
+ */
+int itable_mark_unlinked(uwufs_blk_t inode_num);
+
+/**
+ * Removes an inode whose freeing was deferred from the table and returns
+ * it (returns 0 if there is none). Used at unmount.
+ */
+uwufs_blk_t itable_pop_unlinked(void);
+
+/**
+ * In-memory copy of an inode shared by all the open file handles of
+ * the inode. write_inode keeps it up to date (see itable_inode_written),
+ * so it is always the same as the inode on disk.
+ */
+struct uwufs_open_inode {
+	struct uwufs_inode inode;
+	// incremented whenever the size or the block map of the inode
+	// changes (cached block map cursors must be invalidated)
+	uint64_t map_gen;
+	// map_gen as of the last fsync (fdatasync doesn't need the journal
+	// if only the timestamps changed since), UINT64_MAX if unknown
+	uint64_t synced_map_gen;
+	uint64_t nopen;
+};
+
+/**
+ * Returns the in-memory inode for an open file handle and increments its
+ * open count. `inode` is only copied if the inode was not open yet.
+ * Returns NULL if out of memory.
+ */
+struct uwufs_open_inode *itable_open(uwufs_blk_t inode_num,
+									 const struct uwufs_inode *inode);
+
+/**
+ * Decrements the open count of the inode (the in-memory inode is freed
+ * when it reaches 0).
+ */
+void itable_close(uwufs_blk_t inode_num);
+
+/**
+ * Called by write_inode with the old and new contents of the inode.
+ * Updates the in-memory inode if the inode is open.
+ */
+void itable_inode_written(uwufs_blk_t inode_num,
+						  const struct uwufs_inode *old_inode,
+						  const struct uwufs_inode *new_inode);
+
+/**
+ * Metadata journal (see Journal.h). The low level operations use the
+ * blk functions, the FUSE callbacks the rest.
+ */
+
+/**
+ * Replays the journal of the volume and starts journaling the metadata
+ * writes. Does nothing if the volume has no journal.
+ * Returns 0 or a negative error (the journal is not used then).
+ */
+int journal_open(int device_fd, const struct uwufs_super_blk* super_blk);
+
+/**
+ * Writes everything back to its place and stops journaling (unmount).
+ */
+int journal_close(void);
+
+/**
+ * Starts/ends an operation: the metadata it writes in between is replayed
+ * completely or not at all. Call before taking any inode lock (begin
+ * waits while a transaction is being closed). Nests.
+ */
+void journal_begin(void);
+void journal_end(void);
+
+/**
+ * Makes every operation that ended before the call durable. Concurrent
+ * callers share one device flush. Must not be called between
+ * journal_begin and journal_end.
+ */
+int journal_flush(void);
+
+/**
+ * Flushes, then writes the journaled blks back to their place so the log
+ * can be reused and gives the blks freed since the last checkpoint back
+ * to the allocator.
+ */
+int journal_checkpoint(void);
+
+/**
+ * Journals a write of a metadata blk (it is only written to its place at
+ * the next checkpoint, reads see it right away).
+ * Returns 0 if there is no journal: the caller writes the blk itself.
+ */
+int journal_write_blk(const void* buf, uwufs_blk_t blk_num);
+
+/**
+ * Reads the journaled copy of a blk into `buf`.
+ * Returns 0 if there is none: the blk on the device is up to date.
+ */
+int journal_read_blk(void* buf, uwufs_blk_t blk_num);
+
+/**
+ * Keeps a freed blk from the allocator until the next checkpoint (the
+ * operation that freed it could still be undone by a crash until then).
+ * Returns 0 if there is no journal: the caller frees the blk itself.
+ */
+int journal_defer_free(uwufs_blk_t blk_num);
+
+/**
+ * Number of blks freed but not given back to the allocator yet.
+ */
+uwufs_blk_t journal_deferred_frees(void);
+
+/**
+ * Checkpoints early so the deferred frees can be allocated again, for an
+ * allocation that ran out of blks. Between journal_begin and journal_end
+ * only the frees of the operations committed already come back.
+ * Returns 1 if it checkpointed (the allocation can be tried again).
+ */
+int journal_reclaim_frees(void);
+
+/**
+ * Lazy timestamps (-o lazytime, see LazyTimes.h). read_inode and
+ * write_inode call apply/written, touch_inode calls update.
+ */
+
+void lazytime_enable(int on);
+
+/**
+ * Keeps the timestamps of `inode` in memory instead of writing it.
+ * Returns 0 if lazytime is off: the caller writes the inode.
+ */
+int lazytime_update(uwufs_blk_t inode_num, const struct uwufs_inode* inode);
+
+void lazytime_apply(uwufs_blk_t inode_num, struct uwufs_inode* inode);
+
+void lazytime_written(uwufs_blk_t inode_num);
+
+/**
+ * Returns 1 if the inode has timestamps that were not written yet.
+ */
+int lazytime_has(uwufs_blk_t inode_num);
+
+/**
+ * Returns the inodes with timestamps to write back (malloc'd, `*n` of
+ * them) or NULL if there are none (or out of memory).
+ */
+uwufs_blk_t* lazytime_pending(size_t* n);
+
+/**
+ * Reference counts of the data blks flagged UWUFS_BLK_SHARED (see
+ * BlockRefs.h). A flagged blk without a count belongs to one file.
+ */
+
+/**
+ * One more file has the blk. Returns 0 if out of memory.
+ */
+int blk_ref_share(uwufs_blk_t blk_num);
+
+/**
+ * A file dropped the blk. Returns 1 if no other file has it: the caller
+ * frees it.
+ */
+int blk_ref_release(uwufs_blk_t blk_num);
+
+void blk_ref_clear(void);
+
+/**
+ * Counts a flagged blk map entry at mount (0 if out of memory), then
+ * rebuild_done drops the blks only one file has and returns how many
+ * blks are shared.
+ */
+int blk_ref_rebuild_add(uwufs_blk_t blk_num);
+
+size_t blk_ref_rebuild_done(void);
+
+/**
+ * Free space of the tail blks (see TailBlocks.h, the fragments themselves
+ * are allocated by malloc_tail_frag in low_level_operations.h)
+ */
+
+/**
+ * Returns 1 and the tail blk with the smallest free run of at least
+ * `size` bytes, 0 if there is none.
+ */
+int tail_blk_find(size_t size, uwufs_blk_t* blk_num);
+
+/**
+ * The largest free run of the tail blk is `free` bytes (0: full or freed).
+ */
+void tail_blk_update(uwufs_blk_t blk_num, size_t free);
+
+void tail_blk_clear(void);
+
+/**
+ * Lists a tail blk an inode points to at mount (0 if out of memory).
+ * rebuild_next returns each of them once to be measured (0 after the
+ * last), then rebuild_done returns how many there were.
+ */
+int tail_blk_rebuild_add(uwufs_blk_t blk_num);
+
+uwufs_blk_t tail_blk_rebuild_next(void);
+
+size_t tail_blk_rebuild_done(void);
+
 #ifdef __cplusplus
 }
 #endif
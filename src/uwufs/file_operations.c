@@ -15,6 +15,11 @@
 #include <stdbool.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <stddef.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 #include "cpp/c_api.h"
 
@@ -28,20 +33,115 @@ ssize_t create_file(uwufs_blk_t *inode, uint16_t mode)
 	return -1;
 }
 
+uint32_t uwufs_name_hash(const char *name, size_t len)
+{
+	// FNV-1a
+	uint32_t hash = 2166136261u;
+	size_t i;
+	for (i = 0; i < len; i++) {
+		hash ^= (unsigned char)name[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+#define DIR_ENTRY_SIZE		sizeof(struct uwufs_directory_file_entry)
+#define DIR_HASH_OFFSET		offsetof(struct uwufs_directory_file_entry, name_hash)
+
+static inline uint32_t __dir_entry_hash(const char *hashes, int i)
+{
+	uint32_t hash;
+	memcpy(&hash, hashes + i * DIR_ENTRY_SIZE, sizeof(hash));
+	return hash;
+}
+
+/**
+ * Returns a bitmask of the entries in [start, start + n) whose name hash
+ * is `hash` (bit i is set for entry start + i). n must be <= 32.
+ */
+static inline uint32_t __dir_hash_hits(const struct uwufs_directory_data_blk *dir_blk,
+									   int start,
+									   int n,
+									   uint32_t hash)
+{
+	const char *hashes = (const char *)&dir_blk->file_entries[start]
+		+ DIR_HASH_OFFSET;
+	uint32_t hits = 0;
+	int i = 0;
+
+#if defined(__AVX2__)
+	// the hashes are one entry (256 bytes) apart so gather 8 at a time
+	const __m256i offsets = _mm256_setr_epi32(0, DIR_ENTRY_SIZE,
+		2 * DIR_ENTRY_SIZE, 3 * DIR_ENTRY_SIZE, 4 * DIR_ENTRY_SIZE,
+		5 * DIR_ENTRY_SIZE, 6 * DIR_ENTRY_SIZE, 7 * DIR_ENTRY_SIZE);
+	const __m256i target = _mm256_set1_epi32((int)hash);
+	for (; i + 8 <= n; i += 8) {
+		__m256i h = _mm256_i32gather_epi32(
+			(const int *)(hashes + i * DIR_ENTRY_SIZE), offsets, 1);
+		__m256i eq = _mm256_cmpeq_epi32(h, target);
+		hits |= (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(eq)) << i;
+	}
+#elif defined(__SSE2__)
+	const __m128i target = _mm_set1_epi32((int)hash);
+	for (; i + 4 <= n; i += 4) {
+		__m128i h = _mm_setr_epi32((int)__dir_entry_hash(hashes, i),
+								   (int)__dir_entry_hash(hashes, i + 1),
+								   (int)__dir_entry_hash(hashes, i + 2),
+								   (int)__dir_entry_hash(hashes, i + 3));
+		__m128i eq = _mm_cmpeq_epi32(h, target);
+		hits |= (uint32_t)_mm_movemask_ps(_mm_castsi128_ps(eq)) << i;
+	}
+#endif
+	for (; i < n; i++) {
+		if (__dir_entry_hash(hashes, i) == hash)
+			hits |= 1u << i;
+	}
+	return hits;
+}
+
+ssize_t find_directory_file_entry(const struct uwufs_directory_data_blk *dir_blk,
+								  const char *name,
+								  size_t len,
+								  uint32_t hash)
+{
+	const int n = UWUFS_BLOCK_SIZE / DIR_ENTRY_SIZE;
+	const struct uwufs_directory_file_entry *file_entry;
+	uint32_t hits;
+	int start;
+	int i;
+
+	for (start = 0; start < n; start += 32) {
+		hits = __dir_hash_hits(dir_blk, start, n - start < 32 ? n - start : 32,
+							   hash);
+		while (hits != 0) {
+			i = start + __builtin_ctz(hits);
+			hits &= hits - 1;
+
+			file_entry = &dir_blk->file_entries[i];
+			if (file_entry->inode_num != 0 &&
+				memcmp(file_entry->file_name, name, len) == 0 &&
+				file_entry->file_name[len] == '\0')
+				return i;
+		}
+	}
+	return -ENOENT;
+}
+
 ssize_t put_directory_file_entry(struct uwufs_directory_data_blk *dir_blk,
 								 const char name[UWUFS_FILE_NAME_SIZE],
 								 uwufs_blk_t file_inode_num)
 {
-	struct uwufs_directory_file_entry file_entry;
-	int n = UWUFS_BLOCK_SIZE/sizeof(file_entry);
+	struct uwufs_directory_file_entry *file_entry;
+	size_t len = strnlen(name, UWUFS_FILE_NAME_SIZE - 1);
+	int n = UWUFS_BLOCK_SIZE/sizeof(*file_entry);
 	int i;
 	for (i = 0; i < n; i++) {
-		file_entry = dir_blk->file_entries[i];
-		if (file_entry.inode_num == 0) {
-			dir_blk->file_entries[i].inode_num = file_inode_num;
-			memcpy(dir_blk->file_entries[i].file_name, name,
-				   UWUFS_FILE_NAME_SIZE);
-			dir_blk->file_entries[i].file_name[UWUFS_FILE_NAME_SIZE-1] = '\0';
+		file_entry = &dir_blk->file_entries[i];
+		if (file_entry->inode_num == 0) {
+			file_entry->inode_num = file_inode_num;
+			memset(file_entry->file_name, 0, UWUFS_FILE_NAME_SIZE);
+			memcpy(file_entry->file_name, name, len);
+			file_entry->name_hash = uwufs_name_hash(name, len);
 			return 0;
 		}
 	}
@@ -51,6 +151,42 @@ ssize_t put_directory_file_entry(struct uwufs_directory_data_blk *dir_blk,
 }
 
 
+/**
+ * Puts the entry into the first free slot of the `n` data blks of the
+ * 		directory. `dir_data_blk` and `dir_data_blk_num` are left holding
+ * 		the blk that got the entry (not written yet).
+ *
+ * Return: 0 on success, -ENOSPC if all the blks are full
+ */
+static ssize_t __put_in_free_slot(int fd,
+								  const struct uwufs_inode *dir_inode,
+								  uwufs_blk_t n,
+								  struct uwufs_directory_data_blk *dir_data_blk,
+								  uwufs_blk_t *dir_data_blk_num,
+								  const char name[UWUFS_FILE_NAME_SIZE],
+								  uwufs_blk_t file_inode_num)
+{
+	ssize_t status = -ENOSPC;
+	uwufs_blk_t i;
+	dblk_itr_t dblk_itr = create_dblk_itr(dir_inode, fd, 0);
+
+	for (i = 0; i < n; i++) {
+		*dir_data_blk_num = dblk_itr_next(dblk_itr);
+		if (*dir_data_blk_num == 0) {
+			status = -EIO;
+			break;
+		}
+		status = read_blk(fd, dir_data_blk, *dir_data_blk_num);
+		if (status < 0)
+			break;
+		status = put_directory_file_entry(dir_data_blk, name, file_inode_num);
+		if (status != -ENOSPC)
+			break;
+	}
+	destroy_dblk_itr(dblk_itr);
+	return status;
+}
+
 ssize_t add_directory_file_entry(int fd,
 								 const uwufs_blk_t dir_inode_num,
 								 const char name[UWUFS_FILE_NAME_SIZE],
@@ -84,34 +220,31 @@ ssize_t add_directory_file_entry(int fd,
 		
 		has_malloc = true;
 		dir_inode.direct_blks[0] = dir_data_blk_num;
+		dir_inode.file_blocks++;
 		dir_inode.file_size += UWUFS_BLOCK_SIZE;
 		dir_inode.file_ctime = (uint64_t)unix_time;
 
-		memset(&dir_data_blk, 0, sizeof(dir_data_blk));
-	} else { // Read last block
-		// Assume the dir entries are packed (no holes)
-		dir_data_blk_num = get_dblk(&dir_inode, fd, n-1);
-		if (dir_data_blk_num == 0)
-			return -EIO;
+		memset(&dir_data_blk, 0, UWUFS_BLOCK_SIZE);
+		status = put_directory_file_entry(&dir_data_blk, name, file_inode_num);
+	} else {
+		// Unlink leaves a free slot (inode_num 0) behind instead of moving
+		// entries around, so any blk may have room
+		status = __put_in_free_slot(fd, &dir_inode, n, &dir_data_blk,
+									&dir_data_blk_num, name, file_inode_num);
 	}
 
-	status = read_blk(fd, &dir_data_blk, dir_data_blk_num);
-	if (status < 0)
-		goto error_ret;
-	// RETURN_IF_ERROR(status);
-
-	status = put_directory_file_entry(&dir_data_blk, name, file_inode_num);
-	if (status == -ENOSPC) {
+	if (status == -ENOSPC && n > 0) {
 		status = malloc_blk(fd, &dir_data_blk_num);
 		if (status < 0 || dir_data_blk_num <= 0) {
 			status = -ENOSPC;
 			goto error_ret;
 		}
 
+		dir_inode.file_blocks++;
 		dir_inode.file_size += UWUFS_BLOCK_SIZE;
 		dir_inode.file_ctime = (uint64_t)unix_time;
 
-		memset(&dir_data_blk, 0, sizeof(dir_data_blk));
+		memset(&dir_data_blk, 0, UWUFS_BLOCK_SIZE);
 		status = put_directory_file_entry(&dir_data_blk, name, file_inode_num);
 		if (status < 0) {
 			free_blk(fd, dir_data_blk_num);
@@ -134,14 +267,13 @@ ssize_t add_directory_file_entry(int fd,
 	if (nlinks_change != 0)
 		dir_inode.file_ctime = (uint64_t)unix_time;
 	dir_inode.file_mtime = (uint64_t)unix_time;
-	dir_inode.file_atime = (uint64_t)unix_time;
 
 	status = write_inode(fd, &dir_inode, sizeof(dir_inode), dir_inode_num);
 	// RETURN_IF_ERROR(status);
 	if (status < 0)
 		goto error_ret;
 
-	status = write_blk(fd, &dir_data_blk, dir_data_blk_num);
+	status = write_meta_blk(fd, &dir_data_blk, dir_data_blk_num);
 	// RETURN_IF_ERROR(status);
 	if (status < 0)
 		goto error_ret;
@@ -187,24 +319,41 @@ ssize_t count_directory_file_entries(int fd,
 	return 0;
 }
 
-// Assumes the directory entries are semi-packed, meaning
-// 		entries are packed in the lowest number of data blocks
-// 		except for the last data block, which may be not completely
-// 		filled. The last data block does not have to be strictly packed
+// Number of used slots in a directory data blk
+static int __count_entries(const struct uwufs_directory_data_blk *dir_blk)
+{
+	const int n = UWUFS_BLOCK_SIZE / DIR_ENTRY_SIZE;
+	int count = 0;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (dir_blk->file_entries[i].inode_num != 0)
+			count++;
+	}
+	return count;
+}
+
+// Unlinked entries leave free slots anywhere in the directory, so all
+// the data blks are scanned
 bool is_directory_empty(int fd, struct uwufs_inode *dir_inode) {
 	ssize_t status;
-	size_t i;
+	uwufs_blk_t j;
 	int count = 0;
+	uwufs_blk_t n = (dir_inode->file_size + UWUFS_BLOCK_SIZE - 1)
+		/ UWUFS_BLOCK_SIZE;
 
 	struct uwufs_directory_data_blk dir_blk;
-	status = read_blk(fd, &dir_blk, dir_inode->direct_blks[0]);
-	RETURN_IF_ERROR(status);
-
-	for (i = 0; i < UWUFS_BLOCK_SIZE/sizeof(struct uwufs_directory_file_entry); i++) {
-		if (dir_blk.file_entries[i].inode_num != 0) {
-			count += 1;
-		}
+	dblk_itr_t dblk_itr = create_dblk_itr(dir_inode, fd, 0);
+	for (j = 0; j < n && count <= 2; j++) {
+		uwufs_blk_t dir_blk_num = dblk_itr_next(dblk_itr);
+		if (dir_blk_num == 0)
+			continue;
+		status = read_blk(fd, &dir_blk, dir_blk_num);
+		if (status < 0)
+			break;
+		count += __count_entries(&dir_blk);
 	}
+	destroy_dblk_itr(dblk_itr);
 	return count <= 2;
 }
 
@@ -242,99 +391,105 @@ ssize_t split_path_parent_child(const char *path,
 
 ssize_t __remove_entry_from_dir_data_blk(int fd,
 						 struct uwufs_directory_data_blk *dir_data_blk,
-						 struct uwufs_directory_data_blk *last_dir_data_blk,
-						 int last_file_entry_index,
 						 const char name[UWUFS_FILE_NAME_SIZE],
 						 uwufs_blk_t file_inode_num)
 {
 	ssize_t status;
-	int i;
-	int n = UWUFS_BLOCK_SIZE/sizeof(struct uwufs_directory_file_entry);
-	struct uwufs_directory_file_entry file_entry;
+	size_t len = strnlen(name, UWUFS_FILE_NAME_SIZE);
 
-	for (i = 0; i < n; i++) {
-		file_entry = dir_data_blk->file_entries[i];
-		if (file_entry.inode_num == file_inode_num &&
-			(strcmp(file_entry.file_name, name) == 0)) {
-			// clear file entry
-			goto found_entry_ret;
-		}
-	}
-	return -ENOENT;
+	if (len >= UWUFS_FILE_NAME_SIZE)
+		return -ENOENT;
 
-found_entry_ret:
-	if (last_dir_data_blk == NULL && i == last_file_entry_index) {
-		memset(&(dir_data_blk->file_entries[i]), 0, sizeof(file_entry));
-	} else if (last_dir_data_blk == NULL) {
-		memcpy(&dir_data_blk->file_entries[i],
-			 &(dir_data_blk->file_entries[last_file_entry_index]),
-			 sizeof(file_entry));
-		memset(&(dir_data_blk->file_entries[last_file_entry_index]),
-			 0, sizeof(file_entry));
-	} else {
-		memcpy(&dir_data_blk->file_entries[i],
-			 &(last_dir_data_blk->file_entries[last_file_entry_index]),
-			 sizeof(file_entry));
-		memset(&(last_dir_data_blk->file_entries[last_file_entry_index]),
-			 0, sizeof(file_entry));
+	status = find_directory_file_entry(dir_data_blk, name, len,
+									   uwufs_name_hash(name, len));
+	if (status < 0 ||
+		dir_data_blk->file_entries[status].inode_num != file_inode_num)
+		return -ENOENT;
+
+	// The other entries stay where they are (readdir offsets are
+	// positions in the directory), the slot is reused by the next add
+	memset(&(dir_data_blk->file_entries[status]), 0,
+		 sizeof(struct uwufs_directory_file_entry));
+	return __count_entries(dir_data_blk);
+}
+
+/**
+ * Frees the empty data blks at the end of the directory, from blk `i`
+ * 		(known to be empty) down (blk 0 always stays)
+ */
+static ssize_t __free_empty_last_dblks(int fd,
+									   struct uwufs_inode *dir_inode,
+									   uwufs_blk_t i)
+{
+	ssize_t status;
+	struct uwufs_directory_data_blk dir_data_blk;
+	uwufs_blk_t dir_data_blk_num;
+
+	while (i > 0) {
+		dir_data_blk_num = remove_dblk(dir_inode, fd, i);
+		if (dir_data_blk_num == 0)
+			return -EIO;
+		status = free_blk(fd, dir_data_blk_num); // remove_dblk does not free the actual dblk...
+		if (status < 0)
+			return status;
+		dir_inode->file_blocks--;
+		dir_inode->file_size -= UWUFS_BLOCK_SIZE;
+
+		if (--i == 0)
+			break;
+		status = read_blk(fd, &dir_data_blk, get_dblk(dir_inode, fd, i));
+		if (status < 0)
+			return status;
+		if (__count_entries(&dir_data_blk) != 0)
+			break;
 	}
-	// 0 or positive when successful - can be used to tell if last dir
-	// is empty assuming the last_file_entry_index is scanned in reverse
-	// by the caller of this function
-	return last_file_entry_index;
+	return 0;
 }
 
 ssize_t link_file(int fd,
-				  const char *old_path,
-				  const char *new_path,
+				  uwufs_blk_t old_inode_num,
+				  uwufs_blk_t new_parent_inode_num,
+				  const char *new_name,
 				  bool force_dir_link,
 				  int nlinks_change)
 {
 	ssize_t status;
 	struct uwufs_inode old_inode;
-	uwufs_blk_t old_inode_num;
+	struct uwufs_inode parent_inode;
 	uwufs_blk_t child_file_inode_num;
-	uwufs_blk_t parent_dir_inode_num;
-	char parent_path[strlen(new_path)+1];
-	char child_path[UWUFS_FILE_NAME_SIZE];
 	bool is_dir;
 
 	// TODO: edit m,a,c time
 
 	// FIX: Here to make sure the append_dblk in add_directory_entry
 	// always have enough data blocks (remove it after the bug is fixed)
-	struct uwufs_super_blk super_blk;
-	status = read_blk(fd, &super_blk, 0);
-	if (status < 0)
-		return status;
-	if (super_blk.free_blks_left <= 5) {
-		return -ENOSPC;
-	}
-	
-	status = namei(fd, old_path, NULL, &old_inode_num);
+	status = check_free_blks(fd, 5);
 	if (status < 0)
 		return status;
 
+	if (strlen(new_name) >= UWUFS_FILE_NAME_SIZE)
+		return -ENAMETOOLONG;
+
 	status = read_inode(fd, &old_inode, old_inode_num);
 	if (status < 0)
 		return status;
 	
-	is_dir = old_inode.file_mode & F_TYPE_BITS & F_TYPE_DIRECTORY;
+	is_dir = (old_inode.file_mode & F_TYPE_BITS) == F_TYPE_DIRECTORY;
 	if (!force_dir_link && is_dir) {
 		return -EISDIR;
 	}
 
-	status = split_path_parent_child(new_path, parent_path, child_path);
+	status = read_inode(fd, &parent_inode, new_parent_inode_num);
 	if (status < 0)
 		return status;
+	if ((parent_inode.file_mode & F_TYPE_BITS) != F_TYPE_DIRECTORY)
+		return -ENOTDIR;
 
-	status = namei(fd, new_path, NULL, &child_file_inode_num);
+	status = next_inode_in_path(fd, new_name, &parent_inode,
+								&child_file_inode_num);
 	if (status == -ENOENT) {
-		status = namei(fd, parent_path, NULL, &parent_dir_inode_num);
-		if (status < 0)
-			return -ENOENT;
-		status = add_directory_file_entry(fd, parent_dir_inode_num,
-						   child_path, old_inode_num, is_dir ? nlinks_change : 0); // I hate I need to do this
+		status = add_directory_file_entry(fd, new_parent_inode_num,
+						   new_name, old_inode_num, is_dir ? nlinks_change : 0); // I hate I need to do this
 		if (status < 0) return status;
 		if (!force_dir_link) { // I hate that I need to do this
 			old_inode.file_links_count += nlinks_change;
@@ -352,7 +507,8 @@ ssize_t link_file(int fd,
  * Removes directory entry
  */
 ssize_t unlink_file(int fd,
-					  const char *path,
+					  uwufs_blk_t parent_inode_num,
+					  const char *name,
 					  struct uwufs_inode *inode,
 					  uwufs_blk_t inode_num,
 					  int nlinks_change)
@@ -360,32 +516,16 @@ ssize_t unlink_file(int fd,
 	ssize_t status;
 	time_t unix_time;
 	struct uwufs_inode parent_inode;
-	uwufs_blk_t parent_inode_num;
-	char parent_path[strlen(path)+1];
-	char child_path[UWUFS_FILE_NAME_SIZE];
 	uwufs_blk_t i;
-	uwufs_blk_t last_dblk_num;
-	uwufs_blk_t last_dblk_index;
 	struct uwufs_directory_data_blk dir_data_blk;
 	uwufs_blk_t dir_data_blk_num;
-	struct uwufs_directory_data_blk last_dir_data_blk;
 	uwufs_blk_t num_data_blks;
-	uwufs_blk_t last_dir_entry_inode_num;
-	int last_file_entry_index;
-	int num_file_entries = UWUFS_BLOCK_SIZE / sizeof(struct uwufs_directory_file_entry);
 	dblk_itr_t dblk_itr = NULL;
 
 	unix_time = time(NULL);
 	if (unix_time == -1)
 		unix_time = 0;
 
-	status = split_path_parent_child(path, parent_path, child_path);
-	if (status < 0)
-		return status;
-
-	status = namei(fd, parent_path, NULL, &parent_inode_num);
-	if (status < 0)
-		return -ENOENT;
 #ifdef DEBUG
 	assert(parent_inode_num != 0);
 #endif
@@ -393,27 +533,9 @@ ssize_t unlink_file(int fd,
 	if (status < 0)
 		return status;
 
-	// Find last block for compacting things
 	num_data_blks = (parent_inode.file_size + UWUFS_BLOCK_SIZE - 1)
 		/ UWUFS_BLOCK_SIZE;
-	last_dblk_num = get_dblk(&parent_inode, fd, num_data_blks - 1);
-#ifdef DEBUG
-	assert(last_dblk_num != 0);
-#endif
-	status = read_blk(fd, &last_dir_data_blk, last_dblk_num);
-	if (status < 0) return status;
-	for (last_file_entry_index = num_file_entries - 1;
-		last_file_entry_index >= 0;
-		last_file_entry_index--) {
-		last_dir_entry_inode_num = last_dir_data_blk.file_entries[last_file_entry_index].inode_num;
-		if (last_dir_entry_inode_num > 0) {
-			goto found_last_entry;
-		}
-	}
-	printf("unlink_file: directory data block has inconsistent entries\n");
-	return -EIO;
-
-found_last_entry:
+	status = -ENOENT;
 	dblk_itr = create_dblk_itr(&parent_inode, fd, 0);
 	for (i = 0; i < num_data_blks; i++) {
 		dir_data_blk_num = dblk_itr_next(dblk_itr);
@@ -426,66 +548,25 @@ found_last_entry:
 		if (status < 0)
 			goto fail_ret;
 
-		// this looks bad, but compiler will optimizes it :)
-		if (last_dblk_num == dir_data_blk_num) {
-			status = __remove_entry_from_dir_data_blk(fd,
-												&dir_data_blk,
-												NULL,
-												last_file_entry_index,
-												child_path,
-												inode_num);
-		} else {
-			status = __remove_entry_from_dir_data_blk(fd,
-												&dir_data_blk,
-												&last_dir_data_blk,
-												last_file_entry_index,
-												child_path,
-												inode_num);
-		}
-
+		status = __remove_entry_from_dir_data_blk(fd, &dir_data_blk, name,
+												  inode_num);
 		if (status == -ENOENT)
 			continue;
 		if (status < 0)
 			goto fail_ret;
 
-		// last file entry index is 0 so the last blk is empty
-		if (status == 0) {
-			last_dblk_index = remove_dblk(&parent_inode, fd, num_data_blks - 1);
-			if (last_dblk_index != last_dblk_num) {
-				status = -EIO;
-				goto fail_ret;
-			}
-#ifdef DEBUG
-			assert(last_dblk_index != 0);
-#endif
-			status = write_blk(fd, &dir_data_blk, dir_data_blk_num);
-			if (status < 0)
-				goto fail_ret;
-			status = free_blk(fd, last_dblk_index); // remove_dblk does not free the actual dblk...
+		// Only the empty blks at the end can go, dropping a blk in the
+		// middle would move the entries after it
+		if (status == 0 && i > 0 && i == num_data_blks - 1) {
+			status = __free_empty_last_dblks(fd, &parent_inode, i);
 			if (status < 0) goto fail_ret;
-			parent_inode.file_size -= UWUFS_BLOCK_SIZE;
 			parent_inode.file_ctime = (uint64_t)unix_time;
 			goto success_ret;
-		} else {
-#ifdef DEBUG
-			assert(last_dblk_num != 0);
-#endif
-			status = write_blk(fd, &last_dir_data_blk, last_dblk_num);
-			if (status < 0) goto fail_ret;
-			status = write_blk(fd, &dir_data_blk, dir_data_blk_num);
-			if (status < 0) goto fail_ret;
-			goto success_ret;
 		}
 
-		// BUG: NOOOO, I double freed a data block
-		// if (last_dblk_num != dir_data_blk_num) {
-		// 	status = write_blk(fd, &dir_data_blk, dir_data_blk_num);
-		// 	if (status < 0)
-		// 		goto fail_ret;
-		// }
-		//
-		// goto success_ret;
-		goto fail_ret; // NOTE: should never happen
+		status = write_meta_blk(fd, &dir_data_blk, dir_data_blk_num);
+		if (status < 0) goto fail_ret;
+		goto success_ret;
 	}
 fail_ret:
 	destroy_dblk_itr(dblk_itr);
@@ -499,7 +580,6 @@ success_ret:
 	inode->file_links_count -= 1;
 	inode->file_ctime = (uint64_t)unix_time;
 	parent_inode.file_links_count += nlinks_change; //unlinking subdir
-	parent_inode.file_atime = (uint64_t)unix_time;
 	parent_inode.file_mtime = (uint64_t)unix_time;
 	status = write_inode(fd, &parent_inode, sizeof(parent_inode),
 					  parent_inode_num);
@@ -507,65 +587,6 @@ success_ret:
 	return 0;
 }
 
-ssize_t __free_indirect_blk(int fd,
-							struct uwufs_indirect_blk *indirect_blk)
-{
-	ssize_t status;
-	int i;
-	int n = UWUFS_BLOCK_SIZE / sizeof(uwufs_blk_t);
-	for (i = 0; i < n; i++) {
-		if (indirect_blk->entries[i] <= 1 + UWUFS_RESERVED_SPACE)
-			continue;
-		status = free_blk(fd, indirect_blk->entries[i]);
-		if (status < 0) return status;
-	}
-	return 0;
-}
-
-ssize_t __free_double_indirect_blk(int fd,
-							struct uwufs_indirect_blk *double_indirect_blk)
-{
-	ssize_t status;
-	struct uwufs_indirect_blk single_indirect_blk;
-	int i;
-	int n = UWUFS_BLOCK_SIZE / sizeof(uwufs_blk_t);
-	for (i = 0; i < n; i++) {
-		if (double_indirect_blk->entries[i] <= 1 + UWUFS_RESERVED_SPACE)
-			continue;
-		status = read_blk(fd, &single_indirect_blk, double_indirect_blk->entries[i]);
-		if (status < 0) return status;
-
-		status = __free_indirect_blk(fd, &single_indirect_blk);
-		if (status < 0) return status;
-
-		status = free_blk(fd, double_indirect_blk->entries[i]);
-		if (status < 0) return status;
-	}
-	return 0;
-}
-
-ssize_t __free_triple_indirect_blk(int fd,
-							struct uwufs_indirect_blk *triple_indirect_blk)
-{
-	ssize_t status;
-	struct uwufs_indirect_blk double_indirect_blk;
-	int i;
-	int n = UWUFS_BLOCK_SIZE / sizeof(uwufs_blk_t);
-	for (i = 0; i < n; i++) {
-		if (triple_indirect_blk->entries[i] <= 1 + UWUFS_RESERVED_SPACE)
-			continue;
-		status = read_blk(fd, &double_indirect_blk, triple_indirect_blk->entries[i]);
-		if (status < 0) return status;
-
-		status = __free_double_indirect_blk(fd, &double_indirect_blk);
-		if (status < 0) return status;
-
-		status = free_blk(fd, triple_indirect_blk->entries[i]);
-		if (status < 0) return status;
-	}
-	return 0;
-}
-
 /**
  * Clears the actual inode/file if the link count is 0
  */
@@ -574,49 +595,23 @@ ssize_t remove_file(int fd,
 					  uwufs_blk_t inode_num)
 {
 	ssize_t status;
-	struct uwufs_indirect_blk single_indirect_blk;
-	struct uwufs_indirect_blk double_indirect_blk;
-	struct uwufs_indirect_blk triple_indirect_blk;
-	int i;
 
-free_triple_indirect_blks:
-	if (inode->triple_indirect_blks < 1 + UWUFS_RESERVED_SPACE)
-		goto free_double_indirect_blks;
-	status = read_blk(fd, &triple_indirect_blk, inode->triple_indirect_blks);
-	if (status < 0) return status;
-	status = __free_triple_indirect_blk(fd, &triple_indirect_blk);
-	if (status < 0) return status;
-	status = free_blk(fd, inode->triple_indirect_blks);
-	if (status < 0) return status;
-
-free_double_indirect_blks:
-	if (inode->double_indirect_blks < 1 + UWUFS_RESERVED_SPACE)
-		goto free_single_indirect_blks;
-	status = read_blk(fd, &double_indirect_blk, inode->double_indirect_blks);
-	if (status < 0) return status;
-	status = __free_double_indirect_blk(fd, &double_indirect_blk);
-	if (status < 0) return status;
-	status = free_blk(fd, inode->double_indirect_blks);
-	if (status < 0) return status;
-
-free_single_indirect_blks:
-	if (inode->single_indirect_blks < 1 + UWUFS_RESERVED_SPACE)
-		goto free_direct_blks;
-	status = read_blk(fd, &single_indirect_blk, inode->single_indirect_blks);
-	if (status < 0) return status;
-	status = __free_indirect_blk(fd, &single_indirect_blk);
-	if (status < 0) return status;
-	status = free_blk(fd, inode->single_indirect_blks);
-	if (status < 0) return status;
-
-free_direct_blks:
-	for (i = 0; i < UWUFS_DIRECT_BLOCKS; i++) {
-		if (inode->direct_blks[i] < 1 + UWUFS_RESERVED_SPACE)
-			continue;
-		status = free_blk(fd, inode->direct_blks[i]);
+	// no blks, the data goes with the inode
+	if (inode->file_flags & UWUFS_INODE_INLINE_DATA)
+		goto free_inode;
+	// the tail is in a tail blk, the rest in the blk map
+	if (inode->file_flags & UWUFS_INODE_TAIL_PACKED) {
+		status = free_tail_frag(fd, inode_num, inode->file_tail_blk,
+								inode->file_tail_offset);
 		if (status < 0) return status;
+		inode->file_flags &= ~UWUFS_INODE_TAIL_PACKED;
 	}
 
+	// the data blks, the indirect blks and the blks preallocated past
+	// the end of the file
+	punch_dblks(inode, fd, 0, UINT64_MAX);
+
+free_inode:
 	// NOTE: 2 options
 	// 1. mark as free inode
 	// 2. clear entire inode
@@ -627,238 +622,1256 @@ free_direct_blks:
 
 
 
+/**
+ * True if the blk map of `inode` points nowhere (read from the map
+ * 		itself: files from before the blk counters have file_blocks 0)
+ */
+static bool __blk_map_empty(const struct uwufs_inode *inode)
+{
+	int i;
+	for (i = 0; i < UWUFS_DIRECT_BLOCKS; i++)
+		if (inode->direct_blks[i] != 0)
+			return false;
+	return inode->single_indirect_blks == 0 &&
+		   inode->double_indirect_blks == 0 &&
+		   inode->triple_indirect_blks == 0;
+}
+
+/**
+ * Where the packed tail of `inode` starts, UINT64_MAX if it has none
+ */
+static uint64_t __tail_start(const struct uwufs_inode *inode)
+{
+	if (!(inode->file_flags & UWUFS_INODE_TAIL_PACKED))
+		return UINT64_MAX;
+	return inode->file_size - inode->file_size % UWUFS_BLOCK_SIZE;
+}
+
+/**
+ * Reads `size` bytes at `offset` of the packed tail of `inode` into `buf`
+ */
+static ssize_t __read_tail(int fd, const struct uwufs_inode *inode,
+						   char *buf, size_t size, size_t offset)
+{
+	struct uwufs_tail_blk tail_blk;
+	ssize_t status = read_blk(fd, &tail_blk, inode->file_tail_blk);
+	if (status < 0)
+		return status;
+	memcpy(buf, (char *)&tail_blk + inode->file_tail_offset + offset, size);
+	return size;
+}
+
 ssize_t read_file(int fd, 
 				  char *buf,
 				  size_t size,
 				  off_t offset,
-				  struct uwufs_inode *inode)
+				  struct uwufs_inode *inode,
+				  dblk_itr_t dblk_itr)
 {
-	ssize_t status;
-	size_t offset_bytes = offset % UWUFS_BLOCK_SIZE;
+	ssize_t status = 0;
 	uwufs_blk_t offset_blk = offset / UWUFS_BLOCK_SIZE; 
-	
-	uwufs_blk_t cur_blk_num = offset_blk;
 	size_t cur_bytes_read = 0;
 
-	dblk_itr_t dblk_itr = create_dblk_itr(inode, fd, cur_blk_num);
+	// Don't read past EOF
+	if ((uint64_t)offset >= inode->file_size)
+		return 0;
+	if (size > inode->file_size - offset)
+		size = inode->file_size - offset;
 
+	if (inode->file_flags & UWUFS_INODE_INLINE_DATA) {
+		memcpy(buf, inode->inline_data + offset, size);
+		return size;
+	}
+	// the blks before the packed tail, then the tail
+	uint64_t tail_start = __tail_start(inode);
+	if ((uint64_t)offset + size > tail_start) {
+		size_t head = (uint64_t)offset < tail_start ? tail_start - offset : 0;
+		if (head > 0) {
+			status = read_file(fd, buf, head, offset, inode, dblk_itr);
+			if (status < 0)
+				return status;
+		}
+		status = __read_tail(fd, inode, buf + head, size - head,
+							 offset + head - tail_start);
+		return status < 0 ? status : (ssize_t)size;
+	}
+
+	bool own_itr = dblk_itr == NULL;
+	if (own_itr)
+		dblk_itr = create_dblk_itr(inode, fd, offset_blk);
+	else
+		dblk_itr_seek(dblk_itr, offset_blk);
+
+	// Whole blocks are read straight into `buf`, consecutive ones with a
+	// single read. Only partial first and last blocks go through data_blk
 	struct uwufs_regular_file_data_blk data_blk;
+	char *run_buf = NULL;
+	uwufs_blk_t run_blk_num = 0;
+	uwufs_blk_t run_len = 0;
 	while (cur_bytes_read < size) {
-		
-		cur_blk_num = dblk_itr_next(dblk_itr);
-		if (cur_blk_num == 0) {
-			destroy_dblk_itr(dblk_itr);
-			return cur_bytes_read;
+		uwufs_blk_t entry = dblk_itr_next(dblk_itr);
+		uwufs_blk_t cur_blk_num = UWUFS_BLK_NUM(entry);
+		// a hole or never written: reads as zeros, nothing on the device
+		bool written = entry != 0 && !(entry & UWUFS_BLK_UNWRITTEN);
+		size_t offset_bytes = (offset + cur_bytes_read) % UWUFS_BLOCK_SIZE;
+		size_t bytes_to_read = size - cur_bytes_read;
+		if (bytes_to_read > UWUFS_BLOCK_SIZE - offset_bytes)
+			bytes_to_read = UWUFS_BLOCK_SIZE - offset_bytes;
+
+		if (written && bytes_to_read == UWUFS_BLOCK_SIZE &&
+			run_len > 0 && cur_blk_num == run_blk_num + run_len) {
+			run_len++;
+			cur_bytes_read += bytes_to_read;
+			continue;
 		}
+		if (run_len > 0) {
+			status = read_blks(fd, run_buf, run_blk_num, run_len);
+			if (status < 0)
+				goto ret;
+			run_len = 0;
+		}
+		if (!written) {
+			memset(buf + cur_bytes_read, 0, bytes_to_read);
+		} else if (bytes_to_read == UWUFS_BLOCK_SIZE) {
+			run_buf = buf + cur_bytes_read;
+			run_blk_num = cur_blk_num;
+			run_len = 1;
+		} else {
+			status = read_blk(fd, &data_blk, cur_blk_num);
+			if (status < 0)
+				goto ret;
+			memcpy(buf + cur_bytes_read, data_blk.data + offset_bytes,
+				   bytes_to_read);
+		}
+		cur_bytes_read += bytes_to_read;
+	}
+	if (run_len > 0) {
+		status = read_blks(fd, run_buf, run_blk_num, run_len);
+		if (status < 0)
+			goto ret;
+	}
+	status = cur_bytes_read;
 
-		status = read_blk(fd, &data_blk, cur_blk_num);
-		if (status < 0) {
-			destroy_dblk_itr(dblk_itr);
+ret:
+	if (own_itr)
+		destroy_dblk_itr(dblk_itr);
+	return status;
+}
+
+
+ssize_t read_symlink(int fd, struct uwufs_inode *inode, char *buf)
+{
+	ssize_t status;
+
+	if ((inode->file_mode & F_TYPE_BITS) != F_TYPE_SYMLINK)
+		return -EINVAL;
+	if (inode->file_size > UWUFS_SYMLINK_MAX_SIZE)
+		return -EIO;
+	status = read_file(fd, buf, inode->file_size, 0, inode, NULL);
+	if (status < 0)
+		return status;
+	buf[status] = '\0';
+	return status;
+}
+
+ssize_t map_file_read(int fd,
+					  size_t size,
+					  off_t offset,
+					  struct uwufs_inode *inode,
+					  dblk_itr_t dblk_itr,
+					  struct uwufs_read_seg *segs,
+					  size_t *nsegs,
+					  char *tail_buf)
+{
+	uwufs_blk_t offset_blk = offset / UWUFS_BLOCK_SIZE;
+	size_t cur_bytes_read = 0;
+	size_t n = 0;
+
+	*nsegs = 0;
+	if ((uint64_t)offset >= inode->file_size)
+		return 0;
+	if (size > inode->file_size - offset)
+		size = inode->file_size - offset;
+
+	if (inode->file_flags & UWUFS_INODE_INLINE_DATA) {
+		segs[0].dev_offset = -1;
+		segs[0].mem = inode->inline_data + offset;
+		segs[0].size = size;
+		*nsegs = 1;
+		return size;
+	}
+	// the blks before the packed tail, then the tail: the tail blk is
+	// journaled, it is read (into `tail_buf`) instead of spliced
+	uint64_t tail_start = __tail_start(inode);
+	if ((uint64_t)offset + size > tail_start) {
+		size_t head = (uint64_t)offset < tail_start ? tail_start - offset : 0;
+		ssize_t status;
+		if (head > 0)
+			map_file_read(fd, head, offset, inode, dblk_itr, segs, &n, NULL);
+		status = read_blk(fd, tail_buf, inode->file_tail_blk);
+		if (status < 0)
 			return status;
-		}
+		segs[n].dev_offset = -1;
+		segs[n].mem = tail_buf + inode->file_tail_offset +
+					  (offset + head - tail_start);
+		segs[n].size = size - head;
+		*nsegs = n + 1;
+		return size;
+	}
 
-		size_t bytes_remaining = size - cur_bytes_read;
+	bool own_itr = dblk_itr == NULL;
+	if (own_itr)
+		dblk_itr = create_dblk_itr(inode, fd, offset_blk);
+	else
+		dblk_itr_seek(dblk_itr, offset_blk);
 
-		// first block and offset > 0
-		if (offset_bytes > 0 && cur_bytes_read == 0) {
-			size_t bytes_from_offset = UWUFS_BLOCK_SIZE - offset_bytes;
-			size_t bytes_to_read = bytes_remaining < bytes_from_offset ? bytes_remaining : bytes_from_offset;
-			memcpy(buf, &data_blk + offset_bytes, bytes_to_read);
-			cur_bytes_read += bytes_to_read;
-		}
-		// regular read, full block
-		else if (bytes_remaining > UWUFS_BLOCK_SIZE) {
-			memcpy(buf + cur_bytes_read, &data_blk, sizeof(data_blk));
-			cur_bytes_read += UWUFS_BLOCK_SIZE;
+	while (cur_bytes_read < size) {
+		uwufs_blk_t entry = dblk_itr_next(dblk_itr);
+		bool written = entry != 0 && !(entry & UWUFS_BLK_UNWRITTEN);
+		size_t offset_bytes = (offset + cur_bytes_read) % UWUFS_BLOCK_SIZE;
+		size_t bytes_to_read = size - cur_bytes_read;
+		if (bytes_to_read > UWUFS_BLOCK_SIZE - offset_bytes)
+			bytes_to_read = UWUFS_BLOCK_SIZE - offset_bytes;
+		off_t dev_offset = written ?
+			(off_t)UWUFS_BLK_NUM(entry) * UWUFS_BLOCK_SIZE + offset_bytes : -1;
+
+		// right after the previous piece on the device: one piece
+		if (written && n > 0 && segs[n - 1].dev_offset >= 0 &&
+			segs[n - 1].dev_offset + (off_t)segs[n - 1].size == dev_offset) {
+			segs[n - 1].size += bytes_to_read;
+		} else {
+			segs[n].dev_offset = dev_offset;
+			segs[n].mem = NULL;
+			segs[n].size = bytes_to_read;
+			n++;
 		}
-		else { // last block and partial read
-			memcpy(buf + cur_bytes_read, &data_blk, bytes_remaining);
-			cur_bytes_read += bytes_remaining;
+		cur_bytes_read += bytes_to_read;
+	}
+	if (own_itr)
+		destroy_dblk_itr(dblk_itr);
+	*nsegs = n;
+	return cur_bytes_read;
+}
+
+ssize_t prefetch_file(int fd,
+					  size_t size,
+					  off_t offset,
+					  struct uwufs_inode *inode)
+{
+	uwufs_blk_t first_blk = offset / UWUFS_BLOCK_SIZE;
+	uwufs_blk_t end_blk;
+	uwufs_blk_t run_blk_num = 0;
+	uwufs_blk_t run_len = 0;
+	dblk_itr_t dblk_itr;
+
+	if ((uint64_t)offset >= inode->file_size ||
+		(inode->file_flags & UWUFS_INODE_INLINE_DATA))
+		return 0;
+	if (size > inode->file_size - offset)
+		size = inode->file_size - offset;
+	end_blk = (offset + size + UWUFS_BLOCK_SIZE - 1) / UWUFS_BLOCK_SIZE;
+
+	// the cursor reads the indirect blks as it reaches them
+	dblk_itr = create_dblk_itr(inode, fd, first_blk);
+	for (uwufs_blk_t i = first_blk; i < end_blk; i++) {
+		uwufs_blk_t entry = dblk_itr_next(dblk_itr);
+		bool written = entry != 0 && !(entry & UWUFS_BLK_UNWRITTEN);
+		if (written && run_len > 0 &&
+			UWUFS_BLK_NUM(entry) == run_blk_num + run_len) {
+			run_len++;
+			continue;
 		}
+		if (run_len > 0)
+			prefetch_blks(fd, run_blk_num, run_len);
+		run_blk_num = UWUFS_BLK_NUM(entry);
+		run_len = written ? 1 : 0;
 	}
+	if (run_len > 0)
+		prefetch_blks(fd, run_blk_num, run_len);
 	destroy_dblk_itr(dblk_itr);
-	return cur_bytes_read;
+	return size;
 }
 
+/**
+ * Reads exactly `size` bytes from the pipe `pipe_fd`
+ */
+static ssize_t __read_pipe(int pipe_fd, char *buf, size_t size)
+{
+    size_t done = 0;
+    while (done < size) {
+        ssize_t status = read(pipe_fd, buf + done, size - done);
+        if (status < 0 && errno == EINTR)
+            continue;
+        if (status <= 0)
+            return status < 0 ? -errno : -EIO;
+        done += status;
+    }
+    return done;
+}
+
+/**
+ * Moves the data of an inline file (UWUFS_INODE_INLINE_DATA) to a data
+ * 		block so the block map can be used, and writes the inode back.
+ */
+static ssize_t __uninline_file(int fd, struct uwufs_inode *inode,
+							   uwufs_blk_t inode_num)
+{
+	struct uwufs_regular_file_data_blk data_blk;
+	uwufs_blk_t blk_num;
+	ssize_t status;
+
+	if (!(inode->file_flags & UWUFS_INODE_INLINE_DATA))
+		return 0;
+	if (inode->file_size > 0) {
+		memset(&data_blk, 0, UWUFS_BLOCK_SIZE);
+		memcpy(data_blk.data, inode->inline_data, inode->file_size);
+		status = malloc_blk(fd, &blk_num);
+		if (status < 0)
+			return status;
+		// the data is on the device before the inode points to it
+		status = write_blk(fd, &data_blk, blk_num);
+		if (status < 0) {
+			free_blk(fd, blk_num);
+			return status;
+		}
+	}
+	memset(inode->inline_data, 0, UWUFS_INLINE_DATA_SIZE);
+	inode->file_flags &= ~UWUFS_INODE_INLINE_DATA;
+	if (inode->file_size > 0) {
+		inode->direct_blks[0] = blk_num;
+		inode->file_blocks = 1;
+	}
+	return write_inode(fd, inode, sizeof(*inode), inode_num);
+}
+
+/**
+ * Moves a packed tail back to a data blk of its own and writes the inode
+ * 		(nothing if the tail isn't packed)
+ */
+static ssize_t __unpack_tail(int fd, struct uwufs_inode *inode,
+							 uwufs_blk_t inode_num)
+{
+	struct uwufs_regular_file_data_blk data_blk;
+	uwufs_blk_t index = inode->file_size / UWUFS_BLOCK_SIZE;
+	size_t size = inode->file_size % UWUFS_BLOCK_SIZE;
+	uwufs_blk_t blk_num;
+	ssize_t status;
+
+	if (!(inode->file_flags & UWUFS_INODE_TAIL_PACKED))
+		return 0;
+	memset(&data_blk, 0, UWUFS_BLOCK_SIZE);
+	status = __read_tail(fd, inode, data_blk.data, size, 0);
+	if (status < 0)
+		return status;
+	status = malloc_blk(fd, &blk_num);
+	if (status < 0)
+		return status;
+	// the data is on the device before the inode points to it
+	status = write_blk(fd, &data_blk, blk_num);
+	if (status >= 0 && set_dblk(inode, fd, index, blk_num) == 0)
+		status = -ENOSPC;
+	if (status < 0) {
+		free_blk(fd, blk_num);
+		return status;
+	}
+	inode->file_blocks++;
+
+	// a fragment that can't be dropped only wastes its bytes
+	free_tail_frag(fd, inode_num, inode->file_tail_blk,
+				   inode->file_tail_offset);
+	inode->file_flags &= ~UWUFS_INODE_TAIL_PACKED;
+	inode->file_tail_blk = 0;
+	inode->file_tail_offset = 0;
+	return write_inode(fd, inode, sizeof(*inode), inode_num);
+}
+
+ssize_t pack_file_tail(int fd,
+					   struct uwufs_inode *inode,
+					   uwufs_blk_t inode_num)
+{
+	struct uwufs_regular_file_data_blk data_blk;
+	uwufs_blk_t index = inode->file_size / UWUFS_BLOCK_SIZE;
+	size_t size = inode->file_size % UWUFS_BLOCK_SIZE;
+	uwufs_blk_t entry;
+	uwufs_blk_t blk_num;
+	uint16_t offset;
+	ssize_t status;
+
+	if ((inode->file_mode & F_TYPE_BITS) != F_TYPE_REGULAR ||
+		(inode->file_flags & (UWUFS_INODE_INLINE_DATA |
+							  UWUFS_INODE_TAIL_PACKED)) ||
+		size == 0 || size > UWUFS_TAIL_MAX_SIZE)
+		return 0;
+	// a hole has nothing to pack, preallocated and shared blks stay
+	entry = get_dblk(inode, fd, index);
+	if (entry == 0 || (entry & UWUFS_BLK_FLAGS))
+		return 0;
+
+	status = read_blk(fd, &data_blk, entry);
+	if (status < 0)
+		return status;
+	status = malloc_tail_frag(fd, inode_num, data_blk.data, size, &blk_num,
+							  &offset);
+	if (status < 0)
+		return status;
+	punch_dblks(inode, fd, index, index + 1);
+	inode->file_flags |= UWUFS_INODE_TAIL_PACKED;
+	inode->file_tail_blk = blk_num;
+	inode->file_tail_offset = offset;
+	status = write_inode(fd, inode, sizeof(*inode), inode_num);
+	return status < 0 ? status : 1;
+}
 
-//write file
-ssize_t write_file(
+/**
+ * The kernel keeps the times of the files it caches writes for (see
+ * 		writeback_cache_enable)
+ */
+static bool __kernel_file_times = false;
+
+void writeback_cache_enable(bool on)
+{
+	__kernel_file_times = on;
+}
+
+/**
+ * write_file and write_file_pipe: the data is in `buf`, or if `buf` is
+ * 		NULL the next `size` bytes of the pipe `pipe_fd`
+ */
+static ssize_t __write_file(
     int fd,
     const char *buf,
+    int pipe_fd,
     size_t size,
     off_t offset,
     struct uwufs_inode *inode,
-    uwufs_blk_t inode_num
+    uwufs_blk_t inode_num,
+    dblk_itr_t dblk_itr
 ) {
-    // first, calculate how many blocks we need to malloc and append
+    if (size == 0)
+        return 0;
+
     uint64_t cur_size = inode->file_size;
-    uint64_t cur_blks = (cur_size + UWUFS_BLOCK_SIZE - 1) / UWUFS_BLOCK_SIZE;
     uint64_t new_size = offset + size;
-    uint64_t new_blks = (new_size + UWUFS_BLOCK_SIZE - 1) / UWUFS_BLOCK_SIZE;
+    uwufs_blk_t first_index = offset / UWUFS_BLOCK_SIZE;
+    uwufs_blk_t last_index = (new_size - 1) / UWUFS_BLOCK_SIZE;
+    uwufs_blk_t nblks = last_index - first_index + 1;
+    ssize_t status = 0;
 #ifdef DEBUG
-    printf("cur_size: %lu, cur_blks: %lu, new_size: %lu, new_blks: %lu\n", cur_size, cur_blks, new_size, new_blks);
+    printf("cur_size: %lu, new_size: %lu, first_index: %lu, last_index: %lu\n", cur_size, new_size, first_index, last_index);
 #endif
 
-    struct uwufs_regular_file_data_blk zero_blk;
-    memset(&zero_blk, 0, sizeof(zero_blk));
-    for (uint64_t i = cur_blks; i < new_blks; i++) {
-        uwufs_blk_t new_blk_num;
-        ssize_t status = malloc_blk(fd, &new_blk_num);
-        if (status < 0) {
-#ifdef DEBUG
-            printf("malloc_blk failed: i = %lu\n", i);
-#endif
-            return status;
+    // a file without blocks stays in the inode while it fits, the data
+    // is written (and journaled) with it
+    if (new_size <= UWUFS_INLINE_DATA_SIZE &&
+        cur_size <= UWUFS_INLINE_DATA_SIZE &&
+        !(inode->file_flags & UWUFS_INODE_TAIL_PACKED) &&
+        ((inode->file_flags & UWUFS_INODE_INLINE_DATA) ||
+         __blk_map_empty(inode))) {
+        char data[UWUFS_INLINE_DATA_SIZE];
+        if (buf == NULL) {
+            status = __read_pipe(pipe_fd, data, size);
+            if (status < 0)
+                return status;
+            buf = data;
         }
-        // zero out the block
-        status = write_blk(fd, &zero_blk, new_blk_num);
-        if (status < 0) {
-#ifdef DEBUG
-            printf("write_blk failed: i = %lu\n", i);
-#endif
-            return status;
+        // the block map is empty: the bytes not written read as zeros
+        inode->file_flags |= UWUFS_INODE_INLINE_DATA;
+        memcpy(inode->inline_data + offset, buf, size);
+        if (new_size > cur_size)
+            inode->file_size = new_size;
+        if (!__kernel_file_times) {
+            time_t unix_time = time(NULL);
+            if (unix_time == -1)
+                unix_time = 0;
+            inode->file_mtime = (uint64_t)unix_time;
+            inode->file_ctime = (uint64_t)unix_time;
         }
-        status = append_dblk(inode, fd, i, new_blk_num);
+        status = write_inode(fd, inode, sizeof(*inode), inode_num);
+        return status < 0 ? status : (ssize_t)size;
+    }
+    // grows out of the inode
+    status = __uninline_file(fd, inode, inode_num);
+    if (status < 0)
+        return status;
+    // writes to (or past) a packed tail need its blk back
+    if ((uint64_t)offset + size > __tail_start(inode)) {
+        status = __unpack_tail(fd, inode, inode_num);
+        if (status < 0)
+            return status;
+    }
+    if (dblk_itr != NULL)
+        dblk_itr_invalidate(dblk_itr);
+
+    // the data block numbers, then the positions of the blocks allocated
+    // here, then the shared blocks they replace (0 for holes), then the
+    // new blocks
+    uwufs_blk_t *blk_nums = (uwufs_blk_t *)malloc(4 * nblks * sizeof(uwufs_blk_t));
+    if (blk_nums == NULL)
+        return -ENOMEM;
+    uwufs_blk_t *hole_idx = blk_nums + nblks;
+    uwufs_blk_t *cow_old = blk_nums + 2 * nblks;
+    uwufs_blk_t *new_blks = blk_nums + 3 * nblks;
+
+    // first, find the data blocks the write goes to. Holes (0 block
+    // numbers, anywhere before the end of the file or past it) get a
+    // block now: only the blocks that are written are ever allocated.
+    // Shared blocks are never written in place, they get a copy
+    bool own_itr = dblk_itr == NULL;
+    if (own_itr) {
+        dblk_itr = create_dblk_itr(inode, fd, first_index);
+    } else {
+        dblk_itr_seek(dblk_itr, first_index);
+    }
+    for (uwufs_blk_t i = 0; i < nblks; i++)
+        blk_nums[i] = dblk_itr_next(dblk_itr);
+
+    // a partial first or last block that was a hole (or was never
+    // written) starts from zeros
+    bool first_was_hole = blk_nums[0] == 0 ||
+                          (blk_nums[0] & UWUFS_BLK_UNWRITTEN);
+    bool last_was_hole = blk_nums[nblks - 1] == 0 ||
+                         (blk_nums[nblks - 1] & UWUFS_BLK_UNWRITTEN);
+    uwufs_blk_t unwritten = 0;
+    uwufs_blk_t allocated = 0;
+    uwufs_blk_t needed = 0;
+    uwufs_blk_t used = 0;
+    for (uwufs_blk_t i = 0; i < nblks; i++) {
+        cow_old[i] = 0;
+        if (blk_nums[i] & UWUFS_BLK_UNWRITTEN)
+            unwritten++;
+        if (blk_nums[i] == 0 || (blk_nums[i] & UWUFS_BLK_SHARED))
+            needed++;
+    }
+    // several blocks come in a run from the freelist (the allocation
+    // cache hands them out in reverse order): they are consecutive on
+    // the device, written and later read with one syscall
+    for (uwufs_blk_t j = 0; j < needed; j += status) {
+        if (needed == 1 && (status = malloc_blk(fd, new_blks)) == 0)
+            status = 1;
+        else if (needed > 1)
+            status = malloc_blks(fd, new_blks + j, needed - j);
         if (status < 0) {
 #ifdef DEBUG
-            printf("append_dblk failed: i = %lu\n", i);
+            printf("malloc_blks failed: %lu of %lu\n", j, needed);
 #endif
-            return status;
+            while (j > 0)
+                free_blk(fd, new_blks[--j]);
+            goto undo_allocations;
         }
     }
-
-    // printf("new_size: %lu\n", new_size);
-
-    // now, write the data
-    uwufs_blk_t cur_index = offset / UWUFS_BLOCK_SIZE;
-    dblk_itr_t dblk_itr = create_dblk_itr(inode, fd, cur_index);
-    // write the first block
-    uwufs_blk_t cur_blk_num = dblk_itr_next(dblk_itr);
-    char data_blk[UWUFS_BLOCK_SIZE];
-    // read the block first
-#ifdef DEBUG
-	if (cur_blk_num == 0) {
-		printf("write_file: reading super_blk when not supposed to\n");
-		exit(1);
-	}
-#endif
-    ssize_t status = read_blk(fd, data_blk, cur_blk_num);
-    if (status < 0) {
-        destroy_dblk_itr(dblk_itr);
+    for (uwufs_blk_t i = 0; i < nblks; i++) {
+        if (blk_nums[i] != 0 && !(blk_nums[i] & UWUFS_BLK_SHARED))
+            continue;
+        uwufs_blk_t new_blk = new_blks[used++];
+        if (set_dblk(inode, fd, first_index + i, new_blk) == 0) {
 #ifdef DEBUG
-        printf("read_blk failed: cur_blk_num = %lu\n", cur_blk_num);
+            printf("set_dblk failed: index = %lu\n", first_index + i);
 #endif
-        return status;
+            free_blk(fd, new_blk);
+            while (used < needed)
+                free_blk(fd, new_blks[used++]);
+            status = -ENOSPC;
+            goto undo_allocations;
+        }
+        if (blk_nums[i] == 0) {
+            inode->file_blocks++;
+        } else {
+            cow_old[i] = blk_nums[i];
+            inode->file_shared_blocks--;
+        }
+        blk_nums[i] = new_blk;
+        hole_idx[allocated++] = i;
     }
-    // printf("finished reading first block\n");
-    // calculate the offset in the block
-    size_t offset_bytes = offset % UWUFS_BLOCK_SIZE;
-    // calculate how many bytes we can write in this block
-    size_t bytes_to_write = size < UWUFS_BLOCK_SIZE - offset_bytes ? size : UWUFS_BLOCK_SIZE - offset_bytes;
-    // printf("offset_bytes: %lu, bytes_to_write: %lu\n", offset_bytes, bytes_to_write);
-    // write the data
-    // printf("data_blk: %p\n", data_blk);
-    // printf("dest: %p, src: %p, size: %lu\n", data_blk + offset_bytes, buf, bytes_to_write);
-    memcpy(data_blk + offset_bytes, buf, bytes_to_write);
-    // write the block back
-    // printf("before write the first block\n");
-    status = write_blk(fd, data_blk, cur_blk_num);
-
-    // printf("write rest of the blocks\n");
-    // write the rest of the blocks
-    size_t bytes_written = bytes_to_write;
+    // the cached indirect blocks are stale if blocks were added
+    if (allocated > 0 && !own_itr)
+        dblk_itr_invalidate(dblk_itr);
+
+    // Blocks the write covers completely are written straight from `buf`
+    // or spliced from the pipe (consecutive ones with a single write),
+    // only the partial first and last blocks need the old contents: read
+    // them (from the shared block for a copy), or start from zeros if
+    // they were holes. The pipe is read in order, like `buf`
+    {
+    char data_blk[UWUFS_MAX_BLOCK_SIZE];
+    size_t run_pos = 0;
+    uwufs_blk_t run_blk_num = 0;
+    uwufs_blk_t run_len = 0;
+    uwufs_blk_t i = 0;
+    size_t bytes_written = 0;
     while (bytes_written < size) {
-        cur_blk_num = dblk_itr_next(dblk_itr);
+        uwufs_blk_t cur_blk_num = UWUFS_BLK_NUM(blk_nums[i]);
+        size_t offset_bytes = (offset + bytes_written) % UWUFS_BLOCK_SIZE;
+        size_t bytes_to_write = size - bytes_written;
+        if (bytes_to_write > UWUFS_BLOCK_SIZE - offset_bytes)
+            bytes_to_write = UWUFS_BLOCK_SIZE - offset_bytes;
+
+        if (bytes_to_write == UWUFS_BLOCK_SIZE &&
+            run_len > 0 && cur_blk_num == run_blk_num + run_len) {
+            run_len++;
+        } else {
+            if (run_len > 0) {
+                if (buf != NULL)
+                    status = write_blks(fd, buf + run_pos, run_blk_num, run_len);
+                else
+                    status = splice_blks(fd, pipe_fd, run_blk_num, run_len);
+                if (status < 0)
+                    goto undo_allocations;
+                run_len = 0;
+            }
+            if (bytes_to_write == UWUFS_BLOCK_SIZE) {
+                run_pos = bytes_written;
+                run_blk_num = cur_blk_num;
+                run_len = 1;
+            } else {
+                bool was_hole = i == 0 ? first_was_hole : last_was_hole;
+                if (was_hole) {
+                    memset(data_blk, 0, UWUFS_BLOCK_SIZE);
+                } else {
+                    uwufs_blk_t src_blk_num = cow_old[i] != 0 ?
+                        UWUFS_BLK_NUM(cow_old[i]) : cur_blk_num;
+                    status = read_blk(fd, data_blk, src_blk_num);
+                    if (status < 0) {
 #ifdef DEBUG
-        printf("cur_blk_num = %lu\n", cur_blk_num);
-		assert(cur_blk_num != 0);
+                        printf("read_blk failed: cur_blk_num = %lu\n", src_blk_num);
 #endif
-        status = read_blk(fd, data_blk, cur_blk_num);
-        if (status < 0) {
-            destroy_dblk_itr(dblk_itr);
+                        goto undo_allocations;
+                    }
+                }
+                if (buf != NULL) {
+                    memcpy(data_blk + offset_bytes, buf + bytes_written, bytes_to_write);
+                } else {
+                    status = __read_pipe(pipe_fd, data_blk + offset_bytes, bytes_to_write);
+                    if (status < 0)
+                        goto undo_allocations;
+                }
+                status = write_blk(fd, data_blk, cur_blk_num);
+                if (status < 0) {
 #ifdef DEBUG
-            printf("read_blk failed: cur_blk_num = %lu\n", cur_blk_num);
+                    printf("write_blk failed: cur_blk_num = %lu\n", cur_blk_num);
 #endif
-            return status;
+                    goto undo_allocations;
+                }
+            }
+        }
+        bytes_written += bytes_to_write;
+        i++;
+    }
+    if (run_len > 0) {
+        if (buf != NULL)
+            status = write_blks(fd, buf + run_pos, run_blk_num, run_len);
+        else
+            status = splice_blks(fd, pipe_fd, run_blk_num, run_len);
+        if (status < 0)
+            goto undo_allocations;
+    }
+    }
+
+    // the copies hold the data now: this file lets go of the shared blocks
+    for (uwufs_blk_t k = 0; k < allocated; k++) {
+        uwufs_blk_t i = hole_idx[k];
+        if (cow_old[i] != 0)
+            release_data_blk(fd, cow_old[i]);
+    }
+
+    // preallocated blocks hold data now
+    if (unwritten > 0) {
+        for (uwufs_blk_t i = 0; i < nblks; i++) {
+            if (!(blk_nums[i] & UWUFS_BLK_UNWRITTEN))
+                continue;
+            if (set_dblk(inode, fd, first_index + i,
+                         UWUFS_BLK_NUM(blk_nums[i])) == 0) {
+                status = -EIO;
+                goto error_ret;
+            }
+            inode->file_unwritten_blocks--;
+        }
+        if (!own_itr)
+            dblk_itr_invalidate(dblk_itr);
+    }
+
+    // update the inode
+    {
+        time_t unix_time = time(NULL);
+        if (unix_time == -1)
+            unix_time = 0;
+        if (new_size > cur_size || allocated > 0 || unwritten > 0) {
+            if (new_size > cur_size)
+                inode->file_size = new_size;
+            if (!__kernel_file_times) {
+                inode->file_mtime = (uint64_t)unix_time;
+                inode->file_ctime = (uint64_t)unix_time;
+            }
+            status = write_inode(fd, inode, sizeof(*inode), inode_num);
+        } else if (!__kernel_file_times &&
+                   (inode->file_mtime != (uint64_t)unix_time ||
+                    inode->file_ctime != (uint64_t)unix_time)) {
+            // overwrite in place: only the timestamps change (and not at
+            // all within the same second)
+            inode->file_mtime = (uint64_t)unix_time;
+            inode->file_ctime = (uint64_t)unix_time;
+            status = touch_inode(fd, inode, inode_num);
         }
-        size_t bytes_remaining = size - bytes_written;
-        size_t bytes_to_write = bytes_remaining < UWUFS_BLOCK_SIZE ? bytes_remaining : UWUFS_BLOCK_SIZE;
-        memcpy(data_blk, buf + bytes_written, bytes_to_write);
-        status = write_blk(fd, data_blk, cur_blk_num);
         if (status < 0) {
-            destroy_dblk_itr(dblk_itr);
 #ifdef DEBUG
-            printf("write_blk failed: cur_blk_num = %lu\n", cur_blk_num);
+            printf("write_inode failed\n");
 #endif
-            return status;
+            goto error_ret;
         }
-        bytes_written += bytes_to_write;
     }
 
-    // printf("update the inode\n");
-    // update the inode
-    if (new_size > cur_size) {
-        inode->file_size = new_size;
+    free(blk_nums);
+    if (own_itr)
+        destroy_dblk_itr(dblk_itr);
+    return size;
+
+undo_allocations:
+    // blocks allocated but never written must not stay in the file: they
+    // would read as garbage instead of zeros (or the shared data they
+    // replaced). The indirect blocks added on the way stay (empty), the
+    // inode keeps track of them
+    while (allocated > 0) {
+        uwufs_blk_t i = hole_idx[--allocated];
+        set_dblk(inode, fd, first_index + i, cow_old[i]);
+        free_blk(fd, blk_nums[i]);
+        if (cow_old[i] == 0)
+            inode->file_blocks--;
+        else
+            inode->file_shared_blocks++;
     }
-    time_t unix_time;
-	unix_time = time(NULL);
-	inode->file_atime = (int64_t)unix_time;
-	inode->file_mtime = (int64_t)unix_time;
-	inode->file_ctime = (int64_t)unix_time;
-    status = write_inode(fd, inode, sizeof(*inode), inode_num);
-    if (status < 0) {
+    write_inode(fd, inode, sizeof(*inode), inode_num);
+error_ret:
+    free(blk_nums);
+    if (own_itr)
         destroy_dblk_itr(dblk_itr);
+    return status;
+}
+
+ssize_t write_file(int fd,
+                   const char *buf,
+                   size_t size,
+                   off_t offset,
+                   struct uwufs_inode *inode,
+                   uwufs_blk_t inode_num,
+                   dblk_itr_t dblk_itr)
+{
+    return __write_file(fd, buf, -1, size, offset, inode, inode_num, dblk_itr);
+}
+
+ssize_t write_file_pipe(int fd,
+                        int pipe_fd,
+                        size_t size,
+                        off_t offset,
+                        struct uwufs_inode *inode,
+                        uwufs_blk_t inode_num,
+                        dblk_itr_t dblk_itr)
+{
+    return __write_file(fd, NULL, pipe_fd, size, offset, inode, inode_num,
+                        dblk_itr);
+}
+
+off_t seek_data_hole(int fd, off_t offset, int whence,
+					 const struct uwufs_inode *inode)
+{
+	if (whence != SEEK_DATA && whence != SEEK_HOLE)
+		return -EINVAL;
+	if (offset < 0 || (uint64_t)offset >= inode->file_size)
+		return -ENXIO;
+	// all data
+	if (inode->file_flags & UWUFS_INODE_INLINE_DATA)
+		return whence == SEEK_DATA ? offset : (off_t)inode->file_size;
+
+	uwufs_blk_t start_index = offset / UWUFS_BLOCK_SIZE;
+	uwufs_blk_t end_index = (inode->file_size + UWUFS_BLOCK_SIZE - 1)
+							/ UWUFS_BLOCK_SIZE;
+	// a packed tail is data (a hole in the blk map)
+	bool packed = inode->file_flags & UWUFS_INODE_TAIL_PACKED;
+	if (packed)
+		end_index--;
+	uwufs_blk_t index = seek_dblk(inode, fd, start_index, end_index,
+								  whence == SEEK_DATA);
+	if (index == end_index) {
+		if (whence == SEEK_HOLE)
+			return inode->file_size;
+		if (!packed)
+			return -ENXIO;
+		uint64_t tail_start = __tail_start(inode);
+		return (uint64_t)offset > tail_start ? offset : (off_t)tail_start;
+	}
+
+	uint64_t found = (uint64_t)index * UWUFS_BLOCK_SIZE;
+	if (found < (uint64_t)offset)
+		found = offset;
+	if (found > inode->file_size)
+		found = inode->file_size;
+	return found;
+}
+
+/**
+ * Number of data blocks the block map can address
+ */
+static uwufs_blk_t __max_file_blks(void)
+{
+	const uwufs_blk_t per_blk = UWUFS_BLOCK_SIZE / sizeof(uwufs_blk_t);
+	return UWUFS_DIRECT_BLOCKS + per_blk + per_blk * per_blk +
+		   per_blk * per_blk * per_blk;
+}
+
+/**
+ * Zeroes bytes [from, to) of data block `index` (within one block) if it
+ * 		holds data: holes and unwritten blocks read as zeros already.
+ * 		A shared block is replaced by a zeroed copy (see write_file).
+ */
+static ssize_t __zero_blk_bytes(int fd, struct uwufs_inode *inode,
+								uwufs_blk_t index, size_t from, size_t to)
+{
+	char data_blk[UWUFS_MAX_BLOCK_SIZE];
+	uwufs_blk_t entry = get_dblk(inode, fd, index);
+	uwufs_blk_t new_blk;
+	ssize_t status;
+
+	if (entry == 0 || (entry & UWUFS_BLK_UNWRITTEN))
+		return 0;
+	status = read_blk(fd, data_blk, UWUFS_BLK_NUM(entry));
+	if (status < 0)
+		return status;
+	memset(data_blk + from, 0, to - from);
+	if (!(entry & UWUFS_BLK_SHARED))
+		return write_blk(fd, data_blk, entry);
+
+	status = malloc_blk(fd, &new_blk);
+	if (status < 0)
+		return status;
+	status = write_blk(fd, data_blk, new_blk);
+	if (status >= 0 && set_dblk(inode, fd, index, new_blk) == 0)
+		status = -ENOSPC;
+	if (status < 0) {
+		free_blk(fd, new_blk);
+		return status;
+	}
+	inode->file_shared_blocks--;
+	return release_data_blk(fd, entry);
+}
+
+/**
+ * Gives the holes among data blocks [start_index, end_index) a block
+ * 		flagged unwritten, in runs from malloc_blks. With `zero`, the
+ * 		written blocks of [zero_start, zero_end) are flagged unwritten
+ * 		again (their contents are dropped without any I/O), shared ones
+ * 		are left to the other files and get a new block like holes.
+ */
+static ssize_t __prealloc_blks(int fd, struct uwufs_inode *inode,
+							   uwufs_blk_t start_index, uwufs_blk_t end_index,
+							   bool zero, uwufs_blk_t zero_start,
+							   uwufs_blk_t zero_end)
+{
+	const uwufs_blk_t per_blk = UWUFS_BLOCK_SIZE / sizeof(uwufs_blk_t);
+	uwufs_blk_t entries[UWUFS_MAX_BLOCK_SIZE / sizeof(uwufs_blk_t)];
+	uwufs_blk_t new_blks[UWUFS_MAX_BLOCK_SIZE / sizeof(uwufs_blk_t)];
+	uwufs_blk_t holes = 0;
+	uwufs_blk_t base, n, i, j, nholes;
+	ssize_t status = 0;
+
+	// count first: a preallocation that can't fit fails without
+	// allocating anything
+	dblk_itr_t dblk_itr = create_dblk_itr(inode, fd, start_index);
+	for (i = start_index; i < end_index; i++) {
+		uwufs_blk_t entry = dblk_itr_next(dblk_itr);
+		bool in_zero = zero && i >= zero_start && i < zero_end;
+		if (entry == 0 || (in_zero && (entry & UWUFS_BLK_SHARED)))
+			holes++;
+	}
+	if (holes > 0) {
+		status = check_free_blks(fd, holes);
+		if (status < 0)
+			goto ret;
+	}
+
+	for (base = start_index; base < end_index; base += n) {
+		n = end_index - base < per_blk ? end_index - base : per_blk;
+		// set_dblk changed the indirect blocks the cursor read
+		dblk_itr_invalidate(dblk_itr);
+		dblk_itr_seek(dblk_itr, base);
+		nholes = 0;
+		for (i = 0; i < n; i++) {
+			bool in_zero = zero && base + i >= zero_start && base + i < zero_end;
+			entries[i] = dblk_itr_next(dblk_itr);
+			if (entries[i] == 0 || (in_zero && (entries[i] & UWUFS_BLK_SHARED)))
+				nholes++;
+		}
+		for (j = 0; j < nholes; j += status) {
+			status = malloc_blks(fd, new_blks + j, nholes - j);
+			if (status < 0) {
+				while (j > 0)
+					free_blk(fd, new_blks[--j]);
+				goto ret;
+			}
+		}
+
+		j = 0;
+		for (i = 0; i < n; i++) {
+			uwufs_blk_t entry = entries[i];
+			uwufs_blk_t shared = 0;
+			bool in_zero = zero && base + i >= zero_start && base + i < zero_end;
+			if (entry == 0) {
+				entry = new_blks[j++];
+				inode->file_blocks++;
+			} else if (in_zero && (entry & UWUFS_BLK_SHARED)) {
+				shared = entry;
+				entry = new_blks[j++];
+			} else if (!in_zero || (entry & UWUFS_BLK_UNWRITTEN)) {
+				continue;
+			}
+			if (set_dblk(inode, fd, base + i, entry | UWUFS_BLK_UNWRITTEN) == 0) {
 #ifdef DEBUG
-        printf("write_inode failed\n");
+				printf("set_dblk failed: index = %lu\n", base + i);
 #endif
-        return status;
-    }
+				// the blk just taken and the rest of the run aren't
+				// in the block map
+				if (shared == 0)
+					inode->file_blocks--;
+				for (j--; j < nholes; j++)
+					free_blk(fd, new_blks[j]);
+				status = -ENOSPC;
+				goto ret;
+			}
+			inode->file_unwritten_blocks++;
+			if (shared != 0) {
+				release_data_blk(fd, shared);
+				inode->file_shared_blocks--;
+			}
+		}
+	}
+	status = 0;
 
-    destroy_dblk_itr(dblk_itr);
-    return size;
+ret:
+	destroy_dblk_itr(dblk_itr);
+	return status;
 }
 
-ssize_t truncate_file(int fd, uwufs_blk_t inode_num)
+ssize_t truncate_file(int fd, uwufs_blk_t inode_num, uint64_t size)
 {
 	ssize_t status;
 	struct uwufs_inode inode;
 	status = read_inode(fd, &inode, inode_num);
 	RETURN_IF_ERROR(status);
 
-	uint64_t cur_file_size = inode.file_size;
-	uwufs_blk_t cur_file_blks = cur_file_size / UWUFS_BLOCK_SIZE;
-	if (cur_file_size % UWUFS_BLOCK_SIZE != 0)
-		cur_file_blks++;
-	
 #ifdef DEBUG
-	printf("%ld\n", cur_file_blks);
+	printf("==>Truncating: %lu bytes to %lu\n", inode.file_size, size);
 #endif
+	if (size == 0) {
+		// everything the block map points to, also the blocks
+		// preallocated past the end of the file
+		if (inode.file_flags & UWUFS_INODE_INLINE_DATA)
+			memset(inode.inline_data, 0, UWUFS_INLINE_DATA_SIZE);
+		else
+			punch_dblks(&inode, fd, 0, UINT64_MAX);
+		if (inode.file_flags & UWUFS_INODE_TAIL_PACKED) {
+			status = free_tail_frag(fd, inode_num, inode.file_tail_blk,
+									inode.file_tail_offset);
+			RETURN_IF_ERROR(status);
+		}
 
-	uwufs_blk_t index; 
-	uwufs_blk_t dblk_to_free; 
-	// free up all the blocks before calling remove_dblks()
-	for (index = cur_file_blks; index > 0; index--) {
-		dblk_to_free = get_dblk(&inode, fd, index-1);
-		
-		// here for safety reasons
-		if (dblk_to_free == 0) break;
-#ifdef DEBUG
-		printf("==>Truncating: Freeing blk %lu\n", dblk_to_free);
-#endif
-		status = free_blk(fd, dblk_to_free);
+		inode.file_flags &= ~(UWUFS_INODE_INLINE_DATA | UWUFS_INODE_TAIL_PACKED);
+		inode.file_tail_blk = 0;
+		inode.file_tail_offset = 0;
+		inode.file_size = 0;
+		inode.file_blocks = 0;
+		inode.file_unwritten_blocks = 0;
+		inode.file_shared_blocks = 0;
+		status = write_inode(fd, &inode, sizeof(inode), inode_num);
 		RETURN_IF_ERROR(status);
+		return 0;
+	}
+	if (size > __max_file_blks() * UWUFS_BLOCK_SIZE)
+		return -EFBIG;
+
+	if (inode.file_flags & UWUFS_INODE_INLINE_DATA) {
+		if (size > UWUFS_INLINE_DATA_SIZE) {
+			status = __uninline_file(fd, &inode, inode_num);
+			RETURN_IF_ERROR(status);
+		} else if (size < inode.file_size) {
+			// the bytes past the end read as zeros when it grows again
+			memset(inode.inline_data + size, 0, inode.file_size - size);
+		}
+	}
+	// the packed tail is the last blk of the file: it goes if the file
+	// ends before it, else it moves back to a blk of its own
+	if (inode.file_flags & UWUFS_INODE_TAIL_PACKED) {
+		if (size <= __tail_start(&inode)) {
+			status = free_tail_frag(fd, inode_num, inode.file_tail_blk,
+									inode.file_tail_offset);
+			RETURN_IF_ERROR(status);
+			inode.file_flags &= ~UWUFS_INODE_TAIL_PACKED;
+			inode.file_tail_blk = 0;
+			inode.file_tail_offset = 0;
+		} else {
+			status = __unpack_tail(fd, &inode, inode_num);
+			RETURN_IF_ERROR(status);
+		}
 	}
 
-	remove_dblks(&inode, fd, 0, cur_file_blks);
+	// shrinking frees the blocks past the new end (also the preallocated
+	// ones) and zeroes the rest of the last block, growing leaves a hole
+	if (!(inode.file_flags & UWUFS_INODE_INLINE_DATA) &&
+		size < inode.file_size) {
+		uwufs_blk_t end_index = (size + UWUFS_BLOCK_SIZE - 1) / UWUFS_BLOCK_SIZE;
+		punch_dblks(&inode, fd, end_index, UINT64_MAX);
+		if (size % UWUFS_BLOCK_SIZE != 0) {
+			status = __zero_blk_bytes(fd, &inode, size / UWUFS_BLOCK_SIZE,
+									  size % UWUFS_BLOCK_SIZE,
+									  UWUFS_BLOCK_SIZE);
+			if (status < 0) {
+				write_inode(fd, &inode, sizeof(inode), inode_num);
+				return status;
+			}
+		}
+	}
 
-	size_t inode_dblk_addresses = sizeof(inode.direct_blks) + 
-								 sizeof(inode.single_indirect_blks) +
-								 sizeof(inode.double_indirect_blks) + 
-								 sizeof(inode.triple_indirect_blks);
-	memset(&inode, 0, inode_dblk_addresses);
-	inode.file_size = 0;
+	inode.file_size = size;
 	status = write_inode(fd, &inode, sizeof(inode), inode_num);
 	RETURN_IF_ERROR(status);
-
 	return 0;
 }
+
+ssize_t fallocate_file(int fd,
+					   int mode,
+					   off_t offset,
+					   off_t length,
+					   struct uwufs_inode *inode,
+					   uwufs_blk_t inode_num)
+{
+	const int supported = FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE |
+						  FALLOC_FL_ZERO_RANGE;
+	bool punch = mode & FALLOC_FL_PUNCH_HOLE;
+	bool zero = mode & FALLOC_FL_ZERO_RANGE;
+	ssize_t status;
+
+	if ((mode & ~supported) != 0 || (punch && zero) ||
+		(punch && !(mode & FALLOC_FL_KEEP_SIZE)))
+		return -EOPNOTSUPP;
+	if (offset < 0 || length <= 0)
+		return -EINVAL;
+
+	uint64_t end = (uint64_t)offset + length;
+	uwufs_blk_t first_index = offset / UWUFS_BLOCK_SIZE;
+	uwufs_blk_t end_index = (end + UWUFS_BLOCK_SIZE - 1) / UWUFS_BLOCK_SIZE;
+	// the blocks entirely in the range
+	uwufs_blk_t full_start = (offset + UWUFS_BLOCK_SIZE - 1) / UWUFS_BLOCK_SIZE;
+	uwufs_blk_t full_end = end / UWUFS_BLOCK_SIZE;
+	if (end_index > __max_file_blks())
+		return -EFBIG;
+	status = __uninline_file(fd, inode, inode_num);
+	if (status >= 0)
+		status = __unpack_tail(fd, inode, inode_num);
+	if (status < 0)
+		return status;
+
+	if (punch || zero) {
+		// the partial blocks at the ends keep the bytes out of the range
+		size_t from = offset % UWUFS_BLOCK_SIZE;
+		if (full_start > full_end) {	// within one block
+			status = __zero_blk_bytes(fd, inode, first_index, from,
+									  end % UWUFS_BLOCK_SIZE);
+		} else {
+			status = 0;
+			if (from != 0)
+				status = __zero_blk_bytes(fd, inode, first_index, from,
+										  UWUFS_BLOCK_SIZE);
+			if (status >= 0 && end % UWUFS_BLOCK_SIZE != 0)
+				status = __zero_blk_bytes(fd, inode, full_end, 0,
+										  end % UWUFS_BLOCK_SIZE);
+		}
+		if (status < 0)
+			return status;
+	}
+
+	if (punch)
+		punch_dblks(inode, fd, full_start, full_end);
+	else
+		status = __prealloc_blks(fd, inode, first_index, end_index,
+								 zero, full_start, full_end);
+
+	// the inode is written even if the preallocation stopped halfway:
+	// the blocks it got are in the block map already
+	time_t unix_time = time(NULL);
+	if (unix_time == -1)
+		unix_time = 0;
+	if (!(mode & FALLOC_FL_KEEP_SIZE) && end > inode->file_size) {
+		inode->file_size = end;
+		inode->file_mtime = (uint64_t)unix_time;
+	}
+	if (punch || zero)
+		inode->file_mtime = (uint64_t)unix_time;
+	inode->file_ctime = (uint64_t)unix_time;
+	ssize_t write_status = write_inode(fd, inode, sizeof(*inode), inode_num);
+	if (status < 0)
+		return status;
+	return write_status < 0 ? write_status : 0;
+}
+
+/**
+ * Makes data blocks [out_index, out_index + n) of `out_inode` share the
+ * 		written blocks of [in_index, in_index + n) of `in_inode`: both
+ * 		maps get them flagged UWUFS_BLK_SHARED. The blocks `out_inode`
+ * 		had there are freed, holes and unwritten blocks of the source
+ * 		become holes. The inodes are not written.
+ */
+static ssize_t __clone_blks(int fd, struct uwufs_inode *in_inode,
+							uwufs_blk_t in_index,
+							struct uwufs_inode *out_inode,
+							uwufs_blk_t out_index, uwufs_blk_t n)
+{
+	const uwufs_blk_t per_blk = UWUFS_BLOCK_SIZE / sizeof(uwufs_blk_t);
+	uwufs_blk_t entries[UWUFS_MAX_BLOCK_SIZE / sizeof(uwufs_blk_t)];
+	uwufs_blk_t base, count, i;
+	ssize_t status;
+
+	status = mark_shared_blks(fd);
+	if (status < 0)
+		return status;
+	punch_dblks(out_inode, fd, out_index, out_index + n);
+
+	dblk_itr_t dblk_itr = create_dblk_itr(in_inode, fd, in_index);
+	for (base = 0; base < n; base += count) {
+		count = n - base < per_blk ? n - base : per_blk;
+		// set_dblk changed the indirect blocks the cursor read
+		dblk_itr_invalidate(dblk_itr);
+		dblk_itr_seek(dblk_itr, in_index + base);
+		for (i = 0; i < count; i++)
+			entries[i] = dblk_itr_next(dblk_itr);
+
+		for (i = 0; i < count; i++) {
+			uwufs_blk_t entry = entries[i];
+			uwufs_blk_t blk_num = UWUFS_BLK_NUM(entry);
+			if (entry == 0 || (entry & UWUFS_BLK_UNWRITTEN))
+				continue;
+			if (!blk_ref_share(blk_num)) {
+				status = -ENOMEM;
+				goto ret;
+			}
+			if (set_dblk(out_inode, fd, out_index + base + i,
+						 blk_num | UWUFS_BLK_SHARED) == 0) {
+				blk_ref_release(blk_num);
+				status = -ENOSPC;
+				goto ret;
+			}
+			out_inode->file_blocks++;
+			out_inode->file_shared_blocks++;
+			if (entry & UWUFS_BLK_SHARED)
+				continue;
+			// the source can't write it in place anymore either
+			set_dblk(in_inode, fd, in_index + base + i,
+					 blk_num | UWUFS_BLK_SHARED);
+			in_inode->file_shared_blocks++;
+		}
+	}
+	status = 0;
+
+ret:
+	destroy_dblk_itr(dblk_itr);
+	return status;
+}
+
+ssize_t copy_file_data(int fd,
+					   struct uwufs_inode *in_inode,
+					   uwufs_blk_t in_inode_num,
+					   off_t in_offset,
+					   struct uwufs_inode *out_inode,
+					   uwufs_blk_t out_inode_num,
+					   off_t out_offset,
+					   size_t length,
+					   bool reflink)
+{
+	ssize_t status = 0;
+	size_t copied = 0;
+	char *buf = NULL;
+
+	if (in_offset < 0 || out_offset < 0)
+		return -EINVAL;
+	// nothing past the end of the source
+	if ((uint64_t)in_offset >= in_inode->file_size)
+		return 0;
+	if (length > in_inode->file_size - in_offset)
+		length = in_inode->file_size - in_offset;
+	uint64_t out_end = (uint64_t)out_offset + length;
+	if ((out_end + UWUFS_BLOCK_SIZE - 1) / UWUFS_BLOCK_SIZE > __max_file_blks())
+		return -EFBIG;
+
+	// the whole blocks of the range are shared if both offsets are at the
+	// same place in their block, the partial ones at the ends are copied
+	uwufs_blk_t clone_start = 0;
+	uwufs_blk_t clone_end = 0;
+	if (reflink && in_offset % UWUFS_BLOCK_SIZE == out_offset % UWUFS_BLOCK_SIZE) {
+		clone_start = (in_offset + UWUFS_BLOCK_SIZE - 1) / UWUFS_BLOCK_SIZE;
+		clone_end = (in_offset + length) / UWUFS_BLOCK_SIZE;
+		if (clone_end < clone_start)
+			clone_end = clone_start;
+	}
+	// (an inline source has no whole blocks, nor does a packed tail)
+	if (clone_start < clone_end) {
+		status = __uninline_file(fd, out_inode, out_inode_num);
+		if (status >= 0)
+			status = __unpack_tail(fd, out_inode, out_inode_num);
+		if (status < 0)
+			return status;
+	}
+
+	size_t buf_size = length < UWUFS_COPY_BUF_SIZE ? length : UWUFS_COPY_BUF_SIZE;
+	buf = (char *)malloc(buf_size);
+	if (buf == NULL)
+		return -ENOMEM;
+
+	while (copied < length) {
+		off_t in_pos = in_offset + copied;
+		uwufs_blk_t in_index = in_pos / UWUFS_BLOCK_SIZE;
+		size_t n = length - copied;
+
+		if (in_pos % UWUFS_BLOCK_SIZE == 0 && in_index >= clone_start &&
+			in_index < clone_end) {
+			uwufs_blk_t nblks = clone_end - in_index;
+			uwufs_blk_t out_index = (out_offset + copied) / UWUFS_BLOCK_SIZE;
+			status = __clone_blks(fd, in_inode, in_index, out_inode,
+								  out_index, nblks);
+			if (status < 0)
+				break;
+			copied += nblks * UWUFS_BLOCK_SIZE;
+
+			time_t unix_time = time(NULL);
+			if (unix_time == -1)
+				unix_time = 0;
+			if (out_offset + copied > out_inode->file_size)
+				out_inode->file_size = out_offset + copied;
+			out_inode->file_mtime = (uint64_t)unix_time;
+			out_inode->file_ctime = (uint64_t)unix_time;
+			status = write_inode(fd, out_inode, sizeof(*out_inode),
+								 out_inode_num);
+			if (status >= 0 && in_inode_num != out_inode_num)
+				status = write_inode(fd, in_inode, sizeof(*in_inode),
+									 in_inode_num);
+			if (status < 0)
+				break;
+			continue;
+		}
+
+		// up to the next block to clone, else a buffer at a time
+		if (in_index < clone_start && clone_start < clone_end &&
+			n > clone_start * UWUFS_BLOCK_SIZE - in_pos)
+			n = clone_start * UWUFS_BLOCK_SIZE - in_pos;
+		if (n > buf_size)
+			n = buf_size;
+		status = read_file(fd, buf, n, in_pos, in_inode, NULL);
+		if (status <= 0)
+			break;
+		n = status;
+		status = write_file(fd, buf, n, out_offset + copied, out_inode,
+							out_inode_num, NULL);
+		if (status < 0)
+			break;
+		copied += n;
+	}
+
+	free(buf);
+	if (copied > 0)
+		return copied;
+	return status;
+}
@@ -8,6 +8,7 @@
 #define FILE_OPERATIONS_H
 
 #include "uwufs.h"
+#include "cpp/c_api.h"
 #include <stdlib.h>
 #include <stdbool.h>
 
@@ -22,6 +23,33 @@
  */
 ssize_t create_file(uwufs_blk_t *inode, uint16_t mode);
 
+/**
+ * Hashes a file name for the `name_hash` field of directory entries
+ * (32-bit FNV-1a over the name bytes, not including the null-terminator).
+ *
+ * `name`: file name
+ * `len`: length of `name`
+ */
+uint32_t uwufs_name_hash(const char *name, size_t len);
+
+/**
+ * Scans one directory data blk for an entry. The hashes of all the
+ * entries in the blk are compared at once (SSE2/AVX2 if the compiler
+ * targets it) and the names are only compared on a hash hit.
+ *
+ * Return: index of the entry in `dir_blk->file_entries` or -ENOENT
+ *
+ * Parameters:
+ * `dir_blk`: directory data blk to scan
+ * `name`: file name to look for
+ * `len`: length of `name` (must be < UWUFS_FILE_NAME_SIZE)
+ * `hash`: uwufs_name_hash(name, len)
+ */
+ssize_t find_directory_file_entry(const struct uwufs_directory_data_blk *dir_blk,
+								  const char *name,
+								  size_t len,
+								  uint32_t hash);
+
 /**
  * Assumes the caller has already allocated a directory data blk.
  * Unless you want to specify/provide which directory data blk to
@@ -78,16 +106,35 @@ ssize_t split_path_parent_child(const char *path,
 								char *parent_path,
 								char *child_dir);
 
+/**
+ * Clears the entry `name` of `file_inode_num` in the directory data blk,
+ * 		leaving a free slot (the other entries are not moved)
+ *
+ * Return: number of entries left in the blk or -ENOENT
+ */
 ssize_t __remove_entry_from_dir_data_blk(int fd,
 						 struct uwufs_directory_data_blk *dir_data_blk,
-						 struct uwufs_directory_data_blk *last_dir_data_blk,
-						 int last_file_entry_index,
 						 const char name[UWUFS_FILE_NAME_SIZE],
 						 uwufs_blk_t file_inode_num);
 
+/**
+ * Adds a new directory entry (hard link) for an existing inode
+ *
+ * Return: 0 on success, -EEXIST if `new_name` already exists in the
+ * 		new parent directory
+ *
+ * Parameters:
+ * `fd`: block device
+ * `old_inode_num`: inode to link to
+ * `new_parent_inode_num`: directory to add the entry to
+ * `new_name`: name of the new entry
+ * `force_dir_link`: allow linking directories (only for rename)
+ * `nlinks_change`: change to the file links count
+ */
 ssize_t link_file(int fd,
-				  const char *path,
-				  const char *new_path,
+				  uwufs_blk_t old_inode_num,
+				  uwufs_blk_t new_parent_inode_num,
+				  const char *new_name,
 				  bool force_dir_link,
 				  int nlinks_change);
 
@@ -96,7 +143,8 @@ ssize_t link_file(int fd,
  * 
  *  Parameters:
  * `fd`: block device
- * `path`: path to child entry
+ * `parent_inode_num`: parent directory of the entry
+ * `name`: name of the child entry
  * `inode`: child inode
  * `inode_num`: child inode num
  * `nlinks_change`: change to the parent dir file links count
@@ -105,53 +153,221 @@ ssize_t link_file(int fd,
  * and then it should be -1
  */
 ssize_t unlink_file(int fd,
-					  const char *path,
+					  uwufs_blk_t parent_inode_num,
+					  const char *name,
 					  struct uwufs_inode *inode,
 					  uwufs_blk_t inode_num,
 					  int nlinks_change);
 
+ssize_t remove_file(int fd,
+					  struct uwufs_inode *inode,
+					  uwufs_blk_t inode_num);
+
+
 /**
- * Frees all blk entries in an indirect block.
- * Does not include the indirect block itself.
+ * Reads up to `size` bytes at `offset` (stops at EOF). Holes read as
+ * 		zeros without touching the device, whole blocks that are
+ * 		consecutive on the device are read with one pread.
+ *
+ * Return: number of bytes read
+ *
+ * `dblk_itr`: block map cursor of `inode` to reuse (for example the one
+ * 		of an open file handle) or NULL to use a temporary one
  */
-ssize_t __free_indirect_blk(int fd,
-							struct uwufs_indirect_blk *indirect_blk);
+ssize_t read_file(int fd, 
+				  char *buf,
+				  size_t size,
+				  off_t offset,
+				  struct uwufs_inode *inode,
+				  dblk_itr_t dblk_itr);
 
 /**
- * Frees all blk entries in a double indirect block recursively,
- * including all the indirect blocks and their blk entries.
- * Does not include the double indirect block itself.
+ * Reads the target of the symlink `inode` into `buf` (at least
+ * 		UWUFS_SYMLINK_MAX_SIZE + 1 bytes) and null-terminates it. A
+ * 		short target is in the inode and costs no blk read.
+ *
+ * Return: length of the target, -EINVAL if `inode` is not a symlink
  */
-ssize_t __free_double_indirect_blk(int fd,
-						struct uwufs_indirect_blk *double_indirect_blk);
+ssize_t read_symlink(int fd, struct uwufs_inode *inode, char *buf);
 
 /**
- * Frees all blk entries in a triple indirect block recursively,
- * including all the double and single indirect blocks and
- * their blk entries.
- * Does not include the triple indirect block itself.
+ * A piece of a file read by map_file_read: `size` bytes at `dev_offset`
+ * 		on the device, or if `dev_offset` is -1 the bytes at `mem` (the
+ * 		data of an inline file) or zeros if `mem` is NULL
  */
-ssize_t __free_triple_indirect_blk(int fd,
-						struct uwufs_indirect_blk *triple_indirect_blk);
+struct uwufs_read_seg {
+	off_t dev_offset;
+	const char *mem;
+	size_t size;
+};
 
-ssize_t remove_file(int fd,
+/**
+ * Maps up to `size` bytes at `offset` (stops at EOF) to where they are on
+ * 		the device without reading them, so they can be spliced from the
+ * 		device straight to the reply. Bytes consecutive on the device are
+ * 		one piece, holes and unwritten blocks are zero pieces of at most
+ * 		one block. An inline file is one piece pointing into `inode`,
+ * 		a packed tail one pointing into `tail_buf`.
+ *
+ * `segs`: output var, room for one piece per block the range touches
+ * `nsegs`: output var for the number of pieces
+ * `tail_buf`: UWUFS_BLOCK_SIZE bytes the tail blk is read into if the
+ * 		range reaches a packed tail
+ *
+ * Return: number of bytes mapped
+ */
+ssize_t map_file_read(int fd,
+					  size_t size,
+					  off_t offset,
 					  struct uwufs_inode *inode,
-					  uwufs_blk_t inode_num);
+					  dblk_itr_t dblk_itr,
+					  struct uwufs_read_seg *segs,
+					  size_t *nsegs,
+					  char *tail_buf);
 
+/**
+ * Readahead: walks the block map of up to `size` bytes at `offset` (stops
+ * 		at EOF) in order, reading the indirect blocks on the way, and
+ * 		has the device read the data blocks in the background (see
+ * 		prefetch_blks), a call per run of consecutive blocks. Holes and
+ * 		unwritten blocks are skipped.
+ *
+ * Return: number of bytes prefetched
+ */
+ssize_t prefetch_file(int fd,
+					  size_t size,
+					  off_t offset,
+					  struct uwufs_inode *inode);
 
-ssize_t read_file(int fd, 
-				  char *buf,
-				  size_t size,
-				  off_t offset,
-				  struct uwufs_inode *inode);
+/**
+ * Tail packing: moves the last partial blk of a regular file (if it has
+ * 		one of its own, no larger than UWUFS_TAIL_MAX_SIZE) into a
+ * 		fragment of a tail blk shared with other files and frees the
+ * 		blk (see malloc_tail_frag). Writes reaching the tail, fallocate
+ * 		and reflinks move it back to a blk first, reads copy it from the
+ * 		tail blk.
+ *
+ * Return: 1 if the tail was packed, 0 if there was nothing to pack, or a
+ * 		negative error
+ */
+ssize_t pack_file_tail(int fd,
+					   struct uwufs_inode *inode,
+					   uwufs_blk_t inode_num);
+
+/**
+ * With the FUSE writeback cache the kernel caches writes and owns the
+ * 		size and times of regular files: writes reach write_file later,
+ * 		when the kernel writes its pages back (never past the size it
+ * 		knows), and it sends the times with setattr. write_file then
+ * 		still grows the file but leaves mtime/ctime alone, the time of
+ * 		the write back would overwrite the time of the actual write.
+ */
+void writeback_cache_enable(bool on);
 
+/**
+ * Writes `size` bytes at `offset`, allocating blocks for the holes it
+ * 		writes to (only those: a write past the end of the file leaves
+ * 		a hole behind it) and writing the inode back. Shared blocks
+ * 		(UWUFS_BLK_SHARED) are copied to a new block first.
+ * 		Blocks the write covers completely are written without reading
+ * 		or zeroing them first. A file that has no blocks and stays within
+ * 		UWUFS_INLINE_DATA_SIZE is kept in the inode (UWUFS_INODE_INLINE_DATA),
+ * 		it moves to a block when it grows past it. Sets mtime/ctime unless
+ * 		the kernel keeps them (see writeback_cache_enable).
+ *
+ * `dblk_itr`: block map cursor of `inode` to reuse or NULL (it is
+ * 		invalidated if blocks are allocated)
+ */
 ssize_t write_file(int fd, 
 				  const char *buf,
 				  size_t size,
 				  off_t offset,
 				  struct uwufs_inode *inode,
-				  uwufs_blk_t inode_num);
+				  uwufs_blk_t inode_num,
+				  dblk_itr_t dblk_itr);
 
-ssize_t truncate_file(int fd, uwufs_blk_t inode_num);
+/**
+ * Same as write_file with the next `size` bytes of the pipe `pipe_fd` (a
+ * 		request spliced from /dev/fuse): whole blocks are spliced to the
+ * 		device, only the partial first and last blocks are read.
+ */
+ssize_t write_file_pipe(int fd,
+						int pipe_fd,
+						size_t size,
+						off_t offset,
+						struct uwufs_inode *inode,
+						uwufs_blk_t inode_num,
+						dblk_itr_t dblk_itr);
+
+/**
+ * Changes the size of a regular file to `size` and writes the inode back.
+ * 		Shrinking frees the blocks past the new end (also the ones
+ * 		preallocated past it) and zeroes the rest of the last block, a
+ * 		packed tail past the end is freed and one the file still ends in
+ * 		moves back to a block. Growing only changes the size: the new
+ * 		part is a hole (an inline file moves to a block when it no longer
+ * 		fits in the inode).
+ *
+ * Return: 0, -EFBIG past what the block map can address, or a negative
+ * 		error
+ */
+ssize_t truncate_file(int fd, uwufs_blk_t inode_num, uint64_t size);
+
+/**
+ * fallocate. `mode` 0 (or FALLOC_FL_KEEP_SIZE) gives the holes of
+ * 		[offset, offset + length) blocks flagged unwritten: allocated, but
+ * 		they read as zeros without ever being zero-filled.
+ * 		FALLOC_FL_PUNCH_HOLE (with KEEP_SIZE) frees the blocks of the
+ * 		range, FALLOC_FL_ZERO_RANGE preallocates it and flags its written
+ * 		blocks unwritten again. Both zero the partial blocks at the ends
+ * 		in place. The file grows unless FALLOC_FL_KEEP_SIZE, the inode
+ * 		is written back.
+ *
+ * Return: 0, -EOPNOTSUPP for other modes, -ENOSPC, -EFBIG
+ */
+ssize_t fallocate_file(int fd,
+					   int mode,
+					   off_t offset,
+					   off_t length,
+					   struct uwufs_inode *inode,
+					   uwufs_blk_t inode_num);
+
+/**
+ * SEEK_DATA/SEEK_HOLE: finds the first data (or hole) at or after
+ * 		`offset`. The end of the file and unwritten blocks count as
+ * 		holes.
+ *
+ * Return: the offset found, -ENXIO if `offset` is past the end of the
+ * 		file (or there is no data after it), -EINVAL for other `whence`
+ */
+off_t seek_data_hole(int fd, off_t offset, int whence,
+					 const struct uwufs_inode *inode);
+
+// bytes copy_file_data reads and writes at a time
+#define UWUFS_COPY_BUF_SIZE				(1 << 20)
+
+/**
+ * copy_file_range: copies `length` bytes at `in_offset` of the first
+ * 		inode to `out_offset` of the second one (stops at the end of
+ * 		the source), UWUFS_COPY_BUF_SIZE bytes at a time through
+ * 		read_file and write_file. With `reflink`, the whole blocks of
+ * 		the range share the data blocks of the source instead (see
+ * 		BlockRefs.h) when both offsets are at the same place in their
+ * 		block: only the block maps are written, a later write to either
+ * 		file copies the block it changes. Both inodes are written back.
+ * 		The two inodes can be the same one (the ranges must not overlap).
+ *
+ * Return: number of bytes copied (0 at the end of the source) or a
+ * 		negative error if nothing was copied
+ */
+ssize_t copy_file_data(int fd,
+					   struct uwufs_inode *in_inode,
+					   uwufs_blk_t in_inode_num,
+					   off_t in_offset,
+					   struct uwufs_inode *out_inode,
+					   uwufs_blk_t out_inode_num,
+					   off_t out_offset,
+					   size_t length,
+					   bool reflink);
 
 #endif
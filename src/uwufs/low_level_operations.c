@@ -7,6 +7,8 @@
 #include "uwufs.h"
 
 #include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
@@ -18,15 +20,122 @@
 
 #include "cpp/c_api.h"
 
+/**
+ * Locks that make the operations below safe to call from several threads
+ * 		(they never call back into code that takes other locks).
+ *
+ * `__alloc_lock`: freelist and the free blk counter (`__super`)
+ * `__ialloc_lock`: free inode search + claiming the inodes it finds
+ * `__ilist_locks`: read-modify-write of an ilist blk in write_inode
+ * 		(several inodes share one blk), picked by blk number
+ * `__magazine.lock`: taken before `__alloc_lock`/`__ialloc_lock`, never
+ * 		two magazines at once except in read_free_counts (in order)
+ * `__tail_lock`: read-modify-write of the tail blks, taken before the
+ * 		others (the tail blks are allocated and freed under it)
+ */
+#define UWUFS_ILIST_LOCKS		64
+
+static pthread_mutex_t __tail_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t __alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t __ialloc_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t __ilist_locks[UWUFS_ILIST_LOCKS];
+
+/**
+ * Allocation caches (see alloc_cache_start): free blks and claimed
+ * 		inodes taken from the super blk in batches, one magazine per
+ * 		cpu so concurrent allocations don't all wait on `__alloc_lock`
+ * 		and rewrite blk 0.
+ *
+ * Blks in a magazine are off the freelist, inodes in a magazine are
+ * 		claimed on disk (like find_free_inode does), so the super blk
+ * 		counters don't include them: read_free_counts adds them back.
+ */
+#define UWUFS_MAGAZINES			16
+#define UWUFS_MAGAZINE_BLKS		64	// refilled/returned half at a time
+#define UWUFS_MAGAZINE_INODES	16	// one ilist blk worth with 4K blks
+
+struct __magazine {
+	pthread_mutex_t lock;
+	size_t nblks;
+	uwufs_blk_t blks[UWUFS_MAGAZINE_BLKS];
+	size_t ninodes;
+	uwufs_blk_t inodes[UWUFS_MAGAZINE_INODES];
+};
+
+static struct __magazine __magazines[UWUFS_MAGAZINES];
+static bool __alloc_cache_on = false;
+// ilist blk the next free inode search starts at
+static uwufs_blk_t __ialloc_rotor = 0;
+static pthread_once_t __locks_once = PTHREAD_ONCE_INIT;
+
+/**
+ * In-memory super blk (see mount_super_blk). While mounted, the freelist
+ * 		head and the free counters only change in memory and
+ * 		sync_super_blk writes them back. Otherwise (mkfs, tests) every
+ * 		allocation reads and writes blk 0 itself.
+ *
+ * `__super` is guarded by `__alloc_lock`. The free inode count is kept
+ * 		apart in `__free_inodes` and updated atomically by write_inode
+ * 		(it sees every change of file type) and __claim_free_inodes.
+ */
+static struct uwufs_super_blk __super;
+static bool __super_mounted = false;
+static uint64_t __free_inodes = 0;
+// __super.free_blks_left readable without `__alloc_lock` (check_free_blks)
+static uwufs_blk_t __free_blks_hint = 0;
+
+static void __init_locks(void)
+{
+	int i;
+	for (i = 0; i < UWUFS_ILIST_LOCKS; i++)
+		pthread_mutex_init(&__ilist_locks[i], NULL);
+	for (i = 0; i < UWUFS_MAGAZINES; i++)
+		pthread_mutex_init(&__magazines[i].lock, NULL);
+}
+
+static ssize_t __pop_free_blks(int fd, uwufs_blk_t *blks, size_t n);
+static ssize_t __push_free_blks(int fd, const uwufs_blk_t *blks, size_t n);
+static ssize_t __claim_free_inodes(int fd, uwufs_blk_t *inode_nums, size_t n);
+
+static pthread_mutex_t *__ilist_lock(uwufs_blk_t inode_blk_num)
+{
+	pthread_once(&__locks_once, __init_locks);
+	return &__ilist_locks[inode_blk_num % UWUFS_ILIST_LOCKS];
+}
+
+static struct __magazine *__magazine(void)
+{
+	int cpu = sched_getcpu();
+	pthread_once(&__locks_once, __init_locks);
+	return &__magazines[(cpu < 0 ? 0 : cpu) % UWUFS_MAGAZINES];
+}
+
+/**
+ * Brings `__super` up to date before the caller changes it, and writes
+ * 		the change back after, when the super blk isn't mounted.
+ * 		The caller holds `__alloc_lock`.
+ */
+static ssize_t __super_get(int fd)
+{
+	return __super_mounted ? 0 : read_blk(fd, &__super, 0);
+}
+
+static ssize_t __super_put(int fd)
+{
+	__atomic_store_n(&__free_blks_hint, __super.free_blks_left,
+					 __ATOMIC_RELAXED);
+	return __super_mounted ? 0 : write_blk(fd, &__super, 0);
+}
+
+// pread/pwrite: threads must not share the file offset of the device
 ssize_t read_blk(int fd, void* buf, uwufs_blk_t blk_num)
 {
-	ssize_t status = lseek(fd, blk_num * UWUFS_BLOCK_SIZE, SEEK_SET);
-	if (status < 0) {
-		// printf("read_blk lseek error %lu\n", blk_num);
-		goto debug_msg_ret;
-	}
+	// metadata blks written since the last checkpoint
+	if (journal_read_blk(buf, blk_num))
+		return UWUFS_BLOCK_SIZE;
 
-	status = read(fd, buf, UWUFS_BLOCK_SIZE);
+	ssize_t status = pread(fd, buf, UWUFS_BLOCK_SIZE,
+						   (off_t)blk_num * UWUFS_BLOCK_SIZE);
 	if (status < 0) {
 		// printf("read_blk read error %lu\n", blk_num);
 		goto debug_msg_ret;
@@ -47,12 +156,8 @@ ssize_t write_blk(int fd,
 				  uwufs_blk_t blk_num)
 {
 
-	off_t offset = blk_num * UWUFS_BLOCK_SIZE;
-	ssize_t status = lseek(fd, offset, SEEK_SET);
-	if (status < 0)
-		goto debug_msg_ret;
-
-	status = write(fd, buf, UWUFS_BLOCK_SIZE);
+	off_t offset = (off_t)blk_num * UWUFS_BLOCK_SIZE;
+	ssize_t status = pwrite(fd, buf, UWUFS_BLOCK_SIZE, offset);
 	if (status != UWUFS_BLOCK_SIZE)
 		goto debug_msg_ret;
 
@@ -65,6 +170,176 @@ debug_msg_ret:
 	return status;
 }
 
+ssize_t write_blks(int fd,
+				   const void* buf,
+				   uwufs_blk_t blk_num,
+				   uwufs_blk_t n)
+{
+	const char *pos = (const char *)buf;
+	size_t left = (size_t)n * UWUFS_BLOCK_SIZE;
+	off_t offset = (off_t)blk_num * UWUFS_BLOCK_SIZE;
+	ssize_t status;
+
+	while (left > 0) {
+		status = pwrite(fd, pos, left, offset);
+		if (status < 0 && errno == EINTR)
+			continue;
+		if (status <= 0) {
+			status = status < 0 ? -errno : -EIO;
+			goto debug_msg_ret;
+		}
+		pos += status;
+		offset += status;
+		left -= status;
+	}
+	return (ssize_t)n * UWUFS_BLOCK_SIZE;
+
+debug_msg_ret:
+#ifdef DEBUG
+	printf("write_blks error: %s\n", strerror(-status));
+#endif
+	return status;
+}
+
+ssize_t read_blks(int fd,
+				  void* buf,
+				  uwufs_blk_t blk_num,
+				  uwufs_blk_t n)
+{
+	char *pos = (char *)buf;
+	size_t left = (size_t)n * UWUFS_BLOCK_SIZE;
+	off_t offset = (off_t)blk_num * UWUFS_BLOCK_SIZE;
+	ssize_t status;
+
+	while (left > 0) {
+		status = pread(fd, pos, left, offset);
+		if (status < 0 && errno == EINTR)
+			continue;
+		if (status <= 0) {
+			status = status < 0 ? -errno : -EIO;
+			goto debug_msg_ret;
+		}
+		pos += status;
+		offset += status;
+		left -= status;
+	}
+	return (ssize_t)n * UWUFS_BLOCK_SIZE;
+
+debug_msg_ret:
+#ifdef DEBUG
+	printf("read_blks error: %s\n", strerror(-status));
+#endif
+	return status;
+}
+
+ssize_t splice_blks(int fd,
+					int pipe_fd,
+					uwufs_blk_t blk_num,
+					uwufs_blk_t n)
+{
+	char bounce[UWUFS_MAX_BLOCK_SIZE];
+	size_t left = (size_t)n * UWUFS_BLOCK_SIZE;
+	loff_t offset = (loff_t)blk_num * UWUFS_BLOCK_SIZE;
+	bool can_splice = true;
+	ssize_t status;
+
+	while (left > 0) {
+		if (can_splice) {
+			status = splice(pipe_fd, NULL, fd, &offset, left, SPLICE_F_MOVE);
+			if (status < 0 && errno == EINVAL) {
+				can_splice = false;
+				continue;
+			}
+		} else {
+			status = read(pipe_fd, bounce,
+						  left < sizeof(bounce) ? left : sizeof(bounce));
+			if (status > 0) {
+				size_t len = status;
+				status = pwrite(fd, bounce, len, offset);
+				if (status >= 0 && (size_t)status != len)
+					status = 0;
+				if (status > 0)
+					offset += status;
+			}
+		}
+		if (status < 0 && errno == EINTR)
+			continue;
+		if (status <= 0) {
+			status = status < 0 ? -errno : -EIO;
+			goto debug_msg_ret;
+		}
+		left -= status;
+	}
+	return (ssize_t)n * UWUFS_BLOCK_SIZE;
+
+debug_msg_ret:
+#ifdef DEBUG
+	printf("splice_blks error: %s\n", strerror(-status));
+#endif
+	return status;
+}
+
+int prefetch_blks(int fd, uwufs_blk_t blk_num, uwufs_blk_t n)
+{
+	int status = posix_fadvise(fd, (off_t)blk_num * UWUFS_BLOCK_SIZE,
+							   (off_t)n * UWUFS_BLOCK_SIZE,
+							   POSIX_FADV_WILLNEED);
+#ifdef DEBUG
+	if (status != 0)
+		printf("prefetch_blks error: %s\n", strerror(status));
+#endif
+	return -status;
+}
+
+ssize_t write_meta_blk(int fd, const void* buf, uwufs_blk_t blk_num)
+{
+	if (journal_write_blk(buf, blk_num))
+		return UWUFS_BLOCK_SIZE;
+	return write_blk(fd, buf, blk_num);
+}
+
+/**
+ * Device flushes (see flush_device). `__flushes_started` counts the
+ * 		fdatasyncs that were started, `__flushed` is the number of the
+ * 		last one that succeeded. Both only change under `__flush_lock`.
+ */
+static pthread_mutex_t __flush_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t __flushes_started = 0;
+static uint64_t __flushed = 0;
+
+uint64_t flush_ticket(void)
+{
+	return __atomic_load_n(&__flushes_started, __ATOMIC_ACQUIRE);
+}
+
+ssize_t flush_device(int fd, uint64_t ticket)
+{
+	ssize_t status = 0;
+	uint64_t n;
+
+	pthread_mutex_lock(&__flush_lock);
+	// a flush started after the ticket was taken covers the caller's
+	// writes: the callers that waited for the lock during one flush
+	// all share the next one
+	if (__flushed > ticket)
+		goto unlock_ret;
+
+	n = __flushes_started + 1;
+	__atomic_store_n(&__flushes_started, n, __ATOMIC_RELEASE);
+	if (fdatasync(fd) < 0) {
+		status = -errno;
+#ifdef DEBUG
+		perror("flush_device error");
+#endif
+		goto unlock_ret;
+	}
+	__flushed = n;
+
+unlock_ret:
+	pthread_mutex_unlock(&__flush_lock);
+	return status;
+}
+
 ssize_t read_inode(int fd, void* buf, uwufs_blk_t inode_num)
 {
 	// TEMP: Should read from superblock of the ilist_start for 
@@ -87,10 +362,68 @@ ssize_t read_inode(int fd, void* buf, uwufs_blk_t inode_num)
 									% UWUFS_BLOCK_SIZE;
 	inode_num_in_blk /= sizeof(struct uwufs_inode);
 	memcpy(buf, &inode_blk.inodes[inode_num_in_blk], sizeof(struct uwufs_inode));
+	lazytime_apply(inode_num, (struct uwufs_inode *)buf);
 
 	return sizeof(struct uwufs_inode);
 }
 
+static uwufs_blk_t __inode_blk_num(uwufs_blk_t inode_num)
+{
+	// TEMP: Hard coded (same as read_inode)
+	return 1 + UWUFS_RESERVED_SPACE +
+		(inode_num * sizeof(struct uwufs_inode)) / UWUFS_BLOCK_SIZE;
+}
+
+static int __cmp_inode_num(const void *a, const void *b)
+{
+	uwufs_blk_t x = **(const uwufs_blk_t * const *)a;
+	uwufs_blk_t y = **(const uwufs_blk_t * const *)b;
+	return x < y ? -1 : x > y;
+}
+
+ssize_t read_inodes(int fd,
+					struct uwufs_inode *inodes,
+					const uwufs_blk_t *inode_nums,
+					size_t n)
+{
+	const size_t inodes_per_blk = UWUFS_BLOCK_SIZE / sizeof(struct uwufs_inode);
+	struct uwufs_inode_blk inode_blk;
+	uwufs_blk_t cur_blk_num = 0;
+	ssize_t status;
+	size_t i;
+
+	if (n == 0)
+		return 0;
+
+	// Visit the inodes in ilist order so every ilist blk is read once
+	// and the reads go forward on the device
+	const uwufs_blk_t **order = (const uwufs_blk_t **)malloc(n * sizeof(*order));
+	if (order == NULL)
+		return -ENOMEM;
+	for (i = 0; i < n; i++)
+		order[i] = &inode_nums[i];
+	qsort(order, n, sizeof(*order), __cmp_inode_num);
+
+	for (i = 0; i < n; i++) {
+		uwufs_blk_t inode_num = *order[i];
+		uwufs_blk_t blk_num = __inode_blk_num(inode_num);
+		if (blk_num != cur_blk_num) {
+			status = read_blk(fd, &inode_blk, blk_num);
+			if (status < 0) {
+				free(order);
+				return status;
+			}
+			cur_blk_num = blk_num;
+		}
+		inodes[order[i] - inode_nums] =
+			inode_blk.inodes[inode_num % inodes_per_blk];
+		lazytime_apply(inode_num, &inodes[order[i] - inode_nums]);
+	}
+
+	free(order);
+	return n;
+}
+
 ssize_t write_inode(int fd,
 					const void* buf,
 					size_t size,
@@ -104,6 +437,10 @@ ssize_t write_inode(int fd,
 
 	uwufs_blk_t inode_num_in_blk;
 	struct uwufs_inode_blk inode_blk;
+	struct uwufs_inode old_inode;
+	bool was_free, is_free;
+	pthread_mutex_t *ilist_lock = __ilist_lock(inode_blk_num);
+	pthread_mutex_lock(ilist_lock);
 	ssize_t status = read_blk(fd, &inode_blk, inode_blk_num);
 	if (status < 0)
 		goto debug_msg_ret;
@@ -112,67 +449,192 @@ ssize_t write_inode(int fd,
 									% UWUFS_BLOCK_SIZE;
 	inode_num_in_blk /= sizeof(struct uwufs_inode);
 
+	old_inode = inode_blk.inodes[inode_num_in_blk];
 	memcpy(&inode_blk.inodes[inode_num_in_blk], buf, size);
 
-	status = write_blk(fd, &inode_blk, inode_blk_num);
+	status = write_meta_blk(fd, &inode_blk, inode_blk_num);
 	if (status < 0)
 		goto debug_msg_ret;
 
+	was_free = (old_inode.file_mode & F_TYPE_BITS) == F_TYPE_FREE;
+	is_free = (inode_blk.inodes[inode_num_in_blk].file_mode & F_TYPE_BITS)
+		== F_TYPE_FREE;
+	if (__super_mounted && was_free != is_free)
+		__atomic_fetch_add(&__free_inodes, is_free ? 1 : -1,
+						   __ATOMIC_RELAXED);
+
+	// keep the in-memory inode of open files in sync
+	itable_inode_written(inode_num, &old_inode,
+						 &inode_blk.inodes[inode_num_in_blk]);
+	// the caller's copy has the lazy timestamps (see read_inode)
+	lazytime_written(inode_num);
+
+	pthread_mutex_unlock(ilist_lock);
 	return status;
 
 debug_msg_ret:
+	pthread_mutex_unlock(ilist_lock);
 #ifdef DEBUG
 	perror("write_inode error");
 #endif
 	return status;
 }
 
+ssize_t touch_inode(int fd,
+					const struct uwufs_inode *inode,
+					uwufs_blk_t inode_num)
+{
+	if (!lazytime_update(inode_num, inode))
+		return write_inode(fd, inode, sizeof(*inode), inode_num);
+	// nothing but the timestamps changed
+	itable_inode_written(inode_num, inode, inode);
+	return sizeof(*inode);
+}
+
+/**
+ * Takes one blk (`inode` false) or one inode from any magazine, for when
+ * 		the super blk ran out but other cpus still have some cached.
+ */
+static ssize_t __steal_from_magazines(uwufs_blk_t *num, bool inode)
+{
+	struct __magazine *mag;
+	int i;
+
+	for (i = 0; i < UWUFS_MAGAZINES; i++) {
+		mag = &__magazines[i];
+		pthread_mutex_lock(&mag->lock);
+		if (inode && mag->ninodes > 0) {
+			*num = mag->inodes[--mag->ninodes];
+			pthread_mutex_unlock(&mag->lock);
+			return 0;
+		}
+		if (!inode && mag->nblks > 0) {
+			*num = mag->blks[--mag->nblks];
+			pthread_mutex_unlock(&mag->lock);
+			return 0;
+		}
+		pthread_mutex_unlock(&mag->lock);
+	}
+	return inode ? -EDQUOT : -ENOSPC;
+}
+
+static ssize_t __malloc_blk(int fd, uwufs_blk_t *blk_num)
+{
+	struct __magazine *mag;
+	ssize_t status;
+
+	if (!__alloc_cache_on) {
+		pthread_mutex_lock(&__alloc_lock);
+		status = __pop_free_blks(fd, blk_num, 1);
+		pthread_mutex_unlock(&__alloc_lock);
+		return status < 0 ? status : 0;
+	}
+
+	mag = __magazine();
+	pthread_mutex_lock(&mag->lock);
+	if (mag->nblks == 0) {
+		// only fill half so the next free_blk doesn't return a batch
+		pthread_mutex_lock(&__alloc_lock);
+		status = __pop_free_blks(fd, mag->blks, UWUFS_MAGAZINE_BLKS / 2);
+		pthread_mutex_unlock(&__alloc_lock);
+		if (status < 0) {
+			pthread_mutex_unlock(&mag->lock);
+			if (status == -ENOSPC)
+				return __steal_from_magazines(blk_num, false);
+			return status;
+		}
+		mag->nblks = status;
+	}
+	*blk_num = mag->blks[--mag->nblks];
+	pthread_mutex_unlock(&mag->lock);
+	return 0;
+}
+
 ssize_t malloc_blk(int fd, uwufs_blk_t *blk_num)
 {
-	// Read super blk for freelist head
-	struct uwufs_super_blk super_blk;
-	struct uwufs_free_data_blk free_blk;
-	uwufs_blk_t freelist_head;
+	ssize_t status = __malloc_blk(fd, blk_num);
 
-	ssize_t status = read_blk(fd, &super_blk, 0);
-	if (status < 0)
-		goto debug_msg_ret;
+	// the blks freed since the last checkpoint count as free space (see
+	// read_free_counts) but only come back with a checkpoint
+	if (status == -ENOSPC && journal_reclaim_frees())
+		status = __malloc_blk(fd, blk_num);
+	return status;
+}
 
-	if (super_blk.free_blks_left == 0)
-		return -ENOSPC;
+static ssize_t __malloc_blks(int fd, uwufs_blk_t *blk_nums, size_t n)
+{
+	ssize_t status;
 
-	freelist_head = super_blk.freelist_head;
+	pthread_mutex_lock(&__alloc_lock);
+	status = __pop_free_blks(fd, blk_nums, n);
+	pthread_mutex_unlock(&__alloc_lock);
+	// the freelist ran out but the magazines may still have some
+	if (status == -ENOSPC && __alloc_cache_on) {
+		status = __steal_from_magazines(blk_nums, false);
+		return status < 0 ? status : 1;
+	}
+	return status;
+}
 
-	if (freelist_head <= 0)
-		return -ENOSPC;
+ssize_t malloc_blks(int fd, uwufs_blk_t *blk_nums, size_t n)
+{
+	ssize_t status = __malloc_blks(fd, blk_nums, n);
+
+	if (status == -ENOSPC && journal_reclaim_frees())
+		status = __malloc_blks(fd, blk_nums, n);
+	return status;
+}
 
-	// Updated freelist head to point to next free data block
-	status = read_blk(fd, &free_blk, freelist_head);
+/**
+ * Takes up to `n` blks off the freelist with a single super blk update.
+ * 		The caller holds `__alloc_lock`.
+ *
+ * Return: number of blks taken (at least 1) or a negative error
+ */
+static ssize_t __pop_free_blks(int fd, uwufs_blk_t *blks, size_t n)
+{
+	struct uwufs_free_data_blk free_blk;
+	uwufs_blk_t freelist_head;
+	size_t i;
+
+	ssize_t status = __super_get(fd);
 	if (status < 0)
 		goto debug_msg_ret;
 
+	for (i = 0; i < n && __super.free_blks_left > 0; i++) {
+		freelist_head = __super.freelist_head;
+		if (freelist_head <= 0)
+			break;
+
+		// Updated freelist head to point to next free data block
+		status = read_blk(fd, &free_blk, freelist_head);
+		if (status < 0)
+			break;
+
 #ifdef DEBUG
-	// unless the volume is out of space
-	printf("malloc_blk: freelist head %lu\n", freelist_head);
-	assert(free_blk.next_free_blk != 0);
+		// unless the volume is out of space
+		printf("malloc_blk: freelist head %lu\n", freelist_head);
+		assert(free_blk.next_free_blk != 0);
 #endif
-	super_blk.freelist_head = free_blk.next_free_blk;
-	super_blk.free_blks_left -= 1;
-	
-	if (free_blk.next_free_blk > (super_blk.freelist_start + super_blk.freelist_total_size)) {
+		if (free_blk.next_free_blk > (__super.freelist_start + __super.freelist_total_size)) {
 #ifdef DEBUG
-		printf("The next freelist_head is garbage data/out of range\n");
+			printf("The next freelist_head is garbage data/out of range\n");
 #endif
-		return -EIO;
+			status = -EIO;
+			break;
+		}
+		__super.freelist_head = free_blk.next_free_blk;
+		__super.free_blks_left -= 1;
+		blks[i] = freelist_head;
 	}
-	
-	status = write_blk(fd, &super_blk, 0);
+	if (i == 0)
+		return status < 0 ? status : -ENOSPC;
+
+	status = __super_put(fd);
 	if (status < 0)
 		goto debug_msg_ret;
 
-	// Return malloc'd block
-	*blk_num = freelist_head;
-	return 0;
+	return i;
 
 debug_msg_ret:
 #ifdef DEBUG
@@ -183,54 +645,263 @@ debug_msg_ret:
 
 ssize_t free_blk(int fd, const uwufs_blk_t blk_num)
 {
+	struct __magazine *mag;
+	const size_t half = UWUFS_MAGAZINE_BLKS / 2;
+	ssize_t status;
+
 #ifdef DEBUG
-	printf("in free_blk\n");
 	if (blk_num == 0) {
 		printf("free_blk 0!!!\n");
 	}
 	assert(blk_num != 0);
-	struct uwufs_free_data_blk free_blk;
-	uwufs_blk_t old_head;
 #endif
-	struct uwufs_super_blk super_blk;
+	// back to the allocator at the next journal checkpoint
+	if (journal_defer_free(blk_num))
+		return 0;
+
+	if (!__alloc_cache_on) {
+		pthread_mutex_lock(&__alloc_lock);
+		status = __push_free_blks(fd, &blk_num, 1);
+		pthread_mutex_unlock(&__alloc_lock);
+		return status < 0 ? status : 0;
+	}
+
+	mag = __magazine();
+	pthread_mutex_lock(&mag->lock);
+	if (mag->nblks == UWUFS_MAGAZINE_BLKS) {
+		// give the older half back, the newer half is still warm
+		pthread_mutex_lock(&__alloc_lock);
+		status = __push_free_blks(fd, mag->blks, half);
+		pthread_mutex_unlock(&__alloc_lock);
+		if (status < 0) {
+			pthread_mutex_unlock(&mag->lock);
+			return status;
+		}
+		mag->nblks -= status;
+		memmove(mag->blks, mag->blks + status,
+				mag->nblks * sizeof(mag->blks[0]));
+	}
+	mag->blks[mag->nblks++] = blk_num;
+	pthread_mutex_unlock(&mag->lock);
+	return 0;
+}
+
+ssize_t release_data_blk(int fd, uwufs_blk_t entry)
+{
+	uwufs_blk_t blk_num = UWUFS_BLK_NUM(entry);
+
+	if ((entry & UWUFS_BLK_SHARED) && !blk_ref_release(blk_num))
+		return 0; // other files have it
+	return free_blk(fd, blk_num);
+}
+
+/**
+ * Sets a UWUFS_FEATURE_* flag of the super blk
+ */
+static ssize_t __mark_feature(int fd, uwufs_blk_t feature)
+{
+	ssize_t status;
+
+	pthread_mutex_lock(&__alloc_lock);
+	status = __super_get(fd);
+	if (status >= 0 && !(__super.features & feature)) {
+		__super.features |= feature;
+		status = __super_put(fd);
+	}
+	pthread_mutex_unlock(&__alloc_lock);
+	return status < 0 ? status : 0;
+}
+
+ssize_t mark_shared_blks(int fd)
+{
+	return __mark_feature(fd, UWUFS_FEATURE_SHARED_BLKS);
+}
+
+/**
+ * Largest free run of the data area of `tail_blk`, 0 if its fragment
+ * 		index is full. If `size` is not 0, `*offset` is set to the start
+ * 		of the first free run of at least `size` bytes (0 if none).
+ */
+static size_t __tail_blk_free(const struct uwufs_tail_blk *tail_blk,
+							  size_t size, uint16_t *offset)
+{
+	size_t starts[UWUFS_TAIL_FRAGS];
+	size_t ends[UWUFS_TAIL_FRAGS];
+	size_t pos = UWUFS_TAIL_DATA_OFFSET;
+	size_t largest = 0;
+	size_t n = 0;
+	size_t i, j;
+	bool full = true;
+
+	if (size > 0)
+		*offset = 0;
+	// the fragments in the order of their offsets (insertion sort)
+	for (i = 0; i < UWUFS_TAIL_FRAGS; i++) {
+		const struct uwufs_tail_frag *frag = &tail_blk->frags[i];
+		if (frag->inode_num == 0) {
+			full = false;
+			continue;
+		}
+		for (j = n; j > 0 && starts[j - 1] > frag->offset; j--) {
+			starts[j] = starts[j - 1];
+			ends[j] = ends[j - 1];
+		}
+		starts[j] = frag->offset;
+		ends[j] = frag->offset + frag->size;
+		n++;
+	}
+	if (full)
+		return 0;
+
+	for (i = 0; i <= n; i++) {
+		size_t end = i < n ? starts[i] : UWUFS_BLOCK_SIZE;
+		size_t gap = end > pos ? end - pos : 0;
+		if (size > 0 && *offset == 0 && gap >= size)
+			*offset = pos;
+		if (gap > largest)
+			largest = gap;
+		if (i < n && ends[i] > pos)
+			pos = ends[i];
+	}
+	return largest;
+}
+
+ssize_t malloc_tail_frag(int fd,
+						 uwufs_blk_t inode_num,
+						 const void *data,
+						 size_t size,
+						 uwufs_blk_t *blk_num,
+						 uint16_t *offset)
+{
+	struct uwufs_tail_blk tail_blk;
+	bool new_blk = false;
+	ssize_t status;
+	size_t i;
+
+	if (size == 0 || size > UWUFS_TAIL_MAX_SIZE)
+		return -EINVAL;
+
+	pthread_mutex_lock(&__tail_lock);
+	*offset = 0;
+	while (tail_blk_find(size, blk_num)) {
+		status = read_blk(fd, &tail_blk, *blk_num);
+		if (status < 0)
+			goto unlock_ret;
+		__tail_blk_free(&tail_blk, size, offset);
+		if (*offset != 0)
+			break;
+		// measured wrong: fix it, the blk won't be found again
+		tail_blk_update(*blk_num, __tail_blk_free(&tail_blk, 0, NULL));
+	}
+	if (*offset == 0) {
+		status = __mark_feature(fd, UWUFS_FEATURE_TAIL_BLKS);
+		if (status < 0)
+			goto unlock_ret;
+		status = malloc_blk(fd, blk_num);
+		if (status < 0)
+			goto unlock_ret;
+		new_blk = true;
+		memset(&tail_blk, 0, UWUFS_BLOCK_SIZE);
+		*offset = UWUFS_TAIL_DATA_OFFSET;
+	}
+
+	// a blk with room has a free entry
+	for (i = 0; tail_blk.frags[i].inode_num != 0; i++)
+		;
+	tail_blk.frags[i].inode_num = inode_num;
+	tail_blk.frags[i].offset = *offset;
+	tail_blk.frags[i].size = size;
+	memcpy((char *)&tail_blk + *offset, data, size);
+	status = write_meta_blk(fd, &tail_blk, *blk_num);
+	if (status < 0) {
+		if (new_blk)
+			free_blk(fd, *blk_num);
+		goto unlock_ret;
+	}
+	tail_blk_update(*blk_num, __tail_blk_free(&tail_blk, 0, NULL));
+	status = 0;
+
+unlock_ret:
+	pthread_mutex_unlock(&__tail_lock);
+	return status;
+}
+
+ssize_t free_tail_frag(int fd,
+					   uwufs_blk_t inode_num,
+					   uwufs_blk_t blk_num,
+					   uint16_t offset)
+{
+	struct uwufs_tail_blk tail_blk;
+	bool empty = true;
+	ssize_t status;
+	size_t i;
+
+	pthread_mutex_lock(&__tail_lock);
+	status = read_blk(fd, &tail_blk, blk_num);
+	if (status < 0)
+		goto unlock_ret;
+	for (i = 0; i < UWUFS_TAIL_FRAGS; i++) {
+		struct uwufs_tail_frag *frag = &tail_blk.frags[i];
+		if (frag->inode_num == inode_num && frag->offset == offset) {
+			memset((char *)&tail_blk + frag->offset, 0, frag->size);
+			memset(frag, 0, sizeof(*frag));
+		} else if (frag->inode_num != 0) {
+			empty = false;
+		}
+	}
+
+	if (empty) {
+		tail_blk_update(blk_num, 0);
+		status = free_blk(fd, blk_num);
+		goto unlock_ret;
+	}
+	status = write_meta_blk(fd, &tail_blk, blk_num);
+	if (status < 0)
+		goto unlock_ret;
+	tail_blk_update(blk_num, __tail_blk_free(&tail_blk, 0, NULL));
+	status = 0;
+
+unlock_ret:
+	pthread_mutex_unlock(&__tail_lock);
+	return status;
+}
+
+/**
+ * Puts `n` blks back on the freelist with a single super blk update.
+ * 		The caller holds `__alloc_lock`.
+ *
+ * Return: number of blks returned (the first ones of `blks`, at least 1)
+ * 		or a negative error
+ */
+static ssize_t __push_free_blks(int fd, const uwufs_blk_t *blks, size_t n)
+{
 	struct uwufs_free_data_blk new_freelist_head;
-	ssize_t status = read_blk(fd, &super_blk, 0);
+	size_t i;
+	ssize_t status = __super_get(fd);
 	if (status < 0)
 		goto debug_msg_ret;
 
-	// memset(&new_freelist_head, 0, UWUFS_BLOCK_SIZE);
+	memset(&new_freelist_head, 0, UWUFS_BLOCK_SIZE);
 
 #ifdef DEBUG
-	assert(super_blk.freelist_head != 0);
+	assert(__super.freelist_head != 0);
 #endif
-	new_freelist_head.next_free_blk = super_blk.freelist_head;
-#ifdef DEBUG
-	old_head = super_blk.freelist_head;
-	assert(new_freelist_head.next_free_blk != 0);
-#endif
-	super_blk.freelist_head = blk_num;
-	super_blk.free_blks_left += 1;
-
-	status = write_blk(fd, &new_freelist_head, blk_num);
-	if (status < 0)
+	for (i = 0; i < n; i++) {
+		new_freelist_head.next_free_blk = __super.freelist_head;
+		status = write_blk(fd, &new_freelist_head, blks[i]);
+		if (status < 0)
+			break;
+		__super.freelist_head = blks[i];
+		__super.free_blks_left += 1;
+	}
+	if (i == 0)
 		goto debug_msg_ret;
 
-	status = write_blk(fd, &super_blk, 0);
+	status = __super_put(fd);
 	if (status < 0)
 		goto debug_msg_ret;
 
-#ifdef DEBUG
-	// Read superblock and verify it's correctly set
-	status = read_blk(fd, &super_blk, 0);
-	assert(super_blk.freelist_head != 0);
-	status = read_blk(fd, &free_blk, super_blk.freelist_head);
-	assert(free_blk.next_free_blk != 0);
-	assert(free_blk.next_free_blk == old_head);
-	status = read_blk(fd, &free_blk, free_blk.next_free_blk);
-	assert(free_blk.next_free_blk != 0);
-#endif
-
-	return 0;
+	return i;
 
 debug_msg_ret:
 #ifdef DEBUG
@@ -240,58 +911,122 @@ debug_msg_ret:
 }
 
 
-ssize_t find_free_inode(int fd, uwufs_blk_t *inode_num) {
-    // buffers for inode blk and inode
-    struct uwufs_inode_blk inode_blk;
-    struct uwufs_inode inode;
-    uwufs_blk_t current_inode_blk;
-	
-	// read superblk for ilist start & size
+ssize_t find_free_inode(int fd, uwufs_blk_t *inode_num)
+{
+	struct __magazine *mag;
+	ssize_t status;
+
+	if (!__alloc_cache_on) {
+		pthread_mutex_lock(&__ialloc_lock);
+		status = __claim_free_inodes(fd, inode_num, 1);
+		pthread_mutex_unlock(&__ialloc_lock);
+		return status < 0 ? status : 0;
+	}
+
+	mag = __magazine();
+	pthread_mutex_lock(&mag->lock);
+	if (mag->ninodes == 0) {
+		pthread_mutex_lock(&__ialloc_lock);
+		status = __claim_free_inodes(fd, mag->inodes, UWUFS_MAGAZINE_INODES);
+		pthread_mutex_unlock(&__ialloc_lock);
+		if (status < 0) {
+			pthread_mutex_unlock(&mag->lock);
+			if (status == -EDQUOT)
+				return __steal_from_magazines(inode_num, true);
+			return status;
+		}
+		mag->ninodes = status;
+	}
+	*inode_num = mag->inodes[--mag->ninodes];
+	pthread_mutex_unlock(&mag->lock);
+	return 0;
+}
+
+ssize_t free_inode(int fd, uwufs_blk_t inode_num)
+{
+	struct uwufs_inode inode;
+	memset(&inode, 0, sizeof(inode));
+	inode.file_mode = F_TYPE_FREE;
+	ssize_t status = write_inode(fd, &inode, sizeof(inode), inode_num);
+	return status < 0 ? status : 0;
+}
+
+/**
+ * Claims up to `n` free inodes (written as unlinked regular files so no
+ * 		other search finds them). The search starts where the last one
+ * 		stopped and ends with the first ilist blk that has free inodes,
+ * 		so a claim is a single ilist blk write.
+ * 		The caller holds `__ialloc_lock`.
+ *
+ * Return: number of inodes claimed (at least 1) or a negative error
+ */
+static ssize_t __claim_free_inodes(int fd, uwufs_blk_t *inode_nums, size_t n)
+{
+	const size_t inodes_per_blk = UWUFS_BLOCK_SIZE / sizeof(struct uwufs_inode);
+	struct uwufs_inode_blk inode_blk;
 	struct uwufs_super_blk super_blk;
-	ssize_t status = read_blk(fd, &super_blk, 0);
+	uwufs_blk_t ilist_end;
+	uwufs_blk_t cur_blk;
+	uwufs_blk_t num;
+	pthread_mutex_t *ilist_lock;
+	size_t claimed = 0;
+	size_t scanned;
+	size_t i;
+
+	// read superblk for ilist start & size
+	ssize_t status = read_super_blk(fd, &super_blk);
 	if (status < 0)
 		goto debug_msg_ret;
-
-	// if (super_blk.free_inodes_left == 0)
-	// 	return -ENOSPC;
-	current_inode_blk = super_blk.ilist_start;
-
-    // read one inode block at a time 
-    while (current_inode_blk < 
-			(super_blk.ilist_start + super_blk.ilist_total_size)) 
-    {
-		status = read_blk(fd, &inode_blk, current_inode_blk);
-        if (status < 0) 
+	ilist_end = super_blk.ilist_start + super_blk.ilist_total_size;
+
+	for (scanned = 0; scanned < super_blk.ilist_total_size && claimed == 0;
+		 scanned++) {
+		if (__ialloc_rotor < super_blk.ilist_start ||
+			__ialloc_rotor >= ilist_end)
+			__ialloc_rotor = super_blk.ilist_start;
+		cur_blk = __ialloc_rotor;
+
+		ilist_lock = __ilist_lock(cur_blk);
+		pthread_mutex_lock(ilist_lock);
+		status = read_blk(fd, &inode_blk, cur_blk);
+		if (status < 0) {
+			pthread_mutex_unlock(ilist_lock);
 			goto debug_msg_ret;
+		}
 
-        int inodes_per_block = (UWUFS_BLOCK_SIZE / sizeof(struct uwufs_inode));
-
-        // check each inode in the inode block
-        for (int inode_in_blk = 0; inode_in_blk < inodes_per_block; 
-			inode_in_blk++) 
-		{
-			memcpy(&inode, &inode_blk.inodes[inode_in_blk], 
-					sizeof(struct uwufs_inode));
-
-            // found a free inode
-            if ((inode.file_mode & F_TYPE_BITS) == F_TYPE_FREE) {
-        
-                // calculate inode number and return
-                uwufs_blk_t num = (current_inode_blk - super_blk.ilist_start)
-                                    * inodes_per_block + inode_in_blk;
-				if (num < UWUFS_ROOT_DIR_INODE) {
-					continue; // don't assign inode numbers <0-1>
-				}
-                *inode_num = num; // assign inode number 
+		// check each inode in the inode block
+		for (i = 0; i < inodes_per_blk && claimed < n; i++) {
+			if ((inode_blk.inodes[i].file_mode & F_TYPE_BITS) != F_TYPE_FREE)
+				continue;
+			num = (cur_blk - super_blk.ilist_start) * inodes_per_blk + i;
+			if (num < UWUFS_ROOT_DIR_INODE)
+				continue; // don't assign inode numbers <0-1>
+
+			// allocated but not linked anywhere yet
+			memset(&inode_blk.inodes[i], 0, sizeof(struct uwufs_inode));
+			inode_blk.inodes[i].file_mode = F_TYPE_REGULAR;
+			inode_nums[claimed++] = num;
 #ifdef DEBUG
-				printf("Found free inode: %lu\n", *inode_num);
+			printf("Found free inode: %lu\n", num);
 #endif
-				return 0;
-            }
-        }
-        current_inode_blk++;
-    }
-    return -EDQUOT; // no free inodes
+		}
+		if (claimed > 0)
+			status = write_meta_blk(fd, &inode_blk, cur_blk);
+		pthread_mutex_unlock(ilist_lock);
+		if (status < 0)
+			goto debug_msg_ret;
+
+		// the blk may still have free inodes if `n` were claimed
+		if (claimed < n)
+			__ialloc_rotor = cur_blk + 1;
+	}
+	if (claimed == 0)
+		return -EDQUOT; // no free inodes
+
+	if (__super_mounted)
+		__atomic_fetch_sub(&__free_inodes, (uint64_t)claimed,
+						   __ATOMIC_RELAXED);
+	return claimed;
 
 debug_msg_ret:
 #ifdef DEBUG
@@ -300,21 +1035,133 @@ debug_msg_ret:
 	return status;
 }
 
+ssize_t alloc_cache_start(int fd)
+{
+	(void) fd;
+	pthread_once(&__locks_once, __init_locks);
+	__alloc_cache_on = true;
+	return 0;
+}
+
+ssize_t alloc_cache_stop(int fd)
+{
+	struct __magazine *mag;
+	ssize_t status = 0;
+	ssize_t ret = 0;
+	int i;
+
+	if (!__alloc_cache_on)
+		return 0;
+
+	for (i = 0; i < UWUFS_MAGAZINES; i++) {
+		mag = &__magazines[i];
+		pthread_mutex_lock(&mag->lock);
+		while (mag->nblks > 0) {
+			pthread_mutex_lock(&__alloc_lock);
+			status = __push_free_blks(fd, mag->blks, mag->nblks);
+			pthread_mutex_unlock(&__alloc_lock);
+			if (status < 0)
+				break;
+			mag->nblks -= status;
+			memmove(mag->blks, mag->blks + status,
+					mag->nblks * sizeof(mag->blks[0]));
+		}
+		if (status < 0)
+			ret = status;
+		// counted as freed by write_inode
+		while (mag->ninodes > 0) {
+			status = free_inode(fd, mag->inodes[mag->ninodes - 1]);
+			if (status < 0) {
+				ret = status;
+				break;
+			}
+			mag->ninodes--;
+		}
+		pthread_mutex_unlock(&mag->lock);
+	}
+
+	__alloc_cache_on = false;
+	return ret;
+}
+
+ssize_t check_free_blks(int fd, uwufs_blk_t n)
+{
+	uwufs_blk_t free_blks, free_inodes;
+	ssize_t status;
+
+	// the blks in the magazines only matter when the volume is nearly full
+	if (__super_mounted &&
+		__atomic_load_n(&__free_blks_hint, __ATOMIC_RELAXED) > n)
+		return 0;
+
+	status = read_free_counts(fd, &free_blks, &free_inodes);
+	if (status < 0)
+		return status;
+	// not counting the blks freed since the last checkpoint, they can only
+	// be allocated after one
+	if (free_blks <= n + journal_deferred_frees() &&
+		journal_deferred_frees() > 0 && journal_reclaim_frees()) {
+		status = read_free_counts(fd, &free_blks, &free_inodes);
+		if (status < 0)
+			return status;
+	}
+	return free_blks > n + journal_deferred_frees() ? 0 : -ENOSPC;
+}
+
+ssize_t read_free_counts(int fd,
+						 uwufs_blk_t *free_blks,
+						 uwufs_blk_t *free_inodes)
+{
+	ssize_t status;
+	int i;
+
+	// every magazine then the super blk, so no batch is counted twice
+	// (or not at all) while it moves between them
+	pthread_once(&__locks_once, __init_locks);
+	for (i = 0; i < UWUFS_MAGAZINES; i++)
+		pthread_mutex_lock(&__magazines[i].lock);
+	pthread_mutex_lock(&__alloc_lock);
+
+	status = __super_get(fd);
+	if (status >= 0) {
+		*free_blks = __super.free_blks_left;
+		*free_inodes = __super_mounted ?
+			__atomic_load_n(&__free_inodes, __ATOMIC_RELAXED) :
+			__super.free_inodes_left;
+		for (i = 0; i < UWUFS_MAGAZINES; i++) {
+			*free_blks += __magazines[i].nblks;
+			*free_inodes += __magazines[i].ninodes;
+		}
+		*free_blks += journal_deferred_frees();
+		status = 0;
+	}
+
+	pthread_mutex_unlock(&__alloc_lock);
+	for (i = UWUFS_MAGAZINES - 1; i >= 0; i--)
+		pthread_mutex_unlock(&__magazines[i].lock);
+	return status;
+}
+
 
 ssize_t next_inode_in_path(int fd,
-						   char *file_name, 
+						   const char *file_name,
 						   struct uwufs_inode* cur_inode,
 						   uwufs_blk_t *inode_num) {
 
 	struct uwufs_directory_data_blk dir_data_blk;
 	uwufs_blk_t dir_data_blk_num;
 	ssize_t status;
-	int num_entries = UWUFS_BLOCK_SIZE / sizeof(struct uwufs_directory_file_entry);
 	int n = (cur_inode->file_size + UWUFS_BLOCK_SIZE - 1) / UWUFS_BLOCK_SIZE;
+	size_t len = strlen(file_name);
+	uint32_t hash;
+
+	if (len == 0 || len >= UWUFS_FILE_NAME_SIZE)
+		return -ENOENT;
+	hash = uwufs_name_hash(file_name, len);
 
 	dblk_itr_t dblk_itr = create_dblk_itr(cur_inode, fd, 0);
 
-	int i, j;
+	int i;
 	for (i = 0; i < n; i++) {
 		dir_data_blk_num = dblk_itr_next(dblk_itr);
 		if (dir_data_blk_num == 0) {
@@ -325,20 +1172,16 @@ ssize_t next_inode_in_path(int fd,
 		if (status < 0) 
 			goto debug_msg_ret;
 
-		for (j = 0; j < num_entries; j++) {
-			if (dir_data_blk.file_entries[j].inode_num <= 0) {
-				continue;
-			}
-			if (strlen(file_name) > 0 &&
-				strcmp(dir_data_blk.file_entries[j].file_name, file_name) == 0) {
-				*inode_num = dir_data_blk.file_entries[j].inode_num;
+		status = find_directory_file_entry(&dir_data_blk, file_name, len,
+										   hash);
+		if (status >= 0) {
+			*inode_num = dir_data_blk.file_entries[status].inode_num;
 #ifdef DEBUG
-				// printf("\t\tResolved %s with inode number %lu\n", file_name,
-				// 	dir_data_blk.file_entries[j].inode_num);
+			// printf("\t\tResolved %s with inode number %lu\n", file_name,
+			// 	*inode_num);
 #endif
-				destroy_dblk_itr(dblk_itr);
-				return 0;
-			}
+			destroy_dblk_itr(dblk_itr);
+			return 0;
 		}
 	}
 	destroy_dblk_itr(dblk_itr);
@@ -359,82 +1202,445 @@ ssize_t namei(int fd,
 			  uwufs_blk_t *inode_num) {
 
 	uwufs_blk_t current_inode_number = UWUFS_ROOT_DIR_INODE;
+	uwufs_blk_t dir_inode_number;
+	struct uwufs_inode root_inode;
+	struct uwufs_inode dir_inode;
 	struct uwufs_inode current_inode; 
+	char name[UWUFS_FILE_NAME_SIZE];
+	char target[UWUFS_SYMLINK_MAX_SIZE + 1];
+	int links_followed = 0;
+	size_t len;
 	ssize_t status;
 
 	if (root_dir_inode != NULL) 
-		memcpy(&current_inode, root_dir_inode, sizeof(current_inode));
+		memcpy(&root_inode, root_dir_inode, sizeof(root_inode));
 	else {
-		status = read_inode(fd, &current_inode, current_inode_number);
+		status = read_inode(fd, &root_inode, current_inode_number);
 		if (status < 0) {
 			perror("Couldn't read root dir inode");
 			return status;
 		}
 	}
-
-	//since strtok can modify the original string, copy it
-	char full_path[strlen(path)];
-	strncpy(full_path, path, strlen(path)); 
-	full_path[strlen(path)] = '\0';
-	char* strtok_ptr;
-	char *path_segment;
-
-	path_segment = strtok_r(full_path, "/", &strtok_ptr);
-	while (path_segment != NULL) {
-		status = 0;
-		// check if path segment is < UWUFS_FILE_NAME_SIZE
-		if (strlen(path_segment) >= UWUFS_FILE_NAME_SIZE) {
-			printf("Path segment exceeds FILE_NAME_SIZE\n");
-			return -ENAMETOOLONG;
-		}
-
-		// regular file
-		if ((current_inode.file_mode & F_TYPE_BITS) == F_TYPE_REGULAR) {
-			path_segment = strtok_r(NULL, "/", &strtok_ptr);
-			
-			if (path_segment != NULL) 
-				return -ENOENT; // regular file found but not at leaf of path
+	memcpy(&current_inode, &root_inode, sizeof(current_inode));
+
+	// what is left to resolve: a symlink target replaces the name of the
+	// link in front of it, so links are followed in a loop (bounded by
+	// UWUFS_MAX_SYMLINKS) instead of recursively
+	char *rest = strdup(path);
+	if (rest == NULL)
+		return -ENOMEM;
+	char *path_segment = rest;
+
+	while (true) {
+		while (*path_segment == '/')
+			path_segment++;
+		if (*path_segment == '\0')
 			break;
+
+		len = strcspn(path_segment, "/");
+		if (len >= UWUFS_FILE_NAME_SIZE) {
+			status = -ENAMETOOLONG;
+			goto free_ret;
 		}
-		// directory
-		else if ((current_inode.file_mode & F_TYPE_BITS) == F_TYPE_DIRECTORY) {
-			status = next_inode_in_path(fd, path_segment, &current_inode,
-										&current_inode_number);
-			if (status == -ENOENT) // File does not exist
-				return status;
+		if ((current_inode.file_mode & F_TYPE_BITS) != F_TYPE_DIRECTORY) {
+			status = -ENOTDIR; // not at the leaf of the path
+			goto free_ret;
 		}
-		// symlink
-		// NOTE: Use readlink syscall later
-		// Also need to handle other file types in the future
-		else {
-			struct uwufs_regular_file_data_blk symlink_data;
-			// assumes symlink contents stored in first direct blk
-			read_blk(fd, &symlink_data, current_inode.direct_blks[0]); 
+		memcpy(name, path_segment, len);
+		name[len] = '\0';
+		path_segment += len;
 
-			char symlink_path[strlen(symlink_data.data)];
-			strncpy(symlink_path, symlink_data.data, strlen(symlink_data.data)); 
+		dir_inode_number = current_inode_number;
+		status = next_inode_in_path(fd, name, &current_inode,
+									&current_inode_number);
+		if (status < 0)
+			goto free_ret;
+		memcpy(&dir_inode, &current_inode, sizeof(dir_inode));
+		status = read_inode(fd, &current_inode, current_inode_number);
+		if (status < 0)
+			goto free_ret;
 
-			// start following the new path in the symlink
-			// TODO: maybe add an argument to namei() call that counts the # symlink
-			// 		to avoid recursively dereferencing more than MAX_SYMLINK times
-			status = namei(fd, symlink_path, root_dir_inode, &current_inode_number);
+		if ((current_inode.file_mode & F_TYPE_BITS) != F_TYPE_SYMLINK)
+			continue;
+		if (++links_followed > UWUFS_MAX_SYMLINKS) {
+			status = -ELOOP;
+			goto free_ret;
 		}
-
-		// have next inode num so read in next block & get next path segment
-		if (status < 0 || current_inode_number == 0)
-			goto debug_msg_ret;
-		status = read_inode(fd, &current_inode, current_inode_number);
+		status = read_symlink(fd, &current_inode, target);
 		if (status < 0)
-			goto debug_msg_ret;
-		path_segment = strtok_r(NULL, "/", &strtok_ptr);
+			goto free_ret;
+
+		char *next = (char *)malloc(status + strlen(path_segment) + 1);
+		if (next == NULL) {
+			status = -ENOMEM;
+			goto free_ret;
+		}
+		memcpy(next, target, status);
+		strcpy(next + status, path_segment);
+		free(rest);
+		rest = path_segment = next;
+
+		// an absolute target starts over from the root, a relative one
+		// from the directory that holds the link
+		if (target[0] == '/') {
+			current_inode_number = UWUFS_ROOT_DIR_INODE;
+			memcpy(&current_inode, &root_inode, sizeof(current_inode));
+		} else {
+			current_inode_number = dir_inode_number;
+			memcpy(&current_inode, &dir_inode, sizeof(current_inode));
+		}
 	}
 
 	*inode_num = current_inode_number;
+	free(rest);
 	return 0;
 
-debug_msg_ret:
+free_ret:
+	free(rest);
 #ifdef DEBUG
 	perror("namei error");
 #endif
 	return status;
 }
+
+// UWUFS_BLOCK_SIZE: 4096 until set_blk_size
+uint32_t uwufs_blk_size = 4096;
+
+ssize_t set_blk_size(uwufs_blk_t blk_size)
+{
+	if (!UWUFS_BLOCK_SIZE_SUPPORTED(blk_size))
+		return -EINVAL;
+	uwufs_blk_size = blk_size;
+	return 0;
+}
+
+ssize_t read_super_blk(int fd, struct uwufs_super_blk *super_blk)
+{
+	ssize_t status = 0;
+
+	pthread_mutex_lock(&__alloc_lock);
+	if (__super_mounted) {
+		*super_blk = __super;
+		super_blk->free_inodes_left = __atomic_load_n(&__free_inodes,
+													  __ATOMIC_RELAXED);
+	} else {
+		status = read_blk(fd, super_blk, 0);
+	}
+	pthread_mutex_unlock(&__alloc_lock);
+	return status < 0 ? status : 0;
+}
+
+/**
+ * Marks the data blks of the blk tree rooted at `blk_num` (`depth` levels
+ * 		of indirect blks above the data) as used in `used` (if not NULL)
+ * 		and counts the shared ones (see blk_ref_rebuild_add).
+ */
+static ssize_t __mark_used_blks(int fd,
+								uint8_t *used,
+								const struct uwufs_super_blk *super_blk,
+								uwufs_blk_t blk_num,
+								int depth)
+{
+	struct uwufs_indirect_blk indirect_blk;
+	uwufs_blk_t i;
+	ssize_t status;
+
+	if (depth == 0 && (blk_num & UWUFS_BLK_SHARED) &&
+		!blk_ref_rebuild_add(UWUFS_BLK_NUM(blk_num)))
+		return -ENOMEM;
+	blk_num = UWUFS_BLK_NUM(blk_num);	// preallocated blks are used too
+	if (blk_num < super_blk->freelist_start ||
+		blk_num >= super_blk->freelist_start + super_blk->freelist_total_size)
+		return 0; // not allocated
+	i = blk_num - super_blk->freelist_start;
+	if (used != NULL)
+		used[i / 8] |= 1 << (i % 8);
+	if (depth == 0)
+		return 0;
+
+	status = read_blk(fd, &indirect_blk, blk_num);
+	if (status < 0)
+		return status;
+	for (i = 0; i < UWUFS_BLOCK_SIZE / sizeof(uwufs_blk_t); i++) {
+		status = __mark_used_blks(fd, used, super_blk,
+								  indirect_blk.entries[i], depth - 1);
+		if (status < 0)
+			return status;
+	}
+	return 0;
+}
+
+static ssize_t __mark_inode_blks(int fd,
+								 uint8_t *used,
+								 const struct uwufs_super_blk *super_blk,
+								 const struct uwufs_inode *inode)
+{
+	ssize_t status = 0;
+	int k;
+
+	// the blk map holds the data
+	if (inode->file_flags & UWUFS_INODE_INLINE_DATA)
+		return 0;
+	// other files have fragments in it too: measured after the scan
+	if (inode->file_flags & UWUFS_INODE_TAIL_PACKED) {
+		if (!tail_blk_rebuild_add(inode->file_tail_blk))
+			return -ENOMEM;
+		status = __mark_used_blks(fd, used, super_blk,
+								  inode->file_tail_blk, 0);
+	}
+	for (k = 0; k < UWUFS_DIRECT_BLOCKS && status >= 0; k++)
+		status = __mark_used_blks(fd, used, super_blk,
+								  inode->direct_blks[k], 0);
+	if (status >= 0)
+		status = __mark_used_blks(fd, used, super_blk,
+								  inode->single_indirect_blks, 1);
+	if (status >= 0)
+		status = __mark_used_blks(fd, used, super_blk,
+								  inode->double_indirect_blks, 2);
+	if (status >= 0)
+		status = __mark_used_blks(fd, used, super_blk,
+								  inode->triple_indirect_blks, 3);
+	return status;
+}
+
+/**
+ * Recomputes what the super blk only keeps in memory while mounted, for
+ * 		a volume that wasn't unmounted cleanly: the freelist is rebuilt
+ * 		from the blks the inodes point to and both free counters are
+ * 		counted again. Inodes that are allocated but not linked
+ * 		anywhere (unlinked while open, or claimed and never used) are
+ * 		freed on the way.
+ */
+static ssize_t __rescan(int fd, struct uwufs_super_blk *super_blk)
+{
+	const size_t inodes_per_blk = UWUFS_BLOCK_SIZE / sizeof(struct uwufs_inode);
+	struct uwufs_inode_blk inode_blk;
+	struct uwufs_inode *inode;
+	struct uwufs_free_data_blk free_blk;
+	uwufs_blk_t free_inodes = 0;
+	uwufs_blk_t free_blks = 0;
+	uwufs_blk_t next = 0;
+	uwufs_blk_t blk_num;
+	uwufs_blk_t num;
+	uwufs_blk_t i;
+	bool dirty;
+	ssize_t status = 0;
+	size_t j;
+
+	uint8_t *used = (uint8_t *)calloc(
+		(super_blk->freelist_total_size + 7) / 8, 1);
+	if (used == NULL)
+		return -ENOMEM;
+
+	printf("uwufs: not cleanly unmounted, rebuilding the freelist...\n");
+	for (i = 0; i < super_blk->ilist_total_size; i++) {
+		blk_num = super_blk->ilist_start + i;
+		status = read_blk(fd, &inode_blk, blk_num);
+		if (status < 0)
+			goto free_ret;
+		dirty = false;
+		for (j = 0; j < inodes_per_blk; j++) {
+			num = i * inodes_per_blk + j;
+			inode = &inode_blk.inodes[j];
+			if (num < UWUFS_ROOT_DIR_INODE)
+				continue;
+			if ((inode->file_mode & F_TYPE_BITS) != F_TYPE_FREE &&
+				inode->file_links_count == 0) {
+				inode->file_mode = F_TYPE_FREE; // orphan
+				dirty = true;
+			}
+			if ((inode->file_mode & F_TYPE_BITS) == F_TYPE_FREE) {
+				free_inodes++;
+				continue;
+			}
+
+			status = __mark_inode_blks(fd, used, super_blk, inode);
+			if (status < 0)
+				goto free_ret;
+		}
+		if (dirty) {
+			status = write_blk(fd, &inode_blk, blk_num);
+			if (status < 0)
+				goto free_ret;
+		}
+	}
+
+	// link the unused blks from the end so the head is the lowest one
+	memset(&free_blk, 0, UWUFS_BLOCK_SIZE);
+	for (i = super_blk->freelist_total_size; i-- > 0;) {
+		if (used[i / 8] & (1 << (i % 8)))
+			continue;
+		blk_num = super_blk->freelist_start + i;
+		free_blk.next_free_blk = next;
+		status = write_blk(fd, &free_blk, blk_num);
+		if (status < 0)
+			goto free_ret;
+		next = blk_num;
+		free_blks++;
+	}
+
+	super_blk->freelist_head = next;
+	// the last blk of the list is never handed out (see mkfs.uwu)
+	super_blk->free_blks_left = free_blks > 0 ? free_blks - 1 : 0;
+	super_blk->free_inodes_left = free_inodes;
+	status = 0;
+
+free_ret:
+	free(used);
+	return status;
+}
+
+/**
+ * Counts the references of the shared blks and lists the tail blks after
+ * 		a clean unmount: only the inodes that have some are walked
+ * 		(__rescan does it for the others).
+ */
+static ssize_t __scan_shared_blks(int fd, const struct uwufs_super_blk *super_blk)
+{
+	const size_t inodes_per_blk = UWUFS_BLOCK_SIZE / sizeof(struct uwufs_inode);
+	struct uwufs_inode_blk inode_blk;
+	struct uwufs_inode *inode;
+	uwufs_blk_t i;
+	ssize_t status;
+	size_t j;
+
+	for (i = 0; i < super_blk->ilist_total_size; i++) {
+		status = read_blk(fd, &inode_blk, super_blk->ilist_start + i);
+		if (status < 0)
+			return status;
+		for (j = 0; j < inodes_per_blk; j++) {
+			inode = &inode_blk.inodes[j];
+			if ((inode->file_mode & F_TYPE_BITS) == F_TYPE_FREE ||
+				(inode->file_shared_blocks == 0 &&
+				 !(inode->file_flags & UWUFS_INODE_TAIL_PACKED)))
+				continue;
+			status = __mark_inode_blks(fd, NULL, super_blk, inode);
+			if (status < 0)
+				return status;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Measures the free space of the tail blks the scan listed. Fragments
+ * 		the inodes don't point to anymore (orphans freed by __rescan)
+ * 		are dropped from the index first.
+ */
+static ssize_t __measure_tail_blks(int fd)
+{
+	struct uwufs_tail_blk tail_blk;
+	struct uwufs_inode inode;
+	uwufs_blk_t blk_num;
+	ssize_t status;
+	bool dirty;
+	size_t i;
+
+	while ((blk_num = tail_blk_rebuild_next()) != 0) {
+		status = read_blk(fd, &tail_blk, blk_num);
+		if (status < 0)
+			return status;
+		dirty = false;
+		for (i = 0; i < UWUFS_TAIL_FRAGS; i++) {
+			struct uwufs_tail_frag *frag = &tail_blk.frags[i];
+			if (frag->inode_num == 0)
+				continue;
+			status = read_inode(fd, &inode, frag->inode_num);
+			if (status < 0)
+				return status;
+			if ((inode.file_mode & F_TYPE_BITS) != F_TYPE_FREE &&
+				(inode.file_flags & UWUFS_INODE_TAIL_PACKED) &&
+				inode.file_tail_blk == blk_num &&
+				inode.file_tail_offset == frag->offset)
+				continue;
+			memset(frag, 0, sizeof(*frag));
+			dirty = true;
+		}
+		// not mounted yet, like the ilist blks __rescan fixes
+		if (dirty) {
+			status = write_blk(fd, &tail_blk, blk_num);
+			if (status < 0)
+				return status;
+		}
+		tail_blk_update(blk_num, __tail_blk_free(&tail_blk, 0, NULL));
+	}
+	return 0;
+}
+
+ssize_t mount_super_blk(int fd)
+{
+	ssize_t status;
+
+	pthread_mutex_lock(&__alloc_lock);
+	status = read_blk(fd, &__super, 0);
+	if (status < 0)
+		goto unlock_ret;
+
+	blk_ref_clear();
+	tail_blk_clear();
+	if (__super.state != UWUFS_STATE_CLEAN) {
+		status = __rescan(fd, &__super);
+		if (status < 0)
+			goto unlock_ret;
+	} else if (__super.features & (UWUFS_FEATURE_SHARED_BLKS |
+								   UWUFS_FEATURE_TAIL_BLKS)) {
+		status = __scan_shared_blks(fd, &__super);
+		if (status < 0)
+			goto unlock_ret;
+	}
+	status = __measure_tail_blks(fd);
+	if (status < 0)
+		goto unlock_ret;
+	// no blk is in two files anymore: the next mounts can skip the scan
+	if (blk_ref_rebuild_done() == 0)
+		__super.features &= ~UWUFS_FEATURE_SHARED_BLKS;
+	if (tail_blk_rebuild_done() == 0)
+		__super.features &= ~UWUFS_FEATURE_TAIL_BLKS;
+
+	// the counters on disk can't be trusted until unmount_super_blk
+	__super.state = UWUFS_STATE_MOUNTED;
+	status = write_blk(fd, &__super, 0);
+	if (status < 0)
+		goto unlock_ret;
+
+	__free_inodes = __super.free_inodes_left;
+	__free_blks_hint = __super.free_blks_left;
+	__super_mounted = true;
+	status = 0;
+
+unlock_ret:
+	pthread_mutex_unlock(&__alloc_lock);
+	return status;
+}
+
+ssize_t sync_super_blk(int fd)
+{
+	struct uwufs_super_blk super_blk;
+	ssize_t status;
+
+	if (!__super_mounted)
+		return 0;
+	status = read_super_blk(fd, &super_blk);
+	if (status < 0)
+		return status;
+	status = write_blk(fd, &super_blk, 0);
+	return status < 0 ? status : 0;
+}
+
+ssize_t unmount_super_blk(int fd)
+{
+	struct uwufs_super_blk super_blk;
+	ssize_t status;
+
+	if (!__super_mounted)
+		return 0;
+	status = read_super_blk(fd, &super_blk);
+	if (status < 0)
+		return status;
+	super_blk.state = UWUFS_STATE_CLEAN;
+	status = write_blk(fd, &super_blk, 0);
+	if (status < 0)
+		return status;
+	__super_mounted = false;
+	return 0;
+}
@@ -14,6 +14,7 @@
 /**
  * Reads an entire block from the specified block device.
  * The block size is determined by UWUFS_BLOCK_SIZE (see uwufs.h)
+ * Metadata blks the journal didn't write back yet are read from it.
  *
  * `fd`: block device
  * `buf`: output var to be read into (size must be at least UWUFS_BLOCK_SIZE)
@@ -24,6 +25,7 @@ ssize_t read_blk(int fd, void* buf, uwufs_blk_t blk_num);
 /**
  * Writes an entire block to the specified block device.
  * The buf size must be exactly UWUFS_BLOCK_SIZE (see uwufs.h)
+ * Only for data blks, metadata blks go through write_meta_blk.
  *
  * `fd`: block device
  * `buf`: data to write to block device (size must be UWUFS_BLOCK_SIZE)
@@ -31,8 +33,87 @@ ssize_t read_blk(int fd, void* buf, uwufs_blk_t blk_num);
  */
 ssize_t write_blk(int fd, const void* buf, uwufs_blk_t blk_num);
 
+/**
+ * Writes `n` consecutive data blks starting at `blk_num` with one write.
+ *
+ * `fd`: block device
+ * `buf`: data to write (size must be n * UWUFS_BLOCK_SIZE)
+ * `blk_num`: first block number to write to
+ * `n`: number of blocks
+ *
+ * Return: n * UWUFS_BLOCK_SIZE or a negative error
+ */
+ssize_t write_blks(int fd, const void* buf, uwufs_blk_t blk_num, uwufs_blk_t n);
+
+/**
+ * Reads `n` consecutive data blks starting at `blk_num` with one read.
+ * Only for data blks: the journal is not looked at.
+ *
+ * `fd`: block device
+ * `buf`: output var (size must be at least n * UWUFS_BLOCK_SIZE)
+ * `blk_num`: first block number to read
+ * `n`: number of blocks
+ *
+ * Return: n * UWUFS_BLOCK_SIZE or a negative error
+ */
+ssize_t read_blks(int fd, void* buf, uwufs_blk_t blk_num, uwufs_blk_t n);
+
+/**
+ * Writes `n` consecutive data blks starting at `blk_num` with the next
+ * 		n * UWUFS_BLOCK_SIZE bytes of the pipe `pipe_fd`, spliced so
+ * 		they are not copied through userspace (read and written if the
+ * 		device can't be spliced to).
+ *
+ * `fd`: block device
+ * `pipe_fd`: read end of a pipe holding the data
+ * `blk_num`: first block number to write to
+ * `n`: number of blocks
+ *
+ * Return: n * UWUFS_BLOCK_SIZE or a negative error
+ */
+ssize_t splice_blks(int fd, int pipe_fd, uwufs_blk_t blk_num, uwufs_blk_t n);
+
+/**
+ * Asks the device to read `n` consecutive data blks starting at `blk_num`
+ * 		in the background (into the page cache of the device), without
+ * 		waiting for them.
+ *
+ * Return: 0 or a negative error
+ */
+int prefetch_blks(int fd, uwufs_blk_t blk_num, uwufs_blk_t n);
+
+/**
+ * Writes a metadata blk (ilist, directory or indirect blk). Goes through
+ * 		the journal while there is one (see journal_open), so it only
+ * 		reaches the device at the next checkpoint.
+ *
+ * `fd`: block device
+ * `buf`: data to write to block device (size must be UWUFS_BLOCK_SIZE)
+ * `blk_num`: block number to write to
+ */
+ssize_t write_meta_blk(int fd, const void* buf, uwufs_blk_t blk_num);
+
+/**
+ * Returns a ticket for flush_device. Take it before the writes that
+ * 		have to be made durable are issued (or after they completed).
+ */
+uint64_t flush_ticket(void);
+
+/**
+ * Makes every write to the device that completed before `ticket` was
+ * 		taken durable (fdatasync). Does nothing if a flush started
+ * 		since, so concurrent callers share one device cache flush.
+ *
+ * `fd`: block device
+ * `ticket`: from flush_ticket
+ *
+ * Return: 0 or a negative error
+ */
+ssize_t flush_device(int fd, uint64_t ticket);
+
 /**
  * Reads an inode from the specified block device.
+ * Timestamps that touch_inode kept in memory are returned too.
  * Caution: it assumes the start of ilist is at constant offset determined
  * 		by UWUFS_RESERVED_SPACE (might change if implementation changes)
  *
@@ -44,7 +125,25 @@ ssize_t write_blk(int fd, const void* buf, uwufs_blk_t blk_num);
 ssize_t read_inode(int fd, void* buf, uwufs_blk_t inode_num);
 
 /**
- * Writes an inode to the specified block device.
+ * Reads several inodes at once. The inodes are read in ilist order, so
+ * 		each ilist blk is only read once no matter how the inode
+ * 		numbers are ordered.
+ *
+ * Return: `n` or a negative error
+ *
+ * `fd`: block device
+ * `inodes`: output array (inodes[i] is the inode inode_nums[i])
+ * `inode_nums`: inode numbers to read
+ * `n`: number of inodes
+ */
+ssize_t read_inodes(int fd,
+					struct uwufs_inode *inodes,
+					const uwufs_blk_t *inode_nums,
+					size_t n);
+
+/**
+ * Writes an inode to the specified block device (with its timestamps:
+ * 		nothing is kept in memory for it anymore, see touch_inode).
  * Caution: it assumes the start of ilist is at constant offset determined
  * 		by UWUFS_RESERVED_SPACE (might change if implementation changes)
  *
@@ -57,15 +156,40 @@ ssize_t read_inode(int fd, void* buf, uwufs_blk_t inode_num);
 ssize_t write_inode(int fd, const void* buf, size_t size, uwufs_blk_t inode_num);
 
 /**
- * Allocates a free block from device.
+ * Writes an inode of which only the timestamps changed. With -o lazytime
+ * 		(see lazytime_enable) they are only kept in memory until the
+ * 		inode is written for another reason or they are written back
+ * 		by the caller of lazytime_pending. read_inode returns them.
+ *
+ * The caller holds the inode lock (like for write_inode).
+ */
+ssize_t touch_inode(int fd,
+					const struct uwufs_inode *inode,
+					uwufs_blk_t inode_num);
+
+/**
+ * Allocates a free block from device. When there is none left but the
+ * 		journal holds freed blks back, it checkpoints and tries again
+ * 		(see journal_reclaim_frees, malloc_blks does the same).
  *
  * `fd`: block device
  * `blk_num`: output var will contain the blk number of allocated block
  */
 ssize_t malloc_blk(int fd, uwufs_blk_t *blk_num);
 
+/**
+ * Allocates up to `n` blocks at once, straight from the freelist (one
+ * 		super blk update, no allocation cache): they come in freelist
+ * 		order, so they are consecutive unless the freelist got mixed up
+ * 		by frees.
+ *
+ * Return: number of blks allocated (at least 1) or a negative error
+ */
+ssize_t malloc_blks(int fd, uwufs_blk_t *blk_nums, size_t n);
+
 /**
  * Frees and returns a already allocated block to freelist.
+ * 		While journaling, the blk only goes back at the next checkpoint.
  * Caution: this function does not check if the blk is already free
  * 		nor if it is a data block at all.
  *
@@ -74,15 +198,167 @@ ssize_t malloc_blk(int fd, uwufs_blk_t *blk_num);
  */
 ssize_t free_blk(int fd, const uwufs_blk_t blk_num);
 
+/**
+ * Drops a data blk map entry (flags included): frees the blk unless it
+ * 		is UWUFS_BLK_SHARED and other files still have it.
+ *
+ * `fd`: block device
+ * `entry`: the blk map entry
+ */
+ssize_t release_data_blk(int fd, uwufs_blk_t entry);
+
+/**
+ * Notes in the super blk that some blk maps have UWUFS_BLK_SHARED blks,
+ * 		so mount_super_blk counts their references (see BlockRefs.h).
+ * 		Call before the first blk is shared.
+ *
+ * `fd`: block device
+ */
+ssize_t mark_shared_blks(int fd);
+
+/**
+ * Stores `size` bytes (the tail of the file `inode_num`) as a fragment of
+ * 		a tail blk: the fullest one it fits in, or a new one (see
+ * 		TailBlocks.h). The tail blk is journaled like the other
+ * 		metadata blks.
+ *
+ * `fd`: block device
+ * `blk_num`, `offset`: output vars for where the fragment is
+ *
+ * Return: 0 or a negative error (-EINVAL if `size` is 0 or larger than
+ * 		UWUFS_TAIL_MAX_SIZE)
+ */
+ssize_t malloc_tail_frag(int fd,
+						 uwufs_blk_t inode_num,
+						 const void *data,
+						 size_t size,
+						 uwufs_blk_t *blk_num,
+						 uint16_t *offset);
+
+/**
+ * Drops the fragment of `inode_num` at `offset` of tail blk `blk_num`.
+ * 		The blk is freed with its last fragment.
+ */
+ssize_t free_tail_frag(int fd,
+					   uwufs_blk_t inode_num,
+					   uwufs_blk_t blk_num,
+					   uint16_t offset);
+
 /**
  * Finds a free inode and returns its inode number in the `inode_num`
- * 		output variable
+ * 		output variable. The inode is claimed (written as an unlinked
+ * 		regular file) so other threads can't get the same one: the
+ * 		caller must write it or give it back with free_inode.
  *
  * `fd`: block device
  * `inode_num`: output var will contain the inode number of a free inode
  */
 ssize_t find_free_inode(int fd, uwufs_blk_t *inode_num);
 
+/**
+ * Marks an inode claimed by find_free_inode as free again (for callers
+ * 		that fail before linking the inode anywhere).
+ * 		Does not free any data blks.
+ *
+ * `fd`: block device
+ * `inode_num`: inode to free
+ */
+ssize_t free_inode(int fd, uwufs_blk_t inode_num);
+
+/**
+ * Sets UWUFS_BLOCK_SIZE to the block size of a volume. Call it before
+ * 		reading anything but its super blk (the journal too).
+ *
+ * `blk_size`: UWUFS_SUPER_BLK_SIZE of its super blk
+ *
+ * Return: 0 or -EINVAL if the size isn't supported
+ * 		(UWUFS_BLOCK_SIZE_SUPPORTED)
+ */
+ssize_t set_blk_size(uwufs_blk_t blk_size);
+
+/**
+ * Loads the super blk into memory for the rest of the mount: from here on
+ * 		the allocator only updates the freelist head and the free
+ * 		counters in memory (see sync_super_blk). If the volume wasn't
+ * 		unmounted cleanly the freelist and counters are rebuilt first,
+ * 		which reads every inode and indirect blk. The reference counts
+ * 		of the shared blks are counted again too (only the inodes with
+ * 		shared blks are read for that after a clean unmount).
+ *
+ * `fd`: block device
+ */
+ssize_t mount_super_blk(int fd);
+
+/**
+ * Writes the in-memory super blk back (the volume stays marked as
+ * 		mounted). Does nothing if the super blk isn't mounted.
+ *
+ * `fd`: block device
+ */
+ssize_t sync_super_blk(int fd);
+
+/**
+ * Writes the in-memory super blk back and marks the volume clean, so the
+ * 		next mount_super_blk trusts the counters. Call after
+ * 		alloc_cache_stop, once nothing allocates anymore.
+ *
+ * `fd`: block device
+ */
+ssize_t unmount_super_blk(int fd);
+
+/**
+ * Gets the current super blk (the in-memory one while mounted).
+ *
+ * `fd`: block device
+ * `super_blk`: output var
+ */
+ssize_t read_super_blk(int fd, struct uwufs_super_blk *super_blk);
+
+/**
+ * Makes malloc_blk, free_blk and find_free_inode go through per-cpu
+ * 		caches that take blks and inodes from the super blk in batches.
+ * 		The super blk counters don't include what the caches hold, use
+ * 		read_free_counts for the exact numbers.
+ * 		Call before any other thread allocates.
+ *
+ * `fd`: block device
+ */
+ssize_t alloc_cache_start(int fd);
+
+/**
+ * Returns everything the caches hold to the super blk and goes back to
+ * 		allocating from the super blk directly.
+ * 		Call once no other thread allocates anymore (unmount).
+ *
+ * `fd`: block device
+ */
+ssize_t alloc_cache_stop(int fd);
+
+/**
+ * Checks that more than `n` blks can be allocated. Cheap unless the
+ * 		volume is nearly full (then it counts like read_free_counts, but
+ * 		without the blks the journal still holds back, checkpointing to
+ * 		get them if they are needed).
+ *
+ * Return: 0 if there are, -ENOSPC if not, or another negative error
+ *
+ * `fd`: block device
+ * `n`: number of blks
+ */
+ssize_t check_free_blks(int fd, uwufs_blk_t n);
+
+/**
+ * Gets the number of free blks and free inodes, including the ones held
+ * 		by the allocation caches and the blks the journal holds back.
+ *
+ * `fd`: block device
+ * `free_blks`: output var for the number of free blks
+ * `free_inodes`: output var for the number of free inodes
+ */
+ssize_t read_free_counts(int fd,
+						 uwufs_blk_t *free_blks,
+						 uwufs_blk_t *free_inodes);
+
 
 /**
  * namei helper - scan the set of data blocks for an inode, 
@@ -94,14 +370,16 @@ ssize_t find_free_inode(int fd, uwufs_blk_t *inode_num);
  * `inode`: the inode to search in 
  * `inode_num`: where to save the next inode number if found 
  */
-ssize_t next_inode_in_path(int fd, char *file_name, struct uwufs_inode* inode,
+ssize_t next_inode_in_path(int fd, const char *file_name, struct uwufs_inode* inode,
                            uwufs_blk_t *inode_num);
 
 
 /**
  * Find the inode of the corresponding file. If root directory inode is
  * 		valid, it will use it. Otherwise, it will read the super blk for
- * 		the root directory.
+ * 		the root directory. Symlinks are followed (the last one too):
+ * 		relative targets from the directory holding the link, at most
+ * 		UWUFS_MAX_SYMLINKS of them (-ELOOP).
  *
  * `fd`: block device
  * `path`: null terminated file path
@@ -90,12 +90,15 @@ static void init_superblock(int fd,
 							uwufs_blk_t total_blks, 
 							uwufs_blk_t ilist_start,
 							uwufs_blk_t ilist_total_size,
+							uwufs_blk_t journal_start,
+							uwufs_blk_t journal_total_size,
 							uwufs_blk_t freelist_start,
 							uwufs_blk_t freelist_total_size,
 							uwufs_blk_t freelist_head)
 {
 	// Set super block values
 	struct uwufs_super_blk super_blk;
+	memset(&super_blk, 0, sizeof(super_blk));
 	super_blk.total_blks = total_blks;
 	super_blk.ilist_start = ilist_start;
 	super_blk.ilist_total_size = ilist_total_size;
@@ -105,6 +108,10 @@ static void init_superblock(int fd,
 	super_blk.freelist_total_size = freelist_total_size;
 	super_blk.freelist_head = freelist_head;
 	super_blk.free_blks_left = freelist_total_size - 1; // One block as buffer?
+	super_blk.state = UWUFS_STATE_CLEAN;
+	super_blk.journal_start = journal_start;
+	super_blk.journal_total_size = journal_total_size;
+	super_blk.blk_size = UWUFS_BLOCK_SIZE;
 
 	// Write super block to device
 	ssize_t bytes_written = write_blk(fd, &super_blk, 0);
@@ -115,6 +122,38 @@ static void init_superblock(int fd,
 	}
 }
 
+/**
+ * Writes an empty journal: the header in the reserved blk points to the
+ * 		start of the log. The first sequence number depends on the time
+ * 		so transactions left in the log by an earlier format never
+ * 		match it.
+ */
+static void init_journal(int fd, uwufs_blk_t journal_start)
+{
+	struct uwufs_journal_header header;
+	char zero_blk[UWUFS_MAX_BLOCK_SIZE];
+	ssize_t status;
+
+	memset(&header, 0, sizeof(header));
+	header.magic = UWUFS_JOURNAL_MAGIC;
+	header.head = 0;
+	header.sequence = ((uint64_t)time(NULL) << 20) + 1;
+	status = write_blk(fd, &header, UWUFS_JOURNAL_HEADER_BLK);
+	if (status < 0)
+		goto error_exit;
+
+	memset(zero_blk, 0, UWUFS_BLOCK_SIZE);
+	status = write_blk(fd, zero_blk, journal_start);
+	if (status < 0)
+		goto error_exit;
+	return;
+
+error_exit:
+	perror("mkfs.uwu: error init journal");
+	close(fd);
+	exit(1);
+}
+
 /**
  * Set ilist blocks to all 0. This makes checking if an inode
  * 		is used very easy (Check the file mode if it is 0)
@@ -122,7 +161,7 @@ static void init_superblock(int fd,
 static void init_inodes(int fd,
 						uwufs_blk_t ilist_start,
 						uwufs_blk_t ilist_total_size) {
-	char zero_blk[UWUFS_BLOCK_SIZE];
+	char zero_blk[UWUFS_MAX_BLOCK_SIZE];
 	memset(zero_blk, 0, UWUFS_BLOCK_SIZE);
 
 	uwufs_blk_t i;
@@ -212,6 +251,7 @@ static void init_root_directory(int fd)
 	// TODO: add other permissions, metadata, etc
 	root_inode.file_mode = F_TYPE_DIRECTORY | 0755;
 	root_inode.direct_blks[0] = blk_num;
+	root_inode.file_blocks = 1;
 	root_inode.file_size = UWUFS_BLOCK_SIZE;
 	root_inode.file_links_count = 2; // Account for "." refer to itself
 	root_inode.file_uid = 0;
@@ -258,16 +298,29 @@ static int init_uwufs(int fd,
 	// Calculate where each region starts and stops
 	uwufs_blk_t ilist_start = 1 + reserved_space;
 	uwufs_blk_t ilist_size = (ilist_percent * total_blks);
-	uwufs_blk_t freelist_start = ilist_start + ilist_size;
-	uwufs_blk_t freelist_size = total_blks - 1 - reserved_space - ilist_size;
+	uwufs_blk_t journal_start = ilist_start + ilist_size;
+	uwufs_blk_t journal_size = total_blks / UWUFS_JOURNAL_DEFAULT_DIVISOR;
+	if (journal_size > UWUFS_JOURNAL_MAX_SIZE)
+		journal_size = UWUFS_JOURNAL_MAX_SIZE;
+	if (reserved_space < UWUFS_JOURNAL_HEADER_BLK)
+		journal_size = 0; // nowhere to put the header
+	uwufs_blk_t freelist_start = journal_start + journal_size;
+	uwufs_blk_t freelist_size = total_blks - 1 - reserved_space - ilist_size
+		- journal_size;
 
 	printf("Initializing free list\n");
 	uwufs_blk_t first_free_blk = init_freelist(fd, total_blks, freelist_start,
 											freelist_size);
 
 	printf("Initializing super block\n");
-	init_superblock(fd, total_blks, ilist_start, ilist_size, freelist_start,
-				 	freelist_size, first_free_blk);
+	init_superblock(fd, total_blks, ilist_start, ilist_size, journal_start,
+					journal_size, freelist_start, freelist_size,
+					first_free_blk);
+
+	if (journal_size > 0) {
+		printf("Initializing journal\n");
+		init_journal(fd, journal_start);
+	}
 
 	printf("Initializing inodes\n");
 	init_inodes(fd, ilist_start, ilist_size);
@@ -280,12 +333,25 @@ static int init_uwufs(int fd,
 
 int main(int argc, char *argv[])
 {
-	if (argc < 2) {
-		printf("Usage: %s [block device]\n", argv[0]);
+	const char *device = argv[1];
+
+	// -b picks the block size, which the volume keeps for good
+	if (argc == 4 && strcmp(argv[1], "-b") == 0) {
+		char *end;
+		unsigned long blk_size = strtoul(argv[2], &end, 10);
+
+		if (*end != '\0' || set_blk_size(blk_size) < 0) {
+			printf("Unsupported block size %s (4096, 16384 or 65536)\n",
+				   argv[2]);
+			return 1;
+		}
+		device = argv[3];
+	} else if (argc != 2) {
+		printf("Usage: %s [-b block size] [block device]\n", argv[0]);
 		return 1;
 	}
 
-	int fd = open(argv[1], O_RDWR);
+	int fd = open(device, O_RDWR);
 	if (fd < 0) {
 		perror("Failed to access block device");
 		return 1;
@@ -310,10 +376,10 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
-	printf("Block device %s size : %ld bytes (%ld blocks)\n", argv[1],
-		blk_dev_size, blk_dev_size/UWUFS_BLOCK_SIZE);
+	printf("Block device %s size : %ld bytes (%ld blocks of %u bytes)\n",
+		device, blk_dev_size, blk_dev_size/UWUFS_BLOCK_SIZE, UWUFS_BLOCK_SIZE);
 
-	printf("Formating device %s...\n", argv[1]);
+	printf("Formating device %s...\n", device);
 	// NOTE: Read user definable params later.
 	// 	Specifing blk_dev_size to format can help with testing too
 #ifdef DEBUG
@@ -326,7 +392,7 @@ int main(int argc, char *argv[])
 				  	 UWUFS_ILIST_DEFAULT_PERCENTAGE);
 #endif
 
-	printf("Done formating device %s\n", argv[1]);
+	printf("Done formating device %s\n", device);
 	close(fd);
 	return ret;
 }
@@ -6,7 +6,8 @@
 
 #define FUSE_USE_VERSION 31
 
-#include <fuse3/fuse.h>
+#include <fuse3/fuse_lowlevel.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
@@ -17,27 +18,67 @@
 #endif
 
 #include "uwufs.h"
+#include "low_level_operations.h"
 #include "syscalls.h"
 
 int device_fd;
 
-static const struct fuse_operations uwufs_oper = {
+#define UWUFS_OPT(t, p) { t, offsetof(struct uwufs_options, p), 1 }
+static const struct fuse_opt uwufs_opt_spec[] = {
+	UWUFS_OPT("entry_timeout=%lf", entry_timeout),
+	UWUFS_OPT("attr_timeout=%lf", attr_timeout),
+	UWUFS_OPT("negative_timeout=%lf", negative_timeout),
+	UWUFS_OPT("commit=%lf", commit_interval),
+	UWUFS_OPT("noatime", noatime),
+	{ "relatime", offsetof(struct uwufs_options, noatime), 0 },
+	UWUFS_OPT("lazytime", lazytime),
+	UWUFS_OPT("reflink", reflink),
+	UWUFS_OPT("max_write=%u", max_write),
+	UWUFS_OPT("max_readahead=%u", max_readahead),
+	UWUFS_OPT("writeback_cache", writeback_cache),
+	{ "no_writeback_cache", offsetof(struct uwufs_options, writeback_cache), 0 },
+	UWUFS_OPT("splice", splice),
+	{ "no_splice", offsetof(struct uwufs_options, splice), 0 },
+	UWUFS_OPT("async_read", async_read),
+	{ "sync_read", offsetof(struct uwufs_options, async_read), 0 },
+	UWUFS_OPT("tailpack", tailpack),
+	// also kept for fuse so the kernel mount is read-only too
+	UWUFS_OPT("ro", read_only),
+	FUSE_OPT_KEY("ro", FUSE_OPT_KEY_KEEP),
+	FUSE_OPT_END
+};
+
+static const struct fuse_lowlevel_ops uwufs_oper = {
+	.init		= uwufs_init,
+	.destroy	= uwufs_destroy,
+	.lookup		= uwufs_lookup,
+	.forget		= uwufs_forget,
 	.getattr	= uwufs_getattr,
+	.setattr	= uwufs_setattr,
+	.readlink	= uwufs_readlink,
+	.mknod		= uwufs_mknod,
 	.mkdir		= uwufs_mkdir,
 	.unlink		= uwufs_unlink,
 	.rmdir		= uwufs_rmdir,
+	.symlink	= uwufs_symlink,
 	.rename		= uwufs_rename,
 	.link		= uwufs_link,
-	.chmod		= uwufs_chmod,
-	.chown		= uwufs_chown,
 	.open		= uwufs_open,
 	.read		= uwufs_read,
 	.write		= uwufs_write,
+	.flush		= uwufs_flush,
 	.release	= uwufs_release,
+	.fsync		= uwufs_fsync,
 	.readdir	= uwufs_readdir,
-	.init       = uwufs_init,
+	.fsyncdir	= uwufs_fsyncdir,
+	.statfs		= uwufs_statfs,
 	.create 	= uwufs_create,
-	.utimens 	= uwufs_utimens,
+	.write_buf	= uwufs_write_buf,
+	.forget_multi = uwufs_forget_multi,
+	.fallocate	= uwufs_fallocate,
+	.readdirplus = uwufs_readdirplus,
+	.copy_file_range = uwufs_copy_file_range,
+	.lseek		= uwufs_lseek,
 };
 
 int main(int argc, char *argv[]) {
@@ -58,36 +99,101 @@ int main(int argc, char *argv[]) {
 		return 1;
 	}
 
-	device_fd = open(argv[1], O_RDWR);
+	int ret = 0;
+	uwufs_blk_t blk_dev_size;
+	struct uwufs_super_blk super_blk;
+	const char *device = argv[1];
+
+	// fuse only needs to see the mountpoint and flags
+	device_fd = -1;
+	argv[1] = argv[0];
+	struct fuse_args args = FUSE_ARGS_INIT(argc - 1, &argv[1]);
+	struct fuse_cmdline_opts opts;
+	struct fuse_loop_config loop_config;
+	struct fuse_session *se;
+
+	ret = 1;
+	if (fuse_parse_cmdline(&args, &opts) != 0)
+		goto free_args_ret;
+	if (opts.show_help) {
+		printf("Usage: %s [device] [mountpoint] [optional: flags]\n", argv[0]);
+		fuse_cmdline_help();
+		fuse_lowlevel_help();
+		ret = 0;
+		goto free_args_ret;
+	}
+	if (opts.mountpoint == NULL) {
+		printf("Usage: %s [device] [mountpoint] [optional: flags]\n", argv[0]);
+		goto free_args_ret;
+	}
+
+	// uwufs options are removed from args before fuse sees them
+	if (fuse_opt_parse(&args, &uwufs_opts, uwufs_opt_spec, NULL) != 0)
+		goto free_args_ret;
+
+	device_fd = open(device, uwufs_opts.read_only ? O_RDONLY : O_RDWR);
 	if (device_fd < 0) {
 		perror("Failed to access block device");
-		return 1;
+		goto free_args_ret;
 	}
 
-	int ret = 0;
-	uwufs_blk_t blk_dev_size;
-
 #ifdef __linux__
 	// BLKGETSIZE64 assumes linux system
-	ret = ioctl(device_fd, BLKGETSIZE64, &blk_dev_size);
+	if (ioctl(device_fd, BLKGETSIZE64, &blk_dev_size) < 0) {
+		perror("Not a block device/partition or cannot determine its size");
+		goto free_args_ret;
+	}
 #else
 	perror("Unsupported operating system: not Linux");
-	close(device_fd);
-	return 1;
+	goto free_args_ret;
 #endif
-	if (ret < 0) {
-		perror("Not a block device/partition or cannot determine its size");
-		close(device_fd);
-		return 1;
+
+	// everything on the volume is laid out for its block size
+	if (read_super_blk(device_fd, &super_blk) < 0) {
+		perror("Failed to read the super block");
+		goto free_args_ret;
+	}
+	if (!UWUFS_BLOCK_SIZE_SUPPORTED(UWUFS_SUPER_BLK_SIZE(&super_blk))) {
+		printf("'%s' has %lu byte blocks, which mount.uwu does not support\n",
+			   device, UWUFS_SUPER_BLK_SIZE(&super_blk));
+		goto free_args_ret;
 	}
 
 	// NOTE: LATER - Check integrity of block device/partition
 	printf("Skip checking integrity of block device/partition...\n");
 
-	printf("Mounting '%s' to '%s'...\n", argv[1], argv[2]);
+	printf("Mounting '%s' to '%s'%s...\n", device, opts.mountpoint,
+		   uwufs_opts.read_only ? " read-only" : "");
 
-	argv[1] = argv[0];
-	ret = fuse_main(argc - 1, &argv[1], &uwufs_oper, NULL);
-	close(device_fd);
-	return ret;
+	se = fuse_session_new(&args, &uwufs_oper, sizeof(uwufs_oper), NULL);
+	if (se == NULL)
+		goto free_args_ret;
+	uwufs_set_session(se);
+	if (fuse_set_signal_handlers(se) != 0)
+		goto destroy_session_ret;
+
+	if (fuse_session_mount(se, opts.mountpoint) != 0)
+		goto remove_handlers_ret;
+
+	fuse_daemonize(opts.foreground);
+
+	if (opts.singlethread) {
+		ret = fuse_session_loop(se);
+	} else {
+		loop_config.clone_fd = opts.clone_fd;
+		loop_config.max_idle_threads = opts.max_idle_threads;
+		ret = fuse_session_loop_mt(se, &loop_config);
+	}
+
+	fuse_session_unmount(se);
+remove_handlers_ret:
+	fuse_remove_signal_handlers(se);
+destroy_session_ret:
+	fuse_session_destroy(se);
+free_args_ret:
+	free(opts.mountpoint);
+	fuse_opt_free_args(&args);
+	if (device_fd >= 0)
+		close(device_fd);
+	return ret ? 1 : 0;
 }
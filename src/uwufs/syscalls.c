@@ -1,20 +1,28 @@
 /**
  * Implement fuse syscall operations for uwufs
  *
+ * Uses the FUSE low-level API: the kernel keeps track of the inode
+ * 		numbers (fuse_ino_t) it got from lookup/create/mkdir/link, so
+ * 		path walking only happens once per lookup instead of once per
+ * 		syscall.
+ *
  * Authors: Joseph, Kay
  */
 
 #define FUSE_USE_VERSION 31
 
-#include <fuse3/fuse.h>
+#include <fuse3/fuse_lowlevel.h>
 #include "file_operations.h"
 #include "low_level_operations.h"
 #include "uwufs.h"
 #include "syscalls.h"
 
 #include <errno.h>
+#include <limits.h>
+#include <pthread.h>
 #include <string.h>
 #include <stdio.h>
+#include <time.h>
 
 #ifdef __linux__
 #include <linux/fs.h>
@@ -22,39 +30,427 @@
 
 extern int device_fd;
 
-void* uwufs_init(struct fuse_conn_info *conn,
-				 struct fuse_config *cfg)
+// The kernel may cache entries and attributes for a long time because
+// every change it could not see itself is sent to it with a notification
+// (see __notify_*). Can be changed with -o entry_timeout=... etc.
+struct uwufs_options uwufs_opts = {
+	.entry_timeout = 60.0,
+	.attr_timeout = 60.0,
+	.negative_timeout = 10.0,
+	.read_only = 0,
+	.commit_interval = 5.0,
+	.noatime = 0,
+	.lazytime = 0,
+	.reflink = 0,
+	.max_write = 0,
+	.max_readahead = 0,
+	.writeback_cache = 1,
+	.splice = 1,
+	.async_read = 1,
+	.tailpack = 0,
+};
+
+/**
+ * Read-only mounts (-o ro) never change anything on the device, so the
+ * 		callbacks that would are rejected up front and the rest run
+ * 		without inode locks, inode table or notifications: the
+ * 		only shared state is the device and the super blk loaded by
+ * 		uwufs_init.
+ */
+static struct uwufs_super_blk __ro_super_blk;
+
+static inline bool __reject_read_only(fuse_req_t req)
+{
+	if (!uwufs_opts.read_only)
+		return false;
+	fuse_reply_err(req, EROFS);
+	return true;
+}
+
+/**
+ * The kernel always uses FUSE_ROOT_ID (1) for the root directory,
+ * 		uwufs uses UWUFS_ROOT_DIR_INODE. Inode 1 is never handed out
+ * 		by find_free_inode so every other number maps to itself.
+ */
+static inline uwufs_blk_t __inode_num(fuse_ino_t ino)
+{
+	return ino == FUSE_ROOT_ID ? UWUFS_ROOT_DIR_INODE : ino;
+}
+
+static inline fuse_ino_t __fuse_ino(uwufs_blk_t inode_num)
+{
+	return inode_num == UWUFS_ROOT_DIR_INODE ? FUSE_ROOT_ID : inode_num;
+}
+
+/**
+ * Inode locks
+ *
+ * Every inode has a reader/writer lock. The lock of a directory also
+ * 		guards its entries (lookup/readdir read-lock it, namespace
+ * 		changes write-lock it). Inodes are hashed onto
+ * 		UWUFS_INODE_LOCKS locks, so an operation that needs several
+ * 		inodes locks them all at once in lock order (__lock_inodes) and
+ * 		never takes another inode lock while holding one.
+ *
+ * The allocator, ilist and inode table locks below this layer are
+ * 		only ever taken while holding inode locks, not the other way
+ * 		around.
+ *
+ * Read-only mounts take none of them.
+ */
+#define UWUFS_INODE_LOCKS		1024
+#define UWUFS_MAX_LOCKED_INODES	4
+
+static pthread_rwlock_t __inode_locks[UWUFS_INODE_LOCKS];
+static pthread_once_t __inode_locks_once = PTHREAD_ONCE_INIT;
+
+static void __init_inode_locks(void)
+{
+	pthread_rwlockattr_t attr;
+	int i;
+
+	// a stream of readers must not starve a writer
+	pthread_rwlockattr_init(&attr);
+	pthread_rwlockattr_setkind_np(&attr,
+		PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	for (i = 0; i < UWUFS_INODE_LOCKS; i++)
+		pthread_rwlock_init(&__inode_locks[i], &attr);
+	pthread_rwlockattr_destroy(&attr);
+}
+
+static pthread_rwlock_t *__inode_lock(uwufs_blk_t inode_num)
+{
+	pthread_once(&__inode_locks_once, __init_inode_locks);
+	return &__inode_locks[inode_num % UWUFS_INODE_LOCKS];
+}
+
+static inline void __rdlock_inode(uwufs_blk_t inode_num)
+{
+	if (!uwufs_opts.read_only)
+		pthread_rwlock_rdlock(__inode_lock(inode_num));
+}
+
+static inline void __wrlock_inode(uwufs_blk_t inode_num)
+{
+	if (!uwufs_opts.read_only)
+		pthread_rwlock_wrlock(__inode_lock(inode_num));
+}
+
+static inline void __unlock_inode(uwufs_blk_t inode_num)
+{
+	if (!uwufs_opts.read_only)
+		pthread_rwlock_unlock(__inode_lock(inode_num));
+}
+
+struct __inode_lockset {
+	pthread_rwlock_t *locks[UWUFS_MAX_LOCKED_INODES];
+	int n;
+};
+
+/**
+ * Write-locks all the inodes in `inode_nums` (at most
+ * 		UWUFS_MAX_LOCKED_INODES, 0 entries are skipped). Inodes that
+ * 		share a lock are only locked once.
+ */
+static void __lock_inodes(struct __inode_lockset *set,
+						  const uwufs_blk_t *inode_nums,
+						  int n)
+{
+	pthread_rwlock_t *lock;
+	int i;
+	int j;
+
+	set->n = 0;
+	for (i = 0; i < n; i++) {
+		if (inode_nums[i] == 0)
+			continue;
+		lock = __inode_lock(inode_nums[i]);
+		// insertion sort by address (the lock order), skipping duplicates
+		for (j = set->n; j > 0 && set->locks[j - 1] > lock; j--)
+			set->locks[j] = set->locks[j - 1];
+		if (j > 0 && set->locks[j - 1] == lock) {
+			for (; j < set->n; j++)
+				set->locks[j] = set->locks[j + 1];
+			continue;
+		}
+		set->locks[j] = lock;
+		set->n++;
+	}
+	for (i = 0; i < set->n; i++)
+		pthread_rwlock_wrlock(set->locks[i]);
+}
+
+static void __unlock_inodes(struct __inode_lockset *set)
+{
+	int i;
+	for (i = set->n - 1; i >= 0; i--)
+		pthread_rwlock_unlock(set->locks[i]);
+	set->n = 0;
+}
+
+static time_t __now()
+{
+	time_t unix_time = time(NULL);
+	if (unix_time == -1)
+		unix_time = 0;
+	return unix_time;
+}
+
+/**
+ * Kernel cache invalidations.
+ *
+ * The notifications are sent by a separate thread: sending one from a
+ * 		request handler can deadlock when the kernel holds a lock on
+ * 		the inode/directory while it waits for the reply of the request.
+ */
+enum __notify_type {
+	NOTIFY_INVAL_INODE,
+	NOTIFY_INVAL_ENTRY,
+};
+
+struct __notification {
+	struct __notification *next;
+	enum __notify_type type;
+	fuse_ino_t ino;					// inode or parent dir of the entry
+	off_t off;						// NOTIFY_INVAL_INODE: -1 for attrs only
+	off_t len;
+	uwufs_file_name_t name;			// NOTIFY_INVAL_ENTRY
+};
+
+static struct {
+	struct fuse_session *se;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct __notification *head;
+	struct __notification *tail;
+	bool running;
+} __notify_queue = {
+	.se = NULL,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+void uwufs_set_session(struct fuse_session *se)
+{
+	__notify_queue.se = se;
+}
+
+static void *__notify_thread(void *arg)
 {
-	(void) conn;
-	// For testing fs journaling/recovery:
-	// 		disables page caching in the kernel at the
-	// 		cost of some performance
-	// cfg->direct_io = 1; // Why does this cause read to always read 4k bytes?
-	cfg->use_ino = 1;
+	(void) arg;
+	struct __notification *n;
+
+	pthread_mutex_lock(&__notify_queue.lock);
+	for (;;) {
+		while (__notify_queue.head == NULL && __notify_queue.running)
+			pthread_cond_wait(&__notify_queue.cond, &__notify_queue.lock);
+		n = __notify_queue.head;
+		if (n == NULL)
+			break; // stopped and drained
+		__notify_queue.head = n->next;
+		if (__notify_queue.head == NULL)
+			__notify_queue.tail = NULL;
+		pthread_mutex_unlock(&__notify_queue.lock);
+
+		// -ENOENT only means the kernel did not cache it
+		if (n->type == NOTIFY_INVAL_INODE)
+			fuse_lowlevel_notify_inval_inode(__notify_queue.se, n->ino,
+											 n->off, n->len);
+		else
+			fuse_lowlevel_notify_inval_entry(__notify_queue.se, n->ino,
+											 n->name, strlen(n->name));
+		free(n);
+
+		pthread_mutex_lock(&__notify_queue.lock);
+	}
+	pthread_mutex_unlock(&__notify_queue.lock);
 	return NULL;
 }
 
-int uwufs_getattr(const char *path,
-				  struct stat *stbuf,
-				  struct fuse_file_info *fi)
+static void __notify(enum __notify_type type, uwufs_blk_t inode_num,
+					 off_t off, off_t len, const char *name)
 {
-	(void) fi;
+	struct __notification *n;
+	fuse_ino_t ino = __fuse_ino(inode_num);
+
+	pthread_mutex_lock(&__notify_queue.lock);
+	if (!__notify_queue.running)
+		goto unlock_ret;
+
+	// writes that keep growing a file queue the same invalidation
+	n = __notify_queue.tail;
+	if (n != NULL && n->type == type && n->ino == ino && n->off == off &&
+		n->len == len && (name == NULL || strcmp(n->name, name) == 0))
+		goto unlock_ret;
+
+	n = (struct __notification *)malloc(sizeof(*n));
+	if (n == NULL)
+		goto unlock_ret; // the kernel cache times out eventually
+	n->next = NULL;
+	n->type = type;
+	n->ino = ino;
+	n->off = off;
+	n->len = len;
+	n->name[0] = '\0';
+	if (name != NULL)
+		strncat(n->name, name, UWUFS_FILE_NAME_SIZE - 1);
+
+	if (__notify_queue.tail != NULL)
+		__notify_queue.tail->next = n;
+	else
+		__notify_queue.head = n;
+	__notify_queue.tail = n;
+	pthread_cond_signal(&__notify_queue.cond);
+
+unlock_ret:
+	pthread_mutex_unlock(&__notify_queue.lock);
+}
 
-	// TODO: Check file permissions
+/**
+ * Writes the timestamps of the inode that touch_inode only kept in
+ * 		memory (-o lazytime) back with the rest of the inode.
+ */
+static void __write_back_times(uwufs_blk_t inode_num)
+{
+	struct uwufs_inode inode;
 
-	uwufs_blk_t inode_num;
-	ssize_t status = namei(device_fd, path, NULL, &inode_num);
-	if (status < 0)
-		return -ENOENT;
+	if (!lazytime_has(inode_num))
+		return;
+	journal_begin();
+	__wrlock_inode(inode_num);
+	// read_inode returns the timestamps, write_inode forgets them
+	if (lazytime_has(inode_num) &&
+		read_inode(device_fd, &inode, inode_num) >= 0)
+		write_inode(device_fd, &inode, sizeof(inode), inode_num);
+	__unlock_inode(inode_num);
+	journal_end();
+}
 
-	memset(stbuf, 0, sizeof(struct stat));
+static void __write_back_all_times(void)
+{
+	uwufs_blk_t *inode_nums;
+	size_t n, i;
+
+	inode_nums = lazytime_pending(&n);
+	for (i = 0; i < n; i++)
+		__write_back_times(inode_nums[i]);
+	free(inode_nums);
+}
 
+/**
+ * relatime: the access time only changes on the first access after a
+ * 		change of the inode, or once a day (applications that check
+ * 		whether a file was read since it changed keep working)
+ */
+static bool __atime_due(const struct uwufs_inode *inode, time_t now)
+{
+	if (uwufs_opts.noatime || uwufs_opts.read_only)
+		return false;
+	return inode->file_atime <= inode->file_mtime ||
+		   inode->file_atime <= inode->file_ctime ||
+		   (uint64_t)now >= inode->file_atime + 24 * 60 * 60;
+}
+
+/**
+ * Sets the access time of the inode if it is due (see __atime_due).
+ * 		Only kept in memory with -o lazytime (see touch_inode).
+ */
+static void __touch_atime(uwufs_blk_t inode_num)
+{
 	struct uwufs_inode inode;
-	status = read_inode(device_fd, &inode, inode_num);
-	if (status < 0)
-		return -ENOENT;
+	time_t now = __now();
+
+	journal_begin();
+	__wrlock_inode(inode_num);
+	if (read_inode(device_fd, &inode, inode_num) >= 0 &&
+		(inode.file_mode & F_TYPE_BITS) != F_TYPE_FREE &&
+		__atime_due(&inode, now)) {
+		inode.file_atime = (uint64_t)now;
+		touch_inode(device_fd, &inode, inode_num);
+	}
+	__unlock_inode(inode_num);
+	journal_end();
+}
+
+/**
+ * Checkpoints the journal and writes the in-memory super blk and lazy
+ * 		timestamps back every uwufs_opts.commit_interval seconds (see
+ * 		journal_checkpoint and mount_super_blk)
+ */
+static struct {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	bool running;
+} __commit_timer = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+static void *__commit_thread(void *arg)
+{
+	(void) arg;
+	struct timespec deadline;
+	double secs;
+
+	pthread_mutex_lock(&__commit_timer.lock);
+	while (__commit_timer.running) {
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		secs = uwufs_opts.commit_interval;
+		deadline.tv_sec += (time_t)secs;
+		deadline.tv_nsec += (long)((secs - (time_t)secs) * 1e9);
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+		pthread_cond_timedwait(&__commit_timer.cond, &__commit_timer.lock,
+							   &deadline);
+		if (!__commit_timer.running)
+			break;
+		pthread_mutex_unlock(&__commit_timer.lock);
+		__write_back_all_times();
+		journal_checkpoint();
+		sync_super_blk(device_fd);
+		pthread_mutex_lock(&__commit_timer.lock);
+	}
+	pthread_mutex_unlock(&__commit_timer.lock);
+	return NULL;
+}
+
+/**
+ * Invalidates the cached attributes of the inode
+ */
+static inline void __notify_inval_attr(uwufs_blk_t inode_num)
+{
+	__notify(NOTIFY_INVAL_INODE, inode_num, -1, 0, NULL);
+}
 
-	uint16_t f_mode = inode.file_mode;
+/**
+ * Invalidates the cached attributes and the cached data starting at `off`
+ */
+static inline void __notify_inval_data(uwufs_blk_t inode_num, off_t off)
+{
+	__notify(NOTIFY_INVAL_INODE, inode_num, off, 0, NULL);
+}
+
+/**
+ * Invalidates the cached dentry `name` in the directory `parent_inode_num`
+ * 		and the attributes of the directory
+ */
+static inline void __notify_inval_entry(uwufs_blk_t parent_inode_num,
+										const char *name)
+{
+	__notify(NOTIFY_INVAL_ENTRY, parent_inode_num, 0, 0, name);
+}
+
+static int __fill_stat(uwufs_blk_t inode_num,
+					   const struct uwufs_inode *inode,
+					   struct stat *stbuf)
+{
+	memset(stbuf, 0, sizeof(struct stat));
+
+	uint16_t f_mode = inode->file_mode;
 	switch (f_mode & F_TYPE_BITS) {
 		case F_TYPE_DIRECTORY:
 			stbuf->st_mode = S_IFDIR | (f_mode & F_PERM_BITS);
@@ -62,123 +458,925 @@ int uwufs_getattr(const char *path,
 		case F_TYPE_REGULAR:
 			stbuf->st_mode = S_IFREG | (f_mode & F_PERM_BITS);
 			break;
+		case F_TYPE_SYMLINK:
+			stbuf->st_mode = S_IFLNK | (f_mode & F_PERM_BITS);
+			break;
 		default:
 			return -EINVAL;
 	}
 	// TODO: Fill in other file types and flags (not implemented yet)
 	stbuf->st_ino = inode_num;
-	stbuf->st_size = inode.file_size;
+	stbuf->st_size = inode->file_size;
 	stbuf->st_blksize = UWUFS_BLOCK_SIZE;
-	stbuf->st_blocks = ((inode.file_size + UWUFS_BLOCK_SIZE - 1)
-						/ UWUFS_BLOCK_SIZE) * 8;
-	stbuf->st_nlink = inode.file_links_count;
-	stbuf->st_uid = inode.file_uid;
-	stbuf->st_gid = inode.file_gid;
-	stbuf->st_ctime = inode.file_ctime;
-	stbuf->st_mtime = inode.file_mtime;
-	stbuf->st_atime = inode.file_atime;
+	// real allocation (holes don't count), in 512 byte units
+	stbuf->st_blocks = inode->file_blocks * (UWUFS_BLOCK_SIZE / 512);
+	if (inode->file_flags & UWUFS_INODE_TAIL_PACKED)
+		stbuf->st_blocks += (inode->file_size % UWUFS_BLOCK_SIZE + 511) / 512;
+	stbuf->st_nlink = inode->file_links_count;
+	stbuf->st_uid = inode->file_uid;
+	stbuf->st_gid = inode->file_gid;
+	stbuf->st_ctime = inode->file_ctime;
+	stbuf->st_mtime = inode->file_mtime;
+	stbuf->st_atime = inode->file_atime;
 	return 0;
 }
 
-// NOTE: Might be uneeded because of uwufs_create
-int uwufs_mknod(const char *path, mode_t mode, dev_t device)
+/**
+ * Per-open file state, stored in fi->fh by open/create so read, write
+ * 		and release never have to look up or read the inode again.
+ */
+struct uwufs_file_handle {
+	uwufs_blk_t inode_num;
+	struct uwufs_open_inode *oi;	// shared with the other handles of the inode
+	// readers of the same handle only share the inode lock, the
+	// cursor is used by one of them at a time
+	pthread_mutex_t dblk_itr_lock;
+	dblk_itr_t dblk_itr;			// block map cursor of this handle
+	uint64_t map_gen;				// oi->map_gen the cursor is valid for
+	// readahead state (see __readahead)
+	pthread_mutex_t ra_lock;
+	off_t ra_next;					// where the last read ended
+	off_t ra_end;					// end of what was handed to the worker
+	uwufs_blk_t ra_blks;			// next window, 0 if off
+	// never changes while the inode is open, unlike the rest of oi->inode
+	// which may only be read under the inode lock
+	uint16_t file_type;
+};
+
+static inline struct uwufs_file_handle *__handle(struct fuse_file_info *fi)
 {
-	return -ENOENT;
+	return (struct uwufs_file_handle *)(uintptr_t)fi->fh;
 }
 
+static ssize_t __open_handle(uwufs_blk_t inode_num,
+							 const struct uwufs_inode *inode,
+							 struct fuse_file_info *fi)
+{
+	struct uwufs_file_handle *fh;
+	fh = (struct uwufs_file_handle *)malloc(sizeof(*fh));
+	if (fh == NULL)
+		return -ENOMEM;
+
+	fh->inode_num = inode_num;
+	if (uwufs_opts.read_only) {
+		// nothing to keep in sync: a private copy instead of the table
+		fh->oi = (struct uwufs_open_inode *)calloc(1, sizeof(*fh->oi));
+		if (fh->oi != NULL)
+			fh->oi->inode = *inode;
+	} else {
+		fh->oi = itable_open(inode_num, inode);
+	}
+	if (fh->oi == NULL) {
+		free(fh);
+		return -ENOMEM;
+	}
+	pthread_mutex_init(&fh->dblk_itr_lock, NULL);
+	fh->dblk_itr = create_dblk_itr(&fh->oi->inode, device_fd, 0);
+	fh->map_gen = fh->oi->map_gen;
+	pthread_mutex_init(&fh->ra_lock, NULL);
+	fh->ra_next = 0;
+	fh->ra_end = 0;
+	fh->ra_blks = 0;
+	fh->file_type = inode->file_mode & F_TYPE_BITS;
+	fi->fh = (uintptr_t)fh;
+	return 0;
+}
 
-int uwufs_mkdir(const char *path,
-				mode_t mode)
+static void __close_handle(struct fuse_file_info *fi)
 {
-#ifdef DEBUG
-	printf("mkdir %s\n", path);
-#endif
+	struct uwufs_file_handle *fh = __handle(fi);
+	if (fh == NULL)
+		return;
+	destroy_dblk_itr(fh->dblk_itr);
+	pthread_mutex_destroy(&fh->dblk_itr_lock);
+	pthread_mutex_destroy(&fh->ra_lock);
+	if (uwufs_opts.read_only)
+		free(fh->oi);
+	else
+		itable_close(fh->inode_num);
+	free(fh);
+	fi->fh = 0;
+}
+
+/**
+ * Returns the block map cursor of the handle, dropping its cached
+ * 		indirect blocks if the block map changed since it was last used.
+ * 		The caller holds dblk_itr_lock or the inode write lock.
+ */
+static dblk_itr_t __handle_dblk_itr(struct uwufs_file_handle *fh)
+{
+	if (fh->map_gen != fh->oi->map_gen) {
+		dblk_itr_invalidate(fh->dblk_itr);
+		fh->map_gen = fh->oi->map_gen;
+	}
+	return fh->dblk_itr;
+}
+
+/**
+ * Readahead.
+ *
+ * Every handle remembers where its last read ended: reads that follow
+ * 		each other are a stream. The blocks ahead of a stream are handed
+ * 		to a worker thread that walks their block map and has the device
+ * 		read them in the background (see prefetch_file), so the reads
+ * 		spliced from the device find them in its page cache. The window
+ * 		starts at UWUFS_RA_MIN_BLKS and doubles each time the stream
+ * 		gets halfway through the last one, up to UWUFS_RA_MAX_BLKS. A
+ * 		read anywhere else halves it, below UWUFS_RA_MIN_BLKS readahead
+ * 		is off until the reads are sequential again.
+ *
+ * The requests are only hints: they are dropped when the queue is full
+ * 		or at unmount.
+ */
+#define UWUFS_RA_MIN_BLKS	((64 << 10) / UWUFS_BLOCK_SIZE)	// 64K
+#define UWUFS_RA_MAX_BLKS	((2 << 20) / UWUFS_BLOCK_SIZE)	// 2MB
+#define UWUFS_RA_QUEUE		64
+
+struct __ra_request {
+	uwufs_blk_t inode_num;
+	off_t offset;
+	size_t size;
+};
+
+static struct {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct __ra_request reqs[UWUFS_RA_QUEUE];	// ring
+	size_t head;
+	size_t count;
+	bool running;
+} __ra_queue = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+static void *__ra_thread(void *arg)
+{
+	(void) arg;
+	struct __ra_request r;
+	struct uwufs_inode inode;
+
+	pthread_mutex_lock(&__ra_queue.lock);
+	for (;;) {
+		while (__ra_queue.count == 0 && __ra_queue.running)
+			pthread_cond_wait(&__ra_queue.cond, &__ra_queue.lock);
+		if (!__ra_queue.running)
+			break;
+		r = __ra_queue.reqs[__ra_queue.head];
+		__ra_queue.head = (__ra_queue.head + 1) % UWUFS_RA_QUEUE;
+		__ra_queue.count--;
+		pthread_mutex_unlock(&__ra_queue.lock);
+
+		// the file may be gone by now: prefetching the wrong blocks
+		// only wastes a read
+		__rdlock_inode(r.inode_num);
+		if (read_inode(device_fd, &inode, r.inode_num) >= 0 &&
+			(inode.file_mode & F_TYPE_BITS) == F_TYPE_REGULAR)
+			prefetch_file(device_fd, r.size, r.offset, &inode);
+		__unlock_inode(r.inode_num);
+
+		pthread_mutex_lock(&__ra_queue.lock);
+	}
+	__ra_queue.count = 0;
+	pthread_mutex_unlock(&__ra_queue.lock);
+	return NULL;
+}
+
+static void __ra_queue_push(uwufs_blk_t inode_num, off_t offset, size_t size)
+{
+	struct __ra_request *r;
+
+	pthread_mutex_lock(&__ra_queue.lock);
+	if (__ra_queue.running && __ra_queue.count < UWUFS_RA_QUEUE) {
+		r = &__ra_queue.reqs[(__ra_queue.head + __ra_queue.count) %
+							 UWUFS_RA_QUEUE];
+		r->inode_num = inode_num;
+		r->offset = offset;
+		r->size = size;
+		__ra_queue.count++;
+		pthread_cond_signal(&__ra_queue.cond);
+	}
+	pthread_mutex_unlock(&__ra_queue.lock);
+}
+
+/**
+ * Feeds a read of `size` bytes at `offset` through the handle to the
+ * 		sequential detector, queues the next window if it is due
+ */
+static void __readahead(struct uwufs_file_handle *fh, off_t offset,
+						size_t size)
+{
+	off_t end = offset + size;
+	off_t start = 0;
+	size_t len = 0;
+
+	pthread_mutex_lock(&fh->ra_lock);
+	// reads in flight together can arrive a bit out of order: skipping
+	// ahead inside the prefetched window is still sequential
+	if (offset == fh->ra_next ||
+		(offset > fh->ra_next && offset < fh->ra_end)) {
+		if (fh->ra_blks == 0) {
+			fh->ra_blks = UWUFS_RA_MIN_BLKS;
+			fh->ra_end = end;
+		}
+		if (end + (off_t)fh->ra_blks * UWUFS_BLOCK_SIZE / 2 >= fh->ra_end) {
+			start = fh->ra_end > end ? fh->ra_end : end;
+			len = fh->ra_blks * UWUFS_BLOCK_SIZE;
+			fh->ra_end = start + len;
+			if (fh->ra_blks < UWUFS_RA_MAX_BLKS)
+				fh->ra_blks *= 2;
+		}
+	} else {
+		fh->ra_blks /= 2;
+		if (fh->ra_blks < UWUFS_RA_MIN_BLKS)
+			fh->ra_blks = 0;
+		fh->ra_end = 0;
+	}
+	fh->ra_next = end;
+	pthread_mutex_unlock(&fh->ra_lock);
+
+	if (len > 0)
+		__ra_queue_push(fh->inode_num, start, len);
+}
+
+/**
+ * Call after `unlink_file` and before writing back the inode. If the
+ * 		links count reached 0, the inode is freed now or once the
+ * 		kernel forgets it.
+ */
+static ssize_t __drop_link(uwufs_blk_t inode_num, struct uwufs_inode *inode)
+{
+	if (inode->file_links_count > 0)
+		return 0;
+	if (itable_mark_unlinked(inode_num))
+		return 0;
+	return remove_file(device_fd, inode, inode_num);
+}
+
+static void __free_unlinked_inode(uwufs_blk_t inode_num)
+{
+	struct uwufs_inode inode;
+	ssize_t status;
+
+	journal_begin();
+	__wrlock_inode(inode_num);
+	status = read_inode(device_fd, &inode, inode_num);
+	if (status < 0)
+		goto unlock_ret;
+	if (inode.file_links_count > 0 ||
+		(inode.file_mode & F_TYPE_BITS) == F_TYPE_FREE)
+		goto unlock_ret;
+
+	status = remove_file(device_fd, &inode, inode_num);
+	if (status < 0)
+		goto unlock_ret;
+	write_inode(device_fd, &inode, sizeof(inode), inode_num);
+unlock_ret:
+	__unlock_inode(inode_num);
+	journal_end();
+}
+
+/**
+ * Gives the kernel a reference to `inode_num` (see itable_lookup).
+ * 		Read-only mounts don't count them: nothing is ever unlinked.
+ */
+static inline void __ref_inode(uwufs_blk_t inode_num)
+{
+	if (!uwufs_opts.read_only)
+		itable_lookup(inode_num);
+}
+
+/**
+ * Drops `nlookup` kernel references to `inode_num`, freeing the inode
+ * 		if it was unlinked and this was the last reference.
+ */
+static void __forget_inode(uwufs_blk_t inode_num, uint64_t nlookup)
+{
+	if (uwufs_opts.read_only)
+		return; // see __ref_inode
+	if (itable_forget(inode_num, nlookup))
+		__free_unlinked_inode(inode_num);
+}
+
+/**
+ * Replies with the entry for `inode_num`. The caller already took the
+ * 		reference the kernel gets (see itable_lookup) while it held the
+ * 		lock of the directory the entry is in, so that a concurrent
+ * 		unlink can't free the inode in between. The reference is
+ * 		dropped again if there is an error.
+ */
+static void __reply_entry(fuse_req_t req,
+						  uwufs_blk_t inode_num,
+						  struct fuse_file_info *fi)
+{
+	struct fuse_entry_param e;
+	struct uwufs_inode inode;
+	ssize_t status;
+
+	__rdlock_inode(inode_num);
+	status = read_inode(device_fd, &inode, inode_num);
+	if (status < 0) {
+		status = -EIO;
+		goto error_ret;
+	}
+
+	memset(&e, 0, sizeof(e));
+	status = __fill_stat(inode_num, &inode, &e.attr);
+	if (status < 0)
+		goto error_ret;
+	e.ino = __fuse_ino(inode_num);
+	e.attr_timeout = uwufs_opts.attr_timeout;
+	e.entry_timeout = uwufs_opts.entry_timeout;
+
+	if (fi != NULL) {
+		status = __open_handle(inode_num, &inode, fi);
+		if (status < 0)
+			goto error_ret;
+	}
+	__unlock_inode(inode_num);
+
+	if (fi == NULL) {
+		fuse_reply_entry(req, &e);
+	} else if (fuse_reply_create(req, &e, fi) == -ENOENT) {
+		// create was interrupted, the kernel won't release the handle
+		__close_handle(fi);
+	}
+	return;
+
+error_ret:
+	__unlock_inode(inode_num);
+	__forget_inode(inode_num, 1);
+	fuse_reply_err(req, -status);
+}
+
+/**
+ * Finds `name` in the directory `parent_inode_num`
+ */
+static ssize_t __lookup_child(uwufs_blk_t parent_inode_num,
+							  const char *name,
+							  uwufs_blk_t *inode_num)
+{
+	struct uwufs_inode parent_inode;
+	ssize_t status;
+
+	if (strlen(name) >= UWUFS_FILE_NAME_SIZE)
+		return -ENAMETOOLONG;
+
+	status = read_inode(device_fd, &parent_inode, parent_inode_num);
+	if (status < 0)
+		return -EIO;
+	if ((parent_inode.file_mode & F_TYPE_BITS) != F_TYPE_DIRECTORY)
+		return -ENOTDIR;
+
+	return next_inode_in_path(device_fd, name, &parent_inode, inode_num);
+}
+
+/**
+ * Finds `name` in the directory `parent_inode_num` and write-locks both
+ * 		the directory and the inode of the entry.
+ *
+ * The entry is looked up under a read lock first (the inode number is
+ * 		needed to know which locks to take), then again once everything
+ * 		is locked in case it changed in between.
+ */
+static ssize_t __lock_entry(uwufs_blk_t parent_inode_num,
+							const char *name,
+							uwufs_blk_t *inode_num,
+							struct __inode_lockset *set)
+{
+	uwufs_blk_t inode_nums[2];
+	ssize_t status;
+
+	for (;;) {
+		__rdlock_inode(parent_inode_num);
+		status = __lookup_child(parent_inode_num, name, inode_num);
+		__unlock_inode(parent_inode_num);
+		if (status < 0)
+			return status;
+
+		inode_nums[0] = parent_inode_num;
+		inode_nums[1] = *inode_num;
+		__lock_inodes(set, inode_nums, 2);
+		status = __lookup_child(parent_inode_num, name, inode_num);
+		if (status == 0 && *inode_num == inode_nums[1])
+			return 0;
+		__unlock_inodes(set);
+		if (status < 0)
+			return status;
+	}
+}
+
+void uwufs_init(void *userdata, struct fuse_conn_info *conn)
+{
+	(void) userdata;
+	struct uwufs_super_blk super_blk;
+
+	// Let the kernel fill its inode/dentry caches from the directory
+	// listing (`ls -l` no longer does a lookup+getattr per entry)
+	if (conn->capable & FUSE_CAP_READDIRPLUS)
+		conn->want |= FUSE_CAP_READDIRPLUS;
+
+	// libfuse lowers max_write to the size of its buffers after init,
+	// the kernel allows reads (and max_pages) as large as max_write
+	conn->max_write = uwufs_opts.max_write ? uwufs_opts.max_write : UINT_MAX;
+	// starts at the largest window the kernel allows
+	if (uwufs_opts.max_readahead != 0 &&
+		uwufs_opts.max_readahead < conn->max_readahead)
+		conn->max_readahead = uwufs_opts.max_readahead;
+	uwufs_opts.max_readahead = conn->max_readahead;
+
+	// read replies are spliced from the device (see uwufs_read), write
+	// requests arrive in a pipe (see uwufs_write_buf)
+	conn->want &= ~(FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE |
+					FUSE_CAP_SPLICE_MOVE);
+	if (uwufs_opts.splice)
+		conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ |
+			FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+
+	// reads of a file don't wait for each other (they only share the
+	// inode read lock)
+	if (uwufs_opts.async_read && (conn->capable & FUSE_CAP_ASYNC_READ))
+		conn->want |= FUSE_CAP_ASYNC_READ;
+	else
+		conn->want &= ~FUSE_CAP_ASYNC_READ;
+	uwufs_opts.async_read = (conn->want & FUSE_CAP_ASYNC_READ) != 0;
+
+	// buffered writes return once they are in the page cache, the kernel
+	// writes the pages back in large requests and owns the size and
+	// times of the files it caches (see writeback_cache_enable)
+	if (uwufs_opts.writeback_cache && !uwufs_opts.read_only &&
+		(conn->capable & FUSE_CAP_WRITEBACK_CACHE))
+		conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+	else
+		conn->want &= ~FUSE_CAP_WRITEBACK_CACHE;
+	uwufs_opts.writeback_cache = (conn->want & FUSE_CAP_WRITEBACK_CACHE) != 0;
+	writeback_cache_enable(uwufs_opts.writeback_cache);
+
+	pthread_mutex_lock(&__ra_queue.lock);
+	__ra_queue.running = pthread_create(&__ra_queue.thread, NULL,
+										__ra_thread, NULL) == 0;
+	pthread_mutex_unlock(&__ra_queue.lock);
+
+	if (uwufs_opts.read_only) {
+		// never changes, statfs answers from this copy
+		if (read_blk(device_fd, &__ro_super_blk, 0) < 0)
+			memset(&__ro_super_blk, 0, sizeof(__ro_super_blk));
+		else if (__ro_super_blk.state != UWUFS_STATE_CLEAN)
+			printf("uwufs: not cleanly unmounted, mount read-write once "
+				   "to replay the journal\n");
+		return;
+	}
+
+	// started here and not in main because fuse_daemonize forks
+	if (__notify_queue.se != NULL) {
+		__notify_queue.running = true;
+		if (pthread_create(&__notify_queue.thread, NULL,
+						   __notify_thread, NULL) != 0)
+			__notify_queue.running = false;
+	}
+
+	lazytime_enable(uwufs_opts.lazytime);
+
+	// everything after the super blk is laid out for its block size (which
+	// mount.uwu checked), replay before mount_super_blk looks at the inodes
+	if (read_super_blk(device_fd, &super_blk) < 0 ||
+		set_blk_size(UWUFS_SUPER_BLK_SIZE(&super_blk)) < 0 ||
+		journal_open(device_fd, &super_blk) < 0)
+		printf("uwufs: cannot open the journal, writing through\n");
+	if (mount_super_blk(device_fd) < 0)
+		printf("uwufs: cannot load the super blk, writing it through\n");
+	if (uwufs_opts.commit_interval > 0) {
+		__commit_timer.running = true;
+		if (pthread_create(&__commit_timer.thread, NULL,
+						   __commit_thread, NULL) != 0)
+			__commit_timer.running = false;
+	}
+	alloc_cache_start(device_fd);
+}
+
+void uwufs_destroy(void *userdata)
+{
+	(void) userdata;
+	uwufs_blk_t inode_num;
+
+	pthread_mutex_lock(&__ra_queue.lock);
+	bool running = __ra_queue.running;
+	__ra_queue.running = false;
+	pthread_cond_signal(&__ra_queue.cond);
+	pthread_mutex_unlock(&__ra_queue.lock);
+	if (running)
+		pthread_join(__ra_queue.thread, NULL);
+
+	pthread_mutex_lock(&__notify_queue.lock);
+	running = __notify_queue.running;
+	__notify_queue.running = false;
+	pthread_cond_signal(&__notify_queue.cond);
+	pthread_mutex_unlock(&__notify_queue.lock);
+	if (running)
+		pthread_join(__notify_queue.thread, NULL);
+
+	while ((inode_num = itable_pop_unlinked()) != 0)
+		__free_unlinked_inode(inode_num);
+
+	pthread_mutex_lock(&__commit_timer.lock);
+	running = __commit_timer.running;
+	__commit_timer.running = false;
+	pthread_cond_signal(&__commit_timer.cond);
+	pthread_mutex_unlock(&__commit_timer.lock);
+	if (running)
+		pthread_join(__commit_timer.thread, NULL);
+
+	__write_back_all_times();
+	// leaves exact free counters in the super blk, marked clean
+	journal_close();
+	alloc_cache_stop(device_fd);
+	unmount_super_blk(device_fd);
+}
+
+void uwufs_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	uwufs_blk_t inode_num;
+	ssize_t status;
+
+	__rdlock_inode(__inode_num(parent));
+	status = __lookup_child(__inode_num(parent), name, &inode_num);
+	if (status == 0)
+		__ref_inode(inode_num);
+	__unlock_inode(__inode_num(parent));
+	if (status == -ENOENT && uwufs_opts.negative_timeout > 0) {
+		// negative entry: the kernel caches that `name` does not exist
+		struct fuse_entry_param e;
+		memset(&e, 0, sizeof(e));
+		e.entry_timeout = uwufs_opts.negative_timeout;
+		fuse_reply_entry(req, &e);
+		return;
+	}
+	if (status < 0) {
+		fuse_reply_err(req, -status);
+		return;
+	}
+	__reply_entry(req, inode_num, NULL);
+}
+
+void uwufs_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup)
+{
+	__forget_inode(__inode_num(ino), nlookup);
+	fuse_reply_none(req);
+}
+
+void uwufs_forget_multi(fuse_req_t req, size_t count,
+						struct fuse_forget_data *forgets)
+{
+	size_t i;
+	for (i = 0; i < count; i++)
+		__forget_inode(__inode_num(forgets[i].ino), forgets[i].nlookup);
+	fuse_reply_none(req);
+}
+
+void uwufs_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	// TODO: Check file permissions
+
+	uwufs_blk_t inode_num = __inode_num(ino);
+	struct uwufs_inode inode;
+	struct stat stbuf;
+	ssize_t status;
+	__rdlock_inode(inode_num);
+	// fstat: the open file handle already has the inode
+	if (fi != NULL && __handle(fi) != NULL) {
+		inode = __handle(fi)->oi->inode;
+	} else {
+		status = read_inode(device_fd, &inode, inode_num);
+		if (status < 0) {
+			__unlock_inode(inode_num);
+			fuse_reply_err(req, ENOENT);
+			return;
+		}
+	}
+	__unlock_inode(inode_num);
+
+	status = __fill_stat(inode_num, &inode, &stbuf);
+	if (status < 0) {
+		fuse_reply_err(req, -status);
+		return;
+	}
+	fuse_reply_attr(req, &stbuf, uwufs_opts.attr_timeout);
+}
+
+void uwufs_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+				   int to_set, struct fuse_file_info *fi)
+{
+	if (__reject_read_only(req))
+		return;
+	(void) fi;
+	ssize_t status;
+	uwufs_blk_t inode_num = __inode_num(ino);
+	struct uwufs_inode inode;
+	struct stat stbuf;
+	time_t unix_time = __now();
+
+	journal_begin();
+	__wrlock_inode(inode_num);
+	status = read_inode(device_fd, &inode, inode_num);
+	if (status < 0)
+		goto error_ret;
+
+	// truncate
+	if (to_set & FUSE_SET_ATTR_SIZE) {
+		if ((inode.file_mode & F_TYPE_BITS) == F_TYPE_DIRECTORY) {
+			status = -EISDIR;
+			goto error_ret;
+		}
+		if (attr->st_size < 0) {
+			status = -EINVAL;
+			goto error_ret;
+		}
+		if ((uint64_t)attr->st_size != inode.file_size) {
+			status = truncate_file(device_fd, inode_num, attr->st_size);
+			if (status < 0)
+				goto error_ret;
+			status = read_inode(device_fd, &inode, inode_num);
+			if (status < 0)
+				goto error_ret;
+			inode.file_mtime = (uint64_t)unix_time;
+		}
+	}
+
+	// chmod
+	if (to_set & FUSE_SET_ATTR_MODE)
+		inode.file_mode = (inode.file_mode & F_TYPE_BITS)
+			| (attr->st_mode & F_PERM_BITS);
+
+	// chown
+	if (to_set & FUSE_SET_ATTR_UID)
+		inode.file_uid = attr->st_uid;
+	if (to_set & FUSE_SET_ATTR_GID)
+		inode.file_gid = attr->st_gid;
+
+	// utimens
+	if (to_set & FUSE_SET_ATTR_ATIME_NOW)
+		inode.file_atime = (uint64_t)unix_time;
+	else if (to_set & FUSE_SET_ATTR_ATIME)
+		inode.file_atime = (uint64_t)attr->st_atime;
+	if (to_set & FUSE_SET_ATTR_MTIME_NOW)
+		inode.file_mtime = (uint64_t)unix_time;
+	else if (to_set & FUSE_SET_ATTR_MTIME)
+		inode.file_mtime = (uint64_t)attr->st_mtime;
+
+	if (to_set & FUSE_SET_ATTR_CTIME)
+		inode.file_ctime = (uint64_t)attr->st_ctime;
+	else
+		inode.file_ctime = (uint64_t)unix_time;
+
+	status = write_inode(device_fd, &inode, sizeof(inode), inode_num);
+	if (status < 0)
+		goto error_ret;
+
+	__unlock_inode(inode_num);
+	journal_end();
+
+	if (to_set & FUSE_SET_ATTR_SIZE)
+		__notify_inval_data(inode_num, inode.file_size);
+	else
+		__notify_inval_attr(inode_num);
+
+	status = __fill_stat(inode_num, &inode, &stbuf);
+	if (status < 0)
+		goto reply_err_ret;
+	fuse_reply_attr(req, &stbuf, uwufs_opts.attr_timeout);
+	return;
+
+error_ret:
+	__unlock_inode(inode_num);
+	journal_end();
+reply_err_ret:
+	fuse_reply_err(req, status == -1 ? EIO : -status);
+}
+
+/**
+ * Creates a regular file, or a symlink to `link_target` if it isn't NULL
+ * 		(the target is written with write_file: a short one stays in the
+ * 		inode, see UWUFS_INLINE_DATA_SIZE)
+ */
+// NOTE: Might want to move to file_operations if not using fuse_file_info
+static ssize_t __create_file(fuse_req_t req,
+							 uwufs_blk_t parent_dir_inode_num,
+							 const char *name,
+							 mode_t mode,
+							 const char *link_target,
+							 uwufs_blk_t *inode_num)
+{
+	uwufs_blk_t child_file_inode_num;
+	struct uwufs_inode child_file_inode;
+	const struct fuse_ctx *fuse_ctx = fuse_req_ctx(req);
+	time_t unix_time = __now();
 	ssize_t status;
-	time_t unix_time;
-	// get the uid etc of the user
-	struct fuse_context *fuse_ctx = fuse_get_context();
 
 	// FIX: Here to make sure the append_dblk in add_directory_entry
 	// always have enough data blocks (remove it after the bug is fixed)
-	struct uwufs_super_blk super_blk;
-	status = read_blk(device_fd, &super_blk, 0);
+	status = check_free_blks(device_fd, 5);
 	if (status < 0)
 		return status;
-	if (super_blk.free_blks_left <= 7) {
-		return -ENOSPC;
+
+	journal_begin();
+	__wrlock_inode(parent_dir_inode_num);
+	status = __lookup_child(parent_dir_inode_num, name, &child_file_inode_num);
+	if (status == 0)
+		status = -EEXIST;
+	if (status != -ENOENT)
+		goto unlock_ret;
+
+#ifdef DEBUG
+	printf("__create_file: creating new file\n");
+#endif
+	// Get new empty inode
+	status = find_free_inode(device_fd, &child_file_inode_num);
+	if (status < 0)
+		goto unlock_ret;
+
+	// Init child file inode
+	memset(&child_file_inode, 0, sizeof(struct uwufs_inode));
+	// TODO: Other file perms
+	if (link_target != NULL)
+		child_file_inode.file_mode = F_TYPE_SYMLINK | 0777;
+	else
+		child_file_inode.file_mode = F_TYPE_REGULAR | (mode & F_PERM_BITS);
+	child_file_inode.file_size = 0;
+	child_file_inode.file_links_count = 1;
+	child_file_inode.file_uid = fuse_ctx->uid;
+	child_file_inode.file_gid = fuse_ctx->gid;
+	child_file_inode.file_ctime = (uint64_t)unix_time;
+	child_file_inode.file_mtime = (uint64_t)unix_time;
+	child_file_inode.file_atime = (uint64_t)unix_time;
+
+	status = write_inode(device_fd, &child_file_inode,
+				   sizeof(child_file_inode), child_file_inode_num);
+	if (status < 0) {
+		status = -EIO;
+		goto free_inode_ret;
+	}
+	if (link_target != NULL) {
+		status = write_file(device_fd, link_target, strlen(link_target), 0,
+							&child_file_inode, child_file_inode_num, NULL);
+		if (status < 0) {
+			remove_file(device_fd, &child_file_inode, child_file_inode_num);
+			goto free_inode_ret;
+		}
 	}
 
-	// split path into parent + child parts
-	char parent_path[strlen(path)+1];
-	char child_dir[UWUFS_FILE_NAME_SIZE];
-	status = split_path_parent_child(path, parent_path, child_dir);
+	// Add child file entry to parent dir
+	status = add_directory_file_entry(device_fd, parent_dir_inode_num,
+					   name, child_file_inode_num, 0);
 	if (status < 0)
-		return status;
+		goto free_inode_ret;
+	itable_lookup(child_file_inode_num); // see __reply_entry
+	__unlock_inode(parent_dir_inode_num);
+	journal_end();
+
+	__notify_inval_attr(parent_dir_inode_num);
+	*inode_num = child_file_inode_num;
+	return 0;
+
+free_inode_ret:
+	free_inode(device_fd, child_file_inode_num);
+unlock_ret:
+	__unlock_inode(parent_dir_inode_num);
+	journal_end();
+	return status;
+}
+
+// NOTE: Might be uneeded because of uwufs_create
+void uwufs_mknod(fuse_req_t req, fuse_ino_t parent, const char *name,
+				 mode_t mode, dev_t rdev)
+{
+	if (__reject_read_only(req))
+		return;
+	(void) rdev;
+	uwufs_blk_t inode_num;
+	ssize_t status;
 
-	// read root inode for namei
-	struct uwufs_inode root_inode;
-	status = read_inode(device_fd, &root_inode, UWUFS_ROOT_DIR_INODE);
-	RETURN_IF_ERROR(status);
+	if (!S_ISREG(mode)) {
+		fuse_reply_err(req, EINVAL);
+		return;
+	}
+	status = __create_file(req, __inode_num(parent), name, mode, NULL,
+						   &inode_num);
+	if (status < 0) {
+		fuse_reply_err(req, -status);
+		return;
+	}
+	__reply_entry(req, inode_num, NULL);
+}
+
+void uwufs_symlink(fuse_req_t req, const char *link, fuse_ino_t parent,
+				   const char *name)
+{
+	if (__reject_read_only(req))
+		return;
+	uwufs_blk_t inode_num;
+	ssize_t status;
 
-	// find the parent path inode
-	uwufs_blk_t parent_dir_inode_num;
-	status = namei(device_fd, parent_path, &root_inode, &parent_dir_inode_num);
+	if (strlen(link) > UWUFS_SYMLINK_MAX_SIZE) {
+		fuse_reply_err(req, ENAMETOOLONG);
+		return;
+	}
+	status = __create_file(req, __inode_num(parent), name, 0, link,
+						   &inode_num);
+	if (status < 0) {
+		fuse_reply_err(req, status == -1 ? EIO : -status);
+		return;
+	}
+	__reply_entry(req, inode_num, NULL);
+}
+
+void uwufs_readlink(fuse_req_t req, fuse_ino_t ino)
+{
+	uwufs_blk_t inode_num = __inode_num(ino);
+	struct uwufs_inode inode;
+	char target[UWUFS_SYMLINK_MAX_SIZE + 1];
+	ssize_t status;
+
+	__rdlock_inode(inode_num);
+	status = read_inode(device_fd, &inode, inode_num);
+	if (status >= 0)
+		status = read_symlink(device_fd, &inode, target);
+	__unlock_inode(inode_num);
+	if (status < 0) {
+		fuse_reply_err(req, status == -1 ? EIO : -status);
+		return;
+	}
+	fuse_reply_readlink(req, target);
+}
+
+void uwufs_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
+				 mode_t mode)
+{
+	if (__reject_read_only(req))
+		return;
+#ifdef DEBUG
+	printf("mkdir %s\n", name);
+#endif
+	ssize_t status;
+	time_t unix_time;
+	uwufs_blk_t parent_dir_inode_num = __inode_num(parent);
+	uwufs_blk_t child_dir_inode_num;
+	uwufs_blk_t new_blk_num;
+	struct uwufs_directory_data_blk new_dir_blk;
+	struct uwufs_inode new_inode;
+	// get the uid etc of the user
+	const struct fuse_ctx *fuse_ctx = fuse_req_ctx(req);
+
+	// FIX: Here to make sure the append_dblk in add_directory_entry
+	// always have enough data blocks (remove it after the bug is fixed)
+	status = check_free_blks(device_fd, 7);
 	if (status < 0)
-		return -ENOENT;
+		goto error_ret;
+
+	// make sure the parent dir exists and the child doesn't
+	journal_begin();
+	__wrlock_inode(parent_dir_inode_num);
+	status = __lookup_child(parent_dir_inode_num, name, &child_dir_inode_num);
+	if (status == 0)
+		status = -EEXIST;
+	if (status != -ENOENT)
+		goto unlock_ret;
 
 	// find free inode for new child dir
-	uwufs_blk_t child_dir_inode_num;
 	status = find_free_inode(device_fd, &child_dir_inode_num);
-	RETURN_IF_ERROR(status);
+	if (status < 0)
+		goto unlock_ret;
 
 	// allocate a new data blk
-	uwufs_blk_t new_blk_num;
 	status = malloc_blk(device_fd, &new_blk_num);
 	if (status < 0 || new_blk_num <= 0)
-		return status;
-
-	// update the parent data blk 
-	status = add_directory_file_entry(device_fd, parent_dir_inode_num,
-						child_dir, child_dir_inode_num, 1);
-	if (status < 0) {
-		free_blk(device_fd, new_blk_num);
-		return status;
-	}
+		goto free_inode_ret;
 
 	// new child dir: populate . and .. entry
-	struct uwufs_directory_data_blk new_dir_blk;
-	memset(&new_dir_blk, 0, sizeof(new_dir_blk));
+	memset(&new_dir_blk, 0, UWUFS_BLOCK_SIZE);
 	status = put_directory_file_entry(&new_dir_blk, ".", child_dir_inode_num);
-	if (status < 0) {
-		free_blk(device_fd, new_blk_num);
-		return status;
-	}
+	if (status < 0)
+		goto free_blk_ret;
 
 	status = put_directory_file_entry(&new_dir_blk, "..", parent_dir_inode_num);
-	if (status < 0) {
-		free_blk(device_fd, new_blk_num);
-		return status;
-	}
+	if (status < 0)
+		goto free_blk_ret;
 
 	// Write entries to actual data block
-	status = write_blk(device_fd, &new_dir_blk, new_blk_num);
-	if (status < 0) {
-		free_blk(device_fd, new_blk_num);
-		return status;
-	}
+	status = write_meta_blk(device_fd, &new_dir_blk, new_blk_num);
+	if (status < 0)
+		goto free_blk_ret;
 
 	// TODO: add other permissions, metadata, etc
-	struct uwufs_inode new_inode;
 	memset(&new_inode, 0, sizeof(new_inode));
 	new_inode.file_mode = F_TYPE_DIRECTORY | (F_PERM_BITS & mode);
 	new_inode.direct_blks[0] = new_blk_num;
+	new_inode.file_blocks = 1;
 	new_inode.file_size = UWUFS_BLOCK_SIZE;
 	new_inode.file_links_count = 2; // includes "." refer to itself
 	new_inode.file_uid = fuse_ctx->uid;
 	new_inode.file_gid = fuse_ctx->gid;
-	unix_time = time(NULL);
-	if (unix_time == -1)
-		unix_time = 0;
+	unix_time = __now();
 	new_inode.file_ctime = (uint64_t)unix_time;
 	new_inode.file_mtime = (uint64_t)unix_time;
 	new_inode.file_atime = (uint64_t)unix_time;
@@ -186,585 +1384,1162 @@ int uwufs_mkdir(const char *path,
 	// write new dir inode
 	status = write_inode(device_fd, &new_inode, sizeof(new_inode),
 						 child_dir_inode_num);
-	if (status < 0) {
-		free_blk(device_fd, new_blk_num);
-		return status;
-	}
-	
-	return 0;
+	if (status < 0)
+		goto free_blk_ret;
+
+	// update the parent data blk (the new dir is visible from here on)
+	status = add_directory_file_entry(device_fd, parent_dir_inode_num,
+						name, child_dir_inode_num, 1);
+	if (status < 0)
+		goto free_blk_ret;
+	itable_lookup(child_dir_inode_num); // see __reply_entry
+	__unlock_inode(parent_dir_inode_num);
+	journal_end();
+
+	__notify_inval_attr(parent_dir_inode_num);
+	__reply_entry(req, child_dir_inode_num, NULL);
+	return;
+
+free_blk_ret:
+	free_blk(device_fd, new_blk_num);
+free_inode_ret:
+	free_inode(device_fd, child_dir_inode_num);
+unlock_ret:
+	__unlock_inode(parent_dir_inode_num);
+	journal_end();
+error_ret:
+	fuse_reply_err(req, status == -1 ? EIO : -status);
 }
 
-int uwufs_unlink(const char *path)
+void uwufs_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
 {
+	if (__reject_read_only(req))
+		return;
+	uwufs_blk_t parent_inode_num = __inode_num(parent);
 	uwufs_blk_t inode_num;
 	struct uwufs_inode inode;
-	ssize_t status = namei(device_fd, path, NULL, &inode_num);
+	struct __inode_lockset locks;
+	ssize_t status;
+
+	journal_begin();
+	status = __lock_entry(parent_inode_num, name, &inode_num, &locks);
 	if (status < 0)
-		return -ENOENT;
+		goto reply_err_ret;
 
 	status = read_inode(device_fd, &inode, inode_num);
 	if (status < 0)
-		return status;
+		goto error_ret;
 
-	// TODO: Check file permissions using fuse_context
+	// TODO: Check file permissions using fuse_req_ctx
 
 	switch (inode.file_mode & F_TYPE_BITS) {
 		case F_TYPE_REGULAR:
-		// case F_TYPE_DIRECTORY: // should be handled by rmdir
-			status = unlink_file(device_fd, path, &inode, inode_num, 0);
-			if (status < 0) return status;
-
-			// check if link count is 0
-			if (inode.file_links_count == 0) {
-				// free the data blk and inode
-				status = remove_file(device_fd, &inode, inode_num);
-				if (status < 0) return status;
-			}
+		case F_TYPE_SYMLINK:
+			status = unlink_file(device_fd, parent_inode_num, name, &inode,
+								 inode_num, 0);
+			if (status < 0)
+				goto error_ret;
+
+			// free the data blks and inode if link count is 0
+			status = __drop_link(inode_num, &inode);
+			if (status < 0)
+				goto error_ret;
 
 			// write back to inode
 			status = write_inode(device_fd, &inode, sizeof(inode), inode_num);
-			if (status < 0) return status;
-
-			return 0;
-		// TODO: other file types (Ex: symlinks don't have data blks)
+			if (status < 0)
+				goto error_ret;
+
+			__unlock_inodes(&locks);
+			journal_end();
+
+			__notify_inval_entry(parent_inode_num, name);
+			__notify_inval_attr(inode_num);
+			fuse_reply_err(req, 0);
+			return;
+		case F_TYPE_DIRECTORY: // should be handled by rmdir
+			status = -EISDIR;
+			goto error_ret;
 		default:
 #ifdef DEBUG
 			printf("uwufs_unlink: unknown file type %d\n",
 		  inode.file_mode & F_TYPE_BITS);
 #endif
-			return -EINVAL;
+			status = -EINVAL;
+			goto error_ret;
 	}
-	return -EIO;
-}
 
+error_ret:
+	__unlock_inodes(&locks);
+reply_err_ret:
+	journal_end();
+	fuse_reply_err(req, status == -1 ? EIO : -status);
+}
 
-int uwufs_rmdir(const char *path)
-{	
-	// split parent & child parts
+void uwufs_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	if (__reject_read_only(req))
+		return;
 	ssize_t status;
-	char parent_path[strlen(path)+1];
-	char child_path[UWUFS_FILE_NAME_SIZE];
-	status = split_path_parent_child(path, parent_path, child_path);
-	RETURN_IF_ERROR(status);
-
-	if (strcmp(child_path, ".") == 0)
-		return -EINVAL;
-	if (strcmp(child_path, "..") == 0)
-		return -ENOTEMPTY;
+	uwufs_blk_t parent_inode_num = __inode_num(parent);
+	uwufs_blk_t child_dir_inode_num;
+	struct uwufs_inode child_dir_inode;
+	struct __inode_lockset locks;
 
-	// checking if the user is attempting to remove the root directory
-	if (strcmp(parent_path, "") == 0 &&
-		strcmp(child_path, "") == 0 )  {
-			return -EPERM; // not sure if better error code to use here
+	if (strcmp(name, ".") == 0) {
+		status = -EINVAL;
+		goto reply_err_ret;
+	}
+	if (strcmp(name, "..") == 0) {
+		status = -ENOTEMPTY;
+		goto reply_err_ret;
 	}
 
-	// get child inode
-	uwufs_blk_t child_dir_inode_num;
-	status = namei(device_fd, path, NULL, &child_dir_inode_num);
-	RETURN_IF_ERROR(status);
+	// get and lock child inode
+	journal_begin();
+	status = __lock_entry(parent_inode_num, name, &child_dir_inode_num, &locks);
+	if (status < 0)
+		goto end_ret;
 
-	// read child inode 
-	struct uwufs_inode child_dir_inode;
+	// read child inode
 	status = read_inode(device_fd, &child_dir_inode, child_dir_inode_num);
-	RETURN_IF_ERROR(status);
+	if (status < 0)
+		goto error_ret;
 
-	if ((child_dir_inode.file_mode & F_TYPE_BITS) != F_TYPE_DIRECTORY)
-		return -ENOTDIR;
+	if ((child_dir_inode.file_mode & F_TYPE_BITS) != F_TYPE_DIRECTORY) {
+		status = -ENOTDIR;
+		goto error_ret;
+	}
 
 	// TODO: check permissions to see if user allowed to rmdir
 
 	// check if dir empty (assume entries are semi packed - see is_directory_empty)
-	if (!is_directory_empty(device_fd, &child_dir_inode))
-		return -ENOTEMPTY;
+	if (!is_directory_empty(device_fd, &child_dir_inode)) {
+		status = -ENOTEMPTY;
+		goto error_ret;
+	}
 
 	// check only 2 links as well
-	// NOTE: this shouldn't happen, but handle in case 
+	// NOTE: this shouldn't happen, but handle in case
 	if (child_dir_inode.file_links_count != 2) {
 #ifdef DEBUG
 		printf("The directory has %d links but also has exactly 2 entries\n",
 				 child_dir_inode.file_links_count);
-#endif			
-		return -ENOTEMPTY;
+#endif
+		status = -ENOTEMPTY;
+		goto error_ret;
 	}
 
 	// remove the entry for the child dir from the parent dir blks
-	status = unlink_file(device_fd, path, &child_dir_inode, 
+	status = unlink_file(device_fd, parent_inode_num, name, &child_dir_inode,
 				         child_dir_inode_num, -1);
-	if (status < 0) return -EIO;
+	if (status < 0) {
+		status = -EIO;
+		goto error_ret;
+	}
 
-	// remove child dir (sets inode to FREE & clears data blks)
-	status = remove_file(device_fd, &child_dir_inode, child_dir_inode_num);
-	if (status < 0) return -EIO;
-	status = write_inode(device_fd, &child_dir_inode, 
+	// remove child dir (sets inode to FREE & clears data blks) once
+	// the kernel forgets it ("." is the other link)
+	child_dir_inode.file_links_count = 0;
+	status = __drop_link(child_dir_inode_num, &child_dir_inode);
+	if (status < 0) {
+		status = -EIO;
+		goto error_ret;
+	}
+	status = write_inode(device_fd, &child_dir_inode,
 						 sizeof(struct uwufs_inode), child_dir_inode_num);
-	if (status < 0) return -EIO;
+	if (status < 0) {
+		status = -EIO;
+		goto error_ret;
+	}
 
-	return 0;
+	__unlock_inodes(&locks);
+	journal_end();
+
+	__notify_inval_entry(parent_inode_num, name);
+	fuse_reply_err(req, 0);
+	return;
+
+error_ret:
+	__unlock_inodes(&locks);
+end_ret:
+	journal_end();
+reply_err_ret:
+	fuse_reply_err(req, -status);
 }
 
-int uwufs_rename(const char *old_path, const char *new_path, unsigned int flags)
+/**
+ * Points the ".." entry of a moved directory to its new parent
+ */
+static ssize_t __set_dotdot(struct uwufs_inode *dir_inode,
+							uwufs_blk_t new_parent_inode_num)
 {
-#ifdef __linux__
+	struct uwufs_directory_data_blk dir_data_blk;
+	ssize_t status = read_blk(device_fd, &dir_data_blk,
+							  dir_inode->direct_blks[0]);
+	if (status < 0)
+		return status;
+
+	status = find_directory_file_entry(&dir_data_blk, "..", 2,
+									   uwufs_name_hash("..", 2));
+	if (status < 0)
+		return -EIO;
+	dir_data_blk.file_entries[status].inode_num = new_parent_inode_num;
+
+	return write_meta_blk(device_fd, &dir_data_blk, dir_inode->direct_blks[0]);
+}
+
+void uwufs_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+				  fuse_ino_t new_parent, const char *new_name,
+				  unsigned int flags)
+{
+	if (__reject_read_only(req))
+		return;
+	uwufs_blk_t parent_inode_num = __inode_num(parent);
+	uwufs_blk_t new_parent_inode_num = __inode_num(new_parent);
 	uwufs_blk_t inode_num;
 	uwufs_blk_t inode_num_other;
 	struct uwufs_inode inode_old;
 	struct uwufs_inode inode_new;
-	int nlinks_change = 0;
-	int status2;
-	char old_parent_path[strlen(old_path)+1];
-	char old_child_dir[UWUFS_FILE_NAME_SIZE];
-
-	char new_parent_path[strlen(new_path)+1];
-	char new_child_dir[UWUFS_FILE_NAME_SIZE];
-
+	uwufs_blk_t inode_nums[UWUFS_MAX_LOCKED_INODES];
+	struct __inode_lockset locks;
 	bool is_dir;
+	bool other_is_dir;
+	ssize_t status;
 
-	ssize_t status = namei(device_fd, old_path, NULL, &inode_num);
-	if (status < 0)
-		return -ENOENT;
 	// TODO: edit m,a,c time
+	// NOTE: RENAME_EXCHANGE and RENAME_WHITEOUT are unsupported for now
+	if (flags & ~RENAME_NOREPLACE) {
+		status = -EINVAL;
+		goto reply_err_ret;
+	}
 
-	if (flags == RENAME_WHITEOUT) {
-		status = namei(device_fd, new_path, NULL, &inode_num_other);
-		if (status == -ENOENT) {
-			goto move_file_entry;
-		} else if (status < 0) {
-			return status;
-		}
-		// remove the other file b/c it exists
-		status = read_inode(device_fd, &inode_new, inode_num_other);
+	// Lock both directories and both entries (see __lock_entry)
+	journal_begin();
+	for (;;) {
+		__rdlock_inode(parent_inode_num);
+		status = __lookup_child(parent_inode_num, name, &inode_num);
+		__unlock_inode(parent_inode_num);
 		if (status < 0)
-			return status;
-		nlinks_change = (inode_new.file_mode & F_TYPE_BITS & F_TYPE_DIRECTORY) ? 1 : 0;
-		status = unlink_file(device_fd, new_path, &inode_new, inode_num_other,
-					   nlinks_change);
-		if (status < 0) return status;
-		if (inode_new.file_links_count == 0) {
-			// free the data blk and inode
-			status = remove_file(device_fd, &inode_new, inode_num_other);
-			if (status < 0) return status;
+			goto end_ret;
+		__rdlock_inode(new_parent_inode_num);
+		status = __lookup_child(new_parent_inode_num, new_name,
+								&inode_num_other);
+		__unlock_inode(new_parent_inode_num);
+		if (status == -ENOENT)
+			inode_num_other = 0;
+		else if (status < 0)
+			goto end_ret;
+
+		inode_nums[0] = parent_inode_num;
+		inode_nums[1] = new_parent_inode_num;
+		inode_nums[2] = inode_num;
+		inode_nums[3] = inode_num_other;
+		__lock_inodes(&locks, inode_nums, 4);
+
+		status = __lookup_child(parent_inode_num, name, &inode_num);
+		if (status == 0 && inode_num == inode_nums[2]) {
+			status = __lookup_child(new_parent_inode_num, new_name,
+									&inode_num_other);
+			if (status == -ENOENT)
+				inode_num_other = 0;
+			if ((status == 0 || status == -ENOENT) &&
+				inode_num_other == inode_nums[3])
+				break;
 		}
-		status = write_inode(device_fd, &inode_new, sizeof(inode_new), inode_num_other);
-		if (status < 0) return status;
+		__unlock_inodes(&locks);
+	}
+
+	status = read_inode(device_fd, &inode_old, inode_num);
+	if (status < 0)
+		goto error_ret;
+	is_dir = (inode_old.file_mode & F_TYPE_BITS) == F_TYPE_DIRECTORY;
+
+	if (inode_num_other == 0)
+		goto move_file_entry;
+
+	// new name already exists
+	if (flags & RENAME_NOREPLACE) {
+		status = -EEXIST;
+		goto error_ret;
+	}
+	if (inode_num_other == inode_num) { // both are links to the same file
+		__unlock_inodes(&locks);
+		journal_end();
+		fuse_reply_err(req, 0);
+		return;
+	}
 
-		// regular rename file
-		goto move_file_entry;
-	} else if (flags == RENAME_NOREPLACE) { // NOTE: "mv" only uses this?
-		status = namei(device_fd, new_path, NULL, &inode_num_other);
-		if (status == -ENOENT) {
-			// regular rename file
-			goto move_file_entry;
-		} else if (status < 0) {
-			return status;
-		}
-		// new name already exists
-		return -EEXIST;
-	} else if (flags == RENAME_EXCHANGE) { // NOTE: Unsupported for now
-		printf("uwufs_rename: EXCHANGE not implemented yet\n");
-		return -ENOSYS;
-	} else {
-		printf("uwufs_rename: invalid flags");
-		return -EINVAL;
+	// remove the other file b/c it exists
+	status = read_inode(device_fd, &inode_new, inode_num_other);
+	if (status < 0)
+		goto error_ret;
+	other_is_dir = (inode_new.file_mode & F_TYPE_BITS) == F_TYPE_DIRECTORY;
+	if (is_dir && !other_is_dir) {
+		status = -ENOTDIR;
+		goto error_ret;
 	}
-	return 0;
+	if (!is_dir && other_is_dir) {
+		status = -EISDIR;
+		goto error_ret;
+	}
+	if (other_is_dir && !is_directory_empty(device_fd, &inode_new)) {
+		status = -ENOTEMPTY;
+		goto error_ret;
+	}
+
+	status = unlink_file(device_fd, new_parent_inode_num, new_name, &inode_new,
+						 inode_num_other, other_is_dir ? -1 : 0);
+	if (status < 0)
+		goto error_ret;
+	if (other_is_dir)
+		inode_new.file_links_count = 0;
+	status = __drop_link(inode_num_other, &inode_new);
+	if (status < 0)
+		goto error_ret;
+	status = write_inode(device_fd, &inode_new, sizeof(inode_new),
+						 inode_num_other);
+	if (status < 0)
+		goto error_ret;
+	__notify_inval_attr(inode_num_other);
 
 move_file_entry:
-	status = read_inode(device_fd, &inode_old, inode_num);
-	if (status < 0) return status;
-	is_dir = inode_old.file_mode & F_TYPE_BITS & F_TYPE_DIRECTORY;
-	status = link_file(device_fd, old_path, new_path, true, is_dir ? 1 : 0);
-	if (status < 0) return status;
-	status = unlink_file(device_fd, old_path, &inode_old, inode_num, is_dir ? -1 : 0);
-	if (status < 0) return status;
-	return 0;
-#else
-	printf("uwufs_rename: Not Linux");
-	return -ENOSYS;
-#endif
+	status = link_file(device_fd, inode_num, new_parent_inode_num, new_name,
+					   true, is_dir ? 1 : 0);
+	if (status < 0)
+		goto error_ret;
+	status = unlink_file(device_fd, parent_inode_num, name, &inode_old,
+						 inode_num, is_dir ? -1 : 0);
+	if (status < 0)
+		goto error_ret;
+	if (is_dir && parent_inode_num != new_parent_inode_num) {
+		status = __set_dotdot(&inode_old, new_parent_inode_num);
+		if (status < 0)
+			goto error_ret;
+	}
+	__unlock_inodes(&locks);
+	journal_end();
+
+	__notify_inval_entry(parent_inode_num, name);
+	__notify_inval_attr(new_parent_inode_num);
+	__notify_inval_attr(inode_num);
+	fuse_reply_err(req, 0);
+	return;
+
+error_ret:
+	__unlock_inodes(&locks);
+end_ret:
+	journal_end();
+reply_err_ret:
+	fuse_reply_err(req, status == -1 ? EIO : -status);
 }
 
-int uwufs_link(const char *old_path, const char *new_path)
+void uwufs_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t new_parent,
+				const char *new_name)
 {
-	ssize_t status = link_file(device_fd, old_path, new_path, false, 1);
-	if (status < 0) return status;
-	return 0;
+	if (__reject_read_only(req))
+		return;
+	uwufs_blk_t inode_nums[2] = {__inode_num(ino), __inode_num(new_parent)};
+	struct __inode_lockset locks;
+	ssize_t status;
+
+	journal_begin();
+	__lock_inodes(&locks, inode_nums, 2);
+	status = link_file(device_fd, inode_nums[0], inode_nums[1], new_name,
+					   false, 1);
+	if (status == 0)
+		itable_lookup(inode_nums[0]); // see __reply_entry
+	__unlock_inodes(&locks);
+	journal_end();
+	if (status < 0) {
+		fuse_reply_err(req, status == -1 ? EIO : -status);
+		return;
+	}
+	__notify_inval_attr(inode_nums[1]);
+	__notify_inval_attr(inode_nums[0]);
+	__reply_entry(req, inode_nums[0], NULL);
 }
 
-int uwufs_open(const char *path,
-			   struct fuse_file_info *fi)
+void uwufs_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-	uwufs_blk_t inode_num;
-	ssize_t status = namei(device_fd, path, NULL, &inode_num);
-	if (status < 0)
-		return -ENOENT;
+	uwufs_blk_t inode_num = __inode_num(ino);
+	struct uwufs_inode inode;
+	ssize_t status;
+
+	if ((fi->flags & O_ACCMODE) != O_RDONLY || (fi->flags & O_TRUNC)) {
+		if (__reject_read_only(req))
+			return;
+	}
+
+	if (fi->flags & O_TRUNC) {
+		journal_begin();
+		__wrlock_inode(inode_num);
+	} else {
+		__rdlock_inode(inode_num);
+	}
+
+	status = read_inode(device_fd, &inode, inode_num);
+	if (status < 0) {
+		status = -ENOENT;
+		goto error_ret;
+	}
+	if ((inode.file_mode & F_TYPE_BITS) == F_TYPE_DIRECTORY) {
+		status = -EISDIR;
+		goto error_ret;
+	}
 
 	if (fi->flags & O_TRUNC) {
-		status = truncate_file(device_fd, inode_num);
-		RETURN_IF_ERROR(status);
+		status = truncate_file(device_fd, inode_num, 0);
+		if (status < 0)
+			goto error_ret;
+		status = read_inode(device_fd, &inode, inode_num);
+		if (status < 0)
+			goto error_ret;
+		__notify_inval_data(inode_num, 0);
 	}
-	
-	return 0;
+
+	status = __open_handle(inode_num, &inode, fi);
+	if (status < 0)
+		goto error_ret;
+	__unlock_inode(inode_num);
+	if (fi->flags & O_TRUNC)
+		journal_end();
+
+	// the data can't have changed since the file was last open
+	if (uwufs_opts.read_only)
+		fi->keep_cache = 1;
+
+	if (fuse_reply_open(req, fi) == -ENOENT)
+		__close_handle(fi); // open was interrupted
+	return;
+
+error_ret:
+	__unlock_inode(inode_num);
+	if (fi->flags & O_TRUNC)
+		journal_end();
+	fuse_reply_err(req, status == -1 ? EIO : -status);
 }
 
-// TODO:
-int uwufs_read(const char *path,
-			   char *buf,
-			   size_t size,
-			   off_t offset,
-			   struct fuse_file_info *fi)
+// what holes read as in the replies of uwufs_read
+static char __zero_blk[UWUFS_MAX_BLOCK_SIZE];
+
+void uwufs_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+				struct fuse_file_info *fi)
 {
-	(void) fi;
+	(void) ino;
 	// printf("in uwufs_read\n");
-	
-	uwufs_blk_t inode_num;
-	struct uwufs_inode inode;
-	ssize_t status = namei(device_fd, path, NULL, &inode_num);
-	if (status < 0)
-		return -ENOENT;
 
-	status = read_inode(device_fd, &inode, inode_num);
-	RETURN_IF_ERROR(status);
+	struct uwufs_file_handle *fh = __handle(fi);
+	struct uwufs_inode *inode = &fh->oi->inode;
+	struct uwufs_read_seg *segs;
+	struct fuse_bufvec *bufv;
+	char tail_buf[UWUFS_MAX_BLOCK_SIZE];
+	size_t nsegs;
+	size_t i;
+	ssize_t status;
+	bool touch;
 
-	// TODO: Check file permissions using fuse_context
-	switch (inode.file_mode & F_TYPE_BITS) {
+	// TODO: Check file permissions using fuse_req_ctx
+	switch (fh->file_type) {
 		case F_TYPE_REGULAR:
-			status = read_file(device_fd, buf, size, offset, &inode);
-			if (status < 0)
-				return -EIO;
-
-			return status;
+			// one piece per block at most (+1: the range can start in
+			// the middle of a block)
+			nsegs = size / UWUFS_BLOCK_SIZE + 2;
+			segs = (struct uwufs_read_seg *)malloc(nsegs * sizeof(*segs));
+			bufv = (struct fuse_bufvec *)malloc(sizeof(*bufv) +
+												nsegs * sizeof(bufv->buf[0]));
+			if (segs == NULL || bufv == NULL) {
+				free(segs);
+				free(bufv);
+				fuse_reply_err(req, ENOMEM);
+				return;
+			}
+			__rdlock_inode(fh->inode_num);
+			// another thread reading through the same handle has the
+			// cursor: use a temporary one instead of waiting
+			if (pthread_mutex_trylock(&fh->dblk_itr_lock) == 0) {
+				status = map_file_read(device_fd, size, offset, inode,
+									   __handle_dblk_itr(fh), segs, &nsegs,
+									   tail_buf);
+				pthread_mutex_unlock(&fh->dblk_itr_lock);
+			} else {
+				status = map_file_read(device_fd, size, offset, inode,
+									   NULL, segs, &nsegs, tail_buf);
+			}
+			touch = status >= 0 && __atime_due(inode, __now());
+			if (status < 0) {
+				fuse_reply_err(req, EIO);
+			} else {
+				// the data goes from the device to /dev/fuse without
+				// being copied here if the kernel lets libfuse splice.
+				// Replied before unlocking: the blocks can't change or be
+				// freed until the data is out
+				bufv->count = nsegs;
+				bufv->idx = 0;
+				bufv->off = 0;
+				for (i = 0; i < nsegs; i++) {
+					struct fuse_buf *b = &bufv->buf[i];
+					memset(b, 0, sizeof(*b));
+					b->size = segs[i].size;
+					if (segs[i].dev_offset < 0) {
+						b->mem = segs[i].mem != NULL ?
+							(void *)segs[i].mem : __zero_blk;
+					} else {
+						b->flags = (enum fuse_buf_flags)
+							(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+						b->fd = device_fd;
+						b->pos = segs[i].dev_offset;
+					}
+				}
+				fuse_reply_data(req, bufv, FUSE_BUF_SPLICE_MOVE);
+			}
+			__unlock_inode(fh->inode_num);
+			free(segs);
+			free(bufv);
+			if (status > 0)
+				__readahead(fh, offset, status);
+			if (touch)
+				__touch_atime(fh->inode_num);
+			return;
 		case F_TYPE_DIRECTORY:
-			return -EISDIR;
-		
+			fuse_reply_err(req, EISDIR);
+			return;
+
 		// TODO: other file types (Ex: symlinks don't have data blks)
 		default:
 #ifdef DEBUG
-			printf("uwufs_unlink: unknown file type %d\n",
-		  inode.file_mode & F_TYPE_BITS);
+			printf("uwufs_read: unknown file type %d\n",
+		  fh->file_type);
 #endif
-			return -EINVAL;
+			fuse_reply_err(req, EINVAL);
+			return;
 	}
-
-	return -ENOENT;
 }
 
-// TODO:
-int uwufs_write(const char *path,
-				const char *buf,
-				size_t size,
-				off_t offset,
-				struct fuse_file_info *fi)
+/**
+ * uwufs_write and uwufs_write_buf: the data is in `buf`, or if `buf` is
+ * 		NULL in the pipe `pipe_fd`. Returns the status of write_file
+ * 		(the reply is sent).
+ */
+static ssize_t __write(fuse_req_t req, struct fuse_file_info *fi,
+					   const char *buf, int pipe_fd, size_t size,
+					   off_t offset)
 {
-	(void) fi;
-	
-	uwufs_blk_t inode_num;
-	struct uwufs_inode inode;
-	ssize_t status = namei(device_fd, path, NULL, &inode_num);
-	if (status < 0)
-		return -ENOENT;
-
-	status = read_inode(device_fd, &inode, inode_num);
-	RETURN_IF_ERROR(status);
+	struct uwufs_file_handle *fh = __handle(fi);
+	struct uwufs_inode *inode = &fh->oi->inode;
+	uint64_t old_size;
+	uint64_t new_size;
+	ssize_t status;
 
-	// TODO: Check file permissions using fuse_context
-	switch (inode.file_mode & F_TYPE_BITS) {
+	// TODO: Check file permissions using fuse_req_ctx
+	switch (fh->file_type) {
 		case F_TYPE_REGULAR:
-		// case F_TYPE_DIRECTORY: // should be handled by readdir
-			status = write_file(device_fd, buf, size, offset, 
-				 			    &inode, inode_num);
+			journal_begin();
+			__wrlock_inode(fh->inode_num);
+			old_size = inode->file_size;
+			if (buf != NULL)
+				status = write_file(device_fd, buf, size, offset, inode,
+									fh->inode_num, __handle_dblk_itr(fh));
+			else
+				status = write_file_pipe(device_fd, pipe_fd, size, offset,
+										 inode, fh->inode_num,
+										 __handle_dblk_itr(fh));
+			// write_file already invalidated the cursor if it
+			// allocated blocks
+			fh->map_gen = fh->oi->map_gen;
+			new_size = inode->file_size;
+			__unlock_inode(fh->inode_num);
+			journal_end();
+			// with the writeback cache the size came from the kernel
+			if (new_size != old_size && !uwufs_opts.writeback_cache)
+				__notify_inval_attr(fh->inode_num);
 			if (status < 0)
-				return status;
-
+				fuse_reply_err(req, status == -1 ? EIO : -status);
+			else
+				fuse_reply_write(req, status);
 			return status;
+		case F_TYPE_DIRECTORY:
+			fuse_reply_err(req, EISDIR);
+			return -EISDIR;
 		// TODO: other file types (Ex: symlinks don't have data blks)
 		default:
 #ifdef DEBUG
-			printf("uwufs_unlink: unknown file type %d\n",
-		  inode.file_mode & F_TYPE_BITS);
+			printf("uwufs_write: unknown file type %d\n",
+		  fh->file_type);
 #endif
+			fuse_reply_err(req, EINVAL);
 			return -EINVAL;
 	}
+}
 
-	return -ENOENT;
+void uwufs_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
+				 size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	if (__reject_read_only(req))
+		return;
+	(void) ino;
+	__write(req, fi, buf, -1, size, offset);
 }
 
-int uwufs_release(const char *path, struct fuse_file_info *fi)
+void uwufs_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv,
+					 off_t off, struct fuse_file_info *fi)
 {
-	(void) fi;
-	uwufs_blk_t inode_num;
-	ssize_t status = namei(device_fd, path, NULL, &inode_num);
-	if (status < 0)
-		return -ENOENT;
+	if (__reject_read_only(req))
+		return;
+	(void) ino;
 
-	return 0;
+	size_t size = fuse_buf_size(bufv);
+	struct fuse_buf *in = &bufv->buf[bufv->idx];
+	struct fuse_bufvec mem_bufv = FUSE_BUFVEC_INIT(size);
+	ssize_t status;
+	char *buf;
+
+	// a request spliced from /dev/fuse: the data is still in the pipe
+	if (bufv->count - bufv->idx == 1 && bufv->off == 0 &&
+		(in->flags & FUSE_BUF_IS_FD) && !(in->flags & FUSE_BUF_FD_SEEK)) {
+		status = __write(req, fi, NULL, in->fd, size, off);
+		if (status >= 0)
+			bufv->idx = bufv->count;	// all consumed, libfuse keeps the pipe
+		return;
+	}
+	if (bufv->count - bufv->idx == 1 && !(in->flags & FUSE_BUF_IS_FD)) {
+		__write(req, fi, (const char *)in->mem + bufv->off, -1, size, off);
+		return;
+	}
+
+	buf = (char *)malloc(size);
+	if (buf == NULL) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	mem_bufv.buf[0].mem = buf;
+	status = fuse_buf_copy(&mem_bufv, bufv, (enum fuse_buf_copy_flags)0);
+	if (status < 0)
+		fuse_reply_err(req, -status);
+	else
+		__write(req, fi, buf, -1, status, off);
+	free(buf);
 }
 
-static int __uwufs_helper_readdir_blk(const struct uwufs_directory_data_blk blk,
-									void *buf,
-									fuse_fill_dir_t filler)
+void uwufs_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-	int i;
-	int status;
-	int total_entires_per_blk = UWUFS_BLOCK_SIZE /
-		sizeof(struct uwufs_directory_file_entry);
-	for (i = 0; i < total_entires_per_blk; i ++) {
-		if (blk.file_entries[i].inode_num <= 0) {
-			continue; // assuming there are "holes"
-		}
-		status = filler(buf, blk.file_entries[i].file_name, NULL, 0,
-			   FUSE_FILL_DIR_DEFAULTS);
-		if (status == 1) {
-			return status;
-		}
+	(void) ino;
+	struct uwufs_file_handle *fh = __handle(fi);
+
+	// done writing: the last partial blk joins a tail blk
+	if (uwufs_opts.tailpack && fh != NULL &&
+		fh->file_type == F_TYPE_REGULAR &&
+		(fi->flags & O_ACCMODE) != O_RDONLY) {
+		journal_begin();
+		__wrlock_inode(fh->inode_num);
+		if (fh->oi->inode.file_links_count > 0)
+			pack_file_tail(device_fd, &fh->oi->inode, fh->inode_num);
+		__unlock_inode(fh->inode_num);
+		journal_end();
 	}
-	return 0;
+	__close_handle(fi);
+	fuse_reply_err(req, 0);
 }
 
-// NOTE: Choosing to operate in the first mode (see fuse documentation)
-// 		1. Ignore offset and read the entire directory <<<
-// 		2. Use offset but pass non-zero in 'filler'
-int uwufs_readdir(const char *path,
-				  void *buf,
-				  fuse_fill_dir_t filler,
-				  off_t offset,
-				  struct fuse_file_info *fi,
-				  enum fuse_readdir_flags flags)
+void uwufs_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-	(void) offset;
+	(void) ino;
 	(void) fi;
-	(void) flags;
+	// every write already reached the device (or the journal log) before
+	// it was replied to, durability is up to fsync
+	fuse_reply_err(req, 0);
+}
 
-	uwufs_blk_t inode_num;
-	ssize_t status = namei(device_fd, path, NULL, &inode_num);
-	if (status < 0)
-		return -ENOENT;
+/**
+ * Makes the journal (if `meta`) and the data written so far durable
+ * 		with a single device flush when possible: the journal flush
+ * 		already covers the data written before it.
+ */
+static int __sync(bool meta)
+{
+	uint64_t ticket = flush_ticket();
+	int status = 0;
+
+	if (meta)
+		status = journal_flush();
+	if (status == 0)
+		status = flush_device(device_fd, ticket);
+	return status;
+}
 
-	struct uwufs_inode inode;
-	status = read_inode(device_fd, &inode, inode_num);
-	if (status < 0)
-		return -ENOENT;
+void uwufs_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+				 struct fuse_file_info *fi)
+{
+	(void) ino;
+	if (uwufs_opts.read_only) {
+		fuse_reply_err(req, 0);
+		return;
+	}
 
-	uint16_t f_mode = inode.file_mode;
-	if (F_TYPE_DIRECTORY != (f_mode & F_TYPE_BITS))
-		return -ENOTDIR;
+	struct uwufs_file_handle *fh = __handle(fi);
+	struct uwufs_open_inode *oi = fh->oi;
+	uint64_t map_gen;
+	bool meta;
+	int status;
 
-	// TODO: Don't worry about permission bits yet (but still show it)
+	// fsync also makes the timestamps durable
+	if (!datasync)
+		__write_back_times(fh->inode_num);
+
+	__rdlock_inode(fh->inode_num);
+	map_gen = oi->map_gen;
+	// fdatasync: the size and the blk map have to be durable to read the
+	// data back, the timestamps don't
+	meta = !datasync ||
+		   __atomic_load_n(&oi->synced_map_gen, __ATOMIC_RELAXED) != map_gen;
+	__unlock_inode(fh->inode_num);
+
+	status = __sync(meta);
+	// racing fsyncs may store an older generation: that only costs
+	// another journal flush later
+	if (status == 0 && meta)
+		__atomic_store_n(&oi->synced_map_gen, map_gen, __ATOMIC_RELAXED);
+	fuse_reply_err(req, -status);
+}
+
+#define UWUFS_DIR_ENTRIES_PER_BLK \
+	(UWUFS_BLOCK_SIZE / sizeof(struct uwufs_directory_file_entry))
+
+struct __dirent {
+	uwufs_blk_t inode_num;
+	off_t off;					// offset of the entry after this one
+	uwufs_file_name_t name;
+};
 
-	dblk_itr_t dblk_itr = create_dblk_itr(&inode, device_fd, 0);
-	// Read each data blk and add to filler
-	uwufs_blk_t dir_data_blk_num;
-	int total_blks = (inode.file_size + UWUFS_BLOCK_SIZE - 1) /
-							 UWUFS_BLOCK_SIZE;
+/**
+ * Collects the directory entries starting at `offset` until the reply
+ * 		of `size` bytes is full.
+ *
+ * The offset of an entry is its position in the directory data blks
+ * 		(blk index * entries per blk + index in the blk) plus one, so
+ * 		the kernel can continue a listing where it left off without the
+ * 		whole directory being read again.
+ *
+ * Unlinking an entry only clears its slot (skipped here, reused by the
+ * 		next create) and never moves the others, so the offsets stay valid
+ * 		while the kernel is in the middle of a listing.
+ *
+ * Return: number of entries in `entries` or a negative error
+ */
+static ssize_t __collect_dirents(fuse_req_t req,
+								 const struct uwufs_inode *dir_inode,
+								 size_t size,
+								 off_t offset,
+								 bool plus,
+								 struct __dirent **entries)
+{
 	struct uwufs_directory_data_blk dir_data_blk;
-	int i;
-	for (i = 0; i < total_blks; i++) {
-		dir_data_blk_num = dblk_itr_next(dblk_itr);
+	uwufs_blk_t total_blks = (dir_inode->file_size + UWUFS_BLOCK_SIZE - 1)
+							 / UWUFS_BLOCK_SIZE;
+	uwufs_blk_t blk_index = offset / UWUFS_DIR_ENTRIES_PER_BLK;
+	size_t entry_index = offset % UWUFS_DIR_ENTRIES_PER_BLK;
+	size_t nentries = 0;
+	size_t capacity = 0;
+	size_t bytes = 0;
+	ssize_t status = 0;
+	struct __dirent *p;
+
+	*entries = NULL;
+	if (offset < 0 || blk_index >= total_blks)
+		return 0;
+
+	dblk_itr_t dblk_itr = create_dblk_itr(dir_inode, device_fd, blk_index);
+	for (; blk_index < total_blks; blk_index++, entry_index = 0) {
+		uwufs_blk_t dir_data_blk_num = dblk_itr_next(dblk_itr);
 		if (dir_data_blk_num == 0) { // Shouldn't happen
-			destroy_dblk_itr(dblk_itr);
-			return -EIO;
+			status = -EIO;
+			goto error_ret;
 		}
-
 		status = read_blk(device_fd, &dir_data_blk, dir_data_blk_num);
 		if (status < 0) {
-			destroy_dblk_itr(dblk_itr);
-			return -EIO;
+			status = -EIO;
+			goto error_ret;
 		}
 
-		status = __uwufs_helper_readdir_blk(dir_data_blk, buf, filler);
-		if (status == 1) {
-			// If buf is full, filler/helper will return 1
-			// return error or just not include the rest?
-			destroy_dblk_itr(dblk_itr);
-			return 0;
+		for (; entry_index < UWUFS_DIR_ENTRIES_PER_BLK; entry_index++) {
+			const struct uwufs_directory_file_entry *file_entry =
+				&dir_data_blk.file_entries[entry_index];
+			if (file_entry->inode_num == 0)
+				continue;
+
+			if (plus)
+				bytes += fuse_add_direntry_plus(req, NULL, 0,
+												file_entry->file_name, NULL, 0);
+			else
+				bytes += fuse_add_direntry(req, NULL, 0,
+										   file_entry->file_name, NULL, 0);
+			if (bytes > size)
+				goto done;
+
+			if (nentries == capacity) {
+				capacity = capacity ? capacity * 2 : 32;
+				p = (struct __dirent *)realloc(*entries,
+											   capacity * sizeof(*p));
+				if (p == NULL) {
+					status = -ENOMEM;
+					goto error_ret;
+				}
+				*entries = p;
+			}
+			p = &(*entries)[nentries++];
+			p->inode_num = file_entry->inode_num;
+			p->off = blk_index * UWUFS_DIR_ENTRIES_PER_BLK + entry_index + 1;
+			memcpy(p->name, file_entry->file_name, sizeof(p->name));
 		}
 	}
+
+done:
 	destroy_dblk_itr(dblk_itr);
-	return 0;
+	return nentries;
+
+error_ret:
+	destroy_dblk_itr(dblk_itr);
+	free(*entries);
+	*entries = NULL;
+	return status;
 }
 
-// NOTE: Might want to move to file_operations if not using fuse_file_info
-int __create_regular_file(const char *path,
-						  mode_t mode,
-						  struct fuse_file_info *fi)
+static void __readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+					  off_t offset, bool plus)
 {
-	(void) fi; // TEMP: Don't care for now
-
-	ssize_t file_exists_status;
-
-	char parent_path[strlen(path)+1];
-	char child_path[UWUFS_FILE_NAME_SIZE];
-
-	uwufs_blk_t parent_dir_inode_num;
-
-	uwufs_blk_t child_file_inode_num;
-	struct uwufs_inode child_file_inode;
-
-	struct fuse_context *fuse_ctx = fuse_get_context();
-	time_t unix_time;
-	unix_time = time(NULL);
-	if (unix_time == -1)
-		unix_time = 0;
-
+	uwufs_blk_t inode_num = __inode_num(ino);
+	struct uwufs_inode inode;
+	struct __dirent *entries = NULL;
+	struct uwufs_inode *entry_inodes = NULL;
+	uwufs_blk_t *entry_inode_nums = NULL;
+	char *buf = NULL;
+	size_t pos = 0;
+	ssize_t nentries;
 	ssize_t status;
+	ssize_t i;
 
-	// FIX: Here to make sure the append_dblk in add_directory_entry
-	// always have enough data blocks (remove it after the bug is fixed)
-	struct uwufs_super_blk super_blk;
-	status = read_blk(device_fd, &super_blk, 0);
-	if (status < 0)
-		return status;
-	if (super_blk.free_blks_left <= 5) {
-		return -ENOSPC;
+	// The directory lock keeps the entries (and so the inodes they name)
+	// in place until readdirplus has taken its references
+	__rdlock_inode(inode_num);
+	status = read_inode(device_fd, &inode, inode_num);
+	if (status < 0) {
+		status = -ENOENT;
+		goto error_ret;
+	}
+	if ((inode.file_mode & F_TYPE_BITS) != F_TYPE_DIRECTORY) {
+		status = -ENOTDIR;
+		goto error_ret;
 	}
 
-	status = split_path_parent_child(path, parent_path, child_path);
-	if (status < 0)
-		return status;
-
-	file_exists_status = namei(device_fd, path, NULL, &child_file_inode_num);
-	if (file_exists_status == -ENOENT) { // Create new file here
-#ifdef DEBUG
-		printf("__create_regular_file: creating new file\n");
-#endif
-		// Find parent inode
-		status = namei(device_fd, parent_path, NULL, &parent_dir_inode_num);
-		if (status < 0)
-			return -ENOENT;
-
-		// Get new empty inode
-		status = find_free_inode(device_fd, &child_file_inode_num);
-		RETURN_IF_ERROR(status);
+	// TODO: Don't worry about permission bits yet (but still show it)
 
-		// Add child file entry to parent dir
-		status = add_directory_file_entry(device_fd, parent_dir_inode_num,
-						   child_path, child_file_inode_num, 0);
-		RETURN_IF_ERROR(status);
+	nentries = __collect_dirents(req, &inode, size, offset, plus, &entries);
+	if (nentries <= 0) {
+		__unlock_inode(inode_num);
+		if (nentries < 0)
+			fuse_reply_err(req, -nentries);
+		else
+			fuse_reply_buf(req, NULL, 0);
+		return;
+	}
 
-		// Init child file inode
-		memset(&child_file_inode, 0, sizeof(struct uwufs_inode));
-		// TODO: Other file perms
-		child_file_inode.file_mode = F_TYPE_REGULAR | (mode & F_PERM_BITS);
-		child_file_inode.file_size = 0;
-		child_file_inode.file_links_count = 1;
-		child_file_inode.file_uid = fuse_ctx->uid;
-		child_file_inode.file_gid = fuse_ctx->gid;
-		child_file_inode.file_ctime = (uint64_t)unix_time;
-		child_file_inode.file_mtime = (uint64_t)unix_time;
+	buf = (char *)malloc(size);
+	if (buf == NULL) {
+		status = -ENOMEM;
+		goto error_ret;
+	}
 
-		goto success_ret;
-	} else if (file_exists_status < 0) {
-		return file_exists_status;
+	if (plus) {
+		// Read all the inodes of this reply in one ilist pass
+		entry_inodes = (struct uwufs_inode *)malloc(nentries *
+													sizeof(*entry_inodes));
+		entry_inode_nums = (uwufs_blk_t *)malloc(nentries *
+												 sizeof(*entry_inode_nums));
+		if (entry_inodes == NULL || entry_inode_nums == NULL) {
+			status = -ENOMEM;
+			goto error_ret;
+		}
+		for (i = 0; i < nentries; i++)
+			entry_inode_nums[i] = entries[i].inode_num;
+		status = read_inodes(device_fd, entry_inodes, entry_inode_nums,
+							 nentries);
+		if (status < 0) {
+			status = -EIO;
+			goto error_ret;
+		}
 	}
-#ifdef DEBUG
-	printf("create_regular_file: file already exists");
-#endif
-success_ret:
-	child_file_inode.file_atime = (uint64_t)unix_time;
-	status = write_inode(device_fd, &child_file_inode,
-				   sizeof(child_file_inode), child_file_inode_num);
-	if (status < 0)
-		return -EIO;
 
-	return 0;
+	for (i = 0; i < nentries; i++) {
+		if (plus) {
+			struct fuse_entry_param e;
+			memset(&e, 0, sizeof(e));
+			if (__fill_stat(entries[i].inode_num, &entry_inodes[i],
+							&e.attr) < 0) {
+				status = -EIO;
+				goto error_ret;
+			}
+			e.ino = __fuse_ino(entries[i].inode_num);
+			e.attr_timeout = uwufs_opts.attr_timeout;
+			e.entry_timeout = uwufs_opts.entry_timeout;
+			pos += fuse_add_direntry_plus(req, buf + pos, size - pos,
+										  entries[i].name, &e, entries[i].off);
+			// Like lookup, every entry except . and .. gives the kernel
+			// a reference to the inode
+			if (strcmp(entries[i].name, ".") != 0 &&
+				strcmp(entries[i].name, "..") != 0)
+				__ref_inode(entries[i].inode_num);
+		} else {
+			struct stat stbuf;
+			memset(&stbuf, 0, sizeof(stbuf));
+			stbuf.st_ino = entries[i].inode_num;
+			pos += fuse_add_direntry(req, buf + pos, size - pos,
+									 entries[i].name, &stbuf, entries[i].off);
+		}
+	}
+	__unlock_inode(inode_num);
+
+	fuse_reply_buf(req, buf, pos);
+	free(buf);
+	free(entries);
+	free(entry_inodes);
+	free(entry_inode_nums);
+	// a listing is one access
+	if (offset == 0 && __atime_due(&inode, __now()))
+		__touch_atime(inode_num);
+	return;
+
+error_ret:
+	__unlock_inode(inode_num);
+	free(buf);
+	free(entries);
+	free(entry_inodes);
+	free(entry_inode_nums);
+	fuse_reply_err(req, -status);
 }
 
-int uwufs_create(const char *path,
-				 mode_t mode,
-				 struct fuse_file_info *fi)
+void uwufs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+				   struct fuse_file_info *fi)
 {
-#ifdef DEBUG
-	printf("uwufs_create: %s\n", path);
-#endif
-	if (S_ISREG(mode))
-		return  __create_regular_file(path, mode, fi);
-	return -EINVAL;
+	(void) fi;
+	__readdir(req, ino, size, offset, false);
 }
 
-int uwufs_utimens(const char *path,
-				  const struct timespec tv[2],
-				  struct fuse_file_info *fi)
+void uwufs_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size,
+					   off_t offset, struct fuse_file_info *fi)
 {
 	(void) fi;
-	ssize_t status;
-	uwufs_blk_t inode_num;
-	struct uwufs_inode inode;
-	time_t unix_time;
-	unix_time = time(NULL);
-	if (unix_time == -1)
-		unix_time = 0;
+	__readdir(req, ino, size, offset, true);
+}
 
-	status = namei(device_fd, path, NULL, &inode_num);
-	if (status < 0)
-		return status;
+void uwufs_fsyncdir(fuse_req_t req, fuse_ino_t ino, int datasync,
+					struct fuse_file_info *fi)
+{
+	(void) ino;
+	(void) datasync;
+	(void) fi;
+	if (uwufs_opts.read_only) {
+		fuse_reply_err(req, 0);
+		return;
+	}
+	// directory blks are metadata: all in the journal
+	fuse_reply_err(req, -__sync(true));
+}
 
-	status = read_inode(device_fd, &inode, inode_num);
-	if (status < 0)
-		return status;
+void uwufs_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+	(void) ino;
+	struct uwufs_super_blk super_blk;
+	struct statvfs stbuf;
+	uwufs_blk_t free_blks, free_inodes;
+	ssize_t status;
 
-	if (tv[0].tv_nsec == UTIME_NOW) {
-		inode.file_atime = (uint64_t)unix_time;
-	} else if (tv[0].tv_nsec == UTIME_OMIT) {
-		// Do nothing
+	if (uwufs_opts.read_only) {
+		super_blk = __ro_super_blk;
+		free_blks = super_blk.free_blks_left;
+		free_inodes = super_blk.free_inodes_left;
+		status = 0;
 	} else {
-		inode.file_atime = (uint64_t)tv[0].tv_sec;
+		status = read_super_blk(device_fd, &super_blk);
+		if (status >= 0)
+			status = read_free_counts(device_fd, &free_blks, &free_inodes);
 	}
-	if (tv[1].tv_nsec == UTIME_NOW) {
-		inode.file_atime = (uint64_t)unix_time;
-	} else if (tv[1].tv_nsec == UTIME_OMIT) {
-		// Do nothing
-	} else {
-		inode.file_atime = (uint64_t)tv[1].tv_sec;
+	if (status < 0) {
+		fuse_reply_err(req, EIO);
+		return;
 	}
 
-	status = write_inode(device_fd, &inode, sizeof(inode), inode_num);
-	if (status < 0)
-		return status;
-
-	return 0;
+	memset(&stbuf, 0, sizeof(stbuf));
+	stbuf.f_bsize = UWUFS_BLOCK_SIZE;
+	stbuf.f_frsize = UWUFS_BLOCK_SIZE;
+	stbuf.f_blocks = super_blk.total_blks;
+	stbuf.f_bfree = free_blks;
+	stbuf.f_bavail = free_blks;
+	stbuf.f_files = super_blk.ilist_total_size *
+		(UWUFS_BLOCK_SIZE / sizeof(struct uwufs_inode));
+	stbuf.f_ffree = free_inodes;
+	stbuf.f_favail = free_inodes;
+	stbuf.f_namemax = UWUFS_FILE_NAME_SIZE - 1;
+	fuse_reply_statfs(req, &stbuf);
 }
 
-int uwufs_chmod(const char * path, mode_t mode, struct fuse_file_info *fi)
+void uwufs_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+				  mode_t mode, struct fuse_file_info *fi)
 {
-	(void) fi;
-	ssize_t status;
+	if (__reject_read_only(req))
+		return;
+#ifdef DEBUG
+	printf("uwufs_create: %s\n", name);
+#endif
 	uwufs_blk_t inode_num;
-	struct uwufs_inode inode;
+	ssize_t status;
 
-	status = namei(device_fd, path, NULL, &inode_num);
-	if (status < 0)
-		return -ENOENT;
+	if (!S_ISREG(mode)) {
+		fuse_reply_err(req, EINVAL);
+		return;
+	}
+	status = __create_file(req, __inode_num(parent), name, mode, NULL,
+						   &inode_num);
+	if (status < 0) {
+		fuse_reply_err(req, status == -1 ? EIO : -status);
+		return;
+	}
+	__reply_entry(req, inode_num, fi);
+}
 
-	status = read_inode(device_fd, &inode, inode_num);
-	if (status < 0)
-		return status;
+/**
+ * A fallocate is done in pieces of this many blks, each its own journal
+ * 		handle: the indirect blks one of them changes have to fit in a
+ * 		transaction.
+ */
+#define UWUFS_FALLOC_CHUNK_BLKS \
+	(64 * (UWUFS_BLOCK_SIZE / sizeof(uwufs_blk_t)))
 
-	inode.file_mode = (inode.file_mode & F_TYPE_BITS) | (mode & F_PERM_BITS);
+void uwufs_fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset,
+					 off_t length, struct fuse_file_info *fi)
+{
+	if (__reject_read_only(req))
+		return;
+	(void) ino;
+
+	const off_t chunk = (off_t)UWUFS_FALLOC_CHUNK_BLKS * UWUFS_BLOCK_SIZE;
+	struct uwufs_file_handle *fh = __handle(fi);
+	ssize_t status = 0;
+	off_t off, end, piece_end;
+
+	if (fh->file_type != F_TYPE_REGULAR) {
+		fuse_reply_err(req, fh->file_type == F_TYPE_DIRECTORY ? EISDIR : ENODEV);
+		return;
+	}
+	if (offset < 0 || length <= 0 || offset > INT64_MAX - length) {
+		fuse_reply_err(req, EINVAL);
+		return;
+	}
 
-	status = write_inode(device_fd, &inode, sizeof(inode), inode_num);
+	end = offset + length;
+	for (off = offset; off < end && status >= 0; off = piece_end) {
+		piece_end = (off / chunk + 1) * chunk;
+		if (piece_end > end)
+			piece_end = end;
+		journal_begin();
+		__wrlock_inode(fh->inode_num);
+		status = fallocate_file(device_fd, mode, off, piece_end - off,
+								&fh->oi->inode, fh->inode_num);
+		__unlock_inode(fh->inode_num);
+		journal_end();
+	}
+	// the size, the blocks, and for a punched or zeroed range the data
+	if (mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE))
+		__notify_inval_data(fh->inode_num, offset);
+	else
+		__notify_inval_attr(fh->inode_num);
 	if (status < 0)
-		return status;
-
-	return 0;
+		fuse_reply_err(req, status == -1 ? EIO : -status);
+	else
+		fuse_reply_err(req, 0);
 }
 
-int uwufs_chown(const char * path, uid_t uid, gid_t gid, struct fuse_file_info *fi) {
-	ssize_t status;
-	uwufs_blk_t inode_num;
-	status = namei(device_fd, path, NULL, &inode_num);
-	if (status < 0)
-		return -ENOENT;
+void uwufs_copy_file_range(fuse_req_t req, fuse_ino_t ino_in, off_t off_in,
+						   struct fuse_file_info *fi_in, fuse_ino_t ino_out,
+						   off_t off_out, struct fuse_file_info *fi_out,
+						   size_t len, int flags)
+{
+	if (__reject_read_only(req))
+		return;
+	(void) ino_in;
+	(void) ino_out;
+
+	const size_t chunk = (size_t)UWUFS_FALLOC_CHUNK_BLKS * UWUFS_BLOCK_SIZE;
+	struct uwufs_file_handle *fh_in = __handle(fi_in);
+	struct uwufs_file_handle *fh_out = __handle(fi_out);
+	uwufs_blk_t inode_nums[2] = {fh_in->inode_num, fh_out->inode_num};
+	struct __inode_lockset locks;
+	ssize_t status = 0;
+	size_t copied = 0;
+	size_t piece;
+
+	if (flags != 0) {
+		fuse_reply_err(req, EINVAL);
+		return;
+	}
+	if (fh_in->file_type != F_TYPE_REGULAR ||
+		fh_out->file_type != F_TYPE_REGULAR) {
+		fuse_reply_err(req, fh_in->file_type == F_TYPE_DIRECTORY ||
+							fh_out->file_type == F_TYPE_DIRECTORY ?
+							EISDIR : EINVAL);
+		return;
+	}
+	if (off_in < 0 || off_out < 0 || len > (size_t)INT64_MAX - off_in ||
+		len > (size_t)INT64_MAX - off_out) {
+		fuse_reply_err(req, EINVAL);
+		return;
+	}
+	// the same file: the ranges must not overlap
+	if (fh_in->inode_num == fh_out->inode_num &&
+		off_in < (off_t)(off_out + len) && off_out < (off_t)(off_in + len)) {
+		fuse_reply_err(req, EINVAL);
+		return;
+	}
 
-	struct uwufs_inode inode;
-	status = read_inode(device_fd, &inode, inode_num);
-	RETURN_IF_ERROR(status);
+	while (copied < len) {
+		piece = len - copied < chunk ? len - copied : chunk;
+		journal_begin();
+		__lock_inodes(&locks, inode_nums, 2);
+		status = copy_file_data(device_fd, &fh_in->oi->inode,
+								fh_in->inode_num, off_in + copied,
+								&fh_out->oi->inode, fh_out->inode_num,
+								off_out + copied, piece, uwufs_opts.reflink);
+		__unlock_inodes(&locks);
+		journal_end();
+		if (status <= 0)
+			break;
+		copied += status;
+		if ((size_t)status < piece)
+			break;	// the end of the source
+	}
+	if (copied > 0)
+		__notify_inval_data(fh_out->inode_num, off_out);
+	if (status < 0 && copied == 0)
+		fuse_reply_err(req, status == -1 ? EIO : -status);
+	else
+		fuse_reply_write(req, copied);
+}
 
-	inode.file_uid = uid;
-	inode.file_gid = gid;
+void uwufs_lseek(fuse_req_t req, fuse_ino_t ino, off_t off, int whence,
+				 struct fuse_file_info *fi)
+{
+	(void) ino;
+	struct uwufs_file_handle *fh = __handle(fi);
+	off_t status;
 
-	status = write_inode(device_fd, &inode,
-				   sizeof(inode), inode_num);
+	if (fh->file_type != F_TYPE_REGULAR) {
+		fuse_reply_err(req, EINVAL);
+		return;
+	}
+	__rdlock_inode(fh->inode_num);
+	status = seek_data_hole(device_fd, off, whence, &fh->oi->inode);
+	__unlock_inode(fh->inode_num);
 	if (status < 0)
-		return -EIO;
-
-	return 0;
+		fuse_reply_err(req, -status);
+	else
+		fuse_reply_lseek(req, status);
 }
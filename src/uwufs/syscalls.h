@@ -1,5 +1,6 @@
 /**
  * Header file for fuse syscall operations for uwufs
+ * (FUSE low-level API: callbacks get inode numbers instead of paths)
  *
  * Author: Joseph
  */
@@ -11,57 +12,200 @@
 #define FUSE_USE_VERSION 31
 #endif
 
-#include <fuse3/fuse.h>
+#include <fuse3/fuse_lowlevel.h>
 
 /**
- * Set fuse connection parameters and configurations.
+ * Mount options (see mount_uwufs.c for the -o names)
+ */
+struct uwufs_options {
+	double entry_timeout;		// seconds the kernel caches names
+	double attr_timeout;		// seconds the kernel caches attributes
+	double negative_timeout;	// seconds the kernel caches missing names
+	int read_only;				// reject changes, read without locking
+	double commit_interval;		// seconds between journal checkpoints
+	int noatime;				// never update access times (else relatime)
+	int lazytime;				// keep pure timestamp updates in memory
+	int reflink;				// copy_file_range shares the blocks
+	unsigned int max_write;		// bytes per write request (0: largest)
+	unsigned int max_readahead;	// bytes the kernel reads ahead (0: its max)
+	int writeback_cache;		// the kernel caches writes (if it can)
+	int splice;					// splice data to/from /dev/fuse (if it can)
+	int async_read;				// several reads of a file in flight
+	int tailpack;				// pack the tails of files into shared blks
+};
+
+extern struct uwufs_options uwufs_opts;
+
+/**
+ * Gives the session to send cache invalidation notifications to.
+ * 		Call before the session loop starts (nothing is sent otherwise).
+ */
+void uwufs_set_session(struct fuse_session *se);
+
+/**
+ * Set fuse connection parameters and configurations: the largest requests
+ * 		the kernel and libfuse allow, the writeback cache, splicing and
+ * 		asynchronous reads when the kernel supports them (each can be
+ * 		turned down with a mount option). uwufs_opts is left with what
+ * 		was actually enabled.
  *
  * NOTE: Effects may be limited in a virtual machine (virtual kernel,
  * 		memory, and devices)
  */
-void* uwufs_init(struct fuse_conn_info *conn, struct fuse_config *cfg);
+void uwufs_init(void *userdata, struct fuse_conn_info *conn);
+
+/**
+ * Frees the inodes that were unlinked while the kernel still
+ * 		referenced them and stops the notification thread.
+ */
+void uwufs_destroy(void *userdata);
+
+/**
+ * Resolves `name` in directory `parent`. This is the only place
+ * 		that walks directory entries, every other callback gets
+ * 		the inode number from the kernel.
+ */
+void uwufs_lookup(fuse_req_t req, fuse_ino_t parent, const char *name);
+
+void uwufs_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup);
 
-int uwufs_getattr(const char *path, struct stat *stbuf,
-				  struct fuse_file_info *fi);
+void uwufs_forget_multi(fuse_req_t req, size_t count,
+						struct fuse_forget_data *forgets);
+
+void uwufs_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+
+/**
+ * Handles chmod, chown, truncate and utimens.
+ */
+void uwufs_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+				   int to_set, struct fuse_file_info *fi);
 
 // NOTE: Might be uneeded because of uwufs_create
-int uwufs_mknod(const char *path, mode_t mode, dev_t device);
+void uwufs_mknod(fuse_req_t req, fuse_ino_t parent, const char *name,
+				 mode_t mode, dev_t rdev);
+
+/**
+ * Targets up to UWUFS_INLINE_DATA_SIZE bytes are stored in the inode
+ * 		(fast symlinks: readlink reads no blk), longer ones in one blk.
+ */
+void uwufs_symlink(fuse_req_t req, const char *link, fuse_ino_t parent,
+				   const char *name);
 
-int uwufs_mkdir(const char *path, mode_t mode);
+void uwufs_readlink(fuse_req_t req, fuse_ino_t ino);
+
+void uwufs_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
+				 mode_t mode);
 
 /**
  * Decrements the hard link counter to a file. If the counter
- * 		becomes 0, delete the actual file.
+ * 		becomes 0, delete the actual file (once the kernel forgets it).
  */
-int uwufs_unlink(const char *path);
+void uwufs_unlink(fuse_req_t req, fuse_ino_t parent, const char *name);
 
-int uwufs_rmdir(const char *path);
+void uwufs_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name);
 
-int uwufs_rename(const char *old_path, const char *new_path, unsigned int flags);
+void uwufs_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+				  fuse_ino_t new_parent, const char *new_name,
+				  unsigned int flags);
 
-int uwufs_link(const char *old_path, const char *new_path);
+void uwufs_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t new_parent,
+				const char *new_name);
 
-int uwufs_open(const char *path, struct fuse_file_info *fi);
+void uwufs_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
 
-int uwufs_read(const char *path, char *buf, size_t size,
-			   off_t offset, struct fuse_file_info *fi);
+/**
+ * Replies with where the data is on the device (see map_file_read): libfuse
+ * 		splices it to /dev/fuse without copying it if it can, holes
+ * 		come from a zero block.
+ */
+void uwufs_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+				struct fuse_file_info *fi);
 
-int uwufs_write(const char *path, const char *buf, size_t size,
-				off_t offset, struct fuse_file_info *fi);
+void uwufs_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
+				 size_t size, off_t offset, struct fuse_file_info *fi);
 
-int uwufs_release(const char *path, struct fuse_file_info *fi);
+/**
+ * libfuse calls this instead of uwufs_write. A request spliced from
+ * 		/dev/fuse is still in a pipe: whole blocks are spliced from it to
+ * 		the device (see write_file_pipe), anything else is written from
+ * 		memory.
+ */
+void uwufs_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv,
+					 off_t off, struct fuse_file_info *fi);
 
-int uwufs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-				  off_t offset, struct fuse_file_info *fi,
-				  enum fuse_readdir_flags flags);
+/**
+ * With -o tailpack, a handle opened for writing packs the tail of the
+ * 		file when it is released (see pack_file_tail).
+ */
+void uwufs_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
 
-int uwufs_create(const char *path, mode_t mode, struct fuse_file_info *fi);
+/**
+ * Called at every close of a handle. Nothing to write back: use fsync
+ * 		for durability.
+ */
+void uwufs_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
 
-int uwufs_utimens(const char *path, const struct timespec tv[2],
-				  struct fuse_file_info *fi);
+/**
+ * Makes the file durable. The metadata journal and the data share one
+ * 		device flush, and concurrent fsyncs share it too (see
+ * 		flush_device). fdatasync skips the journal when only the
+ * 		timestamps of the file changed since its last fsync.
+ */
+void uwufs_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+				 struct fuse_file_info *fi);
 
-int uwufs_chmod(const char * path, mode_t mode, struct fuse_file_info *fi);
+/**
+ * Lists the directory entries starting at `offset` (each entry carries
+ * 		the offset of the next one, see __collect_dirents in syscalls.c)
+ */
+void uwufs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+				   struct fuse_file_info *fi);
+
+/**
+ * Same as uwufs_readdir but also returns the attributes of the entries
+ * 		(the inodes of one reply are read in a single ilist pass)
+ */
+void uwufs_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size,
+					   off_t offset, struct fuse_file_info *fi);
+
+/**
+ * Makes the directory durable (flushes the journal)
+ */
+void uwufs_fsyncdir(fuse_req_t req, fuse_ino_t ino, int datasync,
+					struct fuse_file_info *fi);
 
-int uwufs_chown(const char * path, uid_t uid, gid_t gid, struct fuse_file_info *fi);
+/**
+ * Reports the free blks and inodes, counting the ones held by the
+ * 		allocation caches (see alloc_cache_start)
+ */
+void uwufs_statfs(fuse_req_t req, fuse_ino_t ino);
+
+void uwufs_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+				  mode_t mode, struct fuse_file_info *fi);
+
+/**
+ * Preallocates (unwritten blocks, no zero-filling), punches holes or
+ * 		zeroes a range, see fallocate_file. Modes: 0, KEEP_SIZE,
+ * 		PUNCH_HOLE | KEEP_SIZE, ZERO_RANGE (| KEEP_SIZE).
+ */
+void uwufs_fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset,
+					 off_t length, struct fuse_file_info *fi);
+
+/**
+ * Copies a range inside the daemon, a chunk of blocks per journal
+ * 		handle (see copy_file_data). With -o reflink the whole blocks
+ * 		are shared between the files instead of copied.
+ */
+void uwufs_copy_file_range(fuse_req_t req, fuse_ino_t ino_in, off_t off_in,
+						   struct fuse_file_info *fi_in, fuse_ino_t ino_out,
+						   off_t off_out, struct fuse_file_info *fi_out,
+						   size_t len, int flags);
+
+/**
+ * SEEK_DATA/SEEK_HOLE (the kernel handles the other whence values).
+ * 		Walks the block map, skipping unallocated indirect subtrees.
+ */
+void uwufs_lseek(fuse_req_t req, fuse_ino_t ino, off_t off, int whence,
+				 struct fuse_file_info *fi);
 
 #endif
@@ -10,12 +10,24 @@
 
 #include <stdint.h>
 
-// Must be in 4k bytes block (4096 bytes)
-#define UWUFS_BLOCK_SIZE 				4096
+// Block size in bytes, chosen by mkfs.uwu (-b) and recorded in the super
+// blk: a power of two from 4K to 64K (offsets in a tail blk are 16 bits,
+// see uwufs_tail_frag). UWUFS_BLOCK_SIZE is the size of the mounted volume
+// (set_blk_size, 4096 until then), the structures below are sized for the
+// largest one and only their first UWUFS_BLOCK_SIZE bytes are on the device
+#define UWUFS_MAX_BLOCK_SIZE			65536
+// the sizes the blk map walkers are compiled for (see cpp/BlockMap.h)
+#define UWUFS_BLOCK_SIZE_SUPPORTED(size) \
+	((size) == 4096 || (size) == 16384 || (size) == 65536)
+
+extern uint32_t uwufs_blk_size;
+#define UWUFS_BLOCK_SIZE				uwufs_blk_size
 
 /* uwufs defaults (can be changed) */
 #define UWUFS_ILIST_DEFAULT_PERCENTAGE 	0.1f
 #define UWUFS_INODE_DEFAULT_SIZE		256
+#define UWUFS_JOURNAL_DEFAULT_DIVISOR	64 // 1/64 of the volume for the log
+#define UWUFS_JOURNAL_MAX_SIZE			((32 << 20) / UWUFS_BLOCK_SIZE) // blks (32MB)
 
 #define UWUFS_DIRECT_BLOCKS				10
 #define UWUFS_INDIRECT_BLOCKS			1
@@ -26,7 +38,12 @@
 #define UWUFS_RESERVED_SPACE			1
 
 // Total file entry in a directory is 256 bytes
-#define UWUFS_FILE_NAME_SIZE			248 // includes null-terminator
+#define UWUFS_FILE_NAME_SIZE			244 // includes null-terminator
+
+// Symlinks: longest target (PATH_MAX - 1, one data blk, no null-terminator
+// stored) and most links followed while resolving a path
+#define UWUFS_SYMLINK_MAX_SIZE			(4096 - 1)
+#define UWUFS_MAX_SYMLINKS				40
 
 /* File access mode */
 typedef uint16_t uwufs_aflags_t; // Deprecated (use uint16_t directly)
@@ -45,6 +62,17 @@ typedef uint16_t uwufs_aflags_t; // Deprecated (use uint16_t directly)
 
 
 typedef uint64_t uwufs_blk_t; 	// 64 bits (8 bytes)
+
+// Data blk numbers in the block map (direct blks and single indirect blk
+// entries) can carry these flags:
+// UNWRITTEN: the blk is allocated (fallocate) but was never written and
+// 		reads as zeros
+// SHARED: the blk may be in other files too (reflink copies, see
+// 		cpp/BlockRefs.h): it is never written in place, a write copies it
+#define UWUFS_BLK_UNWRITTEN				(1ULL << 63)
+#define UWUFS_BLK_SHARED				(1ULL << 62)
+#define UWUFS_BLK_FLAGS					(UWUFS_BLK_UNWRITTEN | UWUFS_BLK_SHARED)
+#define UWUFS_BLK_NUM(entry)			((entry) & ~UWUFS_BLK_FLAGS)
 typedef char uwufs_file_name_t[UWUFS_FILE_NAME_SIZE];
 
 // PLAN: Metadata blk will be 2nd block (useful for fsck/sanity checks)
@@ -65,16 +93,85 @@ struct __attribute__((__packed__)) uwufs_super_blk {
 	uwufs_blk_t freelist_head;
 	uwufs_blk_t free_inodes_left;
 	uwufs_blk_t free_blks_left;
+	uwufs_blk_t state;				// UWUFS_STATE_*
+	uwufs_blk_t journal_start;		// log blks of the journal (between the
+	uwufs_blk_t journal_total_size;	// ilist and the freelist, 0: no journal)
+	uwufs_blk_t features;			// UWUFS_FEATURE_*
+	uwufs_blk_t blk_size;			// UWUFS_BLOCK_SIZE it was formatted with
+									// (0: 4096, formatted before it was kept)
+
+	char padding[UWUFS_MAX_BLOCK_SIZE - (13 * sizeof(uwufs_blk_t))];
+};
+
+#define UWUFS_SUPER_BLK_SIZE(super_blk) \
+	((super_blk)->blk_size != 0 ? (super_blk)->blk_size : 4096)
+
+// The freelist head and free counters are only written back lazily while
+// mounted: anything but CLEAN means they have to be recomputed
+#define UWUFS_STATE_CLEAN				1
+#define UWUFS_STATE_MOUNTED				2
+
+// Some blk maps have UWUFS_BLK_SHARED blks: their reference counts are
+// counted again at mount
+#define UWUFS_FEATURE_SHARED_BLKS		1
+// Some files have a packed tail (UWUFS_INODE_TAIL_PACKED): the free space
+// of the tail blks is measured again at mount
+#define UWUFS_FEATURE_TAIL_BLKS			2
+
+/* Metadata journal (see cpp/Journal.h) */
+// The reserved blk after the super blk: where replay starts in the log
+#define UWUFS_JOURNAL_HEADER_BLK		1
+#define UWUFS_JOURNAL_MAGIC				0x6c6e726a75777575ULL // "uuwujrnl"
+#define UWUFS_JOURNAL_DESCRIPTOR		1
+#define UWUFS_JOURNAL_COMMIT			2
+
+struct __attribute__((__packed__)) uwufs_journal_header {
+	uint64_t magic;
+	uwufs_blk_t head;		// log blk (from journal_start) replay starts at
+	uint64_t sequence;		// sequence number of the transaction there
+
+	char padding[UWUFS_MAX_BLOCK_SIZE - 3 * sizeof(uint64_t)];
+};
 
-	char padding[UWUFS_BLOCK_SIZE - (8 * sizeof(uwufs_blk_t))];
+// A transaction in the log is one or more descriptor blks, each followed
+// by the `count` blks it describes, then a commit blk
+struct __attribute__((__packed__)) uwufs_journal_blk {
+	uint64_t magic;
+	uint32_t type;			// UWUFS_JOURNAL_DESCRIPTOR or _COMMIT
+	uint32_t count;			// blks described (commit: blks of the transaction)
+	uint64_t sequence;
+	uint64_t checksum;		// commit: of all the blks of the transaction
+	// descriptor: where the blks that follow go (UWUFS_JOURNAL_BLK_NUMS)
+	uwufs_blk_t blk_nums[(UWUFS_MAX_BLOCK_SIZE - 4 * sizeof(uint64_t))
+						 / sizeof(uwufs_blk_t)];
 };
 
+#define UWUFS_JOURNAL_BLK_NUMS			((UWUFS_BLOCK_SIZE - 4 * sizeof(uint64_t)) \
+										 / sizeof(uwufs_blk_t))
+
+// Small regular files and symlink targets (UWUFS_INODE_INLINE_DATA) have
+// no blks: their data is stored where the blk map would be
+#define UWUFS_INLINE_DATA_SIZE			((UWUFS_DIRECT_BLOCKS + \
+										  UWUFS_INDIRECT_BLOCKS + \
+										  UWUFS_DOUBLE_INDIRECT_BLOCKS + \
+										  UWUFS_TRIPLE_INDIRECT_BLOCKS) * \
+										 sizeof(uwufs_blk_t))
+
+// Inode flags (file_flags)
+#define UWUFS_INODE_INLINE_DATA			1
+#define UWUFS_INODE_TAIL_PACKED			2	// see uwufs_tail_blk
+
 // 256 bytes for larger {a,m,c}times etc
 struct __attribute__((__packed__)) uwufs_inode {
-	uwufs_blk_t direct_blks[UWUFS_DIRECT_BLOCKS];
-	uwufs_blk_t single_indirect_blks;
-	uwufs_blk_t double_indirect_blks;
-	uwufs_blk_t triple_indirect_blks;
+	union {
+		struct __attribute__((__packed__)) {
+			uwufs_blk_t direct_blks[UWUFS_DIRECT_BLOCKS];
+			uwufs_blk_t single_indirect_blks;
+			uwufs_blk_t double_indirect_blks;
+			uwufs_blk_t triple_indirect_blks;
+		};
+		char inline_data[UWUFS_INLINE_DATA_SIZE];
+	};
 	uint16_t file_mode; 		// file types/permissions
 	uint64_t file_size;
 	uint16_t file_links_count;
@@ -83,38 +180,74 @@ struct __attribute__((__packed__)) uwufs_inode {
 	uint64_t file_atime;
 	uint64_t file_mtime;
 	uint64_t file_ctime;
+	// blks allocated to the file, data and indirect (holes are 0 blk
+	// pointers and don't count)
+	uint64_t file_blocks;
+	// of file_blocks, data blks flagged UWUFS_BLK_UNWRITTEN
+	uint64_t file_unwritten_blocks;
+	// of file_blocks, data blks flagged UWUFS_BLK_SHARED
+	uint64_t file_shared_blocks;
+	uint16_t file_flags;		// UWUFS_INODE_*
+	// UWUFS_INODE_TAIL_PACKED: the last (file_size % UWUFS_BLOCK_SIZE)
+	// bytes are at this offset of this tail blk, not in the blk map
+	uwufs_blk_t file_tail_blk;
+	uint16_t file_tail_offset;
 
 	// NOTE: might want to also track nano seconds for {a,m,c}time
-	char padding[128 - 20];
+	char padding[128 - 56];
+};
+
+// Tail packing (-o tailpack): the last partial blk of a small file can be
+// stored as a fragment of a tail blk shared with other files. The
+// fragment index at the start of the blk says which bytes belong to which
+// inode (free entries have inode number 0). Tail blks are metadata: they
+// are journaled with the inodes that point to them.
+#define UWUFS_TAIL_FRAGS				32
+
+struct __attribute__((__packed__)) uwufs_tail_frag {
+	uwufs_blk_t inode_num;
+	uint16_t offset;		// in the blk, past the index
+	uint16_t size;
+};
+
+#define UWUFS_TAIL_DATA_OFFSET			(UWUFS_TAIL_FRAGS * \
+										 sizeof(struct uwufs_tail_frag))
+// largest tail that can be packed
+#define UWUFS_TAIL_MAX_SIZE				(UWUFS_BLOCK_SIZE - UWUFS_TAIL_DATA_OFFSET)
+
+struct __attribute__((__packed__)) uwufs_tail_blk {
+	struct uwufs_tail_frag frags[UWUFS_TAIL_FRAGS];
+	char data[UWUFS_MAX_BLOCK_SIZE - UWUFS_TAIL_DATA_OFFSET];
 };
 
 struct __attribute__((__packed__)) uwufs_inode_blk {
-	struct uwufs_inode inodes[UWUFS_BLOCK_SIZE/sizeof(struct uwufs_inode)];
+	struct uwufs_inode inodes[UWUFS_MAX_BLOCK_SIZE/sizeof(struct uwufs_inode)];
 };
 
 struct __attribute__((__packed__)) uwufs_directory_file_entry {
 	uwufs_file_name_t file_name;
+	uint32_t name_hash; 		// see uwufs_name_hash (file_operations.h)
 	uwufs_blk_t inode_num;
 };
 
 struct __attribute__((__packed__)) uwufs_directory_data_blk {
-	// 16 entries (assuming 4096 byte block size and 256 bytes per entry)
+	// 16 entries with 4096 byte blks (256 bytes per entry)
 	struct uwufs_directory_file_entry file_entries[
-		UWUFS_BLOCK_SIZE/sizeof(struct uwufs_directory_file_entry)];
+		UWUFS_MAX_BLOCK_SIZE/sizeof(struct uwufs_directory_file_entry)];
 };
 
 struct __attribute__((__packed__)) uwufs_indirect_blk {
-	uwufs_blk_t entries[UWUFS_BLOCK_SIZE / sizeof(uwufs_blk_t)];
+	uwufs_blk_t entries[UWUFS_MAX_BLOCK_SIZE / sizeof(uwufs_blk_t)];
 };
 
 struct __attribute__((__packed__)) uwufs_regular_file_data_blk {
-	char data[UWUFS_BLOCK_SIZE];
+	char data[UWUFS_MAX_BLOCK_SIZE];
 };
 
 struct __attribute__((__packed__)) uwufs_free_data_blk {
 	uwufs_blk_t next_free_blk;
 
-	char padding[UWUFS_BLOCK_SIZE - sizeof(uwufs_blk_t)];
+	char padding[UWUFS_MAX_BLOCK_SIZE - sizeof(uwufs_blk_t)];
 };
 
 #define RETURN_IF_ERROR(status) \